@@ -0,0 +1,84 @@
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "MiniLua/luainterpreter.hpp"
+#include "MiniLua/luaparser.hpp"
+#include "MiniLua/luavm.hpp"
+#include <catch2/catch.hpp>
+
+static lua::rt::eval_result_t run(const lua::rt::Evaluator& eval, const LuaChunk& chunk) {
+    auto env = std::make_shared<lua::rt::Environment>(nullptr);
+    env->populate_stdlib();
+    eval.budget.set_limit(lua::rt::StepBudget::unlimited);
+
+    auto result = eval.run(chunk, env);
+    env->clear();
+    return result;
+}
+
+TEST_CASE("Interpreter loops") {
+    std::string source = R"#(
+a = {}
+sum = 0
+for i=1, 200 do
+    a[i] = i * 2
+    if a[i] % 3 == 0 then
+        sum = sum + a[i]
+    end
+end
+j = 0
+while j < 200 do
+    j = j + 1
+end
+)#";
+
+    LuaParser parser;
+    PerformanceStatistics ps;
+    auto result = parser.parse(source, ps);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+    auto chunk = std::get<LuaChunk>(result);
+
+    lua::rt::ASTEvaluator ast_eval;
+    lua::rt::BytecodeVM vm;
+    lua::rt::UntrackedASTEvaluator untracked_ast_eval;
+    lua::rt::UntrackedBytecodeVM untracked_vm;
+
+    BENCHMARK("ASTEvaluator") { return run(ast_eval, chunk); };
+    BENCHMARK("BytecodeVM") { return run(vm, chunk); };
+    BENCHMARK("UntrackedASTEvaluator") { return run(untracked_ast_eval, chunk); };
+    BENCHMARK("UntrackedBytecodeVM") { return run(untracked_vm, chunk); };
+}
+
+TEST_CASE("Counting loop") {
+    LuaParser parser;
+    PerformanceStatistics ps;
+    auto result = parser.parse("for i=1, 10000 do end", ps);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+    auto chunk = std::get<LuaChunk>(result);
+
+    lua::rt::ASTEvaluator ast_eval;
+    lua::rt::BytecodeVM vm;
+
+    BENCHMARK("ASTEvaluator") { return run(ast_eval, chunk); };
+    BENCHMARK("BytecodeVM") { return run(vm, chunk); };
+}
+
+TEST_CASE("Operator chain") {
+    // one long expression, so the time is spent in the per-node path (StepBudget::step and
+    // the visit of a node) and not in statements or calls
+    std::string source = "x = 0";
+    for (int i = 0; i < 2000; ++i)
+        source += " + 1";
+
+    LuaParser parser;
+    PerformanceStatistics ps;
+    auto result = parser.parse(source, ps);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+    auto chunk = std::get<LuaChunk>(result);
+
+    lua::rt::ASTEvaluator ast_eval;
+    lua::rt::UntrackedASTEvaluator untracked_ast_eval;
+    lua::rt::BytecodeVM vm;
+
+    BENCHMARK("ASTEvaluator") { return run(ast_eval, chunk); };
+    BENCHMARK("UntrackedASTEvaluator") { return run(untracked_ast_eval, chunk); };
+    BENCHMARK("BytecodeVM") { return run(vm, chunk); };
+}
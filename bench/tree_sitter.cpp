@@ -1,7 +1,9 @@
 #include <iostream>
 #define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "MiniLua/luaastbuilder.hpp"
 #include "tree_sitter/tree_sitter.hpp"
 #include <catch2/catch.hpp>
+#include <string>
 
 TEST_CASE("Tree-Sitter Node navigation") {
     std::string source = R"#(if true then
@@ -345,3 +347,43 @@ end)#";
         return number;
     };
 }
+
+TEST_CASE("ASTBuilder rebuild") {
+    // 1000 functions with 5 lines each
+    std::string source;
+    for (int i = 0; i < 1000; ++i) {
+        auto n = std::to_string(i);
+        source += "function f" + n + "(x)\n    local y = x * " + n + "\n    if y > 10 then\n" +
+                  "        return y - 1\n    end\nend\n";
+    }
+    source += "print(f500(1))\n";
+
+    ts::Parser parser;
+    ts::Tree tree = parser.parse_string(source);
+    lua::rt::ASTBuilder builder;
+    REQUIRE(std::holds_alternative<LuaChunk>(builder.build(tree)));
+
+    // the x of the function in the middle is changed to z and back, so both benchmarks include
+    // the edit of the tree
+    const uint32_t byte = source.find("x * 500");
+    const uint32_t row = 500 * 6 + 1;
+    const ts::Range x{
+        .start = ts::Location{.point = ts::Point{.row = row, .column = 14}, .byte = byte},
+        .end = ts::Location{.point = ts::Point{.row = row, .column = 15}, .byte = byte + 1},
+    };
+    bool edited = false;
+    auto edit = [&]() {
+        edited = !edited;
+        return tree.edit({ts::Edit{.range = x, .replacement = edited ? "z" : "x"}});
+    };
+
+    BENCHMARK("edit and build") {
+        edit();
+        return builder.build(tree);
+    };
+
+    BENCHMARK("edit and rebuild") {
+        auto result = edit();
+        return builder.rebuild(tree, result);
+    };
+}
@@ -1,12 +1,46 @@
 #include "MiniLua/luainterpreter.hpp"
 #include "MiniLua/luaparser.hpp"
+#include "MiniLua/luavm.hpp"
 #include <chrono>
+#include <cstring>
 #include <vector>
 
 using namespace std;
 
 auto main(int argc, char* argv[]) -> int {
 
+    // --bytecode runs the programs with the bytecode VM instead of the AST evaluator,
+    // --no-tracking runs them without provenance (no source changes), --lazy-tracking records
+    // the arithmetic in an execution trace
+    bool bytecode = false;
+    bool tracking = true;
+    bool lazy = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bytecode") == 0)
+            bytecode = true;
+        else if (strcmp(argv[i], "--no-tracking") == 0)
+            tracking = false;
+        else if (strcmp(argv[i], "--lazy-tracking") == 0)
+            lazy = true;
+    }
+
+    unique_ptr<lua::rt::Evaluator> eval;
+    if (bytecode) {
+        if (!tracking)
+            eval = make_unique<lua::rt::UntrackedBytecodeVM>();
+        else if (lazy)
+            eval = make_unique<lua::rt::LazyBytecodeVM>();
+        else
+            eval = make_unique<lua::rt::BytecodeVM>();
+    } else {
+        if (!tracking)
+            eval = make_unique<lua::rt::UntrackedASTEvaluator>();
+        else if (lazy)
+            eval = make_unique<lua::rt::LazyASTEvaluator>();
+        else
+            eval = make_unique<lua::rt::ASTEvaluator>();
+    }
+
     vector<string> programs = {
         "for i=1, 10, 1 do \n    print('hello world ', i)\nend",
         "for i=1, 2 + 4 * 2, 1 do \n    print('hello world ' .. i)\nend",
@@ -86,7 +120,7 @@ auto main(int argc, char* argv[]) -> int {
         const auto result = parser.parse(program, ps);
         auto parse_end = std::chrono::steady_clock::now();
 
-        for (const auto& tok : parser.tokens)
+        for (const auto& tok : parser.tokens())
             cout << tok << endl;
 
         if (holds_alternative<string>(result)) {
@@ -96,18 +130,19 @@ auto main(int argc, char* argv[]) -> int {
             auto eval_start = std::chrono::steady_clock::now();
             auto ast = get<LuaChunk>(result);
             auto env = make_shared<lua::rt::Environment>(nullptr);
-            lua::rt::ASTEvaluator eval;
 
             env->populate_stdlib();
             auto stdlib_end = std::chrono::steady_clock::now();
 
-            if (auto eval_result = ast->accept(eval, env); holds_alternative<string>(eval_result)) {
+            if (auto eval_result = eval->run(ast, env);
+                holds_alternative<lua::rt::EvalError>(eval_result)) {
                 cerr << "In program: " << program << endl;
-                cerr << "Error: " << get<string>(eval_result) << endl;
+                cerr << "Error: " << get<lua::rt::EvalError>(eval_result).message() << endl;
             } else {
                 auto eval_end = std::chrono::steady_clock::now();
                 if (auto sc = get_sc(eval_result)) {
-                    auto new_program = get_string((*sc)->apply(parser.tokens));
+                    auto new_program =
+                        lua::rt::apply_edits(program, (*sc)->edits(parser.tokens()));
                     auto apply_end = std::chrono::steady_clock::now();
 
                     cout << "Source changes: " << (*sc)->to_string() << endl;
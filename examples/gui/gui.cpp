@@ -4,73 +4,76 @@
 
 using namespace std;
 
+DrawWidget::DrawWidget(QWidget* parent, QPlainTextEdit* editor)
+    : QWidget{parent}, editor{editor} {
+
+    // textChanged is emitted whenever formatting is applied, therefore we use cursorPositionChanged
+    connect(editor, &QPlainTextEdit::cursorPositionChanged, this, &DrawWidget::onTextChanged);
+
+    editor->setFont(QFont("monospace"));
+
+    runner.define_effect(
+        "line", make_shared<lua::rt::cfunction>(
+                    [this](const lua::rt::vallist& args) -> lua::rt::cfunction::result {
+                        if (args.size() != 4) {
+                            return lua::rt::vallist{lua::rt::nil(),
+                                                    string{"invalid number of arguments"}};
+                        }
+
+                        for (int i = 0; i < 4; ++i) {
+                            if (!holds_alternative<double>(args[i])) {
+                                return lua::rt::vallist{
+                                    lua::rt::nil(), string{"invalid type of argument "} +
+                                                        to_string(i + 1) + " (number expected)"};
+                            }
+                        }
+
+                        painter->drawLine(get<double>(args[0]), get<double>(args[1]),
+                                          get<double>(args[2]), get<double>(args[3]));
+
+                        return {};
+                    }));
+
+    runner.define_effect(
+        "force", make_shared<lua::rt::cfunction>(
+                     [this](const lua::rt::vallist& args) -> lua::rt::cfunction::result {
+                         if (args.size() != 2) {
+                             return lua::rt::vallist{
+                                 lua::rt::nil(), string{"wrong number of arguments (expected 2)"}};
+                         }
+
+                         cout << "force " << args[0] << " to be " << args[1] << endl;
+
+                         auto source_changes = args[0].forceValue(args[1]);
+
+                         if (!source_changes) {
+                             cout << "could not force value, source location not available"
+                                  << endl;
+                             return {};
+                         }
+
+                         cout << (*source_changes)->to_string() << endl;
+                         addSourceChanges(*source_changes);
+
+                         return {};
+                     }));
+}
+
 void DrawWidget::paintEvent(QPaintEvent* event) {
     QPainter painter;
     painter.begin(this);
     painter.fillRect(event->rect(), Qt::white);
 
     if (lock_guard<mutex> lock(parse_result_mutex); parse_result) {
-        auto env = make_shared<lua::rt::Environment>(nullptr);
-        lua::rt::ASTEvaluator eval;
-
-        env->populate_stdlib();
-
-        env->assign(
-            string{"line"},
-            make_shared<lua::rt::cfunction>([&painter](const lua::rt::vallist& args)
-                                                -> lua::rt::cfunction::result {
-                if (args.size() != 4) {
-                    return lua::rt::vallist{lua::rt::nil(), string{"invalid number of arguments"}};
-                }
-
-                for (int i = 0; i < 4; ++i) {
-                    if (!holds_alternative<double>(args[i])) {
-                        return lua::rt::vallist{lua::rt::nil(),
-                                                string{"invalid type of argument "} +
-                                                    to_string(i + 1) + " (number expected)"};
-                    }
-                }
-
-                painter.drawLine(get<double>(args[0]), get<double>(args[1]), get<double>(args[2]),
-                                 get<double>(args[3]));
-
-                return {};
-            }),
-            false);
-
-        env->assign(
-            string{"force"},
-            make_shared<lua::rt::cfunction>(
-                [this](const lua::rt::vallist& args) -> lua::rt::cfunction::result {
-                    if (args.size() != 2) {
-                        return lua::rt::vallist{lua::rt::nil(),
-                                                string{"wrong number of arguments (expected 2)"}};
-                    }
-
-                    cout << "force " << args[0] << " to be " << args[1] << endl;
-
-                    auto source_changes = args[0].forceValue(args[1]);
-
-                    if (!source_changes) {
-                        cout << "could not force value, source location not available" << endl;
-                        return {};
-                    }
-
-                    cout << (*source_changes)->to_string() << endl;
-                    addSourceChanges(*source_changes);
-
-                    return {};
-                }),
-            false);
-
+        this->painter = &painter;
         clearSourceChanges();
 
-        if (auto eval_result = parse_result->accept(eval, env);
-            holds_alternative<string>(eval_result)) {
-            cerr << "Error: " << get<string>(eval_result) << endl;
+        if (auto eval_result = runner.run(parse_result);
+            holds_alternative<lua::rt::EvalError>(eval_result)) {
+            cerr << "Error: " << get<lua::rt::EvalError>(eval_result).message() << endl;
         }
 
-        env->clear();
+        this->painter = nullptr;
     }
 
     painter.end();
@@ -79,9 +82,8 @@ void DrawWidget::paintEvent(QPaintEvent* event) {
 
 void DrawWidget::addSourceChanges(const shared_ptr<lua::rt::SourceChange>& change) {
     if (!current_source_changes)
-        current_source_changes = make_shared<lua::rt::SourceChangeAnd>();
-    dynamic_pointer_cast<lua::rt::SourceChangeAnd>(current_source_changes)
-        ->changes.push_back(change);
+        current_source_changes = make_shared<lua::rt::SourceChangeSet>();
+    dynamic_pointer_cast<lua::rt::SourceChangeSet>(current_source_changes)->add(*change);
 }
 
 void DrawWidget::clearSourceChanges() { current_source_changes.reset(); }
@@ -91,8 +93,8 @@ void highlight_changes(const shared_ptr<lua::rt::SourceChange>& change, QTextCur
         QTextCharFormat fmt;
         fmt.setBackground(Qt::red);
 
-        cursor.setPosition(p->token.pos, QTextCursor::MoveAnchor);
-        cursor.setPosition(p->token.pos + p->token.length, QTextCursor::KeepAnchor);
+        cursor.setPosition(p->token.pos(), QTextCursor::MoveAnchor);
+        cursor.setPosition(p->token.pos() + p->token.length(), QTextCursor::KeepAnchor);
         cursor.setCharFormat(fmt);
     }
 
@@ -105,6 +107,13 @@ void highlight_changes(const shared_ptr<lua::rt::SourceChange>& change, QTextCur
         if (!p->alternatives.empty())
             highlight_changes(p->alternatives[0], cursor);
     }
+
+    if (auto p = dynamic_pointer_cast<lua::rt::SourceChangeSet>(change); p) {
+        std::vector<lua::rt::SourceAssignment> applied;
+        p->applied(applied);
+        for (const auto& assignment : applied)
+            highlight_changes(make_shared<lua::rt::SourceAssignment>(assignment), cursor);
+    }
 }
 
 void DrawWidget::highlightSourceChanges(QPlainTextEdit* editor) {
@@ -6,11 +6,8 @@
 #include <memory>
 #include <mutex>
 
-namespace lua {
-namespace rt {
-struct SourceChange;
-}
-}
+#include "MiniLua/incremental.hpp"
+#include "MiniLua/luainterpreter.hpp"
 
 class DrawWidget : public QWidget {
     Q_OBJECT
@@ -20,15 +17,13 @@ class DrawWidget : public QWidget {
     std::mutex parse_result_mutex;
     std::shared_ptr<lua::rt::SourceChange> current_source_changes;
 
-public:
-    DrawWidget(QWidget *parent, QPlainTextEdit *editor) : QWidget {parent}, editor {editor} {
-
-        // textChanged is emitted whenever formatting is applied, therefore we use cursorPositionChanged
-        connect(editor, &QPlainTextEdit::cursorPositionChanged,
-                this, &DrawWidget::onTextChanged);
+    // reruns only the statements that changed on every repaint
+    lua::rt::ASTEvaluator eval;
+    lua::rt::IncrementalRunner runner {eval};
+    QPainter *painter = nullptr; // only set during paintEvent
 
-        editor->setFont(QFont("monospace"));
-    }
+public:
+    DrawWidget(QWidget *parent, QPlainTextEdit *editor);
 
     virtual ~DrawWidget() {
 
@@ -0,0 +1,75 @@
+#ifndef ASTARENA_H
+#define ASTARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+The memory of the AST nodes of one parse or build. The nodes (together with their shared_ptr
+control blocks) are placed one after the other in large blocks instead of being separate heap
+allocations, so the nodes of a statement are close to each other.
+
+Destroying a node doesn't give its memory back. Every node holds a reference to its arena and
+the blocks are released at once with the last node (statements that the AST builder shares keep
+the arena of the build that created them alive).
+
+Allocating is not synchronized, an arena must not be shared between threads while nodes are
+created.
+*/
+class ASTArena {
+public:
+    ASTArena() = default;
+    ASTArena(const ASTArena&) = delete;
+    ASTArena& operator=(const ASTArena&) = delete;
+
+    void* allocate(size_t size, size_t align);
+
+    // the memory of all blocks (for statistics)
+    size_t capacity() const { return total; }
+
+private:
+    static constexpr size_t block_size = 16 * 1024;
+
+    vector<unique_ptr<char[]>> blocks;
+    char* next = nullptr;
+    char* end = nullptr;
+    size_t total = 0;
+};
+
+// a standard allocator that takes its memory from an ASTArena and keeps it alive
+template <typename T> struct ArenaAllocator {
+    using value_type = T;
+
+    explicit ArenaAllocator(shared_ptr<ASTArena> arena) : arena{move(arena)} {}
+    template <typename U> ArenaAllocator(const ArenaAllocator<U>& other) : arena{other.arena} {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U> bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+    template <typename U> bool operator!=(const ArenaAllocator<U>& other) const {
+        return arena != other.arena;
+    }
+
+    shared_ptr<ASTArena> arena;
+};
+
+// creates a node in arena
+template <typename T, typename... Args>
+shared_ptr<T> make_node(const shared_ptr<ASTArena>& arena, Args&&... args) {
+    return allocate_shared<T>(ArenaAllocator<T>{arena}, forward<Args>(args)...);
+}
+
+} // namespace rt
+} // namespace lua
+
+#endif // ASTARENA_H
@@ -0,0 +1,215 @@
+#ifndef COMPACTVAL_H
+#define COMPACTVAL_H
+
+#include "val.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+An 8 byte representation of val for storing many values (e.g. the array part of tables).
+
+Numbers are stored as plain doubles. All other values are encoded in the payload of a
+negative quiet NaN (NaN boxing): the type in bits 48-50 and the boolean or a pointer to a
+refcounted box in the lower 48 bits. Strings are copied into their box, tables, functions
+and vallists share the object with the val they were created from.
+
+A CompactVal has no source. Containers that need the provenance of their values keep it in
+a ProvenanceTable next to them (see CompactArray).
+
+The refcounts are not atomic, like the rest of the interpreter CompactVals must not be
+shared between threads.
+*/
+class CompactVal {
+public:
+    enum class Tag : uint8_t {
+        Number = 0,
+        Nil = 1,
+        Bool = 2,
+        String = 3,
+        CFunction = 4,
+        Table = 5,
+        Vallist = 6,
+        LFunction = 7,
+    };
+
+    CompactVal() : bits{nil_bits} {}
+    CompactVal(double d) {
+        // all NaNs are mapped to the same (positive) NaN, so they can't be confused with boxes
+        if (d != d) {
+            bits = canonical_nan;
+        } else {
+            memcpy(&bits, &d, sizeof(d));
+        }
+    }
+    CompactVal(bool b) : bits{encode(Tag::Bool, b)} {}
+    explicit CompactVal(const val& v);
+
+    CompactVal(const CompactVal& other) : bits{other.bits} { retain(); }
+    CompactVal(CompactVal&& other) noexcept : bits{other.bits} { other.bits = nil_bits; }
+    CompactVal& operator=(const CompactVal& other) {
+        other.retain();
+        release();
+        bits = other.bits;
+        return *this;
+    }
+    CompactVal& operator=(CompactVal&& other) noexcept {
+        if (this != &other) {
+            release();
+            bits = other.bits;
+            other.bits = nil_bits;
+        }
+        return *this;
+    }
+    ~CompactVal() { release(); }
+
+    Tag tag() const {
+        return is_boxed() ? static_cast<Tag>((bits >> 48) & 0x7) : Tag::Number;
+    }
+    bool isnil() const { return bits == nil_bits; }
+    bool isnumber() const { return !is_boxed(); }
+
+    // no type check!
+    double number() const {
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+
+    // converts back to a val with the given source
+    val to_val(const shared_ptr<sourceexp>& source = nullptr) const;
+
+    // same semantics as == on val: numbers and strings by value, everything else by identity
+    bool operator==(const CompactVal& other) const;
+    bool operator!=(const CompactVal& other) const { return !(*this == other); }
+
+private:
+    static constexpr uint64_t box_mask = 0xFFF8'0000'0000'0000;
+    static constexpr uint64_t payload_mask = 0x0000'FFFF'FFFF'FFFF;
+    static constexpr uint64_t canonical_nan = 0x7FF8'0000'0000'0000;
+
+    static constexpr uint64_t encode(Tag tag, uint64_t payload) {
+        return box_mask | (static_cast<uint64_t>(tag) << 48) | payload;
+    }
+    static constexpr uint64_t nil_bits = box_mask | (uint64_t{1} << 48); // encode(Tag::Nil, 0)
+
+    struct Box {
+        uint32_t refs = 1;
+    };
+    template <typename T> struct ValueBox : Box {
+        explicit ValueBox(T value) : value{move(value)} {}
+        T value;
+    };
+
+    bool is_boxed() const { return (bits & box_mask) == box_mask; }
+    bool has_box() const { return is_boxed() && tag() >= Tag::String; }
+    Box* box() const { return reinterpret_cast<Box*>(bits & payload_mask); }
+    template <typename T> const T& unbox() const {
+        return static_cast<ValueBox<T>*>(box())->value;
+    }
+    template <typename T> void make_box(Tag tag, T value) {
+        bits = encode(tag, reinterpret_cast<uint64_t>(new ValueBox<T>(move(value))));
+    }
+
+    void retain() const {
+        if (has_box())
+            box()->refs++;
+    }
+    void release() {
+        if (has_box() && --box()->refs == 0)
+            destroy();
+    }
+    void destroy();
+
+    uint64_t bits;
+};
+
+static_assert(sizeof(CompactVal) == 8, "CompactVal must fit into 8 bytes");
+
+/*
+The sources of the values in a container, by position. The sources are kept in a dense vector
+next to the values, it is only allocated when a value with a source is stored and only reaches
+up to the last position that got a source (16 bytes per position, untracked containers cost
+nothing).
+*/
+class ProvenanceTable {
+public:
+    shared_ptr<sourceexp> get(size_t index) const {
+        return index < sources.size() ? sources[index] : nullptr;
+    }
+
+    void set(size_t index, const shared_ptr<sourceexp>& source) {
+        if (source) {
+            if (index >= sources.size())
+                sources.resize(index + 1);
+            sources[index] = source;
+        } else if (index < sources.size()) {
+            sources[index].reset();
+        }
+    }
+
+    // forgets the sources of all positions >= index
+    void truncate(size_t index) {
+        if (index < sources.size())
+            sources.resize(index);
+    }
+
+    void clear() { sources.clear(); }
+
+private:
+    vector<shared_ptr<sourceexp>> sources;
+};
+
+// a sequence of vals stored as CompactVals with their sources in a ProvenanceTable
+class CompactArray {
+public:
+    size_t size() const { return values.size(); }
+    bool empty() const { return values.empty(); }
+
+    val get(size_t index) const { return values[index].to_val(sources.get(index)); }
+    const CompactVal& raw(size_t index) const { return values[index]; }
+
+    void set(size_t index, const val& v) {
+        values[index] = CompactVal{v};
+        sources.set(index, v.source);
+    }
+
+    void push_back(const val& v) {
+        values.emplace_back(v);
+        sources.set(values.size() - 1, v.source);
+    }
+
+    void pop_back() {
+        values.pop_back();
+        sources.set(values.size(), nullptr);
+    }
+
+    void resize(size_t size) {
+        if (size < values.size())
+            sources.truncate(size);
+        values.resize(size);
+    }
+
+    void reserve(size_t size) { values.reserve(size); }
+
+    void clear() {
+        values.clear();
+        sources.clear();
+    }
+
+private:
+    vector<CompactVal> values;
+    ProvenanceTable sources;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // COMPACTVAL_H
@@ -1,32 +1,172 @@
 #ifndef ENVIRONMENT_H
 #define ENVIRONMENT_H
 
+#include "fieldcache.hpp"
+#include "table.hpp"
 #include "val.hpp"
 
+#include <vector>
+
 namespace lua {
 namespace rt {
 
+// observes the accesses to the globals and to the locals of the main chunk (see IncrementalRunner)
+struct EnvironmentTracker {
+    virtual ~EnvironmentTracker() = default;
+
+    virtual void read_global(const val& name, const val& value) = 0;
+    virtual void write_global(const val& name, const val& value) = 0;
+    virtual void read_slot(unsigned slot, const val& value) = 0;
+    virtual void write_slot(unsigned slot, const val& value) = 0;
+};
+
 struct Environment : enable_shared_from_this<Environment> {
 private:
     table t;
     shared_ptr<Environment> parent;
     table* global = nullptr;
+    EnvironmentTracker* tracker = nullptr; // the tracker of the global environment
+
+    // locals with a lexical address (see luaresolver.hpp)
+    vector<val> slots;
+    bool main_chunk = false; // the slots are the locals of a main chunk (see main_frame)
 
 public:
-    Environment(const shared_ptr<Environment>& parent) : parent{parent} {
+    Environment(const shared_ptr<Environment>& parent, size_t num_slots = 0)
+        : parent{parent}, slots(num_slots) {
         if (parent) {
             global = parent->global;
+            tracker = parent->tracker;
         } else {
             global = &t;
         }
     }
 
-    void clear() { t.clear(); }
+    void clear() {
+        t.clear();
+        slots.clear();
+    }
+
+    // makes a cleared environment usable again (see FramePool)
+    void reuse(const shared_ptr<Environment>& parent, size_t num_slots) {
+        this->parent = parent;
+        global = parent ? parent->global : &t;
+        tracker = parent ? parent->tracker : nullptr;
+        slots.resize(num_slots);
+        main_chunk = false;
+    }
+
+    // a new environment in parent for the locals of one run of a main chunk: every run gets its
+    // own, so the closures of an earlier run in the same parent keep their locals
+    static shared_ptr<Environment> main_frame(const shared_ptr<Environment>& parent,
+                                              size_t num_slots) {
+        auto env = make_shared<Environment>(parent, num_slots);
+        env->main_chunk = true;
+        return env;
+    }
+
+    // drops the contents and the parent, but keeps the memory of the slots
+    void recycle() {
+        clear();
+        parent.reset();
+    }
 
+    // lookup by name: searches the tables of all enclosing environments, then the globals
     void assign(const val& var, const val& newval, bool is_local);
     val getvar(const val& var);
 
+    // lookup by lexical address: depth environments up, the given slot
+    const val& local(unsigned depth, unsigned slot) {
+        Environment* env = scope(depth);
+        if (tracker && env->main_chunk)
+            tracker->read_slot(slot, env->slots[slot]);
+        return env->slots[slot];
+    }
+    void assign_local(unsigned depth, unsigned slot, string_view name, const val& newval);
+
+    // lookup in the global table only
+    void assign_global(const val& var, const val& newval);
+    val getglobal(const val& var) const;
+
+    // the same with the inline cache of the accessing site, a lookup is only done when globals
+    // were added since the last access
+    void assign_global(const val& var, const val& newval, FieldCache& cache);
+    val getglobal(const val& var, FieldCache& cache) const;
+
     void populate_stdlib();
+
+    // forgets all variables, the globals are then the same as the ones of initial
+    void reset(const Environment& initial);
+
+    // reports the accesses of this (global) environment and all environments created in it to
+    // tracker (nullptr to stop)
+    void track(EnvironmentTracker* tracker) { this->tracker = tracker; }
+
+private:
+    Environment* scope(unsigned depth) {
+        Environment* env = this;
+        for (; depth > 0; --depth)
+            env = env->parent.get();
+        return env;
+    }
+};
+
+/*
+Recycles the environments of function calls and blocks.
+
+Every call (and every execution of a block) needs a new environment, because closures can
+capture it. Most of them are not captured though, so instead of allocating a new one every
+time, the environments are taken from a free list and go back to it when they are released and
+nobody else refers to them.
+*/
+class FramePool {
+public:
+    // an environment from the pool, that is released when the frame is destroyed
+    class Frame {
+    public:
+        Frame(FramePool& pool, shared_ptr<Environment> env) : pool{pool}, env{move(env)} {}
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+        ~Frame() { pool.release(move(env)); }
+
+        const shared_ptr<Environment>& get() const { return env; }
+        operator const shared_ptr<Environment>&() const { return env; }
+
+    private:
+        FramePool& pool;
+        shared_ptr<Environment> env;
+    };
+
+    // an environment with the given parent and num_slots nil slots
+    shared_ptr<Environment> acquire(const shared_ptr<Environment>& parent, size_t num_slots) {
+        if (free.empty())
+            return make_shared<Environment>(parent, num_slots);
+
+        auto env = move(free.back());
+        free.pop_back();
+        env->reuse(parent, num_slots);
+        return env;
+    }
+
+    Frame frame(const shared_ptr<Environment>& parent, size_t num_slots) {
+        return Frame{*this, acquire(parent, num_slots)};
+    }
+
+    // puts env back into the pool, unless it is still referenced (e.g. by a closure)
+    void release(shared_ptr<Environment>&& env) {
+        if (!env || env.use_count() != 1 || free.size() >= max_free)
+            return;
+
+        env->recycle();
+        free.push_back(move(env));
+    }
+
+    size_t size() const { return free.size(); }
+
+private:
+    static constexpr size_t max_free = 256;
+
+    vector<shared_ptr<Environment>> free;
 };
 
 } // namespace rt
@@ -0,0 +1,68 @@
+#ifndef FIELDCACHE_H
+#define FIELDCACHE_H
+
+#include "table.hpp"
+#include "val.hpp"
+
+#include <array>
+#include <cstdint>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+An inline cache for the accesses to one constant key at one place in the program, e.g. a.b or
+a["b"]. The key has to be a string (or anything else that is never stored in the array part).
+
+The cache remembers the slot of the key in the hash part of the tables it has seen, by their
+shape (see table). Tables that got the same keys in the same order share their shape, so
+reading or assigning the key of any of them doesn't hash it at all. The cache starts
+monomorphic (one shape) and becomes polymorphic when the access sees tables of different
+shapes. If there are more shapes than ways, the access is megamorphic and the cache is not used
+anymore.
+
+Like the tables, caches must not be shared between threads.
+*/
+class FieldCache {
+public:
+    static constexpr unsigned ways = 4;
+
+    val get(table& t, const val& key);
+    void set(table& t, const val& key, const val& value);
+
+    // the same for a site that always sees the same table (the global table): new keys change
+    // its shape again and again, so the cache only keeps the latest shape and is never megamorphic
+    val get_monomorphic(table& t, const val& key);
+    void set_monomorphic(table& t, const val& key, const val& value);
+
+    // number of cached shapes
+    unsigned size() const { return used; }
+    bool megamorphic() const { return megamorphic_; }
+
+private:
+    struct Entry {
+        table::shape_t shape = 0;
+        size_t slot = table::npos; // npos if the key is not in the tables of the shape
+    };
+
+    const Entry* lookup(table::shape_t shape) const {
+        for (unsigned i = 0; i < used; ++i) {
+            if (entries[i].shape == shape)
+                return &entries[i];
+        }
+        return nullptr;
+    }
+
+    void insert(table::shape_t shape, size_t slot);
+
+    array<Entry, ways> entries;
+    uint8_t used = 0;
+    bool megamorphic_ = false;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // FIELDCACHE_H
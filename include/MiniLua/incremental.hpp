@@ -0,0 +1,119 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "environment.hpp"
+#include "luaast.hpp"
+#include "luainterpreter.hpp"
+#include "val.hpp"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+Runs a program over and over again (e.g. on every repaint of a live editor) and only
+re-executes the top-level statements that have to.
+
+For every top-level statement the runner records which globals and locals of the main chunk it
+read and wrote, the calls of effects (host functions like print or drawing) and its source
+changes. A statement of the next run is reused if a statement with the same text (the same tokens,
+wherever it is now) was recorded and all the variables it read still have the same values (and
+sources): then the recorded writes are applied and the effects are called again with the recorded
+arguments instead of executing it.
+
+If the statement moved (e.g. text before it was inserted), the recorded values are moved with it:
+their sources, the source changes and the calls of the effects refer to the tokens and nodes of
+the statement in the last run, they get the ones at the same place in the new statement, and the
+closures get the function of the new statement.
+
+Only statements whose values can be replayed are reused. Tables, closures over anything but the
+locals of the main chunk (both can be changed later through other references) and returns are
+not recorded, statements that read, write or pass such a value are always executed.
+
+All runs use the same global environment, so closures from earlier runs stay valid. It starts
+with the stdlib and the defined globals in every run. The locals of the main chunk are in a new
+frame in every run (see Environment::main_frame), the replayed closures get the one of the new
+run.
+
+The executed statements of a run share the step budget of the evaluator, every run gets the full
+limit again.
+*/
+class IncrementalRunner {
+public:
+    explicit IncrementalRunner(const Evaluator& eval);
+    ~IncrementalRunner();
+
+    IncrementalRunner(const IncrementalRunner&) = delete;
+    IncrementalRunner& operator=(const IncrementalRunner&) = delete;
+
+    // defines a global for all runs
+    void define(const string& name, const val& value);
+
+    // defines a host function with side effects, its calls are repeated when the calling
+    // statement is reused (print is already an effect)
+    void define_effect(const string& name, const cfunction_p& f);
+
+    // runs the chunk, reusing what is possible from the last run
+    eval_result_t run(const LuaChunk& chunk);
+
+    struct Stats {
+        size_t executed = 0;
+        size_t reused = 0;
+    };
+
+    // the statistics of the last run
+    const Stats& stats() const { return last_stats; }
+
+private:
+    struct Effect {
+        cfunction_p f;
+        vallist args;
+        const _LuaFunctioncall* call;
+    };
+
+    struct Memo {
+        LuaStmt stmt;     // keeps the AST alive, the effects refer to its calls
+        LuaChunk chunk;   // the statement as a chunk of its own
+        size_t scope = 0; // identifies the locals of the main chunk declared before stmt
+        bool replayable = true;
+
+        // the first access to a variable if it was a read, with the value read
+        vector<pair<val, val>> global_reads;
+        vector<pair<unsigned, val>> slot_reads;
+        // the last value written to each variable
+        vector<pair<val, val>> global_writes;
+        vector<pair<unsigned, val>> slot_writes;
+
+        vector<Effect> effects;
+        source_change_t sc;
+    };
+
+    class Recorder;
+    class Relocation;
+
+    bool reusable(const Memo& memo, const _LuaStmt& stmt, size_t scope,
+                  Relocation& relocation) const;
+    // moves the recorded values of memo to stmt, false if they can't be moved
+    static bool relocate(Memo& memo, const LuaStmt& stmt, Relocation& relocation);
+    void replay(const Memo& memo);
+
+    const Evaluator& eval;
+    shared_ptr<Environment> initial;
+    shared_ptr<Environment> env;
+    shared_ptr<Environment> frame; // the locals of the main chunk in the last run
+    unique_ptr<Recorder> recorder;
+
+    vector<Memo> memos;
+    Stats last_stats;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // INCREMENTAL_H
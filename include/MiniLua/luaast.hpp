@@ -1,6 +1,8 @@
 #ifndef LUAAST_H
 #define LUAAST_H
 
+#include "astarena.hpp"
+#include "fieldcache.hpp"
 #include "luatoken.hpp"
 #include "val.hpp"
 
@@ -10,53 +12,98 @@
 
 using namespace std;
 
-#define VISITABLE                                                                                  \
-    virtual lua::rt::eval_result_t accept(const lua::rt::ASTEvaluator& visitor,                    \
-                                          const shared_ptr<lua::rt::Environment>& environment,     \
-                                          const lua::rt::assign_t& assign = nullopt) const
-
-#define VISITABLE_IMPL(T)                                                                          \
-    lua::rt::eval_result_t T::accept(const lua::rt::ASTEvaluator& visitor,                         \
-                                     const shared_ptr<lua::rt::Environment>& environment,          \
-                                     const lua::rt::assign_t& assign) const {                      \
-                                                                                                   \
-        unsigned count =                                                                           \
-            static_cast<unsigned>(get<double>(environment->getvar(string{"__visit_count"})));      \
-        if (count++ > get<double>(environment->getvar(string{"__visit_limit"})))                   \
-            return string{"visit limit reached, stopping"};                                        \
-        environment->assign(string{"__visit_count"}, static_cast<double>(count), false);           \
-                                                                                                   \
-        return visitor.visit(*this, environment, assign);                                          \
-    }
+namespace lua {
+namespace rt {
+struct Proto;
+} // namespace rt
+} // namespace lua
 
+/*
+Every node has the kind of its concrete type, so the evaluators can dispatch with a switch
+instead of a virtual call or a dynamic_pointer_cast.
+*/
 struct _LuaAST {
-    VISITABLE = 0;
+    enum class Kind : uint8_t {
+        Name,
+        Op,
+        Unop,
+        Explist,
+        Value,
+        NameVar,
+        IndexVar,
+        MemberVar,
+        Assignment,
+        Functioncall,
+        ReturnStmt,
+        BreakStmt,
+        ForStmt,
+        LoopStmt,
+        IfStmt,
+        Chunk,
+        Tableconstructor,
+        Field,
+        Function,
+        Comment,
+    };
+
+    explicit _LuaAST(Kind kind) : kind{kind} {}
+    virtual ~_LuaAST() = default;
+
+    const Kind kind;
 };
 
 struct _LuaExp : public _LuaAST {
-    VISITABLE = 0;
-    virtual ~_LuaExp() = default;
+    explicit _LuaExp(Kind kind) : _LuaAST{kind} {}
+};
+
+// lexical address of a variable, filled in by lua::rt::resolve (see luaresolver.hpp)
+struct VarRef {
+    enum class Kind : uint8_t { Unresolved, Local, Global };
+
+    Kind kind = Kind::Unresolved;
+    unsigned depth = 0; // number of scopes between the use and the declaration
+    unsigned slot = 0;  // index into the slots of the declaring scope
+};
+
+// a table access with a constant key, filled in by lua::rt::resolve (see luaresolver.hpp)
+struct FieldRef {
+    optional<lua::rt::val> key; // nullopt if the key is not constant
+    mutable lua::rt::FieldCache cache;
 };
 
 struct _LuaName : public _LuaExp {
-    VISITABLE override;
-    _LuaName(const LuaToken& token) : token{token} {}
+    _LuaName(const LuaToken& token) : _LuaExp{Kind::Name}, token{token} {}
 
     LuaToken token;
+
+    // only used if the name is a variable (not a member or field name)
+    VarRef ref;
+
+    // the access to the global table if the variable is a global
+    FieldRef global;
 };
 
 struct _LuaOp : public _LuaExp {
-    VISITABLE override;
+    _LuaOp() : _LuaExp{Kind::Op} {}
+    // operator chains (1 + 2 + 3) lean to the left, their left spine is released in a loop so
+    // long chains don't recurse per operator
+    ~_LuaOp() {
+        while (lhs && lhs->kind == Kind::Op && lhs.use_count() == 1) {
+            LuaExp next = move(static_cast<_LuaOp&>(*lhs).lhs);
+            lhs = move(next);
+        }
+    }
+
     LuaExp lhs;
     LuaExp rhs;
     LuaToken op;
 };
 
 struct _LuaUnop : public _LuaExp {
-    VISITABLE override;
+    _LuaUnop() : _LuaExp{Kind::Unop} {}
 
-    static LuaUnop Not(const LuaExp& exp) {
-        auto result = make_shared<_LuaUnop>();
+    static LuaUnop Not(const shared_ptr<lua::rt::ASTArena>& arena, const LuaExp& exp) {
+        auto result = lua::rt::make_node<_LuaUnop>(arena);
         result->exp = exp;
         result->op = {LuaToken::Type::NOT, "not"};
         return result;
@@ -67,87 +114,105 @@ struct _LuaUnop : public _LuaExp {
 };
 
 struct _LuaExplist : public _LuaAST {
-    VISITABLE override;
+    _LuaExplist() : _LuaAST{Kind::Explist} {}
+
     vector<LuaExp> exps;
 };
 
 struct _LuaValue : public _LuaExp {
-    VISITABLE override;
-
-    _LuaValue(const LuaToken& token) : token{token} {}
+    _LuaValue(const LuaToken& token);
 
-    static LuaValue Value(const LuaToken& token) { return make_shared<_LuaValue>(token); }
+    static LuaValue Value(const shared_ptr<lua::rt::ASTArena>& arena, const LuaToken& token) {
+        return lua::rt::make_node<_LuaValue>(arena, token);
+    }
 
-    static LuaValue True() {
+    static LuaValue True(const shared_ptr<lua::rt::ASTArena>& arena) {
         LuaToken tok{LuaToken::Type::TRUE, "true"};
-        return Value(tok);
+        return Value(arena, tok);
     }
 
-    static LuaValue Int(int num) {
+    static LuaValue Int(const shared_ptr<lua::rt::ASTArena>& arena, int num) {
         LuaToken tok{LuaToken::Type::NUMLIT, to_string(num)};
-        return Value(tok);
+        return Value(arena, tok);
     }
 
     LuaToken token;
+
+    // the literal decoded when the node is created, all evaluations share its source (which is
+    // never named after a variable, see sourceexp::literal), nullopt if the token is not a literal
+    optional<lua::rt::val> constant;
 };
 
 struct _LuaVar : public _LuaExp {
-    VISITABLE override = 0;
+    explicit _LuaVar(Kind kind) : _LuaExp{kind} {}
+
+    // true if exp is a _LuaVar (a variable that can be assigned to)
+    static bool is_var(const _LuaExp& exp) {
+        return exp.kind == Kind::NameVar || exp.kind == Kind::IndexVar ||
+               exp.kind == Kind::MemberVar;
+    }
 };
 
 struct _LuaNameVar : public _LuaVar {
-    VISITABLE override;
-    _LuaNameVar(const LuaName& name) : name{name} {}
+    _LuaNameVar(const LuaName& name) : _LuaVar{Kind::NameVar}, name{name} {}
 
     LuaName name;
 };
 
 struct _LuaIndexVar : public _LuaVar {
-    VISITABLE override;
+    _LuaIndexVar() : _LuaVar{Kind::IndexVar} {}
+
     LuaExp table;
     LuaExp index;
+
+    // only used if the index is a string literal
+    FieldRef field;
 };
 
 struct _LuaMemberVar : public _LuaVar {
-    VISITABLE override;
+    _LuaMemberVar() : _LuaVar{Kind::MemberVar} {}
+
     LuaExp table;
     LuaName member;
+
+    FieldRef field;
 };
 
 struct _LuaStmt : public _LuaAST {
-    VISITABLE override = 0;
-    virtual ~_LuaStmt() = default;
+    explicit _LuaStmt(Kind kind) : _LuaAST{kind} {}
 
-    vector<LuaToken> tokens;
+    TokenSpan tokens;
 };
 
 struct _LuaAssignment : public _LuaStmt {
-    VISITABLE override;
+    _LuaAssignment() : _LuaStmt{Kind::Assignment} {}
+
     LuaExplist varlist;
     LuaExplist explist;
     bool local = false;
 };
 
+// both an expression and a statement, it has two _LuaAST bases with the same kind
 struct _LuaFunctioncall : public _LuaExp, _LuaStmt {
-    VISITABLE override;
+    _LuaFunctioncall() : _LuaExp{Kind::Functioncall}, _LuaStmt{Kind::Functioncall} {}
+
     LuaExp function;
     LuaExplist args;
 };
 
 struct _LuaReturnStmt : public _LuaStmt {
-    VISITABLE override;
-    _LuaReturnStmt() = default;
-    _LuaReturnStmt(const LuaExplist& explist) : explist{explist} {}
+    _LuaReturnStmt() : _LuaStmt{Kind::ReturnStmt} {}
+    _LuaReturnStmt(const LuaExplist& explist) : _LuaStmt{Kind::ReturnStmt}, explist{explist} {}
 
     LuaExplist explist;
 };
 
 struct _LuaBreakStmt : public _LuaStmt {
-    VISITABLE override;
+    _LuaBreakStmt() : _LuaStmt{Kind::BreakStmt} {}
 };
 
 struct _LuaForStmt : public _LuaStmt {
-    VISITABLE override;
+    _LuaForStmt() : _LuaStmt{Kind::ForStmt} {}
 
     LuaName var;
     LuaExp start;
@@ -158,7 +223,7 @@ struct _LuaForStmt : public _LuaStmt {
 };
 
 struct _LuaLoopStmt : public _LuaStmt {
-    VISITABLE override;
+    _LuaLoopStmt() : _LuaStmt{Kind::LoopStmt} {}
 
     bool head_controlled = true;
     LuaExp end;
@@ -167,40 +232,46 @@ struct _LuaLoopStmt : public _LuaStmt {
 };
 
 struct _LuaIfStmt : public _LuaStmt {
-    VISITABLE override;
+    _LuaIfStmt() : _LuaStmt{Kind::IfStmt} {}
 
     vector<pair<LuaExp, LuaChunk>> branches;
 };
 
 struct _LuaChunk : public _LuaAST {
-    VISITABLE override;
+    _LuaChunk() : _LuaAST{Kind::Chunk} {}
 
     vector<LuaStmt> statements;
+
+    // number of local variables of the scope of this chunk, filled in by lua::rt::resolve
+    unsigned num_slots = 0;
+
+    // bytecode of this chunk, filled in by lua::rt::compile
+    mutable shared_ptr<const lua::rt::Proto> bytecode;
 };
 
 struct _LuaTableconstructor : public _LuaExp {
-    VISITABLE override;
+    _LuaTableconstructor() : _LuaExp{Kind::Tableconstructor} {}
 
     vector<LuaField> fields;
-    vector<LuaToken> tokens;
+    TokenSpan tokens;
 };
 
 struct _LuaField : public _LuaAST {
-    VISITABLE override;
+    _LuaField() : _LuaAST{Kind::Field} {}
 
     LuaExp lhs;
     LuaExp rhs;
 };
 
 struct _LuaFunction : public _LuaExp {
-    VISITABLE override;
+    _LuaFunction() : _LuaExp{Kind::Function} {}
 
     LuaExplist params;
     LuaChunk body;
 };
 
 struct _LuaComment : public _LuaStmt {
-    VISITABLE override;
+    _LuaComment() : _LuaStmt{Kind::Comment} {}
 };
 
 #endif // LUAAST_H
@@ -0,0 +1,79 @@
+#ifndef LUAASTBUILDER_H
+#define LUAASTBUILDER_H
+
+#include "luaast.hpp"
+#include "tree_sitter/tree_sitter.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+struct StmtScope;
+
+/*
+Builds the interpreter AST from a tree-sitter syntax tree (see tree_sitter.hpp), as an
+alternative to LuaParser. The chunk is resolved (see luaresolver.hpp) like the ones of
+LuaParser, the tokens have the positions in the source of the tree.
+
+After the tree was edited (ts::Tree::edit), rebuild only builds the statements that intersect
+the changed ranges or the edits again. Every other statement is shared with the last build,
+including its expressions and nested blocks: the tokens of a statement are relative to an anchor
+(see LuaSource) that is moved to its new place, and the resolver only resolves the statements
+that were built (a shared statement whose names are resolved differently now, e.g. because a
+local was declared before it, is copied). So the work of a rebuild follows the size of the
+built statements, apart from a few steps per top-level statement.
+
+The nodes of a shared statement don't change, the chunk of the last build stays valid (e.g. for
+a run that still uses it), but its shared statements have the positions in the new source.
+*/
+class ASTBuilder {
+public:
+    using result_t = variant<LuaChunk, string>;
+
+    // builds the AST of the whole tree
+    result_t build(const ts::Tree& tree);
+
+    // builds the AST of the tree after tree.edit returned edit, reusing the last build
+    result_t rebuild(const ts::Tree& tree, const ts::EditResult& edit);
+
+    struct Stats {
+        size_t built = 0;  // statements that were built
+        size_t reused = 0; // statements that were shared (without their nested statements)
+        size_t copied = 0; // shared statements that were copied to be resolved again
+        size_t tokens = 0; // tokens that were created from the source
+    };
+
+    // the statistics of the last (re)build
+    const Stats& stats() const { return last_stats; }
+
+private:
+    class Build;
+
+    // a statement of the last build
+    struct Entry {
+        uint32_t start; // relative to the statement it is nested in (at the top level: absolute)
+        uint32_t size;
+        ts::TypeId type;
+        LuaStmt stmt;
+        shared_ptr<LuaSource> anchor; // its tokens are relative to it
+        shared_ptr<StmtScope> scope;
+        shared_ptr<const vector<Entry>> nested; // the statements nested in it, by start
+    };
+
+    result_t run(const ts::Tree& tree, const ts::EditResult* edit);
+
+    vector<Entry> statements; // the top-level statements, by start
+    Stats last_stats;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // LUAASTBUILDER_H
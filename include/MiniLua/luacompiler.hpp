@@ -0,0 +1,125 @@
+#ifndef LUACOMPILER_H
+#define LUACOMPILER_H
+
+#include "luaast.hpp"
+#include "val.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+The instruction set of the bytecode VM (see luavm.hpp).
+
+Every function body (and the main chunk) is compiled into a Proto: a flat array of
+instructions that operate on a fixed number of registers R[0..max_registers) of the
+currently executing frame. K[i] denotes the i-th constant of the Proto.
+
+Variables still live in the Environment (closures capture it), registers only hold
+temporaries. Locals are accessed by their lexical address (see luaresolver.hpp), globals
+directly in the global table. Jump targets are absolute instruction indices.
+*/
+enum class OpCode : uint8_t {
+    LOADK,    // R[a] = K[b]
+    MOVE,     // R[a] = R[b]
+    GETLOCAL,  // R[a] = local slot b, c scopes up
+    SETLOCAL,  // local slot b, c scopes up = R[a]; K[aux] is the name of the variable
+    GETGLOBAL, // R[a] = _G[K[b]] with the cache fields[aux]
+    SETGLOBAL, // _G[K[b]] = R[a] with the cache fields[aux]
+    GETVAR,    // R[a] = env[K[b]] (unresolved names)
+    SETVAR,    // env[K[b]] = R[a]; declares a local if c != 0 (unresolved names)
+    GETINDEX, // R[a] = R[b][R[c]]
+    SETINDEX, // R[a][R[b]] = R[c]
+    GETFIELD, // R[a] = R[b][key] with the constant key and cache fields[aux]; c != 0 for members
+    SETFIELD, // R[a][key] = R[b] with the constant key and cache fields[aux]; c != 0 for members
+    NEWTABLE, // R[a] = {} with the source of K[b]
+
+    // arithmetic and comparison: R[a] = R[b] op R[c] with the operator token tokens[aux]
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    POW,
+    MOD,
+    CONCAT,
+    EVAL,
+    LT,
+    LEQ,
+    GT,
+    GEQ,
+    EQ,
+    NEQ,
+
+    // unary operators: R[a] = op R[b] with the operator token tokens[aux]
+    NEG,
+    LEN,
+    NOT,
+    STRIP,
+    POSTFIX_EVAL,
+
+    JMP,  // pc = b
+    TEST, // if R[a].to_bool() == (c != 0) then pc = b
+
+    CALL,     // R[a] = R[a](R[a+1], ..., R[a+b]) for calls[aux]; only the first result if c != 0
+    TAILCALL, // return R[a](R[a+1], ..., R[a+b]) for calls[aux], replaces the current frame
+    CLOSURE,  // R[a] = closure of functions[aux] in the current environment
+
+    PUSHENV, // enter a new scope with a local slots
+    POPENV,  // leave the innermost a scopes
+
+    // numeric for: R[a], R[a+1], R[a+2] = start, limit, step, R[a+3] = the number of the
+    // iteration and R[a+4] = the loop variable (start + R[a+3] * step if start and step are
+    // integers, otherwise the step is added to the last value)
+    FORPREP, // R[a+3] = 0 and the loop variable; if the loop is empty pc = b
+    FORLOOP, // R[a+3] += 1 and the loop variable; if the limit is not yet reached pc = b
+
+    UNPACK, // R[a], ..., R[a+c-1] = flatten(R[a], ..., R[a+b-1]) (padded with nil)
+    RETURN, // return flatten(R[a], ..., R[a+b-1]); returns nil (no return statement) if c != 0
+};
+
+struct Instruction {
+    OpCode op;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+    uint32_t aux = 0;
+};
+
+// a compiled function body (or main chunk)
+struct Proto {
+    vector<Instruction> code;
+    vector<val> constants;
+
+    // AST nodes referenced by the instructions. The Proto is owned by the compiled chunk,
+    // so these are always alive while the Proto is executed.
+    vector<const LuaToken*> tokens;
+    vector<const _LuaFunctioncall*> calls;
+    vector<const _LuaFunction*> functions;
+    vector<const FieldRef*> fields;
+
+    unsigned num_params = 0; // parameters are passed in R[0..num_params)
+    unsigned max_registers = 0;
+
+    string to_string() const;
+};
+
+/*
+Compiles a chunk into bytecode. If params is given, the chunk is compiled as the body of
+a lua function with these formal parameters.
+
+The result is cached in the chunk, so every chunk is compiled at most once.
+*/
+auto compile(const _LuaChunk& chunk, const _LuaExplist* params = nullptr)
+    -> variant<shared_ptr<const Proto>, string>;
+
+} // namespace rt
+} // namespace lua
+
+#endif // LUACOMPILER_H
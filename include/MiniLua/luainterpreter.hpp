@@ -4,8 +4,10 @@
 #include "environment.hpp"
 #include "luaast.hpp"
 #include "operators.hpp"
+#include "provenance.hpp"
 #include "sourcechange.hpp"
 #include "sourceexp.hpp"
+#include "stepbudget.hpp"
 
 #include <memory>
 
@@ -17,79 +19,147 @@ namespace rt {
 #define EVAL(varname, exp, env)                                                                    \
     val varname;                                                                                   \
     source_change_t varname##_sc;                                                                  \
-    if (auto eval_result = (exp)->accept(*this, (env), assign);                                    \
-        holds_alternative<string>(eval_result)) {                                                  \
+    if (auto eval_result = eval(*(exp), (env)); holds_alternative<EvalError>(eval_result)) {       \
         return eval_result;                                                                        \
     } else {                                                                                       \
         varname = get_val(eval_result);                                                            \
         varname##_sc = get_sc(eval_result);                                                        \
     }
 
-#define EVALR(varname, exp, env)                                                                   \
-    val varname;                                                                                   \
+// assigns values to the targets (see BasicASTEvaluator::store)
+#define STORE(varname, targets, env, values, local)                                                \
     source_change_t varname##_sc;                                                                  \
-    if (auto eval_result = (exp)->accept(*this, (env), {});                                        \
-        holds_alternative<string>(eval_result)) {                                                  \
-        return eval_result;                                                                        \
+    if (auto store_result = store(*(targets), (env), (values), (local));                           \
+        holds_alternative<EvalError>(store_result)) {                                              \
+        return store_result;                                                                       \
     } else {                                                                                       \
-        varname = get_val(eval_result);                                                            \
-        varname##_sc = get_sc(eval_result);                                                        \
+        varname##_sc = get_sc(store_result);                                                       \
     }
 
-#define EVALL(varname, exp, env, newval)                                                           \
-    val varname;                                                                                   \
-    source_change_t varname##_sc;                                                                  \
-    if (auto eval_result = (exp)->accept(*this, (env), newval);                                    \
-        holds_alternative<string>(eval_result)) {                                                  \
-        return eval_result;                                                                        \
-    } else {                                                                                       \
-        varname = get_val(eval_result);                                                            \
-        varname##_sc = get_sc(eval_result);                                                        \
+/*
+Common interface of the execution engines. The ASTEvaluator walks the AST directly,
+the BytecodeVM (luavm.hpp) compiles it to bytecode first.
+*/
+struct Evaluator {
+    virtual ~Evaluator() = default;
+
+    // executes the chunk in env and returns its result and source changes, the locals of the
+    // chunk are in a new frame (see Environment::main_frame)
+    eval_result_t run(const LuaChunk& chunk, const shared_ptr<Environment>& env) const {
+        return run_in(chunk, Environment::main_frame(env, chunk->num_slots));
     }
 
-struct ASTEvaluator {
-    eval_result_t visit(const _LuaAST&, const shared_ptr<Environment>&, const assign_t&) const {
-        return string{"unimplemented10"};
+    // executes the chunk directly in frame, which holds the locals of the main chunk (e.g. for
+    // the statements of one program that are run one by one, see IncrementalRunner)
+    virtual eval_result_t run_in(const LuaChunk& chunk,
+                                 const shared_ptr<Environment>& frame) const = 0;
+
+    // limits the steps of every run of this evaluator
+    mutable StepBudget budget;
+
+    // interns the provenance of the arithmetic of every run
+    mutable ProvenanceStore provenance;
+
+    // the environments of calls and blocks are reused
+    mutable FramePool frames;
+};
+
+/*
+Walks the AST. The provenance policy (see provenance.hpp) decides whether the values remember
+their sources: ASTEvaluator tracks them for live editing, LazyASTEvaluator records the arithmetic
+in an execution trace instead, UntrackedASTEvaluator doesn't track them and is fastest.
+
+Unlike the BytecodeVM the evaluator recurses on the native stack for nested calls and
+expressions. A run may use stack_limit bytes of it, but never more than the stack of its thread
+leaves (minus stack_reserve), deeper recursion is a "stack overflow". The stack is checked
+whenever a chunk of the step budget is used up (see StepBudget::refill), not on every node.
+*/
+template <typename Policy> struct BasicASTEvaluator : Evaluator {
+    eval_result_t run_in(const LuaChunk& chunk,
+                         const shared_ptr<Environment>& frame) const override {
+        StepBudget::Run steps{budget};
+        ProvenanceStore::Run store{provenance};
+        char here;
+        StackBase stack{*this, &here};
+        return eval(*chunk, frame);
     }
 
-    eval_result_t visit(const _LuaName& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaOp& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaUnop& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaExplist& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaFunctioncall& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaAssignment& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaValue& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaNameVar& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaIndexVar& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaMemberVar& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaReturnStmt& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaBreakStmt& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaForStmt& for_stmt, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaLoopStmt& loop_stmt, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaChunk& chunk, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaTableconstructor& stmt, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaFunction& exp, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaIfStmt& stmt, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
-    eval_result_t visit(const _LuaComment& stmt, const shared_ptr<Environment>& env,
-                        const assign_t& assign) const;
+    // the maximum size of the native stack a run uses in bytes, exceeding it is a "stack overflow"
+    // (a thread with a smaller stack lowers it, see usable_stack)
+    mutable size_t stack_limit = 6 * 1024 * 1024;
+
+    // the part of the stack of the thread a run leaves free: for the nodes entered between two
+    // checks, the cfunctions they call and the host
+    static constexpr size_t stack_reserve = 256 * 1024;
+
+    // evaluates a node (one step of the budget), switches over its kind to the visit of its type
+    eval_result_t eval(const _LuaExp& exp, const shared_ptr<Environment>& env) const;
+    eval_result_t eval(const _LuaStmt& stmt, const shared_ptr<Environment>& env) const;
+    eval_result_t eval(const _LuaFunctioncall& call, const shared_ptr<Environment>& env) const;
+    eval_result_t eval(const _LuaExplist& explist, const shared_ptr<Environment>& env) const;
+    eval_result_t eval(const _LuaChunk& chunk, const shared_ptr<Environment>& env) const;
+
+    // the store path of assignments and parameter lists: assigns value to the target (a name or
+    // a variable) without reading it, the result is nil with the source changes of the table and
+    // index expressions
+    eval_result_t store(const _LuaExp& target, const shared_ptr<Environment>& env, const val& value,
+                        bool local) const;
+    // assigns the values to the targets in order, the targets without a value get nil
+    eval_result_t store(const _LuaExplist& targets, const shared_ptr<Environment>& env,
+                        const vallist& values, bool local) const;
+
+    eval_result_t visit(const _LuaName& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaOp& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaUnop& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaExplist& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaFunctioncall& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaAssignment& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaValue& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaNameVar& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaIndexVar& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaMemberVar& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaReturnStmt& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaBreakStmt& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaForStmt& for_stmt, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaLoopStmt& loop_stmt, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaChunk& chunk, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaTableconstructor& stmt, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaFunction& exp, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaIfStmt& stmt, const shared_ptr<Environment>& env) const;
+    eval_result_t visit(const _LuaComment& stmt, const shared_ptr<Environment>& env) const;
+
+private:
+    // remembers where the native stack of the outermost run starts and how much of it the run
+    // may use
+    struct StackBase {
+        StackBase(const BasicASTEvaluator& eval, const char* here)
+            : eval{eval}, outermost{!eval.stack_base} {
+            if (outermost) {
+                eval.stack_base = here;
+                eval.stack_max = eval.usable_stack(here);
+            }
+        }
+        ~StackBase() {
+            if (outermost)
+                eval.stack_base = nullptr;
+        }
+
+        const BasicASTEvaluator& eval;
+        bool outermost;
+    };
+
+    // the native stack a run starting at here may use: stack_limit, but no more than the stack of
+    // the thread leaves below here (minus stack_reserve)
+    size_t usable_stack(const char* here) const;
+    // the native stack used by the current run in bytes
+    size_t stack_used() const;
+
+    // the slow path of a step (see StepBudget::refill): starts the next chunk of the budget and
+    // checks the stack, the error that stops the run or nullopt
+    optional<EvalError> checkpoint() const;
+
+    mutable const char* stack_base = nullptr;
+    mutable size_t stack_max = 0;
 };
 
 } // namespace rt
@@ -1,9 +1,9 @@
 #ifndef LUAPARSER_H
 #define LUAPARSER_H
 
+#include "astarena.hpp"
 #include "luaast.hpp"
 
-#include <boost/spirit/include/lex_lexertl.hpp>
 #include <chrono>
 #include <memory>
 #include <regex>
@@ -14,40 +14,6 @@
 #include <vector>
 
 using namespace std;
-namespace bs = boost::spirit;
-
-constexpr size_t WS = 1000;
-
-template <typename Lexer> struct lua_tokens : bs::lex::lexer<Lexer> {
-    lua_tokens() {
-        // define tokens (the regular expression to match and the corresponding
-        // token id) and add them to the lexer
-        this->self.add("\\s+", WS)("--\\[\\[[^\\]]*\\]\\]", LuaToken::Type::BLOCKCOMMENT)("--[^\n]*", LuaToken::Type::COMMENT)
-                ("(\\\"[^\\\"]*\\\")|('[^']*')", LuaToken::Type::STRINGLIT)
-                ("((\\d+\\.?\\d*)|(\\d*\\.?\\d+))(e-?\\d+)?", LuaToken::Type::NUMLIT)("\\+", LuaToken::Type::ADD)(
-            "-", LuaToken::Type::SUB)("\\*", LuaToken::Type::MUL)("\\/", LuaToken::Type::DIV)(
-            "%", LuaToken::Type::MOD)("\\^", LuaToken::Type::POW)("\\#", LuaToken::Type::LEN)(
-            "\\$", LuaToken::Type::STRIP)("\\\\", LuaToken::Type::EVAL)("==", LuaToken::Type::EQ)(
-            "~=", LuaToken::Type::NEQ)("<=", LuaToken::Type::LEQ)(">=", LuaToken::Type::GEQ)(
-            "<", LuaToken::Type::LT)(">", LuaToken::Type::GT)("=", LuaToken::Type::ASSIGN)(
-            "\\{", LuaToken::Type::LCB)("\\}", LuaToken::Type::RCB)("\\(", LuaToken::Type::LRB)(
-            "\\)", LuaToken::Type::RRB)("\\[", LuaToken::Type::LSB)("\\]", LuaToken::Type::RSB)(
-            ";", LuaToken::Type::SEM)(":", LuaToken::Type::COLON)(",", LuaToken::Type::COMMA)(
-            "\\.\\.\\.", LuaToken::Type::ELLIPSE)("\\.\\.", LuaToken::Type::CONCAT)(
-            "\\.", LuaToken::Type::DOT)("and\\W", /* \b is not supported :-(*/ LuaToken::Type::AND)(
-            "break\\W", LuaToken::Type::BREAK)("do\\W", LuaToken::Type::DO)(
-            "elseif\\W", LuaToken::Type::ELSEIF)("else\\W", LuaToken::Type::ELSE)(
-            "end", LuaToken::Type::END)("false", LuaToken::Type::FALSE)(
-            "for\\W", LuaToken::Type::FOR)("function\\W", LuaToken::Type::FUNCTION)(
-            "if\\W", LuaToken::Type::IF)("in\\W", LuaToken::Type::IN)("local\\W",
-                                                                      LuaToken::Type::LOCAL)(
-            "nil", LuaToken::Type::NIL)("not\\W", LuaToken::Type::NOT)("or\\W", LuaToken::Type::OR)(
-            "repeat\\W", LuaToken::Type::REPEAT)("return\\W", LuaToken::Type::RETURN)(
-            "then\\W", LuaToken::Type::THEN)("true", LuaToken::Type::TRUE)("until\\W",
-                                                                           LuaToken::Type::UNTIL)(
-            "while\\W", LuaToken::Type::WHILE)("[a-zA-Z_]\\w*", LuaToken::Type::NAME);
-    }
-};
 
 struct PerformanceStatistics {
     chrono::microseconds parse;
@@ -70,16 +36,28 @@ public:
 
     auto parse(const string program, PerformanceStatistics& ps) -> parse_result_t<LuaChunk>;
 
-    token_list_t tokens;
+    // the tokens of the last parsed program (the AST refers to them with TokenSpans)
+    const token_list_t& tokens() const { return *token_list; }
 
 private:
-    using token_type =
-        bs::lex::lexertl::token<string::const_iterator, boost::mpl::vector0<>, boost::mpl::false_>;
-    using lexer_type = bs::lex::lexertl::lexer<token_type>;
+    shared_ptr<token_list_t> token_list;
+
+    // the nodes of every parse are allocated in an arena of their own
+    shared_ptr<lua::rt::ASTArena> arena;
+
+    // the parser recurses for nested expressions and blocks, deeper nesting is a parse error
+    static constexpr unsigned max_depth = 1000;
+    mutable unsigned depth = 0;
+
+    template <typename T, typename... Args> shared_ptr<T> make(Args&&... args) const {
+        return lua::rt::make_node<T>(arena, forward<Args>(args)...);
+    }
 
-    lua_tokens<lexer_type> lua_lexer;
+    // the tokens of the program, an error if a token or the program is too large for a LuaToken
+    auto tokenize(const string& program) -> parse_result_t<token_list_t>;
 
-    auto tokenize(string::const_iterator begin, string::const_iterator end) -> token_list_t;
+    // the tokens [first, last) of a node
+    TokenSpan span(token_it_t first, token_it_t last) const;
 
     auto parse_chunk(token_it_t& begin, token_it_t& end) const -> parse_result_t<LuaChunk>;
     auto parse_block(token_it_t& begin, token_it_t& end) const -> parse_result_t<LuaChunk>;
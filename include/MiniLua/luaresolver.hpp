@@ -0,0 +1,68 @@
+#ifndef LUARESOLVER_H
+#define LUARESOLVER_H
+
+#include "luaast.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+Resolves all variables of a chunk to their lexical address (VarRef).
+
+Every block (the body of a function, loop or if branch and the main chunk) is a scope and
+gets its own Environment at runtime. The locals of a scope are stored in the slots of that
+Environment: a local variable is addressed by the number of scopes between its use and its
+declaration (depth) and its index in the declaring scope (slot). All other variables are
+globals and are looked up in the global table directly.
+
+Table accesses with a constant string key (a.b and a["b"]) and the globals get their key
+(FieldRef), so the evaluators can cache where the key is found.
+
+Is called by LuaParser::parse, so every parsed chunk is already resolved.
+*/
+void resolve(const LuaChunk& chunk);
+
+/*
+How a statement was resolved in the scopes around it: the names it uses that are declared outside
+of it (a local with the depth counted from the scope of the statement) and the locals it declares
+in that scope. before is a fingerprint of the locals that are visible before the statement, in
+two places with the same fingerprint the statement is resolved the same way.
+*/
+struct StmtScope {
+    bool resolved = false;
+    uint64_t before = 0;
+    vector<pair<string, VarRef>> uses;
+    vector<pair<string, unsigned>> declares;
+};
+
+/*
+The statements of a chunk that are shared with chunks that were resolved before (see
+ASTBuilder::rebuild), and the statements whose StmtScope is recorded.
+
+A shared statement (with a resolved StmtScope) is skipped if its names are resolved the same way
+in the new chunk, only its locals are declared. Otherwise it is replaced by copy(stmt) in its
+chunk, which is resolved instead: the nodes of a shared statement are never changed, the chunks
+before still use them. Every other statement in scopes is resolved and its StmtScope recorded.
+*/
+struct SharedStatements {
+    unordered_map<const _LuaStmt*, StmtScope*> scopes;
+    // a copy of the nodes the resolver annotates, copy can add the scopes of the copies
+    function<LuaStmt(const LuaStmt&)> copy;
+};
+
+// resolves a chunk that shares statements with chunks resolved before
+void resolve(const LuaChunk& chunk, SharedStatements& shared);
+
+} // namespace rt
+} // namespace lua
+
+#endif // LUARESOLVER_H
@@ -1,14 +1,39 @@
 #ifndef LUATOKEN_H
 #define LUATOKEN_H
 
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 using namespace std;
 
+class LuaSource;
+
+/*
+A 16 byte token: a pointer to the shared text it was found in (see LuaSource), the offset and
+length of the match in that text and the type. Copying a token only copies these and counts the
+reference to the text, match and ws are views into the text.
+
+The whitespace before a token is not stored, it is the whitespace that directly precedes the
+match in the text (tokens never end with whitespace).
+
+The offset has 32 and the length 24 bits, so a token of a shared text has to start before
+max_pos and be shorter than max_length (the scanner rejects programs with larger ones). A token
+with a text of its own can be longer, its match is the rest of its text.
+
+The offset of a token of an anchor (see LuaSource) is relative to the anchor, its position and
+match are found through the anchors up to the text.
+
+The refcounts are not atomic, like the rest of the interpreter tokens must not be shared
+between threads.
+*/
 struct LuaToken {
     // clang-format off
-    enum Type {
+    enum Type : uint8_t {
         NONE,
         ADD, SUB, MUL, DIV, MOD, POW, LEN, STRIP, EVAL, //+, -, *, /, %, ^, #, $, "\"
         EQ, NEQ, LEQ, GEQ, LT, GT, ASSIGN, //==, ~=, <=, >=, <, >, =
@@ -21,15 +46,173 @@ struct LuaToken {
         REPEAT, RETURN, THEN, TRUE, UNTIL, WHILE,
 
         NAME, STRINGLIT, NUMLIT, COMMENT, BLOCKCOMMENT
-    } type;
+    };
     //clang-format on
-    string match;
-    long pos = string::npos;
-    long length = 0;
-    string ws = "";
+
+    static constexpr size_t max_pos = numeric_limits<uint32_t>::max();
+    static constexpr size_t max_length = (size_t{1} << 24) - 1;
+
+    LuaToken() : start{0}, length_{0}, type{NONE} {}
+
+    // a token with a text of its own (pos is -1 if the token is not part of a program)
+    LuaToken(Type type, string_view match, long pos = -1, string_view ws = "");
+
+    LuaToken(const LuaToken& other)
+        : text{other.text}, start{other.start}, length_{other.length_}, type{other.type} {
+        retain();
+    }
+    LuaToken(LuaToken&& other) noexcept
+        : text{other.text}, start{other.start}, length_{other.length_}, type{other.type} {
+        other.text = nullptr;
+    }
+    LuaToken& operator=(const LuaToken& other) {
+        other.retain();
+        release();
+        text = other.text;
+        start = other.start;
+        length_ = other.length_;
+        type = other.type;
+        return *this;
+    }
+    LuaToken& operator=(LuaToken&& other) noexcept {
+        if (this != &other) {
+            release();
+            text = other.text;
+            start = other.start;
+            length_ = other.length_;
+            type = other.type;
+            other.text = nullptr;
+        }
+        return *this;
+    }
+    ~LuaToken() { release(); }
+
+    // the position in the program, -1 if there is none
+    long pos() const;
+    long length() const;
+
+    string_view match() const;
+    string_view ws() const;
 
     string to_string() const;
     friend ostream& operator<<(ostream& os, const LuaToken& token);
+
+private:
+    friend class LuaSource;
+
+    struct Text {
+        uint32_t refs = 1;
+        long base; // the position of the text in the program (of an anchor: in its parent)
+        string text;
+        // an anchor has no text of its own, it is a place in the text of its parent
+        Text* parent = nullptr;
+
+        ~Text() {
+            if (parent && --parent->refs == 0)
+                delete parent;
+        }
+    };
+
+    // the text that contains the match and the offset of the match in it
+    const Text& root(size_t& offset) const;
+
+    LuaToken(Text* text, uint32_t start, uint32_t length, Type type)
+        : text{text}, start{start}, length_{length}, type{type} {
+        retain();
+    }
+
+    void retain() const {
+        if (text)
+            text->refs++;
+    }
+    void release() {
+        if (text && --text->refs == 0)
+            delete text;
+    }
+
+    Text* text = nullptr;
+    uint32_t start;
+    uint32_t length_ : 24;
+
+public:
+    Type type : 8;
+};
+
+static_assert(sizeof(LuaToken) == 16, "LuaToken must fit into 16 bytes");
+
+/*
+The text of a program that its tokens refer to. Creating tokens from it doesn't copy anything.
+
+A source can also be a part of a program (a text that starts at pos) or an anchor: a place in
+another source that has no text of its own. The tokens of a part or an anchor are relative to
+it, so moving it (e.g. after text before it was inserted) moves all of its tokens without
+changing them. An anchor keeps the source it is in alive.
+*/
+class LuaSource {
+public:
+    explicit LuaSource(string text, size_t pos = 0)
+        : text{new LuaToken::Text{1, static_cast<long>(pos), move(text)}} {}
+    // an anchor at pos (a position in the program) in parent
+    LuaSource(const LuaSource& parent, size_t pos);
+    LuaSource(const LuaSource&) = delete;
+    LuaSource& operator=(const LuaSource&) = delete;
+    ~LuaSource() {
+        if (--text->refs == 0)
+            delete text;
+    }
+
+    // the text of the program (or part) the source is in
+    const string& str() const;
+
+    // the position in the program
+    long pos() const;
+
+    // moves a part to pos
+    void move_to(size_t pos);
+    // moves an anchor to pos in parent
+    void move_to(const LuaSource& parent, size_t pos);
+
+    // the token of the match at start, relative to the source (start <= max_pos, length <
+    // max_length)
+    LuaToken token(LuaToken::Type type, size_t start, size_t length) const {
+        return LuaToken{text, static_cast<uint32_t>(start), static_cast<uint32_t>(length), type};
+    }
+
+private:
+    friend struct LuaToken;
+
+    LuaToken::Text* text;
+};
+
+/*
+The tokens [first, last) of an AST node in the token list of its program. All nodes of a program
+share the list, so a statement doesn't copy the tokens of the statements nested in it.
+*/
+struct TokenSpan {
+    using list_t = vector<LuaToken>;
+
+    TokenSpan() = default;
+    TokenSpan(shared_ptr<list_t> list, size_t first, size_t last)
+        : list{move(list)}, first{static_cast<uint32_t>(first)},
+          last{static_cast<uint32_t>(last)} {}
+
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+
+    const LuaToken* begin() const { return list ? list->data() + first : nullptr; }
+    const LuaToken* end() const { return list ? list->data() + last : nullptr; }
+    LuaToken* begin() { return list ? list->data() + first : nullptr; }
+    LuaToken* end() { return list ? list->data() + last : nullptr; }
+
+    const LuaToken& operator[](size_t i) const { return (*list)[first + i]; }
+    const LuaToken& front() const { return (*list)[first]; }
+    const LuaToken& back() const { return (*list)[last - 1]; }
+
+    vector<LuaToken> to_vector() const { return vector<LuaToken>(begin(), end()); }
+
+    shared_ptr<list_t> list;
+    uint32_t first = 0;
+    uint32_t last = 0;
 };
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef LUAVM_H
+#define LUAVM_H
+
+#include "environment.hpp"
+#include "luacompiler.hpp"
+#include "luainterpreter.hpp"
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+Executes chunks that were compiled with lua::rt::compile.
+
+The chunk (and every lua function when it is called for the first time) is compiled once and
+the bytecode is cached in the AST, so repeated runs of the same program only pay for the
+dispatch loop. Values, source tracking and source changes are the same as in the ASTEvaluator,
+so both can be used interchangeably through the Evaluator interface.
+
+Every call of a lua function gets its own activation environment (a child of the closure
+environment), so recursive functions work as expected.
+
+Lua calls don't recurse on the native stack: the frames of the active calls, their registers and
+scopes are kept in stacks on the heap. A call in a return statement (return f(x)) is a proper
+tail call that replaces the frame of the caller. The depth of the recursion is only limited by
+stack_limit.
+
+Like the AST evaluator it is templated on the provenance policy (see provenance.hpp).
+*/
+template <typename Policy> struct BasicBytecodeVM : Evaluator {
+    eval_result_t run_in(const LuaChunk& chunk,
+                         const shared_ptr<Environment>& frame) const override;
+
+    // the maximum size of the stacks of a run in bytes, exceeding it is a "stack overflow"
+    mutable size_t stack_limit = 64 * 1024 * 1024;
+
+private:
+    struct CallFrame {
+        shared_ptr<const Proto> proto;
+        lfunction_p function; // keeps the called function alive (nullptr for the main chunk)
+        size_t pc = 0;
+        size_t base = 0;      // the first register of the frame
+        size_t env_base = 0;  // the first scope of the frame
+        size_t result = 0;    // the register of the caller that receives the result
+        bool single = false;  // the caller only wants the first result
+    };
+
+    eval_result_t execute(const shared_ptr<const Proto>& entry, const shared_ptr<Environment>& env,
+                          source_change_t& sc) const;
+};
+
+using BytecodeVM = BasicBytecodeVM<FullTracking>;
+using LazyBytecodeVM = BasicBytecodeVM<LazyTracking>;
+using UntrackedBytecodeVM = BasicBytecodeVM<NoTracking>;
+
+} // namespace rt
+} // namespace lua
+
+#endif // LUAVM_H
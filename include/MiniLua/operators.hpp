@@ -2,29 +2,41 @@
 #define OPERATORS_H
 
 #include "luatoken.hpp"
+#include "provenance.hpp"
 #include "val.hpp"
 
 namespace lua {
 namespace rt {
 
+// the operators that create sources for their results are templated on the provenance policy
+// (see provenance.hpp), they are instantiated for FullTracking, LazyTracking and NoTracking
+
+template <typename Policy = FullTracking>
 eval_result_t op_add(val a, val b, const LuaToken& tok = {LuaToken::Type::ADD, ""});
 inline val operator+(const val& a, const val& b) { return unwrap(op_add(a, b)); }
 
+template <typename Policy = FullTracking>
 eval_result_t op_sub(val a, val b, const LuaToken& tok = {LuaToken::Type::SUB, ""});
 inline val operator-(const val& a, const val& b) { return unwrap(op_sub(a, b)); }
 
+template <typename Policy = FullTracking>
 eval_result_t op_mul(val a, val b, const LuaToken& tok = {LuaToken::Type::MUL, ""});
 inline val operator*(const val& a, const val& b) { return unwrap(op_mul(a, b)); }
 
+template <typename Policy = FullTracking>
 eval_result_t op_div(val a, val b, const LuaToken& tok = {LuaToken::Type::DIV, ""});
 inline val operator/(const val& a, const val& b) { return unwrap(op_div(a, b)); }
 
+template <typename Policy = FullTracking>
 eval_result_t op_pow(val a, val b, const LuaToken& tok = {LuaToken::Type::POW, ""});
 inline val operator^(const val& a, const val& b) { return unwrap(op_pow(a, b)); }
 
+template <typename Policy = FullTracking>
 eval_result_t op_mod(val a, val b, const LuaToken& tok = {LuaToken::Type::MOD, ""});
 eval_result_t op_concat(val a, val b);
+template <typename Policy = FullTracking>
 eval_result_t op_eval(val a, val b, const LuaToken& tok = {LuaToken::Type::EVAL, ""});
+template <typename Policy = FullTracking>
 eval_result_t op_postfix_eval(val a, const LuaToken& tok = {LuaToken::Type::EVAL, ""});
 
 eval_result_t op_lt(val a, val b);
@@ -56,6 +68,7 @@ eval_result_t op_len(val v);
 eval_result_t op_not(val v);
 inline bool operator!(const val& a) { return get<bool>(unwrap(op_not(a))); }
 
+template <typename Policy = FullTracking>
 eval_result_t op_neg(val v, const LuaToken& tok = {LuaToken::Type::SUB, ""});
 inline val operator-(const val& a) { return unwrap(op_neg(a)); }
 
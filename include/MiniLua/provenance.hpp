@@ -0,0 +1,42 @@
+#ifndef PROVENANCE_H
+#define PROVENANCE_H
+
+namespace lua {
+namespace rt {
+
+/*
+Provenance policies for the evaluators and the operators (op_* in operators.hpp).
+
+With FullTracking every value remembers the expression it was computed from (val::source), so
+it can be forced to a new value and the live evaluation operators produce source changes. This
+is what the editor needs.
+
+NoTracking drops all sources: literals evaluate to plain values, the operators don't create
+sourcebinop/sourceunop nodes and the evaluation operators don't change the source. Since no
+value has a source, no source changes can arise either. Runs without provenance don't allocate
+anything for it.
+
+LazyTracking tracks the same sources as FullTracking, but the arithmetic operators only append a
+record of the operation to the execution trace (see trace.hpp) instead of allocating a
+sourcebinop/sourceunop with copies of both operands. The nodes are rebuilt from the trace when a
+value is forced.
+*/
+struct FullTracking {
+    static constexpr bool tracking = true;
+    static constexpr bool lazy = false;
+};
+
+struct LazyTracking {
+    static constexpr bool tracking = true;
+    static constexpr bool lazy = true;
+};
+
+struct NoTracking {
+    static constexpr bool tracking = false;
+    static constexpr bool lazy = false;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // PROVENANCE_H
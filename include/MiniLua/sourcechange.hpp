@@ -13,16 +13,44 @@ struct SourceChangeVisitor {
     virtual void visit(const struct SourceChangeOr& sc) = 0;
     virtual void visit(const struct SourceChangeAnd& sc) = 0;
     virtual void visit(const struct SourceAssignment& sc) = 0;
+
+    // visits the tree of the set by default
+    virtual void visit(const struct SourceChangeSet& sc);
 };
 
+// replaces length characters at pos of the source text
+struct TextEdit {
+    long pos;
+    long length;
+    string replacement;
+};
+
+// applies edits (sorted by position, not overlapping) to the source text
+string apply_edits(const string& source, const vector<TextEdit>& edits);
+
 struct ApplySCVisitor : public SourceChangeVisitor {
     void visit(const SourceChangeOr& sc) override;
     void visit(const SourceChangeAnd& sc) override;
     void visit(const SourceAssignment& sc) override;
+    void visit(const SourceChangeSet& sc) override;
 
+    /*
+    The tokens have to be sorted by position (like the tokens of the parser), the replaced
+    tokens are found with a binary search. If there are several changes of the same token, the
+    one that was collected last wins. Both functions clear the collected changes.
+    */
+
+    // applies the collected changes to a copy of the tokens
     vector<LuaToken> apply_changes(const vector<LuaToken>& tokens);
 
+    // the collected changes as edits of the source text, sorted by position
+    vector<TextEdit> text_edits(const vector<LuaToken>& tokens);
+
     std::vector<SourceAssignment> changes;
+
+private:
+    // sorts the changes by position and removes the overwritten ones
+    void normalize();
 };
 
 struct SourceChange {
@@ -36,6 +64,13 @@ struct SourceChange {
         return vis.apply_changes(tokens);
     }
 
+    vector<TextEdit> edits(const vector<LuaToken>& tokens) {
+        ApplySCVisitor vis;
+        accept(vis);
+
+        return vis.text_edits(tokens);
+    }
+
     virtual void accept(SourceChangeVisitor& v) const = 0;
     std::string hint = "?";
 };
@@ -74,12 +109,57 @@ struct SourceAssignment : SourceChange {
     virtual void accept(SourceChangeVisitor& v) const override { v.visit(*this); }
 };
 
+/*
+A flat collection of source changes that are all applied, like a SourceChangeAnd.
+
+The evaluators collect the changes of an evaluation in one set (see operator&=) instead of
+allocating a two-element SourceChangeAnd for every combination. The set stores the change trees
+that are added to it in two arrays: their nodes in preorder and the assignments. A
+SourceChangeOr is a node followed by its alternatives, every alternative is the range of nodes
+of its subtree. Adding changes only appends to the arrays and the applied assignments are
+collected in a single scan.
+
+The equivalent SourceChange tree is only built when it is needed (tree()).
+*/
+struct SourceChangeSet : SourceChange {
+    // appends the change, SourceChangeAnds and sets at the top are flattened
+    void add(const SourceChange& change);
+
+    bool empty() const { return nodes.empty(); }
+
+    // appends the assignments that are applied (the first alternative of every choice) to out
+    void applied(vector<SourceAssignment>& out) const;
+
+    // builds the equivalent tree of SourceChangeAnd, SourceChangeOr and SourceAssignment
+    shared_ptr<SourceChange> tree() const;
+
+    virtual string to_string() const override;
+
+    virtual void accept(SourceChangeVisitor& v) const override { v.visit(*this); }
+
+private:
+    struct Node {
+        enum class Kind : uint8_t { Assignment, And, Or };
+
+        Kind kind;
+        uint32_t size;       // number of nodes in the subtree, including this one
+        uint32_t assignment; // index into assignments (only Kind::Assignment)
+    };
+
+    struct Appender;
+
+    shared_ptr<SourceChange> build(size_t& index) const;
+
+    vector<Node> nodes;
+    vector<SourceAssignment> assignments;
+};
+
 inline source_change_t operator|(const source_change_t& lhs, const source_change_t& rhs) {
     if (lhs && rhs) {
         auto sc_or = make_shared<SourceChangeOr>();
         sc_or->alternatives = {*lhs, *rhs};
 
-        return move(sc_or);
+        return sc_or;
     }
 
     return lhs ? lhs : rhs;
@@ -87,21 +167,40 @@ inline source_change_t operator|(const source_change_t& lhs, const source_change
 
 inline source_change_t operator&(const source_change_t& lhs, const source_change_t& rhs) {
     if (lhs && rhs) {
-        auto sc_and = make_shared<SourceChangeAnd>();
-        sc_and->changes = {*lhs, *rhs};
+        auto sc_and = make_shared<SourceChangeSet>();
+        sc_and->add(**lhs);
+        sc_and->add(**rhs);
 
-        return move(sc_and);
+        return sc_and;
     }
 
     return lhs ? lhs : rhs;
 }
 
-// adds a source change to an eval_result_t
-inline eval_result_t operator<<(const eval_result_t& lhs, const source_change_t& rhs) {
-    if (holds_alternative<string>(lhs))
+// adds rhs to lhs, in place if lhs is a set that is not shared
+inline source_change_t& operator&=(source_change_t& lhs, const source_change_t& rhs) {
+    if (!rhs)
         return lhs;
+    if (!lhs)
+        return lhs = rhs;
+
+    auto set = dynamic_pointer_cast<SourceChangeSet>(*lhs);
+    // lhs and set are the only owners
+    if (!set || set.use_count() > 2) {
+        set = make_shared<SourceChangeSet>();
+        set->add(**lhs);
+        lhs = set;
+    }
+    set->add(**rhs);
+
+    return lhs;
+}
 
-    return eval_success(get_val(lhs), get_sc(lhs) & rhs);
+// adds a source change to an eval_result_t
+inline eval_result_t operator<<(eval_result_t lhs, const source_change_t& rhs) {
+    if (auto success = get_if<eval_success_t>(&lhs))
+        success->second &= rhs;
+    return lhs;
 }
 
 } // namespace rt
@@ -4,10 +4,14 @@
 #include "luatoken.hpp"
 #include "val.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+
 namespace lua {
 namespace rt {
 
-struct sourceexp : std::enable_shared_from_this<sourceexp> {
+struct sourceexp {
     virtual ~sourceexp();
     virtual source_change_t forceValue(const val& v) const = 0;
     virtual eval_result_t reevaluate() = 0;
@@ -15,6 +19,13 @@ struct sourceexp : std::enable_shared_from_this<sourceexp> {
     virtual vector<LuaToken> get_all_tokens() const = 0;
 
     string identifier = "";
+
+    // the number of nodes on the longest path to a leaf (see ProvenanceStore)
+    uint32_t depth = 1;
+
+    // the source of a literal of the AST (see _LuaValue), all evaluations of the literal share it,
+    // so it is never named (a variable gets a named copy, see Environment)
+    bool literal = false;
 };
 
 struct sourceval : sourceexp {
@@ -40,16 +51,8 @@ struct sourceval : sourceexp {
 };
 
 struct sourcebinop : sourceexp {
-    static shared_ptr<sourcebinop> create(const val& lhs, const val& rhs, const LuaToken& op) {
-        if (!lhs.source && !rhs.source)
-            return nullptr;
-
-        auto ptr = make_shared<sourcebinop>();
-        ptr->lhs = lhs;
-        ptr->rhs = rhs;
-        ptr->op = op;
-        return ptr;
-    }
+    // the node is taken from the ProvenanceStore of the thread (it may be shared or a summary)
+    static shared_ptr<sourceexp> create(const val& lhs, const val& rhs, const LuaToken& op);
 
     source_change_t forceValue(const val& v) const override;
     eval_result_t reevaluate() override;
@@ -74,15 +77,8 @@ struct sourcebinop : sourceexp {
 };
 
 struct sourceunop : sourceexp {
-    static shared_ptr<sourceunop> create(const val& v, const LuaToken& op) {
-        if (!v.source)
-            return nullptr;
-
-        auto ptr = make_shared<sourceunop>();
-        ptr->v = v;
-        ptr->op = op;
-        return ptr;
-    }
+    // the node is taken from the ProvenanceStore of the thread (it may be shared or a summary)
+    static shared_ptr<sourceexp> create(const val& v, const LuaToken& op);
 
     source_change_t forceValue(const val& new_v) const override;
     eval_result_t reevaluate() override;
@@ -101,6 +97,165 @@ struct sourceunop : sourceexp {
     LuaToken op;
 };
 
+// the variable of a numeric for loop in iteration n (counting from 0): start + n * step
+// (instead of a chain of n additions)
+struct sourcefor : sourceexp {
+    static shared_ptr<sourcefor> create(const val& start, const val& step, double n) {
+        if (!start.source && !step.source)
+            return nullptr;
+
+        auto ptr = make_shared<sourcefor>();
+        ptr->start = start;
+        ptr->step = step;
+        ptr->n = n;
+        ptr->depth = 1 + max(start.source ? start.source->depth : 0,
+                             step.source ? step.source->depth : 0);
+        return ptr;
+    }
+
+    source_change_t forceValue(const val& v) const override;
+    eval_result_t reevaluate() override;
+    bool isDirty() const override;
+
+    vector<LuaToken> get_all_tokens() const override {
+        vector<LuaToken> result;
+        if (start.source)
+            result = start.source->get_all_tokens();
+        if (step.source) {
+            auto step_tokens = step.source->get_all_tokens();
+            result.insert(end(result), begin(step_tokens), end(step_tokens));
+        }
+        return result;
+    }
+
+    val start;
+    val step;
+    double n;
+};
+
+// a collapsed chain of operations that are affine in the value at its start (base) and in the
+// sources added to or subtracted from it on the way (terms):
+// scale * base + coeff_1 * term_1 + ... + offset (see ProvenanceStore)
+struct sourceaffine : sourceexp {
+    struct Term {
+        val v;
+        double coeff;
+    };
+
+    // the number of different sources a chain keeps as terms
+    static constexpr size_t max_terms = 8;
+
+    static shared_ptr<sourceaffine> create(const val& base, double scale, double offset,
+                                           vector<Term> terms = {}) {
+        auto ptr = make_shared<sourceaffine>();
+        ptr->base = base;
+        ptr->scale = scale;
+        ptr->offset = offset;
+        ptr->terms = move(terms);
+        ptr->depth = 1 + (base.source ? base.source->depth : 0);
+        for (const auto& term : ptr->terms)
+            ptr->depth = max(ptr->depth, 1 + term.v.source->depth);
+        return ptr;
+    }
+
+    source_change_t forceValue(const val& v) const override;
+    eval_result_t reevaluate() override;
+    bool isDirty() const override;
+
+    // the operators of the chain are gone, only the tokens of the base and the terms are left
+    vector<LuaToken> get_all_tokens() const override {
+        vector<LuaToken> result;
+        if (base.source)
+            result = base.source->get_all_tokens();
+        for (const auto& term : terms) {
+            auto term_tokens = term.v.source->get_all_tokens();
+            result.insert(end(result), begin(term_tokens), end(term_tokens));
+        }
+        return result;
+    }
+
+    val base;
+    double scale = 1;
+    double offset = 0;
+    vector<Term> terms; // every term has a source
+};
+
+/*
+Creates the sourcebinop and sourceunop nodes of the arithmetic operators.
+
+Every evaluator has its own store (Evaluator::provenance). Evaluator::run_in starts a Run, which
+makes the store the active one of the thread and empties it unless a run of it is already active,
+so a run doesn't share nodes with the runs before it. Outside of a run (e.g. operators called by the
+host) the thread has a store of its own.
+
+The nodes are interned: an operation with the same operator, the same operand values and the same
+operand sources gets the node that is already there (e.g. an expression that is evaluated again in
+a loop), so the sources form a DAG. A node that was named after a variable (sourceexp::identifier)
+isn't handed out again, the same operation for another variable gets a node of its own. The store
+only refers to its nodes weakly, it doesn't keep them alive. When it holds more than max_size nodes
+the expired ones are removed (all of them if that isn't enough).
+
+Chains of operations are limited to max_depth nodes: an addition, subtraction, multiplication or
+division by a value and a negation of a deeper source are collapsed into a sourceaffine with the
+source at the start of the chain, so iterations like x = x + dx don't keep every intermediate
+value alive and can still be forced. The sources added to or subtracted from the chain (dx) are
+kept as terms of the summary, so forcing can change the start or one of them. Factors and
+divisors are constants of the summary, their sources can't be changed through it, and neither can
+the sources beyond max_terms. The results of other operations on a too deep source don't remember
+that source, only the one of the other operand.
+*/
+class ProvenanceStore {
+public:
+    // the store of the innermost active run (or the one of the thread)
+    static ProvenanceStore& active();
+
+    // the scope of a run, the outermost one of a store empties it
+    class Run {
+    public:
+        explicit Run(ProvenanceStore& store);
+        ~Run();
+        Run(const Run&) = delete;
+        Run& operator=(const Run&) = delete;
+
+    private:
+        ProvenanceStore& store;
+        ProvenanceStore* outer;
+    };
+
+    shared_ptr<sourceexp> binop(const val& lhs, const val& rhs, const LuaToken& op);
+    shared_ptr<sourceexp> unop(const val& v, const LuaToken& op);
+
+    // the number of nodes in the table (including expired ones)
+    size_t size() const { return nodes.size(); }
+
+    size_t max_depth = 1000;
+    size_t max_size = 4096;
+
+private:
+    struct Key {
+        LuaToken::Type type;
+        long pos;
+        const sourceexp* sources[2];
+        double operands[2];
+
+        bool operator==(const Key& other) const {
+            return type == other.type && pos == other.pos && sources[0] == other.sources[0] &&
+                   sources[1] == other.sources[1] && operands[0] == other.operands[0] &&
+                   operands[1] == other.operands[1];
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    // the node for key, created by make if there is none
+    template <typename F> shared_ptr<sourceexp> intern(const Key& key, F make);
+
+    unordered_map<Key, weak_ptr<sourceexp>, KeyHash> nodes;
+    unsigned runs = 0;
+};
+
 } // namespace rt
 } // namespace lua
 
@@ -0,0 +1,135 @@
+#ifndef STEPBUDGET_H
+#define STEPBUDGET_H
+
+#include "val.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+Limits the number of steps an evaluator may take (visited AST nodes in the ASTEvaluator,
+executed instructions in the BytecodeVM), so that e.g. an infinite loop in a program that
+is currently being edited does not hang the host.
+
+The budget belongs to the evaluator, but every run gets the full limit again: Evaluator::run_in
+starts a Run, which resets the budget unless a run is already active (a host that runs a program
+in several calls of run_in, like the IncrementalRunner, starts a Run around them so they share one
+budget). extend() grants more steps to the current run, abort() (e.g. from inside a cfunction)
+stops it at the next step. A run that used up its steps calls on_exhausted before it stops, which
+can resume it by calling extend() (e.g. after asking the user whether to go on).
+
+The steps are counted down in chunks of chunk_size: step() only decrements the counter of the
+current chunk, refill() starts the next one when it runs out. The evaluators do their periodic
+checks (like the native stack of the ASTEvaluator) there, off the path of every step. The chunks
+are not visible in consumed() and exhausted().
+*/
+class StepBudget {
+public:
+    using steps_t = int64_t;
+    static constexpr steps_t unlimited = numeric_limits<steps_t>::max();
+    static constexpr steps_t chunk_size = 64;
+
+    StepBudget(steps_t limit = 500) { set_limit(limit); }
+
+    // the scope of a run, the outermost one resets the budget
+    class Run {
+    public:
+        explicit Run(StepBudget& budget) : budget{budget} {
+            if (budget.runs++ == 0)
+                budget.reset();
+        }
+        ~Run() { budget.runs--; }
+        Run(const Run&) = delete;
+        Run& operator=(const Run&) = delete;
+
+    private:
+        StepBudget& budget;
+    };
+
+    // takes one step, returns false if the current chunk is used up (then refill decides).
+    // this runs for every node and instruction, so keep it at one decrement and one branch:
+    // everything else (limits, abort, the checks of the evaluators) belongs into refill.
+    // bench/interpreter.cpp measures it in "Operator chain"
+    bool step() { return --remaining >= 0; }
+
+    // takes the step that step() refused from the next chunk, returns false if the budget is
+    // used up
+    bool refill() {
+        if (remaining >= 0)
+            return true;
+        if (reserve == 0 && !aborted && on_exhausted)
+            on_exhausted(*this);
+        if (reserve == 0)
+            return false;
+        remaining = min(reserve, chunk_size);
+        reserve -= remaining;
+        --remaining;
+        return true;
+    }
+
+    // sets the limit of every run (and of the current one)
+    void set_limit(steps_t limit) {
+        this->limit = limit;
+        reset();
+    }
+
+    // gives the current run the full limit and forgets its consumed steps
+    void reset() {
+        granted = limit;
+        remaining = min(limit, chunk_size);
+        reserve = limit - remaining;
+        aborted = false;
+    }
+
+    // adds more steps to the current run
+    void extend(steps_t steps) {
+        remaining = max<steps_t>(remaining, 0);
+        steps = min(steps, unlimited - max(remaining + reserve, granted));
+        reserve += steps;
+        granted += steps;
+        aborted = false;
+    }
+
+    // uses up the remaining budget of the current run
+    void abort() {
+        granted = consumed();
+        remaining = 0;
+        reserve = 0;
+        aborted = true;
+    }
+
+    // steps taken by the current (or last) run
+    steps_t consumed() const { return granted - max<steps_t>(remaining, 0) - reserve; }
+    bool exhausted() const { return remaining <= 0 && reserve == 0; }
+
+    // called when the current run used up its steps (not after abort), the run goes on if it
+    // calls extend() and stops otherwise
+    function<void(StepBudget&)> on_exhausted;
+
+    // the error message of a run that was stopped by this budget
+    EvalError error() const {
+        if (aborted)
+            return EvalError{"execution aborted"};
+        return EvalError{"visit limit reached, stopping"};
+    }
+
+private:
+    steps_t limit;
+    steps_t granted;
+    steps_t remaining; // the steps left in the current chunk
+    steps_t reserve;   // the steps after the current chunk
+    bool aborted;
+    unsigned runs = 0;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // STEPBUDGET_H
@@ -0,0 +1,211 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include "compactval.hpp"
+#include "val.hpp"
+
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+/*
+A lua table with an array part for the keys 1..n and a hash part for all other keys.
+
+The array part stores its values compactly (see CompactArray). Integer keys move to the
+array part as soon as they extend it, so appending with t[#t + 1] = v is O(1) and so is the
+length operator: the table caches its border (the number of non-nil values at the start of
+the array part).
+
+The interface is close to the unordered_map this used to be: t[key] can be read and assigned,
+find/count/iteration work as usual (but the iterators are read-only). Assigning nil removes
+the key.
+
+The hash part stores its values in slots, the shape of a table maps the keys to their slots.
+Tables that got the same keys in the same order share their shape: the shapes form a tree of
+transitions, a new key moves the table to the child of its shape for that key. So the slot of a
+key is the same for all tables of a shape, which is what the inline caches (see fieldcache.hpp)
+rely on. Removing a key only empties its slot, the shape stays the same.
+
+A table with more than max_shared_keys keys gets a shape of its own (a dictionary) that changes
+in place, but its id still changes with every new key.
+
+Like the rest of the interpreter shapes must not be shared between threads, every thread has its
+own tree.
+*/
+struct table {
+    class reference;
+    class const_iterator;
+    using iterator = const_iterator;
+    using shape_t = uint64_t;
+
+    static constexpr size_t npos = static_cast<size_t>(-1);
+    static constexpr size_t max_shared_keys = 32;
+
+    table();
+    table(const vector<pair<val, val>>& content) : table() {
+        for (const auto& p : content)
+            set(p.first, p.second);
+    }
+
+    // copies share the shape unless it is a dictionary, the moved-from table is empty
+    table(const table& other);
+    table(table&& other);
+    table& operator=(const table& other);
+    table& operator=(table&& other);
+
+    val get(const val& key) const;
+    void set(const val& key, const val& value);
+
+    reference operator[](const val& key);
+
+    // 1 if the key has a (non-nil) value
+    size_t count(const val& key) const;
+
+    // the length of the table (#t)
+    size_t border() const { return array_border; }
+
+    // number of (non-nil) entries
+    size_t size() const { return array_count + hash_count; }
+    bool empty() const { return size() == 0; }
+
+    void clear();
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const val& key) const;
+
+    shape_t shape() const;
+
+    // the slot of key in the hash part (npos if it is not there), the same for all tables with
+    // this shape
+    size_t slot(const val& key) const;
+    // the value in a slot (nil if the slot is npos or its key was removed)
+    val get_slot(size_t slot) const { return slot < values.size() ? values[slot] : val{}; }
+    // assigns a value to a slot that has one already (it doesn't change the shape), returns false
+    // if the slot is empty
+    bool set_slot(size_t slot, const val& value) {
+        if (slot >= values.size() || values[slot].isnil() || value.isnil())
+            return false;
+        values[slot] = value;
+        return true;
+    }
+
+private:
+    struct Shape;
+
+    CompactArray array;
+    size_t array_count = 0;  // number of non-nil values in the array part
+    size_t array_border = 0; // index of the first nil in the array part (or its size)
+    shared_ptr<Shape> shape_;
+    vector<val> values;    // the hash part by slot, nil if the key was removed
+    size_t hash_count = 0; // number of non-nil values in the hash part
+
+    // adds a key that has no slot yet to the hash part
+    void insert(const val& key, const val& value);
+
+    // the index into the array part if key is an integer in [1, size of the array part + 1]
+    bool array_index(const val& key, size_t& index) const;
+
+    void set_array(size_t index, const val& value);
+    void push_array(const val& value);
+};
+
+// the result of t[key]: converts to the value, assigning to it sets the value
+class table::reference {
+public:
+    reference(table& t, const val& key) : t{t}, key{key} {}
+
+    operator val() const { return t.get(key); }
+    reference& operator=(const val& value) {
+        t.set(key, value);
+        return *this;
+    }
+    reference& operator=(const reference& other) { return *this = static_cast<val>(other); }
+
+private:
+    table& t;
+    val key;
+};
+
+inline table::reference table::operator[](const val& key) { return reference{*this, key}; }
+
+// the keys of the hash part of tables and their slots (in the order the keys were added)
+struct table::Shape : enable_shared_from_this<Shape> {
+    ~Shape();
+
+    // the empty shape of new tables (the root of the tree of this thread)
+    static const shared_ptr<Shape>& root();
+    static shape_t new_id();
+
+    // the shape with one more key
+    shared_ptr<Shape> transition(const val& key);
+    // a copy of this shape that belongs to one table
+    shared_ptr<Shape> dictionary() const;
+
+    shape_t id = new_id();
+    unordered_map<val, size_t> slots;
+    vector<val> keys; // by slot
+    bool shared = true;
+
+    // the tree of shared shapes: the children are only kept while a table has them
+    shared_ptr<Shape> parent;
+    unordered_map<val, weak_ptr<Shape>> transitions;
+};
+
+inline table::shape_t table::shape() const { return shape_->id; }
+
+inline size_t table::slot(const val& key) const {
+    auto it = shape_->slots.find(key);
+    return it != shape_->slots.end() ? it->second : npos;
+}
+
+class table::const_iterator {
+public:
+    using iterator_category = forward_iterator_tag;
+    using value_type = pair<val, val>;
+    using difference_type = ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    reference operator*() const { return current; }
+    pointer operator->() const { return &current; }
+
+    const_iterator& operator++() {
+        ++index;
+        load();
+        return *this;
+    }
+    const_iterator operator++(int) {
+        auto old = *this;
+        ++*this;
+        return old;
+    }
+
+    bool operator==(const const_iterator& other) const { return index == other.index; }
+    bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+private:
+    friend struct table;
+
+    const_iterator(const table* t, size_t index) : t{t}, index{index} { load(); }
+
+    // skips the holes of the array part and the empty slots and loads the current entry
+    void load();
+
+    const table* t;
+    size_t index; // into the array part, then into the slots
+    value_type current;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // TABLE_H
@@ -0,0 +1,115 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "luatoken.hpp"
+#include "sourceexp.hpp"
+#include "val.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+namespace lua {
+namespace rt {
+
+class ExecutionTrace;
+
+/*
+The record of an arithmetic operation in an ExecutionTrace and the source of its result: the
+operator, the values of the operands (arithmetic only succeeds on numbers) and the ids of the
+sources of the operands in the trace. The record is only as large as the sourceexp it has to be
+plus these fields, everything else is kept by the trace: the sources of operands that aren't
+records of the same trace and the nodes that were built.
+
+The sourcebinop or sourceunop of the operation is only built when the source is used (node()),
+once per record. Its operands are the nodes of the records of the same trace and the retained
+sources, so the nodes don't own the trace.
+*/
+struct tracedop : sourceexp {
+    // the id of a missing operand source, and the flag of the ids of retained sources
+    static constexpr uint32_t none = UINT32_MAX;
+    static constexpr uint32_t retained = 1u << 31;
+
+    source_change_t forceValue(const val& v) const override;
+    eval_result_t reevaluate() override;
+    bool isDirty() const override;
+    vector<LuaToken> get_all_tokens() const override;
+
+    // the sourcebinop or sourceunop of the operation
+    shared_ptr<sourceexp> node() const;
+
+    // first, so it takes the padding at the end of sourceexp
+    bool unary = false;
+    LuaToken op;
+    double operands[2] = {};
+    // the index of a record of the trace, or a retained source if the flag is set
+    uint32_t sources[2] = {none, none};
+    ExecutionTrace* trace = nullptr;
+};
+
+/*
+The provenance of the arithmetic of LazyTracking runs (see provenance.hpp).
+
+The operators append a record per operation to the active trace of the thread. The source of the
+result points to its record and shares the ownership of the whole trace, so recording an
+operation doesn't allocate: a trace is a block of records that is kept as long as a value refers
+to one of them (like the nodes in an ASTArena).
+
+A trace has a fixed capacity. When the active trace is full it starts over if no value refers to
+it anymore (a ring buffer of the most recent operations), otherwise a new trace becomes active.
+
+The sources of operands that are not records of the same trace (literals, loop variables, the
+results of math functions or of older traces) are retained by the trace.
+
+Chains of records are limited like the nodes of FullTracking: an operation on a source of
+ProvenanceStore::max_depth or deeper is not recorded, its source is created by the active
+ProvenanceStore, which collapses the chain (see ProvenanceStore).
+
+Like the rest of the interpreter a trace must not be shared between threads, every thread
+records into its own.
+*/
+class ExecutionTrace : public enable_shared_from_this<ExecutionTrace> {
+public:
+    static constexpr size_t capacity = 1024;
+
+    ExecutionTrace() { records.reserve(capacity); }
+    ExecutionTrace(const ExecutionTrace&) = delete;
+    ExecutionTrace& operator=(const ExecutionTrace&) = delete;
+
+    // the source of the result of a binary or unary operation, nullptr if no operand has a source
+    static shared_ptr<sourceexp> binop(const val& lhs, const val& rhs, const LuaToken& op);
+    static shared_ptr<sourceexp> unop(const val& v, const LuaToken& op);
+
+    // the trace the operations of this thread are recorded in
+    static const shared_ptr<ExecutionTrace>& active();
+
+    size_t size() const { return records.size(); }
+
+private:
+    friend struct tracedop;
+
+    // the active trace with room for another record
+    static const shared_ptr<ExecutionTrace>& writable();
+
+    // the id of the source of an operand (see tracedop::sources), a source that isn't a record
+    // of this trace is retained
+    uint32_t operand(const val& v);
+
+    // the source with the id (a node of a record or a retained source)
+    const shared_ptr<sourceexp>& source(uint32_t id) const;
+
+    // the node of the record at index, builds the missing nodes of its operands first
+    const shared_ptr<sourceexp>& node(uint32_t index) const;
+
+    vector<tracedop> records;
+    vector<shared_ptr<sourceexp>> retained;
+    // the nodes of the records, by index (filled when they are built)
+    mutable vector<shared_ptr<sourceexp>> built;
+};
+
+} // namespace rt
+} // namespace lua
+
+#endif // TRACE_H
@@ -1,6 +1,7 @@
 #ifndef VAL_H
 #define VAL_H
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <optional>
@@ -92,8 +93,11 @@ struct val : _val_t {
     string to_string() const;
     string literal() const;
 
-    string type() const {
-        switch (index()) {
+    string type() const { return type_name(index()); }
+
+    // the name of the type with the index in the variant
+    static const char* type_name(size_t index) {
+        switch (index) {
         case 0:
             return "nil";
         case 1:
@@ -151,18 +155,15 @@ template <> struct hash<lua::rt::val> {
 namespace lua {
 namespace rt {
 
-using assign_t = optional<tuple<val, bool>>;
-struct ASTEvaluator;
+struct FullTracking;
+struct LazyTracking;
+struct NoTracking;
+template <typename Policy> struct BasicASTEvaluator;
+using ASTEvaluator = BasicASTEvaluator<FullTracking>;
+using LazyASTEvaluator = BasicASTEvaluator<LazyTracking>;
+using UntrackedASTEvaluator = BasicASTEvaluator<NoTracking>;
 struct Environment;
 
-struct table : public unordered_map<val, val> {
-    table() {}
-    table(const vector<pair<val, val>>& content) {
-        for (const auto& p : content)
-            operator[](p.first) = p.second;
-    }
-};
-
 struct vallist : public vector<val> {
     template <typename... T> vallist(T&&... v) : vector<val>{forward<T>(v)...} {}
 };
@@ -199,9 +200,48 @@ struct lfunction {
     shared_ptr<Environment> env; // closure environment
 };
 
+/*
+The error of an evaluation. Creating one doesn't build a string: static messages (string
+literals) are only referenced and the operators only remember the types of their operands,
+message() formats the text when it is read. This keeps code that tries operations and handles
+their errors cheap. Messages that have to be built at runtime are shared by the copies.
+*/
+class EvalError {
+public:
+    // a string literal (an array that outlives the error) is only referenced, other messages are
+    // copied
+    template <size_t N> explicit EvalError(const char (&message)[N]) : text{message} {}
+    // a mutable array can change after the error was created, so it is copied
+    template <size_t N> explicit EvalError(char (&message)[N]) : EvalError{string{message}} {}
+    EvalError(string message) : built{make_shared<const string>(move(message))} {}
+
+    // the types of the operands replace the {} in message (a string literal), e.g.
+    // "cannot index {}"
+    template <size_t N>
+    EvalError(const char (&message)[N], const val& a) : text{message}, num_types{1} {
+        types[0] = static_cast<uint8_t>(a.index());
+    }
+    template <size_t N>
+    EvalError(const char (&message)[N], const val& a, const val& b)
+        : text{message}, num_types{2} {
+        types[0] = static_cast<uint8_t>(a.index());
+        types[1] = static_cast<uint8_t>(b.index());
+    }
+    template <size_t N> EvalError(char (&message)[N], const val& a) = delete;
+    template <size_t N> EvalError(char (&message)[N], const val& a, const val& b) = delete;
+
+    string message() const;
+
+private:
+    const char* text = nullptr;
+    shared_ptr<const string> built;
+    uint8_t types[2] = {};
+    uint8_t num_types = 0;
+};
+
 /*
 Evaluating and expression or program (LuaExp, LuaChunk, LuaStatement etc) may
-result in either an error string or an eval_success_t.
+result in either an EvalError or an eval_success_t.
 This successful result contains a value (the result of evaluating an expression)
 or nil (statements have no result) and an optional source change as a side
 effect.
@@ -218,11 +258,12 @@ Evaluating a=4 results in (nil, nullopt); a successful execution with no result
 
 using source_change_t = optional<shared_ptr<SourceChange>>;
 using eval_success_t = pair<val, source_change_t>;
-using eval_result_t = variant<eval_success_t, string>;
+using eval_result_t = variant<eval_success_t, EvalError>;
 
 // when evaluating an expression, signal success with result v and SourceChange side effect sc
-inline eval_result_t eval_success(const val& v, optional<shared_ptr<SourceChange>> sc = nullopt) {
-    return make_pair(v, sc);
+// (the pair is constructed in the result)
+inline eval_result_t eval_success(val v, optional<shared_ptr<SourceChange>> sc = nullopt) {
+    return eval_result_t{in_place_index<0>, move(v), move(sc)};
 }
 
 // gets the value of the result (no error check!)
@@ -235,8 +276,8 @@ inline optional<shared_ptr<SourceChange>> get_sc(const eval_result_t& result) {
 
 // gets the values and throws errors as a runtime exception
 inline val unwrap(const eval_result_t& result) {
-    if (holds_alternative<string>(result))
-        throw runtime_error(get<string>(result));
+    if (holds_alternative<EvalError>(result))
+        throw runtime_error(get<EvalError>(result).message());
     return get_val(result);
 }
 
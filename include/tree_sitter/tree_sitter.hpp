@@ -319,7 +319,7 @@ const TypeId NODE_LABEL_STATEMENT = LUA_LANGUAGE.node_type_id("label_statement",
 const TypeId NODE_FUNCTION = LUA_LANGUAGE.node_type_id("function", true);
 const TypeId NODE_LOCAL_FUNCTION = LUA_LANGUAGE.node_type_id("local_function", true);
 const TypeId NODE_FUNCTION_CALL = LUA_LANGUAGE.node_type_id("function_call", true);
-const TypeId NODE_ARGUMENTS = LUA_LANGUAGE.node_type_id("ARGUMENTS", true);
+const TypeId NODE_ARGUMENTS = LUA_LANGUAGE.node_type_id("arguments", true);
 const TypeId NODE_FUNCTION_NAME = LUA_LANGUAGE.node_type_id("function_name", true);
 const TypeId NODE_FUNCTION_NAME_FIELD = LUA_LANGUAGE.node_type_id("function_name_field", true);
 const TypeId NODE_PARAMETERS = LUA_LANGUAGE.node_type_id("parameters", true);
@@ -0,0 +1,37 @@
+#include "MiniLua/astarena.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace lua {
+namespace rt {
+
+void* ASTArena::allocate(size_t size, size_t align) {
+    auto aligned = [align](char* p) {
+        auto address = reinterpret_cast<uintptr_t>(p);
+        return p + (align - address % align) % align;
+    };
+
+    if (next) {
+        char* result = aligned(next);
+        if (result + size <= end) {
+            next = result + size;
+            return result;
+        }
+    }
+
+    // a new block, large nodes get a block of their own
+    size_t capacity = max(block_size, size + align);
+    blocks.emplace_back(new char[capacity]);
+    total += capacity;
+
+    char* result = aligned(blocks.back().get());
+    if (capacity == block_size) {
+        next = result + size;
+        end = blocks.back().get() + capacity;
+    }
+    return result;
+}
+
+} // namespace rt
+} // namespace lua
@@ -0,0 +1,106 @@
+#include "MiniLua/compactval.hpp"
+
+namespace lua {
+namespace rt {
+
+CompactVal::CompactVal(const val& v) : bits{nil_bits} {
+    switch (v.index()) {
+    case 0:
+        break;
+    case 1:
+        bits = encode(Tag::Bool, get<bool>(v));
+        break;
+    case 2:
+        *this = CompactVal{get<double>(v)};
+        break;
+    case 3:
+        make_box(Tag::String, get<string>(v));
+        break;
+    case 4:
+        make_box(Tag::CFunction, get<cfunction_p>(v));
+        break;
+    case 5:
+        make_box(Tag::Table, get<table_p>(v));
+        break;
+    case 6:
+        make_box(Tag::Vallist, get<vallist_p>(v));
+        break;
+    case 7:
+        make_box(Tag::LFunction, get<lfunction_p>(v));
+        break;
+    }
+}
+
+val CompactVal::to_val(const shared_ptr<sourceexp>& source) const {
+    switch (tag()) {
+    case Tag::Number:
+        return val{number(), source};
+    case Tag::Nil:
+        return val{nil(), source};
+    case Tag::Bool:
+        return val{(bits & 1) != 0, source};
+    case Tag::String:
+        return val{unbox<string>(), source};
+    case Tag::CFunction:
+        return val{unbox<cfunction_p>(), source};
+    case Tag::Table:
+        return val{unbox<table_p>(), source};
+    case Tag::Vallist:
+        return val{unbox<vallist_p>(), source};
+    case Tag::LFunction:
+        return val{unbox<lfunction_p>(), source};
+    }
+    return val{};
+}
+
+bool CompactVal::operator==(const CompactVal& other) const {
+    if (isnumber() || other.isnumber())
+        return isnumber() && other.isnumber() && number() == other.number();
+
+    if (bits == other.bits)
+        return true;
+
+    if (tag() != other.tag())
+        return false;
+
+    switch (tag()) {
+    case Tag::String:
+        return unbox<string>() == other.unbox<string>();
+    case Tag::CFunction:
+        return unbox<cfunction_p>() == other.unbox<cfunction_p>();
+    case Tag::Table:
+        return unbox<table_p>() == other.unbox<table_p>();
+    case Tag::Vallist:
+        return unbox<vallist_p>() == other.unbox<vallist_p>();
+    case Tag::LFunction:
+        return unbox<lfunction_p>() == other.unbox<lfunction_p>();
+    default:
+        return false;
+    }
+}
+
+void CompactVal::destroy() {
+    switch (tag()) {
+    case Tag::String:
+        delete static_cast<ValueBox<string>*>(box());
+        break;
+    case Tag::CFunction:
+        delete static_cast<ValueBox<cfunction_p>*>(box());
+        break;
+    case Tag::Table:
+        delete static_cast<ValueBox<table_p>*>(box());
+        break;
+    case Tag::Vallist:
+        delete static_cast<ValueBox<vallist_p>*>(box());
+        break;
+    case Tag::LFunction:
+        delete static_cast<ValueBox<lfunction_p>*>(box());
+        break;
+    default:
+        break;
+    }
+    bits = nil_bits;
+}
+
+} // namespace rt
+} // namespace lua
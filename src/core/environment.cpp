@@ -49,7 +49,7 @@ auto sin(const vallist& args) -> cfunction::result {
                 if (holds_alternative<double>(v)) {
                     return eval_success(std::sin(get<double>(v.reevaluate())));
                 }
-                return string{"sin can only be applied to a number"};
+                return EvalError{"sin can only be applied to a number"};
             }
 
             bool isDirty() const override { return v.source && v.source->isDirty(); }
@@ -90,7 +90,7 @@ auto cos(const vallist& args) -> cfunction::result {
                 if (holds_alternative<double>(v)) {
                     return eval_success(std::cos(get<double>(v.reevaluate())));
                 }
-                return string{"cos can only be applied to a number"};
+                return EvalError{"cos can only be applied to a number"};
             }
 
             bool isDirty() const override { return v.source && v.source->isDirty(); }
@@ -131,7 +131,7 @@ auto tan(const vallist& args) -> cfunction::result {
                 if (holds_alternative<double>(v)) {
                     return eval_success(std::tan(get<double>(v.reevaluate())));
                 }
-                return string{"sin can only be applied to a number"};
+                return EvalError{"sin can only be applied to a number"};
             }
 
             bool isDirty() const override { return v.source && v.source->isDirty(); }
@@ -172,7 +172,7 @@ auto atan(const vallist& args) -> cfunction::result {
                 if (holds_alternative<double>(x)) {
                     return eval_success(std::atan(get<double>(x.reevaluate())));
                 }
-                return string{"atan can only be applied to numbers"};
+                return EvalError{"atan can only be applied to numbers"};
             }
 
             bool isDirty() const override { return (x.source && x.source->isDirty()); }
@@ -216,7 +216,7 @@ auto acos(const vallist& args) -> cfunction::result {
                 if (holds_alternative<double>(x)) {
                     return eval_success(std::acos(get<double>(x.reevaluate())));
                 }
-                return string{"acos can only be applied to numbers"};
+                return EvalError{"acos can only be applied to numbers"};
             }
 
             bool isDirty() const override { return (x.source && x.source->isDirty()); }
@@ -260,7 +260,7 @@ auto asin(const vallist& args) -> cfunction::result {
                 if (holds_alternative<double>(x)) {
                     return eval_success(std::asin(get<double>(x.reevaluate())));
                 }
-                return string{"asin can only be applied to numbers"};
+                return EvalError{"asin can only be applied to numbers"};
             }
 
             bool isDirty() const override { return (x.source && x.source->isDirty()); }
@@ -305,7 +305,7 @@ auto atan2(const vallist& args) -> cfunction::result {
                     return eval_success(
                         std::atan2(get<double>(y.reevaluate()), get<double>(x.reevaluate())));
                 }
-                return string{"atan2 can only be applied to numbers"};
+                return EvalError{"atan2 can only be applied to numbers"};
             }
 
             bool isDirty() const override {
@@ -368,7 +368,7 @@ auto abs(const vallist& args) -> cfunction::result {
                 if (holds_alternative<double>(v)) {
                     return eval_success(fabs(get<double>(v.reevaluate())));
                 }
-                return string{"abs can only be applied to a number"};
+                return EvalError{"abs can only be applied to a number"};
             }
 
             bool isDirty() const override { return v.source && v.source->isDirty(); }
@@ -401,40 +401,117 @@ auto floor(const vallist& args) -> cfunction::result {
 
 } // namespace stdlib
 
-void Environment::assign(const val& var, const val& newval, bool is_local) {
-    // cout << "assignment " << var << "=" << newval << (is_local ? " (local)" : "") << endl;
-
-    if (newval.source && newval.source->identifier.empty()) {
-        newval.source->identifier = var.to_string();
+// the value stored in the variable name: its source is named after the first variable it is
+// assigned to. The source of a literal is shared by all evaluations of the literal, so the variable
+// gets a named copy of it (in storage) instead.
+static const val& named(const val& newval, string_view name, val& storage) {
+    const auto& source = newval.source;
+    if (!source || !source->identifier.empty() || name.empty())
+        return newval;
+
+    if (!source->literal) {
+        source->identifier = string{name};
+        return newval;
     }
 
+    auto copy = sourceval::create(static_cast<const sourceval&>(*source).location);
+    copy->identifier = string{name};
+    storage = newval;
+    storage.source = move(copy);
+    return storage;
+}
+
+void Environment::assign(const val& var, const val& value, bool is_local) {
+    // cout << "assignment " << var << "=" << value << (is_local ? " (local)" : "") << endl;
+
+    val storage;
+    const val& newval = named(value, var.to_string(), storage);
+
+    // the table of the global environment holds the globals, accesses to it are tracked
     if (is_local) {
-        t[var] = newval;
+        if (tracker && !parent)
+            tracker->write_global(var, newval);
+        t.set(var, newval);
         return;
     }
 
     // search environments for variable
     for (Environment* env = this; env != nullptr; env = env->parent.get()) {
         if (env->t.count(var)) {
-            env->t[var] = newval;
+            if (tracker && !env->parent)
+                tracker->write_global(var, newval);
+            env->t.set(var, newval);
             return;
         }
     }
 
     // not yet assigned, assign to global environment
-    (*global)[var] = newval;
+    if (tracker)
+        tracker->write_global(var, newval);
+    global->set(var, newval);
 }
 
 val Environment::getvar(const val& var) {
     // search environments for variable
     for (Environment* env = this; env != nullptr; env = env->parent.get()) {
         if (env->t.count(var)) {
-            return env->t[var];
+            val value = env->t.get(var);
+            if (tracker && !env->parent)
+                tracker->read_global(var, value);
+            return value;
         }
     }
+    if (tracker)
+        tracker->read_global(var, nil());
     return nil();
 }
 
+void Environment::assign_local(unsigned depth, unsigned slot, string_view name,
+                               const val& value) {
+    val storage;
+    const val& newval = named(value, name, storage);
+    Environment* env = scope(depth);
+    if (tracker && env->main_chunk)
+        tracker->write_slot(slot, newval);
+    env->slots[slot] = newval;
+}
+
+void Environment::assign_global(const val& var, const val& value) {
+    val storage;
+    const val& newval = named(value, var.to_string(), storage);
+    if (tracker)
+        tracker->write_global(var, newval);
+    global->set(var, newval);
+}
+
+val Environment::getglobal(const val& var) const {
+    val value = global->get(var);
+    if (tracker)
+        tracker->read_global(var, value);
+    return value;
+}
+
+void Environment::assign_global(const val& var, const val& value, FieldCache& cache) {
+    val storage;
+    const val& newval = value.source ? named(value, var.to_string(), storage) : value;
+    if (tracker)
+        tracker->write_global(var, newval);
+    cache.set_monomorphic(*global, var, newval);
+}
+
+val Environment::getglobal(const val& var, FieldCache& cache) const {
+    val value = cache.get_monomorphic(*global, var);
+    if (tracker)
+        tracker->read_global(var, value);
+    return value;
+}
+
+void Environment::reset(const Environment& initial) {
+    clear();
+    for (const auto& [name, value] : *initial.global)
+        t.set(name, value);
+}
+
 void Environment::populate_stdlib() {
     t["print"] = function(stdlib::print);
     t["type"] = function(stdlib::type);
@@ -454,9 +531,6 @@ void Environment::populate_stdlib() {
     (*math)["pi"] = 3.1415926;
 
     // t["_G"] = shared_ptr<table>(shared_from_this(), &t);
-
-    t["__visit_count"] = 0.0;
-    t["__visit_limit"] = 500.0;
 }
 
 } // namespace rt
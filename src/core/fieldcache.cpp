@@ -0,0 +1,54 @@
+#include "MiniLua/fieldcache.hpp"
+
+namespace lua {
+namespace rt {
+
+val FieldCache::get(table& t, const val& key) {
+    if (megamorphic_)
+        return t.get(key);
+
+    if (const Entry* entry = lookup(t.shape()); entry)
+        return t.get_slot(entry->slot);
+
+    size_t slot = t.slot(key);
+    insert(t.shape(), slot);
+    return t.get_slot(slot);
+}
+
+void FieldCache::set(table& t, const val& key, const val& value) {
+    // only existing keys can be assigned in place, everything else changes the shape
+    if (!megamorphic_ && !value.isnil()) {
+        if (const Entry* entry = lookup(t.shape()); entry && t.set_slot(entry->slot, value))
+            return;
+    }
+
+    t.set(key, value);
+}
+
+val FieldCache::get_monomorphic(table& t, const val& key) {
+    if (used == 0 || entries[0].shape != t.shape()) {
+        entries[0] = Entry{t.shape(), t.slot(key)};
+        used = 1;
+    }
+    return t.get_slot(entries[0].slot);
+}
+
+void FieldCache::set_monomorphic(table& t, const val& key, const val& value) {
+    if (used == 1 && entries[0].shape == t.shape() && t.set_slot(entries[0].slot, value))
+        return;
+
+    t.set(key, value);
+}
+
+void FieldCache::insert(table::shape_t shape, size_t slot) {
+    if (used == ways) {
+        megamorphic_ = true;
+        used = 0;
+        return;
+    }
+
+    entries[used++] = Entry{shape, slot};
+}
+
+} // namespace rt
+} // namespace lua
@@ -0,0 +1,667 @@
+#include "MiniLua/incremental.hpp"
+#include "MiniLua/trace.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <unordered_map>
+
+namespace lua {
+namespace rt {
+
+// the same value with the same source
+static bool same(const val& a, const val& b) {
+    if (a.index() != b.index() || a.source != b.source)
+        return false;
+
+    return visit(
+        [&b](const auto& value) {
+            using T = decay_t<decltype(value)>;
+            if constexpr (is_same_v<T, nil>) {
+                return true;
+            } else {
+                return value == get<T>(b);
+            }
+        },
+        static_cast<const val::value_t&>(a));
+}
+
+static bool same(unsigned a, unsigned b) { return a == b; }
+
+// records the accesses of the executed statement into its memo
+class IncrementalRunner::Recorder : public EnvironmentTracker {
+public:
+    // the memo of the executed statement, nullptr if nothing is recorded
+    Memo* memo = nullptr;
+    // the locals of the main chunk in the current run
+    const Environment* frame = nullptr;
+
+    void read_global(const val& name, const val& value) override {
+        if (!recording(value))
+            return;
+        if (!find(memo->global_writes, name) && !find(memo->global_reads, name))
+            memo->global_reads.emplace_back(name, value);
+    }
+
+    void write_global(const val& name, const val& value) override {
+        if (recording(value))
+            update(memo->global_writes, name, value);
+    }
+
+    void read_slot(unsigned slot, const val& value) override {
+        if (!recording(value))
+            return;
+        if (!find(memo->slot_writes, slot) && !find(memo->slot_reads, slot))
+            memo->slot_reads.emplace_back(slot, value);
+    }
+
+    void write_slot(unsigned slot, const val& value) override {
+        if (recording(value))
+            update(memo->slot_writes, slot, value);
+    }
+
+    void effect(const cfunction_p& f, const vallist& args, const _LuaFunctioncall& call) {
+        if (!memo || !memo->replayable)
+            return;
+        for (const auto& arg : args) {
+            if (!recording(arg))
+                return;
+        }
+        memo->effects.push_back(Effect{f, args, &call});
+    }
+
+private:
+    // checks that value can be replayed, otherwise the statement is not recorded anymore
+    bool recording(const val& value) {
+        if (!memo || !memo->replayable)
+            return false;
+
+        if (value.istable() || holds_alternative<vallist_p>(value) ||
+            (holds_alternative<lfunction_p>(value) &&
+             get<lfunction_p>(value)->env.get() != frame)) {
+            memo->replayable = false;
+        }
+        return memo->replayable;
+    }
+
+    template <typename K> static bool find(const vector<pair<K, val>>& accesses, const K& key) {
+        for (const auto& access : accesses) {
+            if (same(access.first, key))
+                return true;
+        }
+        return false;
+    }
+
+    template <typename K>
+    static void update(vector<pair<K, val>>& accesses, const K& key, const val& value) {
+        for (auto& access : accesses) {
+            if (same(access.first, key)) {
+                access.second = value;
+                return;
+            }
+        }
+        accesses.emplace_back(key, value);
+    }
+};
+
+namespace {
+
+// the calls and functions of a statement in a fixed order, so the ones of two statements with
+// the same text correspond by index
+struct Nodes {
+    vector<const _LuaFunctioncall*> calls;
+    vector<const _LuaFunction*> functions;
+
+    void stmt(const _LuaStmt& stmt);
+    void chunk(const LuaChunk& chunk) {
+        for (const auto& stmt : chunk->statements)
+            this->stmt(*stmt);
+    }
+    void explist(const LuaExplist& explist) {
+        if (!explist)
+            return;
+        for (const auto& e : explist->exps)
+            exp(e.get());
+    }
+
+    // without recursion for the operators, their chains can be long
+    void exp(const _LuaExp* root);
+};
+
+void Nodes::stmt(const _LuaStmt& stmt) {
+    using Kind = _LuaAST::Kind;
+    switch (stmt.kind) {
+    case Kind::Assignment: {
+        const auto& assignment = static_cast<const _LuaAssignment&>(stmt);
+        explist(assignment.varlist);
+        explist(assignment.explist);
+        break;
+    }
+    case Kind::Functioncall:
+        exp(&static_cast<const _LuaFunctioncall&>(stmt));
+        break;
+    case Kind::ReturnStmt:
+        explist(static_cast<const _LuaReturnStmt&>(stmt).explist);
+        break;
+    case Kind::ForStmt: {
+        const auto& for_stmt = static_cast<const _LuaForStmt&>(stmt);
+        exp(for_stmt.start.get());
+        exp(for_stmt.end.get());
+        exp(for_stmt.step.get());
+        chunk(for_stmt.body);
+        break;
+    }
+    case Kind::LoopStmt: {
+        const auto& loop_stmt = static_cast<const _LuaLoopStmt&>(stmt);
+        exp(loop_stmt.end.get());
+        chunk(loop_stmt.body);
+        break;
+    }
+    case Kind::IfStmt:
+        for (const auto& [condition, body] : static_cast<const _LuaIfStmt&>(stmt).branches) {
+            exp(condition.get());
+            chunk(body);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void Nodes::exp(const _LuaExp* root) {
+    using Kind = _LuaAST::Kind;
+    vector<const _LuaExp*> todo{root};
+    while (!todo.empty()) {
+        const _LuaExp* exp = todo.back();
+        todo.pop_back();
+        if (!exp)
+            continue;
+
+        switch (exp->kind) {
+        case Kind::Op:
+            todo.push_back(static_cast<const _LuaOp*>(exp)->rhs.get());
+            todo.push_back(static_cast<const _LuaOp*>(exp)->lhs.get());
+            break;
+        case Kind::Unop:
+            todo.push_back(static_cast<const _LuaUnop*>(exp)->exp.get());
+            break;
+        case Kind::IndexVar:
+            todo.push_back(static_cast<const _LuaIndexVar*>(exp)->index.get());
+            todo.push_back(static_cast<const _LuaIndexVar*>(exp)->table.get());
+            break;
+        case Kind::MemberVar:
+            todo.push_back(static_cast<const _LuaMemberVar*>(exp)->table.get());
+            break;
+        case Kind::Functioncall: {
+            const auto* call = static_cast<const _LuaFunctioncall*>(exp);
+            calls.push_back(call);
+            if (call->args) {
+                for (auto it = call->args->exps.rbegin(); it != call->args->exps.rend(); ++it)
+                    todo.push_back(it->get());
+            }
+            todo.push_back(call->function.get());
+            break;
+        }
+        case Kind::Tableconstructor:
+            for (const auto& field : static_cast<const _LuaTableconstructor*>(exp)->fields) {
+                todo.push_back(field->rhs.get());
+                todo.push_back(field->lhs.get());
+            }
+            break;
+        case Kind::Function: {
+            const auto* function = static_cast<const _LuaFunction*>(exp);
+            functions.push_back(function);
+            chunk(function->body);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+} // namespace
+
+/*
+Moves the recorded values of the statements that are reused at another position to the new AST.
+A token of a statement that moved is replaced by the token at the same index of the new
+statement, the closures of its functions and the calls in it by the ones at the same place. The
+moved sources and closures are shared by all values that had the same one, so the reads of the
+following statements still compare equal. Everything else (e.g. tokens of statements that were
+executed again) is kept.
+
+Every run has its own frame for the locals of the main chunk, the closures over the frame of the
+last run are moved to the one of this run.
+*/
+class IncrementalRunner::Relocation {
+public:
+    // the statement from of the last run has the same text as to
+    void move(const LuaStmt& from, const LuaStmt& to) {
+        if (from->tokens.empty())
+            return;
+        statements.emplace(from->tokens.front().pos(), Moved{from, to});
+
+        Nodes before, after;
+        before.stmt(*from);
+        after.stmt(*to);
+        for (size_t i = 0; i < before.calls.size(); ++i)
+            calls.emplace(before.calls[i], after.calls[i]);
+        for (size_t i = 0; i < before.functions.size(); ++i)
+            functions.emplace(before.functions[i]->body.get(), after.functions[i]);
+    }
+
+    // the closures over from get to as their environment
+    void rebind(const Environment* from, const shared_ptr<Environment>& to) {
+        this->from = from;
+        this->to = to;
+    }
+
+    bool empty() const { return statements.empty(); }
+
+    // false if the source of the value can't be moved
+    bool value(val& value) {
+        if (empty() && !holds_alternative<lfunction_p>(value))
+            return true;
+        failed = false;
+        bool changed = false;
+        value = moved(value, changed);
+        return !failed;
+    }
+
+    bool changes(source_change_t& sc) {
+        if (empty() || !sc)
+            return true;
+        failed = false;
+        bool changed = false;
+        sc = change(*sc, changed);
+        return !failed;
+    }
+
+    void call(const _LuaFunctioncall*& call) const {
+        if (auto it = calls.find(call); it != calls.end())
+            call = it->second;
+    }
+
+private:
+    struct Moved {
+        LuaStmt from;
+        LuaStmt to;
+    };
+
+    // by the position of the first token of the statement in the last run
+    map<long, Moved> statements;
+    unordered_map<const _LuaFunctioncall*, const _LuaFunctioncall*> calls;
+    unordered_map<const _LuaChunk*, const _LuaFunction*> functions; // by the body of the old one
+
+    // the moved sources and closures by the old ones (which are kept, so they stay unique)
+    unordered_map<const sourceexp*, pair<shared_ptr<sourceexp>, shared_ptr<sourceexp>>> sources;
+    unordered_map<const lfunction*, pair<lfunction_p, lfunction_p>> closures;
+    const Environment* from = nullptr;
+    shared_ptr<Environment> to;
+    bool failed = false;
+
+    void token(LuaToken& token, bool& changed) {
+        auto it = statements.upper_bound(token.pos());
+        if (it == statements.begin())
+            return;
+        --it;
+        const auto& from = it->second.from->tokens;
+        if (token.pos() >= from.back().pos() + from.back().length())
+            return;
+
+        auto before = [](const LuaToken& t, long pos) { return t.pos() < pos; };
+        auto found = lower_bound(from.begin(), from.end(), token.pos(), before);
+        if (found == from.end() || found->pos() != token.pos() || found->type != token.type) {
+            failed = true;
+            return;
+        }
+        token = it->second.to->tokens[found - from.begin()];
+        changed = true;
+    }
+
+    val moved(const val& value, bool& changed) {
+        val result = value;
+        if (holds_alternative<lfunction_p>(value)) {
+            if (auto f = closure(get<lfunction_p>(value)); f != get<lfunction_p>(value)) {
+                result = val{f, value.source};
+                changed = true;
+            }
+        }
+        if (value.source && !empty()) {
+            result.source = source(value.source);
+            changed |= result.source != value.source;
+        }
+        return result;
+    }
+
+    lfunction_p closure(const lfunction_p& f) {
+        auto it = functions.find(f->f.get());
+        bool rebound = from && f->env.get() == from;
+        if (it == functions.end() && !rebound)
+            return f;
+
+        auto& entry = closures[f.get()];
+        if (!entry.first.get()) {
+            const auto& body = it != functions.end() ? it->second->body : f->f;
+            const auto& params = it != functions.end() ? it->second->params : f->params;
+            entry = {f, make_shared<lfunction>(body, params, rebound ? to : f->env)};
+        }
+        return entry.second;
+    }
+
+    shared_ptr<sourceexp> source(const shared_ptr<sourceexp>& node) {
+        auto& entry = sources[node.get()];
+        if (!entry.first) {
+            entry.first = node;
+            entry.second = rebuild(node);
+            if (entry.second != node) {
+                entry.second->identifier = node->identifier;
+                entry.second->depth = node->depth;
+                entry.second->literal = node->literal;
+            }
+        }
+        return entry.second;
+    }
+
+    // the node with its tokens and operands moved, node itself if nothing moved
+    shared_ptr<sourceexp> rebuild(const shared_ptr<sourceexp>& node) {
+        bool changed = false;
+
+        if (auto value = dynamic_pointer_cast<sourceval>(node)) {
+            auto location = value->location;
+            for (auto& t : location)
+                token(t, changed);
+            return changed ? sourceval::create(location) : node;
+        }
+        if (auto binop = dynamic_pointer_cast<sourcebinop>(node)) {
+            auto result = make_shared<sourcebinop>();
+            result->op = binop->op;
+            token(result->op, changed);
+            result->lhs = moved(binop->lhs, changed);
+            result->rhs = moved(binop->rhs, changed);
+            return changed ? result : node;
+        }
+        if (auto unop = dynamic_pointer_cast<sourceunop>(node)) {
+            auto result = make_shared<sourceunop>();
+            result->op = unop->op;
+            token(result->op, changed);
+            result->v = moved(unop->v, changed);
+            return changed ? result : node;
+        }
+        if (auto for_var = dynamic_pointer_cast<sourcefor>(node)) {
+            auto result = make_shared<sourcefor>(*for_var);
+            result->start = moved(for_var->start, changed);
+            result->step = moved(for_var->step, changed);
+            return changed ? result : node;
+        }
+        if (auto affine = dynamic_pointer_cast<sourceaffine>(node)) {
+            auto result = make_shared<sourceaffine>(*affine);
+            result->base = moved(affine->base, changed);
+            for (auto& term : result->terms)
+                term.v = moved(term.v, changed);
+            return changed ? result : node;
+        }
+        if (auto traced = dynamic_pointer_cast<tracedop>(node)) {
+            auto built = traced->node();
+            auto result = source(built);
+            return result != built ? result : node;
+        }
+
+        failed = true;
+        return node;
+    }
+
+    shared_ptr<SourceChange> change(const shared_ptr<SourceChange>& sc, bool& changed) {
+        if (auto assignment = dynamic_pointer_cast<SourceAssignment>(sc)) {
+            bool moved = false;
+            LuaToken t = assignment->token;
+            token(t, moved);
+            if (!moved)
+                return sc;
+            auto result = SourceAssignment::create(t, assignment->replacement);
+            result->hint = assignment->hint;
+            changed = true;
+            return result;
+        }
+        if (auto set = dynamic_pointer_cast<SourceChangeSet>(sc)) {
+            bool moved = false;
+            auto result = change(set->tree(), moved);
+            changed |= moved;
+            return moved ? result : sc;
+        }
+        if (auto and_change = dynamic_pointer_cast<SourceChangeAnd>(sc)) {
+            auto result = make_shared<SourceChangeAnd>(*and_change);
+            bool moved = false;
+            for (auto& c : result->changes)
+                c = change(c, moved);
+            changed |= moved;
+            return moved ? result : sc;
+        }
+        if (auto or_change = dynamic_pointer_cast<SourceChangeOr>(sc)) {
+            auto result = make_shared<SourceChangeOr>(*or_change);
+            bool moved = false;
+            for (auto& c : result->alternatives)
+                c = change(c, moved);
+            changed |= moved;
+            return moved ? result : sc;
+        }
+
+        failed = true;
+        return sc;
+    }
+};
+
+IncrementalRunner::IncrementalRunner(const Evaluator& eval)
+    : eval{eval}, initial{make_shared<Environment>(nullptr)},
+      env{make_shared<Environment>(nullptr)}, recorder{make_unique<Recorder>()} {
+    initial->populate_stdlib();
+    env->track(recorder.get());
+    define_effect("print", get<cfunction_p>(initial->getglobal(val{"print"})));
+}
+
+IncrementalRunner::~IncrementalRunner() {
+    // the closures in the environments can refer to them
+    env->clear();
+    if (frame)
+        frame->clear();
+}
+
+void IncrementalRunner::define(const string& name, const val& value) {
+    initial->assign_global(val{name}, value);
+}
+
+void IncrementalRunner::define_effect(const string& name, const cfunction_p& f) {
+    Recorder* recorder = this->recorder.get();
+    define(name, make_shared<cfunction>(
+                     [recorder, f](const vallist& args,
+                                   const _LuaFunctioncall& call) -> cfunction::result {
+                         recorder->effect(f, args, call);
+                         return f->f(args, call);
+                     }));
+}
+
+bool IncrementalRunner::reusable(const Memo& memo, const _LuaStmt& stmt, size_t scope,
+                                 Relocation& relocation) const {
+    if (!memo.replayable || memo.scope != scope)
+        return false;
+
+    // the text of the statement has to be the same
+    if (memo.stmt->tokens.size() != stmt.tokens.size())
+        return false;
+    for (size_t i = 0; i < stmt.tokens.size(); ++i) {
+        const auto& a = memo.stmt->tokens[i];
+        const auto& b = stmt.tokens[i];
+        if (a.type != b.type || a.match() != b.match())
+            return false;
+    }
+
+    // and the variables it read (the values of moved statements are compared in their new place)
+    for (auto [name, value] : memo.global_reads) {
+        if (!relocation.value(value) || !same(env->getglobal(name), value))
+            return false;
+    }
+    for (auto [slot, value] : memo.slot_reads) {
+        if (!relocation.value(value) || !same(frame->local(0, slot), value))
+            return false;
+    }
+
+    return true;
+}
+
+bool IncrementalRunner::relocate(Memo& memo, const LuaStmt& stmt, Relocation& relocation) {
+    bool moved = false;
+    for (size_t i = 0; i < stmt->tokens.size(); ++i)
+        moved |= memo.stmt->tokens[i].pos() != stmt->tokens[i].pos();
+    if (moved) {
+        relocation.move(memo.stmt, stmt);
+        memo.stmt = stmt;
+    }
+
+    // the reads are compared with the values of this run in the next one
+    for (auto& read : memo.global_reads)
+        relocation.value(read.second);
+    for (auto& read : memo.slot_reads)
+        relocation.value(read.second);
+
+    for (auto& write : memo.global_writes) {
+        if (!relocation.value(write.second))
+            return false;
+    }
+    for (auto& write : memo.slot_writes) {
+        if (!relocation.value(write.second))
+            return false;
+    }
+    for (auto& effect : memo.effects) {
+        relocation.call(effect.call);
+        for (auto& arg : effect.args) {
+            if (!relocation.value(arg))
+                return false;
+        }
+    }
+    return relocation.changes(memo.sc);
+}
+
+void IncrementalRunner::replay(const Memo& memo) {
+    for (const auto& [name, value] : memo.global_writes)
+        env->assign_global(name, value);
+    for (const auto& [slot, value] : memo.slot_writes)
+        frame->assign_local(0, slot, "", value);
+
+    for (const auto& effect : memo.effects)
+        effect.f->f(effect.args, *effect.call);
+}
+
+// identifies the text of a statement
+static size_t text(const _LuaStmt& stmt) {
+    size_t h = stmt.tokens.size();
+    for (const auto& token : stmt.tokens)
+        h = h * 31 + (hash<string_view>{}(token.match()) ^ static_cast<size_t>(token.type));
+    return h;
+}
+
+// identifies the locals of the main chunk after stmt (by name and slot)
+static size_t declare(size_t scope, const _LuaStmt& stmt) {
+    if (stmt.kind != _LuaAST::Kind::Assignment)
+        return scope;
+    const auto& assignment = static_cast<const _LuaAssignment&>(stmt);
+    if (!assignment.local)
+        return scope;
+
+    auto combine = [&scope](const _LuaName& name) {
+        size_t h = hash<string_view>{}(name.token.match()) ^ (size_t{name.ref.slot} << 1);
+        scope ^= h + 0x9e3779b9 + (scope << 6) + (scope >> 2);
+    };
+
+    for (const auto& var : assignment.varlist->exps) {
+        if (var->kind == _LuaAST::Kind::Name)
+            combine(static_cast<const _LuaName&>(*var));
+        else if (var->kind == _LuaAST::Kind::NameVar)
+            combine(*static_cast<const _LuaNameVar&>(*var).name);
+    }
+    return scope;
+}
+
+eval_result_t IncrementalRunner::run(const LuaChunk& chunk) {
+    // the statements are runs of the evaluator that share the budget and the provenance store
+    // of this run
+    StepBudget::Run steps{eval.budget};
+    ProvenanceStore::Run store{eval.provenance};
+
+    env->reset(*initial);
+    // the closures of the last run keep its locals, the reused ones get the new frame
+    auto last = move(frame);
+    frame = Environment::main_frame(env, chunk->num_slots);
+    recorder->frame = frame.get();
+
+    Stats stats;
+    vector<Memo> next;
+    next.reserve(chunk->statements.size());
+    source_change_t sc;
+
+    auto finish = [&](eval_result_t result) {
+        memos = move(next);
+        last_stats = stats;
+        return result;
+    };
+
+    // the statements of the last run by their text, the reused ones are moved out
+    unordered_map<size_t, vector<size_t>> recorded;
+    for (size_t i = 0; i < memos.size(); ++i)
+        recorded[text(*memos[i].stmt)].push_back(i);
+    Relocation relocation;
+    relocation.rebind(last.get(), frame);
+
+    size_t scope = 0;
+    for (const auto& stmt : chunk->statements) {
+        Memo* reused = nullptr;
+        if (auto it = recorded.find(text(*stmt)); it != recorded.end()) {
+            for (size_t i : it->second) {
+                Memo& memo = memos[i];
+                if (!memo.stmt || !reusable(memo, *stmt, scope, relocation))
+                    continue;
+                if (relocate(memo, stmt, relocation))
+                    reused = &memo;
+                else
+                    memo.stmt = nullptr;
+                break;
+            }
+        }
+
+        if (reused) {
+            replay(*reused);
+            sc &= reused->sc;
+            stats.reused++;
+            next.push_back(move(*reused));
+        } else {
+            Memo memo;
+            memo.stmt = stmt;
+            memo.scope = scope;
+            memo.chunk = make_shared<_LuaChunk>();
+            memo.chunk->statements.push_back(stmt);
+
+            recorder->memo = &memo;
+            auto result = eval.run_in(memo.chunk, frame);
+            recorder->memo = nullptr;
+            stats.executed++;
+
+            if (holds_alternative<EvalError>(result))
+                return finish(result);
+
+            memo.sc = get_sc(result);
+            sc &= memo.sc;
+
+            // a return from the main chunk ends the run
+            if (!get_val(result).isnil())
+                return finish(eval_success(get_val(result), sc));
+
+            next.push_back(move(memo));
+        }
+
+        scope = declare(scope, *stmt);
+    }
+
+    return finish(eval_success(nil(), sc));
+}
+
+} // namespace rt
+} // namespace lua
@@ -1,23 +1,35 @@
 #include "MiniLua/luaast.hpp"
-#include "MiniLua/luainterpreter.hpp"
+#include "MiniLua/sourceexp.hpp"
 
-VISITABLE_IMPL(_LuaName)
-VISITABLE_IMPL(_LuaExplist)
-VISITABLE_IMPL(_LuaValue)
-VISITABLE_IMPL(_LuaOp)
-VISITABLE_IMPL(_LuaUnop)
-VISITABLE_IMPL(_LuaNameVar)
-VISITABLE_IMPL(_LuaIndexVar)
-VISITABLE_IMPL(_LuaMemberVar)
-VISITABLE_IMPL(_LuaFunctioncall)
-VISITABLE_IMPL(_LuaReturnStmt)
-VISITABLE_IMPL(_LuaBreakStmt)
-VISITABLE_IMPL(_LuaForStmt)
-VISITABLE_IMPL(_LuaLoopStmt)
-VISITABLE_IMPL(_LuaIfStmt)
-VISITABLE_IMPL(_LuaChunk)
-VISITABLE_IMPL(_LuaTableconstructor)
-VISITABLE_IMPL(_LuaAssignment)
-VISITABLE_IMPL(_LuaFunction)
-VISITABLE_IMPL(_LuaField)
-VISITABLE_IMPL(_LuaComment)
+#include <cstdlib>
+
+_LuaValue::_LuaValue(const LuaToken& token) : _LuaExp{Kind::Value}, token{token} {
+    using lua::rt::sourceval;
+    using lua::rt::val;
+
+    auto source = [&token] {
+        auto leaf = sourceval::create(token);
+        leaf->literal = true;
+        return leaf;
+    };
+
+    switch (token.type) {
+    case LuaToken::Type::NIL:
+        constant = val{lua::rt::nil(), source()};
+        break;
+    case LuaToken::Type::FALSE:
+        constant = val{false, source()};
+        break;
+    case LuaToken::Type::TRUE:
+        constant = val{true, source()};
+        break;
+    case LuaToken::Type::NUMLIT:
+        constant = val{atof(("0" + string{token.match()}).c_str()), source()};
+        break;
+    case LuaToken::Type::STRINGLIT:
+        constant = val{string{token.match().substr(1, token.match().size() - 2)}, source()};
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,1375 @@
+#include "MiniLua/luaastbuilder.hpp"
+#include "MiniLua/astarena.hpp"
+#include "MiniLua/luaresolver.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+namespace lua {
+namespace rt {
+
+namespace {
+
+template <typename T> using built_t = variant<T, string>;
+
+string at(const ts::Node& node) {
+    auto point = node.start_point();
+    return " at " + to_string(point.row + 1) + ":" + to_string(point.column + 1);
+}
+
+string unsupported(const ts::Node& node) {
+    return string{"unsupported syntax: "} + node.type() + at(node);
+}
+
+// the first syntax error in node
+string syntax_error(const ts::Node& node) {
+    for (const auto& child : node.children()) {
+        if (child.has_error() || child.is_missing())
+            return syntax_error(child);
+    }
+
+    if (node.is_missing())
+        return string{"syntax error: missing "} + node.type() + at(node);
+    return "syntax error" + at(node);
+}
+
+LuaToken::Type token_type(const ts::Node& leaf) {
+    using T = LuaToken::Type;
+    static const unordered_map<string_view, LuaToken::Type> types = {
+        {"+", T::ADD},
+        {"-", T::SUB},
+        {"*", T::MUL},
+        {"/", T::DIV},
+        {"%", T::MOD},
+        {"^", T::POW},
+        {"#", T::LEN},
+        {"==", T::EQ},
+        {"~=", T::NEQ},
+        {"<=", T::LEQ},
+        {">=", T::GEQ},
+        {"<", T::LT},
+        {">", T::GT},
+        {"=", T::ASSIGN},
+        {"{", T::LCB},
+        {"}", T::RCB},
+        {"(", T::LRB},
+        {")", T::RRB},
+        {"[", T::LSB},
+        {"]", T::RSB},
+        {";", T::SEM},
+        {":", T::COLON},
+        {",", T::COMMA},
+        {".", T::DOT},
+        {"..", T::CONCAT},
+        {"...", T::ELLIPSE},
+        {"spread", T::ELLIPSE},
+        {"and", T::AND},
+        {"break", T::BREAK},
+        {"break_statement", T::BREAK},
+        {"do", T::DO},
+        {"else", T::ELSE},
+        {"elseif", T::ELSEIF},
+        {"end", T::END},
+        {"false", T::FALSE},
+        {"for", T::FOR},
+        {"function", T::FUNCTION},
+        {"if", T::IF},
+        {"in", T::IN},
+        {"local", T::LOCAL},
+        {"nil", T::NIL},
+        {"not", T::NOT},
+        {"or", T::OR},
+        {"repeat", T::REPEAT},
+        {"return", T::RETURN},
+        {"then", T::THEN},
+        {"true", T::TRUE},
+        {"until", T::UNTIL},
+        {"while", T::WHILE},
+        {"identifier", T::NAME},
+        {"property_identifier", T::NAME},
+        {"method", T::NAME},
+        {"self", T::NAME},
+        {"next", T::NAME},
+        {"_G", T::NAME},
+        {"_VERSION", T::NAME},
+        {"global_variable", T::NAME},
+        {"string", T::STRINGLIT},
+        {"number", T::NUMLIT},
+        {"comment", T::COMMENT},
+    };
+
+    auto it = types.find(leaf.type());
+    if (it == types.end())
+        return T::NONE;
+    return it->second;
+}
+
+// copies the nodes of a shared statement that the resolver annotates, so the copy can be resolved
+// in another place without changing the statement (the tokens, token spans and literals are
+// shared with it)
+class Copy {
+public:
+    explicit Copy(shared_ptr<ASTArena> arena) : arena{move(arena)} {}
+
+    LuaStmt stat(const LuaStmt& stmt);
+
+    // the copies of the statement and the statements nested in it, by the originals
+    unordered_map<const _LuaStmt*, LuaStmt> copies;
+
+private:
+    shared_ptr<ASTArena> arena;
+
+    template <typename T, typename... Args> shared_ptr<T> make(Args&&... args) const {
+        return make_node<T>(arena, forward<Args>(args)...);
+    }
+
+    LuaName name(const LuaName& name) const { return make<_LuaName>(name->token); }
+
+    LuaChunk chunk(const LuaChunk& chunk) {
+        if (!chunk)
+            return nullptr;
+        auto copy = make<_LuaChunk>();
+        copy->statements.reserve(chunk->statements.size());
+        for (const auto& stmt : chunk->statements)
+            copy->statements.push_back(stat(stmt));
+        return copy;
+    }
+
+    LuaExp exp(const LuaExp& exp);
+    LuaExplist explist(const LuaExplist& explist) {
+        if (!explist)
+            return nullptr;
+        auto copy = make<_LuaExplist>();
+        copy->exps.reserve(explist->exps.size());
+        for (const auto& e : explist->exps)
+            copy->exps.push_back(this->exp(e));
+        return copy;
+    }
+
+    LuaFunctioncall call(const _LuaFunctioncall& call) {
+        auto copy = make<_LuaFunctioncall>();
+        copy->function = exp(call.function);
+        copy->args = explist(call.args);
+        return copy;
+    }
+};
+
+LuaStmt Copy::stat(const LuaStmt& stmt) {
+    if (!stmt)
+        return nullptr;
+
+    using Kind = _LuaAST::Kind;
+    LuaStmt copy;
+    switch (stmt->kind) {
+    case Kind::Functioncall:
+        copy = call(static_cast<const _LuaFunctioncall&>(*stmt));
+        break;
+    case Kind::Assignment: {
+        const auto& assign = static_cast<const _LuaAssignment&>(*stmt);
+        auto result = make<_LuaAssignment>();
+        result->varlist = explist(assign.varlist);
+        result->explist = explist(assign.explist);
+        result->local = assign.local;
+        copy = move(result);
+        break;
+    }
+    case Kind::LoopStmt: {
+        const auto& loop = static_cast<const _LuaLoopStmt&>(*stmt);
+        auto result = make<_LuaLoopStmt>();
+        result->head_controlled = loop.head_controlled;
+        result->end = exp(loop.end);
+        result->body = chunk(loop.body);
+        copy = move(result);
+        break;
+    }
+    case Kind::ForStmt: {
+        const auto& for_stmt = static_cast<const _LuaForStmt&>(*stmt);
+        auto result = make<_LuaForStmt>();
+        result->var = name(for_stmt.var);
+        result->start = exp(for_stmt.start);
+        result->end = exp(for_stmt.end);
+        result->step = exp(for_stmt.step);
+        result->body = chunk(for_stmt.body);
+        copy = move(result);
+        break;
+    }
+    case Kind::IfStmt: {
+        auto result = make<_LuaIfStmt>();
+        for (const auto& branch : static_cast<const _LuaIfStmt&>(*stmt).branches)
+            result->branches.emplace_back(exp(branch.first), chunk(branch.second));
+        copy = move(result);
+        break;
+    }
+    case Kind::ReturnStmt:
+        copy = make<_LuaReturnStmt>(explist(static_cast<const _LuaReturnStmt&>(*stmt).explist));
+        break;
+    case Kind::BreakStmt:
+        copy = make<_LuaBreakStmt>();
+        break;
+    default:
+        copy = make<_LuaComment>();
+    }
+
+    copy->tokens = stmt->tokens;
+    copies.emplace(stmt.get(), copy);
+    return copy;
+}
+
+LuaExp Copy::exp(const LuaExp& exp) {
+    if (!exp)
+        return nullptr;
+
+    using Kind = _LuaAST::Kind;
+    switch (exp->kind) {
+    case Kind::Name:
+        return name(static_pointer_cast<_LuaName>(exp));
+    case Kind::NameVar:
+        return make<_LuaNameVar>(name(static_cast<const _LuaNameVar&>(*exp).name));
+    case Kind::Op: {
+        // the left spine of operator chains (1 + 2 + 3) is copied in a loop, innermost first
+        vector<const _LuaOp*> chain{static_cast<const _LuaOp*>(exp.get())};
+        while (chain.back()->lhs && chain.back()->lhs->kind == Kind::Op)
+            chain.push_back(static_cast<const _LuaOp*>(chain.back()->lhs.get()));
+
+        LuaExp result = this->exp(chain.back()->lhs);
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            auto copy = make<_LuaOp>();
+            copy->lhs = move(result);
+            copy->op = (*it)->op;
+            copy->rhs = this->exp((*it)->rhs);
+            result = move(copy);
+        }
+        return result;
+    }
+    case Kind::Unop: {
+        const auto& unop = static_cast<const _LuaUnop&>(*exp);
+        auto copy = make<_LuaUnop>();
+        copy->exp = this->exp(unop.exp);
+        copy->op = unop.op;
+        return copy;
+    }
+    case Kind::Functioncall:
+        return static_pointer_cast<_LuaExp>(call(static_cast<const _LuaFunctioncall&>(*exp)));
+    case Kind::IndexVar: {
+        const auto& index_var = static_cast<const _LuaIndexVar&>(*exp);
+        auto copy = make<_LuaIndexVar>();
+        copy->table = this->exp(index_var.table);
+        copy->index = this->exp(index_var.index);
+        return copy;
+    }
+    case Kind::MemberVar: {
+        const auto& member_var = static_cast<const _LuaMemberVar&>(*exp);
+        auto copy = make<_LuaMemberVar>();
+        copy->table = this->exp(member_var.table);
+        copy->member = name(member_var.member);
+        return copy;
+    }
+    case Kind::Tableconstructor: {
+        const auto& tableconst = static_cast<const _LuaTableconstructor&>(*exp);
+        auto copy = make<_LuaTableconstructor>();
+        copy->fields.reserve(tableconst.fields.size());
+        for (const auto& field : tableconst.fields) {
+            auto field_copy = make<_LuaField>();
+            field_copy->lhs = this->exp(field->lhs);
+            field_copy->rhs = this->exp(field->rhs);
+            copy->fields.push_back(move(field_copy));
+        }
+        copy->tokens = tableconst.tokens;
+        return copy;
+    }
+    case Kind::Function: {
+        const auto& function = static_cast<const _LuaFunction&>(*exp);
+        auto copy = make<_LuaFunction>();
+        copy->params = explist(function.params);
+        copy->body = chunk(function.body);
+        return copy;
+    }
+    default:
+        // a value has no annotations
+        return exp;
+    }
+}
+
+// walks over the children of the nodes with a cursor, skipping the extras (comments)
+class Walker {
+public:
+    explicit Walker(const ts::Node& node) : cursor{node} {}
+
+    void reset(const ts::Node& node) {
+        cursor.reset(node);
+        end_ = empty = false;
+    }
+
+    ts::Node node() const { return cursor.current_node(); }
+
+    // true after the last child
+    bool end() const { return end_; }
+
+    bool is(string_view type) const { return !end_ && string_view{node().type()} == type; }
+    bool is(ts::TypeId type) const { return !end_ && node().type_id() == type; }
+
+    void next() {
+        while (!end_) {
+            if (!cursor.goto_next_sibling())
+                end_ = true;
+            else if (!node().is_extra())
+                return;
+        }
+    }
+
+    // moves to the first child of the current node
+    void enter() {
+        if (!cursor.goto_first_child()) {
+            end_ = empty = true;
+        } else if (node().is_extra()) {
+            next();
+        }
+    }
+
+    // moves back to the node that was entered last
+    void leave() {
+        if (!empty)
+            cursor.goto_parent();
+        end_ = empty = false;
+    }
+
+private:
+    ts::Cursor cursor;
+    bool end_ = false;
+    bool empty = false; // the entered node has no children
+};
+
+// moves over the leaves of a tree in the order of the source
+class Leaves {
+public:
+    explicit Leaves(const ts::Node& root) : cursor{root} {
+        if (cursor.goto_first_child())
+            down();
+        else
+            done = true;
+    }
+
+    bool end() const { return done; }
+    ts::Node leaf() const { return cursor.current_node(); }
+
+    void next() {
+        if (over())
+            down();
+    }
+
+    // moves to the first leaf that starts at pos or after it, without visiting the subtrees
+    // before it
+    void skip(uint32_t pos) {
+        while (!done) {
+            auto node = cursor.current_node();
+            if (node.start_byte() >= pos) {
+                down();
+                return;
+            }
+            if (node.end_byte() > pos) {
+                if (!cursor.goto_first_child())
+                    return;
+            } else if (!over()) {
+                return;
+            }
+        }
+    }
+
+private:
+    ts::Cursor cursor;
+    bool done = false;
+
+    void down() {
+        while (cursor.goto_first_child()) {
+        }
+    }
+
+    // moves to the next sibling of the node or of one of its parents
+    bool over() {
+        while (!cursor.goto_next_sibling()) {
+            if (!cursor.goto_parent()) {
+                done = true;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+} // namespace
+
+/*
+The state of one (re)build. The syntax is parsed from the sequences of children, moving one
+cursor over the tree like the parser moves over the tokens: every function starts at the current
+child and moves past the children it consumed.
+
+The tokens of the built statements are added to one list in the order of the source (a second
+cursor moves over the leaves): the leaves of a shared statement are skipped, its tokens are
+added from its list if it is nested in a built statement.
+*/
+class ASTBuilder::Build {
+public:
+    Build(const ts::Tree& tree, const ts::EditResult* edit, const vector<Entry>& last,
+          vector<Entry>& next, Stats& stats)
+        : text{tree.source()}, edit{edit}, stats{stats}, walker{tree.root_node()},
+          leaves{tree.root_node()}, frame{nullptr, 0, &next, edit ? &last : nullptr, 0} {}
+
+    built_t<LuaChunk> program(const ts::Node& root) {
+        walker.reset(root);
+        walker.enter();
+
+        auto chunk = block();
+        if (too_long)
+            return *too_long;
+        if (holds_alternative<LuaChunk>(chunk) && !walker.end())
+            return unsupported(walker.node());
+        return chunk;
+    }
+
+    // moves the shared statements to their places in the new source and resolves the chunk
+    void finish(const LuaChunk& chunk) {
+        for (const auto& moved : moves) {
+            if (moved.parent)
+                moved.anchor->move_to(*moved.parent, moved.pos);
+            else
+                moved.anchor->move_to(moved.pos);
+        }
+
+        resolving.copy = [this](const LuaStmt& stmt) { return unshare(stmt); };
+        resolve(chunk, resolving);
+    }
+
+private:
+    const string& text;
+    const ts::EditResult* edit; // nullptr for a full build
+    Stats& stats;
+
+    // the error of the first token that doesn't fit into a LuaToken
+    mutable optional<string> too_long;
+
+    Walker walker;
+    Leaves leaves;
+
+    // the nodes that are built or copied
+    shared_ptr<ASTArena> arena = make_shared<ASTArena>();
+
+    template <typename T, typename... Args> shared_ptr<T> make(Args&&... args) const {
+        return make_node<T>(arena, forward<Args>(args)...);
+    }
+
+    // the tokens of the statements that are built, in the order of the source
+    shared_ptr<TokenSpan::list_t> list = make_shared<TokenSpan::list_t>();
+
+    // the statement that is built
+    struct Frame {
+        const LuaSource* anchor;   // nullptr at the top level
+        uint32_t start;            // the position of the statement
+        vector<Entry>* entries;    // the statements nested in it
+        const vector<Entry>* last; // the ones of the last build, nullptr if there are none
+        long last_start;           // the position of the statement in the last source
+    };
+    Frame frame;
+
+    // a shared statement moves to its new place when the build succeeded
+    struct Moved {
+        LuaSource* anchor;
+        const LuaSource* parent; // nullptr at the top level
+        uint32_t pos;
+    };
+    vector<Moved> moves;
+
+    // the entries of the shared statements (to replace them if they are copied)
+    unordered_map<const _LuaStmt*, pair<vector<Entry>*, size_t>> places;
+
+    // the scopes of the statements for the resolver
+    SharedStatements resolving;
+
+    LuaToken token(const ts::Node& leaf) const {
+        size_t start = leaf.start_byte();
+        size_t end = leaf.end_byte();
+        auto type = token_type(leaf);
+
+        if (type == LuaToken::Type::COMMENT) {
+            // the whitespace at the end of a line comment belongs to the next token
+            while (end > start && isspace(static_cast<unsigned char>(text[end - 1])))
+                --end;
+            if (text.compare(start, 4, "--[[") == 0)
+                type = LuaToken::Type::BLOCKCOMMENT;
+        }
+
+        if (end - start >= LuaToken::max_length) {
+            if (!too_long)
+                too_long = "the token" + at(leaf) + " is too long";
+            end = start;
+        }
+        stats.tokens++;
+        return frame.anchor->token(type, start - frame.start, end - start);
+    }
+
+    // adds the tokens of the leaves before pos to list
+    void push(uint32_t pos) {
+        for (; !leaves.end(); leaves.next()) {
+            auto leaf = leaves.leaf();
+            if (leaf.start_byte() >= pos)
+                return;
+            list->push_back(token(leaf));
+        }
+    }
+
+    LuaName name(const ts::Node& node) const { return make<_LuaName>(token(node)); }
+
+    // the current child has to be of the type
+    optional<string> expect(string_view type, const ts::Node& parent) {
+        if (!walker.is(type))
+            return "'" + string{type} + "' expected" + at(parent);
+        walker.next();
+        return nullopt;
+    }
+
+    static bool is_statement(const ts::Node& node) {
+        auto type = node.type_id();
+        return type == ts::NODE_VARIABLE_DECLARATION ||
+               type == ts::NODE_LOCAL_VARIABLE_DECLARATION || type == ts::NODE_DO_STATEMENT ||
+               type == ts::NODE_IF_STATEMENT || type == ts::NODE_WHILE_STATEMENT ||
+               type == ts::NODE_REPEAT_STATEMENT || type == ts::NODE_FOR_STATEMENT ||
+               type == ts::NODE_FOR_IN_STATEMENT || type == ts::NODE_GOTO_STATEMENT ||
+               type == ts::NODE_BREAK_STATEMENT || type == ts::NODE_LABEL_STATEMENT ||
+               type == ts::NODE_FUNCTION || type == ts::NODE_LOCAL_FUNCTION ||
+               type == ts::NODE_FUNCTION_CALL || type == ts::NODE_RETURN_STATEMENT ||
+               type == ts::NODE_EXPRESSION;
+    }
+
+    // the statements starting at the current child (empty statements are skipped)
+    built_t<LuaChunk> block() {
+        LuaChunk chunk = make<_LuaChunk>();
+
+        while (!walker.end()) {
+            if (walker.is(";")) {
+                walker.next();
+                continue;
+            }
+            if (!is_statement(walker.node()))
+                break;
+
+            auto stmt = this->stmt();
+            if (holds_alternative<string>(stmt))
+                return get<string>(stmt);
+            chunk->statements.push_back(get<LuaStmt>(stmt));
+        }
+
+        return chunk;
+    }
+
+    static bool touches(const ts::Range& range, uint32_t start, uint32_t end) {
+        return range.start.byte <= end && start <= range.end.byte;
+    }
+
+    // true if the text from start to end is in a changed range or an edit
+    bool touched(uint32_t start, uint32_t end) const {
+        for (const auto& range : edit->changed_ranges) {
+            if (touches(range, start, end))
+                return true;
+        }
+        for (const auto& applied : edit->applied_edits) {
+            if (touches(applied.after, start, end))
+                return true;
+        }
+        return false;
+    }
+
+    // how far the text at pos (after the edits before it) moved since the last source
+    long delta(uint32_t pos) const {
+        long delta = 0;
+        for (const auto& applied : edit->applied_edits) {
+            if (applied.after.end.byte <= pos)
+                delta = static_cast<long>(applied.after.end.byte) - applied.before.end.byte;
+        }
+        return delta;
+    }
+
+    // the statement of the last build at the position of node in the statement of frame, with
+    // the same type
+    const Entry* counterpart(const Frame& frame, const ts::Node& node) const {
+        if (!frame.last)
+            return nullptr;
+
+        long key = node.start_byte() - delta(node.start_byte()) - frame.last_start;
+        auto it = lower_bound(frame.last->begin(), frame.last->end(), key,
+                              [](const Entry& entry, long key) { return entry.start < key; });
+        if (it == frame.last->end() || it->start != key || it->type != node.type_id())
+            return nullptr;
+        return &*it;
+    }
+
+    // the statement of the last build with the same text as node, nullptr if there is none
+    LuaStmt reuse(const ts::Node& node) {
+        if (!frame.last)
+            return nullptr;
+
+        uint32_t start = node.start_byte();
+        uint32_t end = node.end_byte();
+        if (touched(start, end))
+            return nullptr;
+
+        const Entry* old = counterpart(frame, node);
+        if (!old || old->size != end - start || !old->scope->resolved)
+            return nullptr;
+
+        // its tokens are taken from the last build instead of the leaves of the node
+        if (frame.anchor) {
+            push(start);
+            list->insert(list->end(), old->stmt->tokens.begin(), old->stmt->tokens.end());
+        }
+        leaves.skip(end);
+
+        moves.push_back(Moved{old->anchor.get(), frame.anchor, start});
+        places[old->stmt.get()] = {frame.entries, frame.entries->size()};
+        resolving.scopes[old->stmt.get()] = old->scope.get();
+        frame.entries->push_back(*old);
+        frame.entries->back().start = start - frame.start;
+
+        stats.reused++;
+        return old->stmt;
+    }
+
+    // a copy of a shared statement to resolve it again
+    LuaStmt unshare(const LuaStmt& stmt) {
+        Copy copy{arena};
+        auto result = copy.stat(stmt);
+
+        if (auto place = places.find(stmt.get()); place != places.end()) {
+            auto& entry = (*place->second.first)[place->second.second];
+            entry = copied(entry, copy.copies);
+        }
+
+        stats.copied++;
+        return result;
+    }
+
+    // the entry of a copy, the copies of the nested statements get entries, too
+    Entry copied(const Entry& entry, const unordered_map<const _LuaStmt*, LuaStmt>& copies) {
+        Entry result = entry;
+        if (auto copy = copies.find(entry.stmt.get()); copy != copies.end())
+            result.stmt = copy->second;
+        result.scope = make_shared<StmtScope>();
+        resolving.scopes[result.stmt.get()] = result.scope.get();
+
+        auto nested = make_shared<vector<Entry>>();
+        nested->reserve(entry.nested->size());
+        for (const auto& stmt : *entry.nested)
+            nested->push_back(copied(stmt, copies));
+        result.nested = move(nested);
+        return result;
+    }
+
+    // the statement at the current child
+    built_t<LuaStmt> stmt() {
+        auto node = walker.node();
+        uint32_t start = node.start_byte();
+        uint32_t end = node.end_byte();
+
+        if (auto shared = reuse(node)) {
+            walker.next();
+            return shared;
+        }
+
+        // the tokens are relative to the statement, a top-level statement has its own text
+        shared_ptr<LuaSource> anchor;
+        if (frame.anchor) {
+            push(start);
+            anchor = make_shared<LuaSource>(*frame.anchor, start);
+        } else {
+            leaves.skip(start);
+            anchor = make_shared<LuaSource>(text.substr(start, end - start), start);
+        }
+        size_t first = list->size();
+
+        Frame outer = frame;
+        auto entries = make_shared<vector<Entry>>();
+        frame = Frame{anchor.get(), start, entries.get(), nullptr, 0};
+        if (const Entry* old = counterpart(outer, node)) {
+            // its nested statements can be shared
+            frame.last = old->nested.get();
+            frame.last_start = outer.last_start + old->start;
+        }
+
+        walker.enter();
+        auto result = build(node);
+        walker.leave();
+        walker.next();
+        push(end);
+        frame = outer;
+
+        if (holds_alternative<LuaStmt>(result)) {
+            auto& stmt = get<LuaStmt>(result);
+            stmt->tokens = TokenSpan{list, first, list->size()};
+            auto scope = make_shared<StmtScope>();
+            resolving.scopes[stmt.get()] = scope.get();
+            frame.entries->push_back(Entry{start - frame.start, end - start, node.type_id(), stmt,
+                                           move(anchor), move(scope), move(entries)});
+            stats.built++;
+        }
+        return result;
+    }
+
+    // the statement node from its first child
+    built_t<LuaStmt> build(const ts::Node& node) {
+        auto type = node.type_id();
+
+        if (type == ts::NODE_FUNCTION_CALL) {
+            auto call = this->call(node);
+            if (holds_alternative<string>(call))
+                return get<string>(call);
+            return static_pointer_cast<_LuaStmt>(get<LuaFunctioncall>(call));
+        }
+
+        if (type == ts::NODE_VARIABLE_DECLARATION) {
+            // var {, var} = explist
+            auto assign = make<_LuaAssignment>();
+            assign->varlist = make<_LuaExplist>();
+
+            for (;;) {
+                auto var = this->var(node);
+                if (holds_alternative<string>(var))
+                    return get<string>(var);
+                assign->varlist->exps.push_back(get<LuaExp>(var));
+
+                if (!walker.is(","))
+                    break;
+                walker.next();
+            }
+
+            if (auto error = expect("=", node))
+                return *error;
+
+            auto explist = this->explist(node);
+            if (holds_alternative<string>(explist))
+                return get<string>(explist);
+            assign->explist = get<LuaExplist>(explist);
+            return move(assign);
+        }
+
+        if (type == ts::NODE_LOCAL_VARIABLE_DECLARATION) {
+            // local namelist [= explist]
+            auto assign = make<_LuaAssignment>();
+            assign->local = true;
+            assign->varlist = make<_LuaExplist>();
+            assign->explist = make<_LuaExplist>();
+
+            for (walker.next(); !walker.end() && !walker.is("="); walker.next()) {
+                if (walker.is(ts::NODE_VARIABLE_DECLARATOR)) {
+                    for (walker.enter(); !walker.end(); walker.next()) {
+                        if (walker.is(ts::NODE_IDENTIFIER))
+                            assign->varlist->exps.push_back(
+                                make<_LuaNameVar>(name(walker.node())));
+                    }
+                    walker.leave();
+                } else if (walker.is(ts::NODE_IDENTIFIER)) {
+                    assign->varlist->exps.push_back(make<_LuaNameVar>(name(walker.node())));
+                }
+            }
+
+            if (walker.is("=")) {
+                walker.next();
+                auto explist = this->explist(node);
+                if (holds_alternative<string>(explist))
+                    return get<string>(explist);
+                assign->explist = get<LuaExplist>(explist);
+            }
+            return move(assign);
+        }
+
+        if (type == ts::NODE_FUNCTION) {
+            // function funcname funcbody
+            auto assign = make<_LuaAssignment>();
+            assign->varlist = make<_LuaExplist>();
+            assign->explist = make<_LuaExplist>();
+
+            walker.next();
+            if (!walker.is("function_name"))
+                return unsupported(node);
+
+            // Name {. Name} [: Name], a method gets self as first parameter
+            LuaExp var;
+            bool method = false;
+            for (walker.enter(); !walker.end(); walker.next()) {
+                if (walker.is(ts::NODE_FUNCTION_NAME_FIELD)) {
+                    for (walker.enter(); !walker.end(); walker.next()) {
+                        if (walker.is(ts::NODE_IDENTIFIER)) {
+                            var = make<_LuaNameVar>(name(walker.node()));
+                        } else if (walker.is(ts::NODE_PROPERTY_IDENTIFIER)) {
+                            var = member(var, walker.node());
+                        }
+                    }
+                    walker.leave();
+                } else if (walker.is(ts::NODE_IDENTIFIER)) {
+                    var = make<_LuaNameVar>(name(walker.node()));
+                } else if (walker.is(ts::NODE_METHOD)) {
+                    var = member(var, walker.node());
+                    method = true;
+                }
+            }
+            walker.leave();
+            if (!var)
+                return unsupported(walker.node());
+            walker.next();
+
+            auto function = this->function(node, method);
+            if (holds_alternative<string>(function))
+                return get<string>(function);
+
+            assign->varlist->exps.push_back(var);
+            assign->explist->exps.push_back(get<LuaFunction>(function));
+            return move(assign);
+        }
+
+        if (type == ts::NODE_LOCAL_FUNCTION) {
+            // local function Name funcbody
+            auto assign = make<_LuaAssignment>();
+            assign->local = true;
+            assign->varlist = make<_LuaExplist>();
+            assign->explist = make<_LuaExplist>();
+
+            walker.next();
+            walker.next();
+            if (!walker.is(ts::NODE_IDENTIFIER))
+                return "name expected" + at(node);
+            assign->varlist->exps.push_back(name(walker.node()));
+            walker.next();
+
+            auto function = this->function(node, false);
+            if (holds_alternative<string>(function))
+                return get<string>(function);
+            assign->explist->exps.push_back(get<LuaFunction>(function));
+            return move(assign);
+        }
+
+        if (type == ts::NODE_IF_STATEMENT) {
+            // if exp then block {elseif exp then block} [else block] end
+            auto if_stmt = make<_LuaIfStmt>();
+
+            // exp then block
+            auto branch = [&](const ts::Node& node) -> optional<string> {
+                auto cond = exp(node);
+                if (holds_alternative<string>(cond))
+                    return get<string>(cond);
+                if (auto error = expect("then", node))
+                    return error;
+
+                auto body = block();
+                if (holds_alternative<string>(body))
+                    return get<string>(body);
+                if_stmt->branches.emplace_back(get<LuaExp>(cond), get<LuaChunk>(body));
+                return nullopt;
+            };
+
+            walker.next();
+            if (auto error = branch(node))
+                return *error;
+
+            while (walker.is(ts::NODE_ELSEIF)) {
+                auto elseif = walker.node();
+                walker.enter();
+                walker.next();
+                if (auto error = branch(elseif))
+                    return *error;
+                walker.leave();
+                walker.next();
+            }
+
+            if (walker.is(ts::NODE_ELSE)) {
+                walker.enter();
+                walker.next();
+                auto body = block();
+                if (holds_alternative<string>(body))
+                    return get<string>(body);
+                if_stmt->branches.emplace_back(_LuaValue::True(arena), get<LuaChunk>(body));
+                walker.leave();
+                walker.next();
+            }
+
+            if (auto error = expect("end", node))
+                return *error;
+            return move(if_stmt);
+        }
+
+        if (type == ts::NODE_DO_STATEMENT) {
+            // do block end is the same as a branch that is always taken
+            auto if_stmt = make<_LuaIfStmt>();
+            walker.next();
+            auto body = block();
+            if (holds_alternative<string>(body))
+                return get<string>(body);
+            if_stmt->branches.emplace_back(_LuaValue::True(arena), get<LuaChunk>(body));
+            return move(if_stmt);
+        }
+
+        if (type == ts::NODE_WHILE_STATEMENT || type == ts::NODE_REPEAT_STATEMENT) {
+            // while exp do block end | repeat block until exp
+            auto loop = make<_LuaLoopStmt>();
+            loop->head_controlled = type == ts::NODE_WHILE_STATEMENT;
+
+            walker.next();
+            if (loop->head_controlled) {
+                auto cond = exp(node);
+                if (holds_alternative<string>(cond))
+                    return get<string>(cond);
+                loop->end = get<LuaExp>(cond);
+                if (auto error = expect("do", node))
+                    return *error;
+            }
+
+            auto body = block();
+            if (holds_alternative<string>(body))
+                return get<string>(body);
+            loop->body = get<LuaChunk>(body);
+
+            if (!loop->head_controlled) {
+                if (auto error = expect("until", node))
+                    return *error;
+                auto cond = exp(node);
+                if (holds_alternative<string>(cond))
+                    return get<string>(cond);
+                loop->end = _LuaUnop::Not(arena, get<LuaExp>(cond));
+            }
+            return move(loop);
+        }
+
+        if (type == ts::NODE_FOR_STATEMENT) {
+            // for Name = exp, exp [, exp] do block end
+            auto for_stmt = make<_LuaForStmt>();
+
+            walker.next();
+            if (!walker.is(ts::NODE_LOOP_EXPRESSION))
+                return unsupported(node);
+            auto head = walker.node();
+
+            walker.enter();
+            if (!walker.is(ts::NODE_IDENTIFIER))
+                return "name expected" + at(head);
+            for_stmt->var = name(walker.node());
+            walker.next();
+            if (auto error = expect("=", head))
+                return *error;
+
+            for (LuaExp* e : {&for_stmt->start, &for_stmt->end, &for_stmt->step}) {
+                if (e != &for_stmt->start) {
+                    if (!walker.is(","))
+                        break;
+                    walker.next();
+                }
+                auto value = exp(head);
+                if (holds_alternative<string>(value))
+                    return get<string>(value);
+                *e = get<LuaExp>(value);
+            }
+            if (!for_stmt->end)
+                return "',' expected" + at(head);
+            if (!for_stmt->step)
+                for_stmt->step = _LuaValue::Int(arena, 1);
+            walker.leave();
+            walker.next();
+
+            if (auto error = expect("do", node))
+                return *error;
+            auto body = block();
+            if (holds_alternative<string>(body))
+                return get<string>(body);
+            for_stmt->body = get<LuaChunk>(body);
+            return move(for_stmt);
+        }
+
+        if (type == ts::NODE_RETURN_STATEMENT) {
+            // return [explist]
+            walker.next();
+            if (walker.end() || walker.is(";"))
+                return make<_LuaReturnStmt>();
+
+            auto explist = this->explist(node);
+            if (holds_alternative<string>(explist))
+                return get<string>(explist);
+            return make<_LuaReturnStmt>(get<LuaExplist>(explist));
+        }
+
+        if (type == ts::NODE_BREAK_STATEMENT)
+            return make<_LuaBreakStmt>();
+
+        return unsupported(node);
+    }
+
+    LuaExp member(const LuaExp& table, const ts::Node& name) const {
+        auto var = make<_LuaMemberVar>();
+        var->table = table;
+        var->member = this->name(name);
+        return var;
+    }
+
+    // an assignable expression
+    built_t<LuaExp> var(const ts::Node& parent) {
+        if (walker.end())
+            return "variable expected" + at(parent);
+        auto node = walker.node();
+
+        built_t<LuaExp> var;
+        if (walker.is(ts::NODE_VARIABLE_DECLARATOR)) {
+            walker.enter();
+            var = exp(node);
+            if (holds_alternative<LuaExp>(var) && !walker.end())
+                return unsupported(walker.node());
+            walker.leave();
+            walker.next();
+        } else {
+            var = exp(parent);
+        }
+
+        if (holds_alternative<LuaExp>(var) && !_LuaVar::is_var(*get<LuaExp>(var)))
+            return "variable expected" + at(node);
+        return var;
+    }
+
+    // an expression starting at the current child, including the parentheses and indexing that
+    // the grammar doesn't wrap in a node of their own: ( exp ) and prefixexp [ exp ]
+    built_t<LuaExp> exp(const ts::Node& parent) {
+        if (walker.end())
+            return "expression expected" + at(parent);
+
+        built_t<LuaExp> result;
+        if (walker.is("(")) {
+            walker.next();
+            result = exp(parent);
+            if (holds_alternative<string>(result))
+                return result;
+            if (auto error = expect(")", parent))
+                return *error;
+        } else {
+            result = exp_node();
+        }
+
+        return index(move(result), parent);
+    }
+
+    // prefixexp [ exp ] at the current child
+    built_t<LuaExp> index(built_t<LuaExp> result, const ts::Node& parent) {
+        while (holds_alternative<LuaExp>(result) && walker.is("[")) {
+            auto var = make<_LuaIndexVar>();
+            var->table = get<LuaExp>(result);
+
+            walker.next();
+            auto index = exp(parent);
+            if (holds_alternative<string>(index))
+                return index;
+            var->index = get<LuaExp>(index);
+
+            if (auto error = expect("]", parent))
+                return *error;
+            result = move(var);
+        }
+
+        return result;
+    }
+
+    // the expression of the current child
+    built_t<LuaExp> exp_node() {
+        auto node = walker.node();
+        auto type = node.type_id();
+
+        if (type == ts::NODE_NUMBER || type == ts::NODE_STRING || type == ts::NODE_NIL ||
+            type == ts::NODE_TRUE || type == ts::NODE_FALSE) {
+            walker.next();
+            return make<_LuaValue>(token(node));
+        }
+
+        if (type == ts::NODE_IDENTIFIER || type == ts::NODE_SELF || type == ts::NODE_NEXT ||
+            type == ts::NODE_GLOBAL_VARIABLE) {
+            walker.next();
+            return make<_LuaNameVar>(name(node));
+        }
+
+        walker.enter();
+        auto result = exp_children(node);
+        walker.leave();
+        walker.next();
+        return result;
+    }
+
+    // the expression node from its first child
+    built_t<LuaExp> exp_children(const ts::Node& node) {
+        auto type = node.type_id();
+
+        if (type == ts::NODE_EXPRESSION || type == ts::NODE_CONDITION_EXPRESSION) {
+            auto result = exp(node);
+            if (holds_alternative<LuaExp>(result) && !walker.end())
+                return unsupported(walker.node());
+            return result;
+        }
+
+        if (type == ts::NODE_BINARY_OPERATION) {
+            auto op = make<_LuaOp>();
+
+            auto lhs = exp(node);
+            if (holds_alternative<string>(lhs))
+                return lhs;
+            op->lhs = get<LuaExp>(lhs);
+
+            if (walker.end())
+                return "operator expected" + at(node);
+            op->op = token(walker.node());
+            if (op->op.type == LuaToken::Type::NONE)
+                return unsupported(walker.node());
+            walker.next();
+
+            auto rhs = exp(node);
+            if (holds_alternative<string>(rhs))
+                return rhs;
+            op->rhs = get<LuaExp>(rhs);
+            return move(op);
+        }
+
+        if (type == ts::NODE_UNARY_OPERATION) {
+            auto unop = make<_LuaUnop>();
+            unop->op = token(walker.node());
+            if (unop->op.type == LuaToken::Type::NONE)
+                return unsupported(walker.node());
+            walker.next();
+
+            auto e = exp(node);
+            if (holds_alternative<string>(e))
+                return e;
+            unop->exp = get<LuaExp>(e);
+            return move(unop);
+        }
+
+        if (type == ts::NODE_FUNCTION_CALL) {
+            auto call = this->call(node);
+            if (holds_alternative<string>(call))
+                return get<string>(call);
+            return static_pointer_cast<_LuaExp>(get<LuaFunctioncall>(call));
+        }
+
+        if (type == ts::NODE_FIELD_EXPRESSION) {
+            // prefixexp . Name
+            auto table = exp(node);
+            if (holds_alternative<string>(table))
+                return table;
+            if (auto error = expect(".", node))
+                return *error;
+            if (walker.end())
+                return "name expected" + at(node);
+            return member(get<LuaExp>(table), walker.node());
+        }
+
+        if (type == ts::NODE_FUNCTION_DEFINITION) {
+            // function funcbody
+            walker.next();
+            auto function = this->function(node, false);
+            if (holds_alternative<string>(function))
+                return get<string>(function);
+            return static_pointer_cast<_LuaExp>(get<LuaFunction>(function));
+        }
+
+        if (type == ts::NODE_TABLE)
+            return table(node);
+
+        return unsupported(node);
+    }
+
+    built_t<LuaExplist> explist(const ts::Node& parent) {
+        auto explist = make<_LuaExplist>();
+
+        for (;;) {
+            auto e = exp(parent);
+            if (holds_alternative<string>(e))
+                return get<string>(e);
+            explist->exps.push_back(get<LuaExp>(e));
+
+            if (!walker.is(","))
+                return explist;
+            walker.next();
+        }
+    }
+
+    // prefixexp args | prefixexp : Name args
+    built_t<LuaFunctioncall> call(const ts::Node& node) {
+        auto call = make<_LuaFunctioncall>();
+
+        auto function = exp(node);
+        if (holds_alternative<string>(function))
+            return get<string>(function);
+        call->function = get<LuaExp>(function);
+
+        // a:m(...) calls a.m(a, ...), a is evaluated twice
+        LuaExp self;
+        if (walker.is(":")) {
+            walker.next();
+            if (walker.end())
+                return "name expected" + at(node);
+            self = call->function;
+            call->function = member(self, walker.node());
+            walker.next();
+        }
+
+        if (!walker.is(ts::NODE_ARGUMENTS))
+            return "arguments expected" + at(node);
+        auto args = walker.node();
+
+        // ( [explist] ) | tableconstructor | String
+        walker.enter();
+        if (walker.is("(")) {
+            walker.next();
+            if (walker.is(")")) {
+                call->args = make<_LuaExplist>();
+            } else {
+                auto explist = this->explist(args);
+                if (holds_alternative<string>(explist))
+                    return get<string>(explist);
+                call->args = get<LuaExplist>(explist);
+            }
+            if (auto error = expect(")", args))
+                return *error;
+        } else {
+            auto explist = this->explist(args);
+            if (holds_alternative<string>(explist))
+                return get<string>(explist);
+            call->args = get<LuaExplist>(explist);
+        }
+        walker.leave();
+        walker.next();
+
+        if (self)
+            call->args->exps.insert(call->args->exps.begin(), self);
+
+        return call;
+    }
+
+    // funcbody ::= ( [parlist] ) block end, starting at the parameters
+    built_t<LuaFunction> function(const ts::Node& node, bool method) {
+        auto function = make<_LuaFunction>();
+        function->params = make<_LuaExplist>();
+
+        if (method) {
+            LuaToken self{LuaToken::Type::NAME, "self"};
+            function->params->exps.push_back(
+                make<_LuaNameVar>(make<_LuaName>(self)));
+        }
+
+        if (!walker.is(ts::NODE_PARAMETERS))
+            return "parameters expected" + at(node);
+
+        for (walker.enter(); !walker.end(); walker.next()) {
+            if (walker.is(ts::NODE_IDENTIFIER) || walker.is(ts::NODE_SELF)) {
+                function->params->exps.push_back(make<_LuaNameVar>(name(walker.node())));
+            } else if (walker.is(ts::NODE_SPREAD)) {
+                function->params->exps.push_back(make<_LuaValue>(token(walker.node())));
+            }
+        }
+        walker.leave();
+        walker.next();
+
+        auto body = block();
+        if (holds_alternative<string>(body))
+            return get<string>(body);
+        function->body = get<LuaChunk>(body);
+
+        if (auto error = expect("end", node))
+            return *error;
+
+        return function;
+    }
+
+    // { [field {fieldsep field} [fieldsep]] }
+    built_t<LuaExp> table(const ts::Node& node) {
+        auto table = make<_LuaTableconstructor>();
+        push(node.start_byte());
+        size_t first = list->size();
+
+        for (; !walker.end(); walker.next()) {
+            if (!walker.is(ts::NODE_FIELD))
+                continue;
+
+            auto field = make<_LuaField>();
+            auto field_node = walker.node();
+            walker.enter();
+
+            built_t<LuaExp> value;
+            if (walker.is("[")) {
+                // [ exp ] = exp
+                walker.next();
+                auto key = exp(field_node);
+                if (holds_alternative<string>(key))
+                    return key;
+                field->lhs = get<LuaExp>(key);
+                if (auto error = expect("]", field_node))
+                    return *error;
+                if (auto error = expect("=", field_node))
+                    return *error;
+                value = exp(field_node);
+            } else if (walker.is(ts::NODE_IDENTIFIER)) {
+                // Name = exp or an expression starting with a name
+                auto name = this->name(walker.node());
+                walker.next();
+                if (walker.is("=")) {
+                    field->lhs = name;
+                    walker.next();
+                    value = exp(field_node);
+                } else {
+                    value = index(make<_LuaNameVar>(name), field_node);
+                }
+            } else {
+                value = exp(field_node);
+            }
+
+            if (holds_alternative<string>(value))
+                return value;
+            field->rhs = get<LuaExp>(value);
+
+            walker.leave();
+            table->fields.push_back(field);
+        }
+
+        push(node.end_byte());
+        table->tokens = TokenSpan{list, first, list->size()};
+        return move(table);
+    }
+};
+
+ASTBuilder::result_t ASTBuilder::build(const ts::Tree& tree) { return run(tree, nullptr); }
+
+ASTBuilder::result_t ASTBuilder::rebuild(const ts::Tree& tree, const ts::EditResult& edit) {
+    return run(tree, &edit);
+}
+
+ASTBuilder::result_t ASTBuilder::run(const ts::Tree& tree, const ts::EditResult* edit) {
+    // the positions have to fit into the tokens
+    if (tree.source().size() > LuaToken::max_pos) {
+        statements.clear();
+        return "the program is larger than 4 GiB";
+    }
+
+    ts::Node root = tree.root_node();
+    if (root.has_error()) {
+        statements.clear();
+        return syntax_error(root);
+    }
+
+    vector<Entry> next;
+    last_stats = Stats{};
+
+    Build build{tree, edit, statements, next, last_stats};
+    auto result = build.program(root);
+    if (holds_alternative<string>(result)) {
+        // nothing was moved, but the next rebuild can't know what was built
+        statements.clear();
+        return get<string>(result);
+    }
+
+    auto chunk = get<LuaChunk>(result);
+    build.finish(chunk);
+    statements = move(next);
+    return chunk;
+}
+
+} // namespace rt
+} // namespace lua
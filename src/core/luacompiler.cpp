@@ -0,0 +1,713 @@
+#include "MiniLua/luacompiler.hpp"
+#include "MiniLua/sourceexp.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+
+namespace lua {
+namespace rt {
+
+namespace {
+
+using compile_error_t = optional<string>;
+
+const unordered_map<LuaToken::Type, OpCode> binops = {
+    {LuaToken::Type::ADD, OpCode::ADD},       {LuaToken::Type::SUB, OpCode::SUB},
+    {LuaToken::Type::MUL, OpCode::MUL},       {LuaToken::Type::DIV, OpCode::DIV},
+    {LuaToken::Type::POW, OpCode::POW},       {LuaToken::Type::MOD, OpCode::MOD},
+    {LuaToken::Type::CONCAT, OpCode::CONCAT}, {LuaToken::Type::EVAL, OpCode::EVAL},
+    {LuaToken::Type::LT, OpCode::LT},         {LuaToken::Type::LEQ, OpCode::LEQ},
+    {LuaToken::Type::GT, OpCode::GT},         {LuaToken::Type::GEQ, OpCode::GEQ},
+    {LuaToken::Type::EQ, OpCode::EQ},         {LuaToken::Type::NEQ, OpCode::NEQ}};
+
+const unordered_map<LuaToken::Type, OpCode> unops = {
+    {LuaToken::Type::SUB, OpCode::NEG},
+    {LuaToken::Type::LEN, OpCode::LEN},
+    {LuaToken::Type::NOT, OpCode::NOT},
+    {LuaToken::Type::STRIP, OpCode::STRIP},
+    {LuaToken::Type::EVAL, OpCode::POSTFIX_EVAL}};
+
+// the maximum nesting of an expression, deeper expressions are a compile error
+constexpr unsigned max_exp_depth = 1000;
+
+class Compiler {
+public:
+    auto function(const _LuaChunk& chunk, const _LuaExplist* params) -> compile_error_t;
+
+    Proto proto;
+
+private:
+    struct Loop {
+        unsigned env_depth;    // number of open scopes at the exit of the loop
+        vector<size_t> breaks; // jumps that have to be patched with the exit of the loop
+    };
+
+    unsigned top = 0;       // first free register
+    unsigned env_depth = 0; // number of scopes opened with PUSHENV
+    unsigned exp_depth = 0; // nesting of the expression that is compiled
+    vector<Loop> loops;
+    unordered_map<string, uint32_t> names;
+
+    auto alloc(unsigned n = 1) -> unsigned {
+        unsigned reg = top;
+        top += n;
+        proto.max_registers = max(proto.max_registers, top);
+        return reg;
+    }
+    void free_to(unsigned reg) { top = reg; }
+
+    auto emit(OpCode op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0, uint32_t aux = 0)
+        -> size_t {
+        proto.code.push_back(Instruction{op, a, b, c, aux});
+        return proto.code.size() - 1;
+    }
+    auto here() const -> uint32_t { return static_cast<uint32_t>(proto.code.size()); }
+    void patch(size_t jump, uint32_t target) { proto.code[jump].b = target; }
+
+    auto constant(const val& v) -> uint32_t;
+    auto name(string_view name) -> uint32_t;
+    auto token(const LuaToken& tok) -> uint32_t;
+    auto field(const FieldRef& ref) -> uint32_t;
+
+    auto block(const _LuaChunk& chunk) -> compile_error_t;
+    auto scoped_block(const _LuaChunk& chunk) -> compile_error_t;
+    auto stat(const LuaStmt& stmt) -> compile_error_t;
+    auto assignment(const _LuaAssignment& assignment) -> compile_error_t;
+    auto store(const LuaExp& var, unsigned src, bool local) -> compile_error_t;
+    auto store(const _LuaName& var, unsigned src, bool local) -> compile_error_t;
+    auto loop(const _LuaLoopStmt& loop_stmt) -> compile_error_t;
+    auto for_loop(const _LuaForStmt& for_stmt) -> compile_error_t;
+    auto if_stmt(const _LuaIfStmt& if_stmt) -> compile_error_t;
+    auto return_stmt(const _LuaReturnStmt& return_stmt) -> compile_error_t;
+    auto break_stmt() -> compile_error_t;
+
+    // compiles an expression; nesting the compiler can't flatten (e.g. a .. b .. c, which is
+    // right associative) recurses, so it is limited to max_exp_depth
+    auto exp(const LuaExp& exp, unsigned dst, bool multi = false) -> compile_error_t;
+    auto nested_exp(const LuaExp& exp, unsigned dst, bool multi) -> compile_error_t;
+    auto explist(const vector<LuaExp>& exps, unsigned base, bool multi) -> compile_error_t;
+    auto value(const _LuaValue& value, unsigned dst) -> compile_error_t;
+    auto call(const _LuaFunctioncall& call, unsigned dst, bool multi, bool tail = false)
+        -> compile_error_t;
+    auto binop(const _LuaOp& op, unsigned dst) -> compile_error_t;
+    auto unop(const _LuaUnop& op, unsigned dst) -> compile_error_t;
+    auto tableconstructor(const _LuaTableconstructor& tableconst, unsigned dst) -> compile_error_t;
+};
+
+auto Compiler::constant(const val& v) -> uint32_t {
+    proto.constants.push_back(v);
+    return static_cast<uint32_t>(proto.constants.size() - 1);
+}
+
+auto Compiler::name(string_view name) -> uint32_t {
+    string key{name};
+    if (auto it = names.find(key); it != names.end())
+        return it->second;
+    return names[key] = constant(key);
+}
+
+auto Compiler::token(const LuaToken& tok) -> uint32_t {
+    proto.tokens.push_back(&tok);
+    return static_cast<uint32_t>(proto.tokens.size() - 1);
+}
+
+auto Compiler::field(const FieldRef& ref) -> uint32_t {
+    proto.fields.push_back(&ref);
+    return static_cast<uint32_t>(proto.fields.size() - 1);
+}
+
+auto Compiler::function(const _LuaChunk& chunk, const _LuaExplist* params) -> compile_error_t {
+    if (params) {
+        // the arguments are passed in the first registers and are bound to the formal parameters
+        // in the prologue
+        proto.num_params = static_cast<unsigned>(params->exps.size());
+        alloc(proto.num_params);
+
+        for (unsigned i = 0; i < params->exps.size(); ++i) {
+            if (params->exps[i]->kind != _LuaAST::Kind::NameVar)
+                return string{"value unimplemented"};
+            if (auto err = store(params->exps[i], i, true); err)
+                return err;
+        }
+    }
+
+    if (auto err = block(chunk); err)
+        return err;
+
+    emit(OpCode::RETURN, 0, 0, 1);
+    return nullopt;
+}
+
+auto Compiler::block(const _LuaChunk& chunk) -> compile_error_t {
+    for (const auto& stmt : chunk.statements) {
+        if (auto err = stat(stmt); err)
+            return err;
+    }
+    return nullopt;
+}
+
+auto Compiler::scoped_block(const _LuaChunk& chunk) -> compile_error_t {
+    emit(OpCode::PUSHENV, chunk.num_slots);
+    env_depth++;
+
+    if (auto err = block(chunk); err)
+        return err;
+
+    emit(OpCode::POPENV, 1);
+    env_depth--;
+    return nullopt;
+}
+
+auto Compiler::stat(const LuaStmt& stmt) -> compile_error_t {
+    using Kind = _LuaAST::Kind;
+    switch (stmt->kind) {
+    case Kind::Functioncall: {
+        unsigned reg = alloc();
+        auto err = call(static_cast<const _LuaFunctioncall&>(*stmt), reg, false);
+        free_to(reg);
+        return err;
+    }
+    case Kind::Assignment:
+        return assignment(static_cast<const _LuaAssignment&>(*stmt));
+    case Kind::LoopStmt:
+        return loop(static_cast<const _LuaLoopStmt&>(*stmt));
+    case Kind::ForStmt:
+        return for_loop(static_cast<const _LuaForStmt&>(*stmt));
+    case Kind::IfStmt:
+        return if_stmt(static_cast<const _LuaIfStmt&>(*stmt));
+    case Kind::ReturnStmt:
+        return return_stmt(static_cast<const _LuaReturnStmt&>(*stmt));
+    case Kind::BreakStmt:
+        return break_stmt();
+    case Kind::Comment:
+        return nullopt;
+    default:
+        return string{"statement unimplemented"};
+    }
+}
+
+auto Compiler::assignment(const _LuaAssignment& assignment) -> compile_error_t {
+    const auto& vars = assignment.varlist->exps;
+    const auto& exps = assignment.explist->exps;
+
+    unsigned base = alloc(static_cast<unsigned>(max(vars.size(), exps.size())));
+
+    // only expand the last expression if there are not enough values for all variables
+    bool expand = exps.size() < vars.size();
+    if (auto err = explist(exps, base, expand); err)
+        return err;
+    if (expand)
+        emit(OpCode::UNPACK, base, static_cast<uint32_t>(exps.size()),
+             static_cast<uint32_t>(vars.size()));
+
+    for (unsigned i = 0; i < vars.size(); ++i) {
+        if (auto err = store(vars[i], base + i, assignment.local); err)
+            return err;
+    }
+
+    free_to(base);
+    return nullopt;
+}
+
+auto Compiler::store(const LuaExp& var, unsigned src, bool local) -> compile_error_t {
+    using Kind = _LuaAST::Kind;
+    switch (var->kind) {
+    case Kind::NameVar:
+        return store(*static_cast<const _LuaNameVar&>(*var).name, src, local);
+    case Kind::Name:
+        return store(static_cast<const _LuaName&>(*var), src, local);
+    case Kind::IndexVar: {
+        const auto* index_var = static_cast<const _LuaIndexVar*>(var.get());
+        if (index_var->field.key) {
+            unsigned reg = alloc();
+            if (auto err = exp(index_var->table, reg); err)
+                return err;
+            emit(OpCode::SETFIELD, reg, src, 0, field(index_var->field));
+            free_to(reg);
+            return nullopt;
+        }
+
+        unsigned reg = alloc(2);
+        if (auto err = exp(index_var->table, reg); err)
+            return err;
+        if (auto err = exp(index_var->index, reg + 1); err)
+            return err;
+        emit(OpCode::SETINDEX, reg, reg + 1, src);
+        free_to(reg);
+        return nullopt;
+    }
+    case Kind::MemberVar: {
+        const auto& member_var = static_cast<const _LuaMemberVar&>(*var);
+        unsigned reg = alloc();
+        if (auto err = exp(member_var.table, reg); err)
+            return err;
+        emit(OpCode::SETFIELD, reg, src, 1, field(member_var.field));
+        free_to(reg);
+        return nullopt;
+    }
+    default:
+        return string{"cannot assign to an expression"};
+    }
+}
+
+auto Compiler::store(const _LuaName& var, unsigned src, bool local) -> compile_error_t {
+    switch (var.ref.kind) {
+    case VarRef::Kind::Local:
+        emit(OpCode::SETLOCAL, src, var.ref.slot, var.ref.depth, name(var.token.match()));
+        break;
+    case VarRef::Kind::Global:
+        emit(OpCode::SETGLOBAL, src, name(var.token.match()), 0, field(var.global));
+        break;
+    default:
+        emit(OpCode::SETVAR, src, name(var.token.match()), local);
+    }
+    return nullopt;
+}
+
+auto Compiler::loop(const _LuaLoopStmt& loop_stmt) -> compile_error_t {
+    uint32_t start = here();
+    loops.push_back(Loop{env_depth, {}});
+
+    if (loop_stmt.head_controlled) {
+        unsigned reg = alloc();
+        if (auto err = exp(loop_stmt.end, reg); err)
+            return err;
+        size_t test = emit(OpCode::TEST, reg, 0, 0);
+        free_to(reg);
+
+        if (auto err = scoped_block(*loop_stmt.body); err)
+            return err;
+        emit(OpCode::JMP, 0, start);
+
+        patch(test, here());
+    } else {
+        // the condition of repeat-until can see the locals of the body
+        emit(OpCode::PUSHENV, loop_stmt.body->num_slots);
+        env_depth++;
+
+        if (auto err = block(*loop_stmt.body); err)
+            return err;
+
+        unsigned reg = alloc();
+        if (auto err = exp(loop_stmt.end, reg); err)
+            return err;
+
+        emit(OpCode::POPENV, 1);
+        env_depth--;
+
+        emit(OpCode::TEST, reg, start, 1);
+        free_to(reg);
+    }
+
+    for (auto jump : loops.back().breaks)
+        patch(jump, here());
+    loops.pop_back();
+
+    return nullopt;
+}
+
+auto Compiler::for_loop(const _LuaForStmt& for_stmt) -> compile_error_t {
+    // start, limit and step are evaluated once before the loop
+    unsigned base = alloc(5);
+    if (auto err = exp(for_stmt.start, base); err)
+        return err;
+    if (auto err = exp(for_stmt.end, base + 1); err)
+        return err;
+    if (auto err = exp(for_stmt.step, base + 2); err)
+        return err;
+
+    loops.push_back(Loop{env_depth, {}});
+
+    size_t prep = emit(OpCode::FORPREP, base);
+    uint32_t body = here();
+
+    // every iteration gets a new scope with the loop variable
+    emit(OpCode::PUSHENV, for_stmt.body->num_slots);
+    env_depth++;
+    if (auto err = store(*for_stmt.var, base + 4, true); err)
+        return err;
+
+    if (auto err = block(*for_stmt.body); err)
+        return err;
+
+    emit(OpCode::POPENV, 1);
+    env_depth--;
+    emit(OpCode::FORLOOP, base, body);
+
+    patch(prep, here());
+    for (auto jump : loops.back().breaks)
+        patch(jump, here());
+    loops.pop_back();
+
+    free_to(base);
+    return nullopt;
+}
+
+auto Compiler::if_stmt(const _LuaIfStmt& if_stmt) -> compile_error_t {
+    vector<size_t> exits;
+
+    for (const auto& branch : if_stmt.branches) {
+        unsigned reg = alloc();
+        if (auto err = exp(branch.first, reg); err)
+            return err;
+        size_t test = emit(OpCode::TEST, reg, 0, 0);
+        free_to(reg);
+
+        if (auto err = scoped_block(*branch.second); err)
+            return err;
+        exits.push_back(emit(OpCode::JMP));
+
+        patch(test, here());
+    }
+
+    for (auto jump : exits)
+        patch(jump, here());
+
+    return nullopt;
+}
+
+auto Compiler::return_stmt(const _LuaReturnStmt& return_stmt) -> compile_error_t {
+    if (!return_stmt.explist) {
+        emit(OpCode::RETURN, 0, 0);
+        return nullopt;
+    }
+
+    const auto& exps = return_stmt.explist->exps;
+
+    // return f(...) replaces the frame of the current function with the one of f
+    if (exps.size() == 1 && exps[0]->kind == _LuaAST::Kind::Functioncall)
+        return call(static_cast<const _LuaFunctioncall&>(*exps[0]), 0, true, true);
+
+    unsigned base = alloc(static_cast<unsigned>(exps.size()));
+    if (auto err = explist(exps, base, true); err)
+        return err;
+    emit(OpCode::RETURN, base, static_cast<uint32_t>(exps.size()));
+    free_to(base);
+
+    return nullopt;
+}
+
+auto Compiler::break_stmt() -> compile_error_t {
+    if (loops.empty())
+        return string{"break outside of a loop"};
+
+    auto& loop = loops.back();
+    if (env_depth > loop.env_depth)
+        emit(OpCode::POPENV, env_depth - loop.env_depth);
+    loop.breaks.push_back(emit(OpCode::JMP));
+
+    return nullopt;
+}
+
+auto Compiler::explist(const vector<LuaExp>& exps, unsigned base, bool multi) -> compile_error_t {
+    for (unsigned i = 0; i < exps.size(); ++i) {
+        if (auto err = exp(exps[i], base + i, multi && i == exps.size() - 1); err)
+            return err;
+    }
+    return nullopt;
+}
+
+auto Compiler::exp(const LuaExp& exp, unsigned dst, bool multi) -> compile_error_t {
+    if (exp_depth == max_exp_depth)
+        return string{"expression nested too deeply"};
+
+    ++exp_depth;
+    auto err = nested_exp(exp, dst, multi);
+    --exp_depth;
+    return err;
+}
+
+auto Compiler::nested_exp(const LuaExp& exp, unsigned dst, bool multi) -> compile_error_t {
+    using Kind = _LuaAST::Kind;
+    switch (exp->kind) {
+    case Kind::Value:
+        return value(static_cast<const _LuaValue&>(*exp), dst);
+    case Kind::NameVar: {
+        const auto& var = *static_cast<const _LuaNameVar&>(*exp).name;
+        switch (var.ref.kind) {
+        case VarRef::Kind::Local:
+            emit(OpCode::GETLOCAL, dst, var.ref.slot, var.ref.depth);
+            break;
+        case VarRef::Kind::Global:
+            emit(OpCode::GETGLOBAL, dst, name(var.token.match()), 0, field(var.global));
+            break;
+        default:
+            emit(OpCode::GETVAR, dst, name(var.token.match()));
+        }
+        return nullopt;
+    }
+    case Kind::Op:
+        return binop(static_cast<const _LuaOp&>(*exp), dst);
+    case Kind::Unop:
+        return unop(static_cast<const _LuaUnop&>(*exp), dst);
+    case Kind::Functioncall:
+        return call(static_cast<const _LuaFunctioncall&>(*exp), dst, multi);
+    case Kind::IndexVar: {
+        const auto& index_var = static_cast<const _LuaIndexVar&>(*exp);
+        if (auto err = this->exp(index_var.table, dst); err)
+            return err;
+        if (index_var.field.key) {
+            emit(OpCode::GETFIELD, dst, dst, 0, field(index_var.field));
+            return nullopt;
+        }
+        unsigned reg = alloc();
+        if (auto err = this->exp(index_var.index, reg); err)
+            return err;
+        emit(OpCode::GETINDEX, dst, dst, reg);
+        free_to(reg);
+        return nullopt;
+    }
+    case Kind::MemberVar: {
+        const auto& member_var = static_cast<const _LuaMemberVar&>(*exp);
+        if (auto err = this->exp(member_var.table, dst); err)
+            return err;
+        emit(OpCode::GETFIELD, dst, dst, 1, field(member_var.field));
+        return nullopt;
+    }
+    case Kind::Function:
+        proto.functions.push_back(static_cast<const _LuaFunction*>(exp.get()));
+        emit(OpCode::CLOSURE, dst, 0, 0, static_cast<uint32_t>(proto.functions.size() - 1));
+        return nullopt;
+    case Kind::Tableconstructor:
+        return tableconstructor(static_cast<const _LuaTableconstructor&>(*exp), dst);
+    case Kind::Name:
+        // names that are not variables (e.g. the keys in table constructors) evaluate to strings
+        emit(OpCode::LOADK, dst, name(static_cast<const _LuaName&>(*exp).token.match()));
+        return nullopt;
+    default:
+        return string{"expression unimplemented"};
+    }
+}
+
+auto Compiler::value(const _LuaValue& value, unsigned dst) -> compile_error_t {
+    if (!value.constant)
+        return string{"value unimplemented"};
+
+    emit(OpCode::LOADK, dst, constant(*value.constant));
+    return nullopt;
+}
+
+auto Compiler::call(const _LuaFunctioncall& call, unsigned dst, bool multi, bool tail)
+    -> compile_error_t {
+    const auto& args = call.args->exps;
+
+    unsigned base = alloc(1 + static_cast<unsigned>(args.size()));
+    if (auto err = exp(call.function, base); err)
+        return err;
+    if (auto err = explist(args, base + 1, true); err)
+        return err;
+
+    proto.calls.push_back(&call);
+    emit(tail ? OpCode::TAILCALL : OpCode::CALL, base, static_cast<uint32_t>(args.size()), !multi,
+         static_cast<uint32_t>(proto.calls.size() - 1));
+
+    if (!tail && dst != base)
+        emit(OpCode::MOVE, dst, base);
+    free_to(base);
+
+    return nullopt;
+}
+
+auto Compiler::binop(const _LuaOp& op, unsigned dst) -> compile_error_t {
+    // operator chains like 1 + 2 + 3 lean to the left, the operators on the left spine are
+    // compiled in a loop (innermost first) so long chains don't recurse per operator
+    vector<const _LuaOp*> chain{&op};
+    while (chain.back()->lhs->kind == _LuaAST::Kind::Op)
+        chain.push_back(static_cast<const _LuaOp*>(chain.back()->lhs.get()));
+
+    if (auto err = exp(chain.back()->lhs, dst); err)
+        return err;
+
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        const _LuaOp& op = **it;
+
+        if (op.op.type == LuaToken::Type::AND || op.op.type == LuaToken::Type::OR) {
+            // short circuit: the right operand is only evaluated if the left one does not
+            // already determine the result
+            size_t test = emit(OpCode::TEST, dst, 0, op.op.type == LuaToken::Type::OR);
+            if (auto err = exp(op.rhs, dst); err)
+                return err;
+            patch(test, here());
+            continue;
+        }
+
+        auto opcode = binops.find(op.op.type);
+        if (opcode == binops.end())
+            return string{op.op.match()} + " is not a binary operator";
+
+        unsigned reg = alloc();
+        if (auto err = exp(op.rhs, reg); err)
+            return err;
+        emit(opcode->second, dst, dst, reg, token(op.op));
+        free_to(reg);
+    }
+
+    return nullopt;
+}
+
+auto Compiler::unop(const _LuaUnop& op, unsigned dst) -> compile_error_t {
+    auto opcode = unops.find(op.op.type);
+    if (opcode == unops.end())
+        return string{op.op.match()} + " is not a unary operator";
+
+    if (auto err = exp(op.exp, dst); err)
+        return err;
+    emit(opcode->second, dst, dst, 0, token(op.op));
+
+    return nullopt;
+}
+
+auto Compiler::tableconstructor(const _LuaTableconstructor& tableconst, unsigned dst)
+    -> compile_error_t {
+    auto source = sourceval::create(tableconst.tokens.to_vector());
+    emit(OpCode::NEWTABLE, dst, constant(val{nil(), source}));
+
+    double default_idx = 1.0;
+    for (const LuaField& field : tableconst.fields) {
+        unsigned reg = alloc(2);
+
+        if (auto err = exp(field->rhs, reg + 1); err)
+            return err;
+
+        if (!field->lhs) {
+            emit(OpCode::LOADK, reg, constant(val{default_idx++}));
+        } else if (auto err = exp(field->lhs, reg); err) {
+            return err;
+        }
+
+        emit(OpCode::SETINDEX, dst, reg, reg + 1);
+        free_to(reg);
+    }
+
+    return nullopt;
+}
+
+const char* opcode_name(OpCode op) {
+    switch (op) {
+    case OpCode::LOADK:
+        return "LOADK";
+    case OpCode::MOVE:
+        return "MOVE";
+    case OpCode::GETLOCAL:
+        return "GETLOCAL";
+    case OpCode::SETLOCAL:
+        return "SETLOCAL";
+    case OpCode::GETGLOBAL:
+        return "GETGLOBAL";
+    case OpCode::SETGLOBAL:
+        return "SETGLOBAL";
+    case OpCode::GETVAR:
+        return "GETVAR";
+    case OpCode::SETVAR:
+        return "SETVAR";
+    case OpCode::GETINDEX:
+        return "GETINDEX";
+    case OpCode::SETINDEX:
+        return "SETINDEX";
+    case OpCode::GETFIELD:
+        return "GETFIELD";
+    case OpCode::SETFIELD:
+        return "SETFIELD";
+    case OpCode::NEWTABLE:
+        return "NEWTABLE";
+    case OpCode::ADD:
+        return "ADD";
+    case OpCode::SUB:
+        return "SUB";
+    case OpCode::MUL:
+        return "MUL";
+    case OpCode::DIV:
+        return "DIV";
+    case OpCode::POW:
+        return "POW";
+    case OpCode::MOD:
+        return "MOD";
+    case OpCode::CONCAT:
+        return "CONCAT";
+    case OpCode::EVAL:
+        return "EVAL";
+    case OpCode::LT:
+        return "LT";
+    case OpCode::LEQ:
+        return "LEQ";
+    case OpCode::GT:
+        return "GT";
+    case OpCode::GEQ:
+        return "GEQ";
+    case OpCode::EQ:
+        return "EQ";
+    case OpCode::NEQ:
+        return "NEQ";
+    case OpCode::NEG:
+        return "NEG";
+    case OpCode::LEN:
+        return "LEN";
+    case OpCode::NOT:
+        return "NOT";
+    case OpCode::STRIP:
+        return "STRIP";
+    case OpCode::POSTFIX_EVAL:
+        return "POSTFIX_EVAL";
+    case OpCode::JMP:
+        return "JMP";
+    case OpCode::TEST:
+        return "TEST";
+    case OpCode::CALL:
+        return "CALL";
+    case OpCode::TAILCALL:
+        return "TAILCALL";
+    case OpCode::CLOSURE:
+        return "CLOSURE";
+    case OpCode::PUSHENV:
+        return "PUSHENV";
+    case OpCode::POPENV:
+        return "POPENV";
+    case OpCode::FORPREP:
+        return "FORPREP";
+    case OpCode::FORLOOP:
+        return "FORLOOP";
+    case OpCode::UNPACK:
+        return "UNPACK";
+    case OpCode::RETURN:
+        return "RETURN";
+    default:
+        return "invalid opcode";
+    }
+}
+
+} // namespace
+
+string Proto::to_string() const {
+    stringstream ss;
+    for (unsigned pc = 0; pc < code.size(); ++pc) {
+        const auto& i = code[pc];
+        ss << pc << "\t" << opcode_name(i.op) << "\t" << i.a << " " << i.b << " " << i.c << " "
+           << i.aux;
+        if (i.op == OpCode::LOADK || i.op == OpCode::GETGLOBAL || i.op == OpCode::SETGLOBAL ||
+            i.op == OpCode::GETVAR || i.op == OpCode::SETVAR)
+            ss << "\t; " << constants[i.b].literal();
+        else if (i.op == OpCode::SETLOCAL)
+            ss << "\t; " << constants[i.aux].literal();
+        else if (i.op == OpCode::GETFIELD || i.op == OpCode::SETFIELD)
+            ss << "\t; " << fields[i.aux]->key->literal();
+        ss << "\n";
+    }
+    return ss.str();
+}
+
+auto compile(const _LuaChunk& chunk, const _LuaExplist* params)
+    -> variant<shared_ptr<const Proto>, string> {
+    if (chunk.bytecode)
+        return chunk.bytecode;
+
+    Compiler compiler;
+    if (auto err = compiler.function(chunk, params); err)
+        return "compile -> " + *err;
+
+    chunk.bytecode = make_shared<const Proto>(move(compiler.proto));
+    return chunk.bytecode;
+}
+
+} // namespace rt
+} // namespace lua
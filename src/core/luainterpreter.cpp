@@ -1,19 +1,251 @@
 #include "MiniLua/luainterpreter.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__GLIBC__)
+#include <pthread.h>
+#endif
+
 namespace lua {
 namespace rt {
 
-eval_result_t ASTEvaluator::visit(const _LuaName& name, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
-    //    cout << "visit name" << endl;
-    if (assign) {
-        env->assign(val{name.token.match}, get<val>(*assign), get<bool>(*assign));
+// the lowest address of the stack of the current thread (it grows down), nullptr if unknown
+static const char* stack_end() {
+#if defined(__GLIBC__)
+    // for the main thread this reads /proc/self/maps, so it is only done once per thread
+    thread_local const char* end = [] {
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0)
+            return static_cast<const char*>(nullptr);
+
+        void* addr = nullptr;
+        size_t size = 0;
+        if (pthread_attr_getstack(&attr, &addr, &size) != 0)
+            addr = nullptr;
+        pthread_attr_destroy(&attr);
+        return static_cast<const char*>(addr);
+    }();
+    return end;
+#else
+    return nullptr;
+#endif
+}
+
+template <typename Policy>
+size_t BasicASTEvaluator<Policy>::usable_stack(const char* here) const {
+    const char* end = stack_end();
+    if (!end || here <= end)
+        return stack_limit;
+
+    auto available = static_cast<size_t>(here - end);
+    return min(stack_limit, available > stack_reserve ? available - stack_reserve : 0);
+}
+
+template <typename Policy> size_t BasicASTEvaluator<Policy>::stack_used() const {
+    if (!stack_base)
+        return 0;
+
+    // the stack grows down on the supported platforms, but the distance works either way
+    char here;
+    auto base = reinterpret_cast<uintptr_t>(stack_base);
+    auto current = reinterpret_cast<uintptr_t>(&here);
+    return base > current ? base - current : current - base;
+}
+
+template <typename Policy>
+optional<EvalError> BasicASTEvaluator<Policy>::checkpoint() const {
+    if (!budget.refill())
+        return budget.error();
+
+    // the evaluator recurses at most chunk_size nodes deeper before the next check
+    if (stack_used() > stack_max)
+        return EvalError{"stack overflow"};
+    return nullopt;
+}
+
+// takes a step of the budget, the other checks only run when a chunk of it is used up
+#define STEP()                                                                                     \
+    if (!budget.step()) {                                                                          \
+        if (auto error = checkpoint())                                                             \
+            return *error;                                                                         \
+    }
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::eval(const _LuaExp& exp,
+                                              const shared_ptr<Environment>& env) const {
+    STEP();
+
+    using Kind = _LuaAST::Kind;
+    switch (exp.kind) {
+    case Kind::Name:
+        return visit(static_cast<const _LuaName&>(exp), env);
+    case Kind::Op:
+        return visit(static_cast<const _LuaOp&>(exp), env);
+    case Kind::Unop:
+        return visit(static_cast<const _LuaUnop&>(exp), env);
+    case Kind::Value:
+        return visit(static_cast<const _LuaValue&>(exp), env);
+    case Kind::NameVar:
+        return visit(static_cast<const _LuaNameVar&>(exp), env);
+    case Kind::IndexVar:
+        return visit(static_cast<const _LuaIndexVar&>(exp), env);
+    case Kind::MemberVar:
+        return visit(static_cast<const _LuaMemberVar&>(exp), env);
+    case Kind::Functioncall:
+        return visit(static_cast<const _LuaFunctioncall&>(exp), env);
+    case Kind::Tableconstructor:
+        return visit(static_cast<const _LuaTableconstructor&>(exp), env);
+    case Kind::Function:
+        return visit(static_cast<const _LuaFunction&>(exp), env);
+    default:
+        return EvalError{"unimplemented10"};
+    }
+}
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::eval(const _LuaStmt& stmt,
+                                              const shared_ptr<Environment>& env) const {
+    STEP();
+
+    using Kind = _LuaAST::Kind;
+    switch (stmt.kind) {
+    case Kind::Assignment:
+        return visit(static_cast<const _LuaAssignment&>(stmt), env);
+    case Kind::Functioncall:
+        return visit(static_cast<const _LuaFunctioncall&>(stmt), env);
+    case Kind::ReturnStmt:
+        return visit(static_cast<const _LuaReturnStmt&>(stmt), env);
+    case Kind::BreakStmt:
+        return visit(static_cast<const _LuaBreakStmt&>(stmt), env);
+    case Kind::ForStmt:
+        return visit(static_cast<const _LuaForStmt&>(stmt), env);
+    case Kind::LoopStmt:
+        return visit(static_cast<const _LuaLoopStmt&>(stmt), env);
+    case Kind::IfStmt:
+        return visit(static_cast<const _LuaIfStmt&>(stmt), env);
+    case Kind::Comment:
+        return visit(static_cast<const _LuaComment&>(stmt), env);
+    default:
+        return EvalError{"unimplemented10"};
+    }
+}
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::eval(const _LuaFunctioncall& call,
+                                              const shared_ptr<Environment>& env) const {
+    STEP();
+    return visit(call, env);
+}
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::eval(const _LuaExplist& explist,
+                                              const shared_ptr<Environment>& env) const {
+    STEP();
+    return visit(explist, env);
+}
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::eval(const _LuaChunk& chunk,
+                                              const shared_ptr<Environment>& env) const {
+    STEP();
+    return visit(chunk, env);
+}
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::store(const _LuaExp& target,
+                                               const shared_ptr<Environment>& env,
+                                               const val& value, bool local) const {
+    STEP();
+
+    using Kind = _LuaAST::Kind;
+    const _LuaName* name = nullptr;
+    switch (target.kind) {
+    case Kind::Name:
+        name = &static_cast<const _LuaName&>(target);
+        break;
+    case Kind::NameVar:
+        name = static_cast<const _LuaNameVar&>(target).name.get();
+        break;
+    case Kind::IndexVar: {
+        const auto& var = static_cast<const _LuaIndexVar&>(target);
+
+        if (var.field.key) {
+            EVAL(table, var.table, env);
+            table = fst(table);
+
+            if (!holds_alternative<table_p>(table))
+                return EvalError{"cannot access index on {}", table};
+            var.field.cache.set(*get<table_p>(table), *var.field.key, value);
+            return eval_success(nil(), table_sc);
+        }
+
+        EVAL(index, var.index, env);
+        EVAL(table, var.table, env);
+        table = fst(table);
+
+        if (!holds_alternative<table_p>(table))
+            return EvalError{"cannot access index on {}", table};
+        get<table_p>(table)->set(index, value);
+        index_sc &= table_sc;
+        return eval_success(nil(), move(index_sc));
+    }
+    case Kind::MemberVar: {
+        const auto& var = static_cast<const _LuaMemberVar&>(target);
+
+        EVAL(table, var.table, env);
+        table = fst(table);
+
+        if (!holds_alternative<table_p>(table))
+            return EvalError{"cannot access member on {}", table};
+        var.field.cache.set(*get<table_p>(table), *var.field.key, value);
+        return eval_success(nil(), table_sc);
+    }
+    case Kind::Value:
+        // the ... of a parameter list, varargs are not supported
+        return eval_success(nil());
+    default:
+        return EvalError{"cannot assign to an expression"};
+    }
+
+    switch (name->ref.kind) {
+    case VarRef::Kind::Local:
+        env->assign_local(name->ref.depth, name->ref.slot, name->token.match(), value);
+        break;
+    case VarRef::Kind::Global:
+        env->assign_global(*name->global.key, value, name->global.cache);
+        break;
+    default:
+        env->assign(val{string{name->token.match()}}, value, local);
+    }
+    return eval_success(nil());
+}
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::store(const _LuaExplist& targets,
+                                               const shared_ptr<Environment>& env,
+                                               const vallist& values, bool local) const {
+    source_change_t sc;
+
+    for (size_t i = 0; i < targets.exps.size(); ++i) {
+        STORE(target, targets.exps[i], env, i < values.size() ? values[i] : val{nil()}, local);
+        sc &= target_sc;
     }
-    return eval_success(name.token.match);
+
+    return eval_success(nil(), sc);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaOp& op, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaName& name,
+                                               const shared_ptr<Environment>& env) const {
+    //    cout << "visit name" << endl;
+    return eval_success(string{name.token.match()});
+}
+
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaOp& op,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit op" << endl;
 
     EVAL(lhs, op.lhs, env);
@@ -22,47 +254,49 @@ eval_result_t ASTEvaluator::visit(const _LuaOp& op, const shared_ptr<Environment
 
     lhs = fst(lhs);
     rhs = fst(rhs);
+    lhs_sc &= rhs_sc;
 
     switch (op.op.type) {
     case LuaToken::Type::ADD:
-        return op_add(lhs, rhs, op.op) << (lhs_sc & rhs_sc);
+        return op_add<Policy>(lhs, rhs, op.op) << lhs_sc;
     case LuaToken::Type::SUB:
-        return op_sub(lhs, rhs, op.op) << (lhs_sc & rhs_sc);
+        return op_sub<Policy>(lhs, rhs, op.op) << lhs_sc;
     case LuaToken::Type::MUL:
-        return op_mul(lhs, rhs, op.op) << (lhs_sc & rhs_sc);
+        return op_mul<Policy>(lhs, rhs, op.op) << lhs_sc;
     case LuaToken::Type::DIV:
-        return op_div(lhs, rhs, op.op) << (lhs_sc & rhs_sc);
+        return op_div<Policy>(lhs, rhs, op.op) << lhs_sc;
     case LuaToken::Type::POW:
-        return op_pow(lhs, rhs, op.op) << (lhs_sc & rhs_sc);
+        return op_pow<Policy>(lhs, rhs, op.op) << lhs_sc;
     case LuaToken::Type::MOD:
-        return op_mod(lhs, rhs, op.op) << (lhs_sc & rhs_sc);
+        return op_mod<Policy>(lhs, rhs, op.op) << lhs_sc;
     case LuaToken::Type::CONCAT:
-        return op_concat(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_concat(lhs, rhs) << lhs_sc;
     case LuaToken::Type::EVAL:
-        return op_eval(lhs, rhs, op.op) << (lhs_sc & rhs_sc);
+        return op_eval<Policy>(lhs, rhs, op.op) << lhs_sc;
     case LuaToken::Type::LT:
-        return op_lt(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_lt(lhs, rhs) << lhs_sc;
     case LuaToken::Type::LEQ:
-        return op_leq(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_leq(lhs, rhs) << lhs_sc;
     case LuaToken::Type::GT:
-        return op_gt(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_gt(lhs, rhs) << lhs_sc;
     case LuaToken::Type::GEQ:
-        return op_geq(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_geq(lhs, rhs) << lhs_sc;
     case LuaToken::Type::EQ:
-        return op_eq(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_eq(lhs, rhs) << lhs_sc;
     case LuaToken::Type::NEQ:
-        return op_neq(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_neq(lhs, rhs) << lhs_sc;
     case LuaToken::Type::AND:
-        return op_and(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_and(lhs, rhs) << lhs_sc;
     case LuaToken::Type::OR:
-        return op_or(lhs, rhs) << (lhs_sc & rhs_sc);
+        return op_or(lhs, rhs) << lhs_sc;
     default:
-        return string{op.op.match + " is not a binary operator"};
+        return string{op.op.match()} + " is not a binary operator";
     }
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaUnop& op, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaUnop& op,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit unop" << endl;
 
     EVAL(rhs, op.exp, env);
@@ -71,7 +305,7 @@ eval_result_t ASTEvaluator::visit(const _LuaUnop& op, const shared_ptr<Environme
 
     switch (op.op.type) {
     case LuaToken::Type::SUB:
-        return op_neg(rhs, op.op) << rhs_sc;
+        return op_neg<Policy>(rhs, op.op) << rhs_sc;
     case LuaToken::Type::LEN:
         return op_len(rhs) << rhs_sc;
     case LuaToken::Type::NOT:
@@ -79,49 +313,39 @@ eval_result_t ASTEvaluator::visit(const _LuaUnop& op, const shared_ptr<Environme
     case LuaToken::Type::STRIP:
         return op_strip(rhs) << rhs_sc;
     case LuaToken::Type::EVAL:
-        return op_postfix_eval(rhs, op.op) << rhs_sc;
+        return op_postfix_eval<Policy>(rhs, op.op) << rhs_sc;
     default:
-        return string{op.op.match + " is not a unary operator"};
+        return string{op.op.match()} + " is not a unary operator";
     }
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaExplist& explist, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaExplist& explist,
+                                               const shared_ptr<Environment>& env) const {
     // cout << "visit explist" << endl;
 
     auto t = make_shared<vallist>();
     source_change_t sc;
 
-    for (unsigned i = 0; i < explist.exps.size(); ++i) {
-        if (!assign) {
-            EVAL(exp, explist.exps[i], env);
-            t->push_back(exp);
-            sc = sc & exp_sc;
-        } else {
-            if (!holds_alternative<vallist_p>(get<val>(*assign)))
-                return string{"only a vallist can be assigned to a vallist"};
-            bool local = get<bool>(*assign);
-            EVALL(exp, explist.exps[i], env,
-                  make_tuple(get<vallist_p>(get<val>(*assign))->size() > i
-                                 ? get<vallist_p>(get<val>(*assign))->at(i)
-                                 : nil(),
-                             local));
-            t->push_back(exp);
-            sc = sc & exp_sc;
-        }
+    for (const auto& exp : explist.exps) {
+        EVAL(value, exp, env);
+        t->push_back(value);
+        sc &= value_sc;
     }
 
     return eval_success(t, sc);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaFunctioncall& exp, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaFunctioncall& exp,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit functioncall" << endl;
 
     EVAL(func, exp.function, env);
 
     EVAL(_args, exp.args, env);
     vallist args = flatten(*get<vallist_p>(_args));
+    func_sc &= _args_sc;
 
     // call builtin function
     if (holds_alternative<cfunction_p>(func)) {
@@ -129,9 +353,10 @@ eval_result_t ASTEvaluator::visit(const _LuaFunctioncall& exp, const shared_ptr<
 
         if (holds_alternative<std::shared_ptr<SourceChange>>(result)) {
             auto change = get<std::shared_ptr<SourceChange>>(result);
-            return eval_success(make_shared<vallist>(), func_sc & _args_sc & change);
+            func_sc &= change;
+            return eval_success(make_shared<vallist>(), move(func_sc));
         } else if (holds_alternative<vallist>(result)) {
-            return eval_success(make_shared<vallist>(get<vallist>(result)), func_sc & _args_sc);
+            return eval_success(make_shared<vallist>(get<vallist>(result)), move(func_sc));
         } else {
             return get<string>(result);
         }
@@ -139,129 +364,145 @@ eval_result_t ASTEvaluator::visit(const _LuaFunctioncall& exp, const shared_ptr<
 
     // call lua function
     if (holds_alternative<lfunction_p>(func)) {
-        EVALL(params, get<lfunction_p>(func)->params, get<lfunction_p>(func)->env,
-              make_tuple(make_shared<vallist>(args), true));
+        const auto& lf = get<lfunction_p>(func);
 
-        EVAL(result, get<lfunction_p>(func)->f, get<lfunction_p>(func)->env);
+        // every call gets a new scope for the parameters and locals
+        auto callenv = frames.frame(lf->env, lf->f->num_slots);
 
-        if (holds_alternative<vallist_p>(result))
-            return eval_success(result, func_sc & _args_sc & params_sc & result_sc);
+        STORE(params, lf->params, callenv, args, true);
+
+        EVAL(result, lf->f, callenv);
+        func_sc &= params_sc;
 
-        return eval_success(make_shared<vallist>(), func_sc & _args_sc & params_sc);
+        if (holds_alternative<vallist_p>(result)) {
+            func_sc &= result_sc;
+            return eval_success(result, move(func_sc));
+        }
+
+        return eval_success(make_shared<vallist>(), move(func_sc));
     }
 
     if (holds_alternative<nil>(func)) {
-        return string{"attempted to call a nil value"};
+        return EvalError{"attempted to call a nil value"};
     }
 
-    return string{"functioncall unimplemented"};
+    return EvalError{"functioncall unimplemented"};
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaAssignment& assignment,
-                                  const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaAssignment& assignment,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit assignment" << assignment.local << endl;
 
     EVAL(_exps, assignment.explist, env);
     vallist exps = flatten(*get<vallist_p>(_exps));
-    EVALL(_vars, assignment.varlist, env, make_tuple(make_shared<vallist>(exps), assignment.local));
+    STORE(_vars, assignment.varlist, env, exps, assignment.local);
 
-    return eval_success(nil(), _exps_sc & _vars_sc);
+    _exps_sc &= _vars_sc;
+    return eval_success(nil(), move(_exps_sc));
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaNameVar& var, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaNameVar& var,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit namevar " << var.name->token << endl;
 
-    EVAL(name, var.name, env);
+    const auto& ref = var.name->ref;
 
-    return eval_success(env->getvar(name), name_sc);
+    switch (ref.kind) {
+    case VarRef::Kind::Local:
+        return eval_success(env->local(ref.depth, ref.slot));
+    case VarRef::Kind::Global:
+        return eval_success(env->getglobal(*var.name->global.key, var.name->global.cache));
+    default:
+        return eval_success(env->getvar(string{var.name->token.match()}));
+    }
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaIndexVar& var, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaIndexVar& var,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit indexvar" << endl;
 
-    EVALR(index, var.index, env);
-    EVALR(table, var.table, env);
+    if (var.field.key) {
+        // a["b"] is cached like a.b
+        EVAL(table, var.table, env);
 
-    table = fst(table);
+        table = fst(table);
 
-    if (holds_alternative<table_p>(table)) {
-
-        if (assign) {
-            (*get<table_p>(table))[index] = get<val>(*assign);
+        if (holds_alternative<table_p>(table)) {
+            auto& t = *get<table_p>(table);
+            return eval_success(var.field.cache.get(t, *var.field.key), table_sc);
+        } else {
+            return EvalError{"cannot access index on {}", table};
         }
+    }
+
+    EVAL(index, var.index, env);
+    EVAL(table, var.table, env);
+
+    table = fst(table);
 
-        return eval_success((*get<table_p>(table))[index], index_sc & table_sc);
+    if (holds_alternative<table_p>(table)) {
+        index_sc &= table_sc;
+        return eval_success(get<table_p>(table)->get(index), move(index_sc));
     } else {
-        return string{"cannot access index on " + table.type()};
+        return EvalError{"cannot access index on {}", table};
     }
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaMemberVar& var, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaMemberVar& var,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit membervar" << endl;
-    EVAL(index, var.member, env);
-    EVALR(table, var.table, env);
+    EVAL(table, var.table, env);
 
     table = fst(table);
 
-    if (holds_alternative<table_p>(fst(table))) {
-
-        if (assign) {
-            (*get<table_p>(table))[index] = get<val>(*assign);
-        }
-
-        return eval_success((*get<table_p>(table))[index], index_sc & table_sc);
+    if (holds_alternative<table_p>(table)) {
+        auto& t = *get<table_p>(table);
+        return eval_success(var.field.cache.get(t, *var.field.key), table_sc);
     } else {
-        return string{"cannot access member on " + table.type()};
+        return EvalError{"cannot access member on {}", table};
     }
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaReturnStmt& stmt, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaReturnStmt& stmt,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit returnstmt" << endl;
 
     EVAL(result, stmt.explist, env);
     return eval_success(make_shared<vallist>(flatten(*get<vallist_p>(result))), result_sc);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaBreakStmt& stmt, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaBreakStmt& stmt,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit breakstmt" << endl;
     return eval_success(true);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaValue& value, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaValue& value,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit value " << value.token << endl;
 
-    switch (value.token.type) {
-    case LuaToken::Type::NIL:
-        return eval_success(val{nil(), sourceval::create(value.token)});
-    case LuaToken::Type::FALSE:
-        return eval_success(val{false, sourceval::create(value.token)});
-    case LuaToken::Type::TRUE:
-        return eval_success(val{true, sourceval::create(value.token)});
-    case LuaToken::Type::NUMLIT:
-        try {
-            return eval_success(
-                val{atof(("0" + value.token.match).c_str()), sourceval::create(value.token)});
-        } catch (const invalid_argument& invalid) {
-            return string{"invalid_argument to stod: "} + invalid.what();
-        }
+    if (!value.constant)
+        return EvalError{"value unimplemented"};
 
-    case LuaToken::Type::STRINGLIT:
-        return eval_success(val{string(value.token.match.begin() + 1, value.token.match.end() - 1),
-                                sourceval::create(value.token)});
-    default:
-        return string{"value unimplemented"};
+    if constexpr (!Policy::tracking) {
+        val result = *value.constant;
+        result.source.reset();
+        return eval_success(result);
     }
+
+    return eval_success(*value.constant);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaChunk& chunk, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaChunk& chunk,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit chunk" << endl;
 
     source_change_t sc;
@@ -269,9 +510,9 @@ eval_result_t ASTEvaluator::visit(const _LuaChunk& chunk, const shared_ptr<Envir
     for (const auto& stmt : chunk.statements) {
         EVAL(result, stmt, env);
 
-        sc = sc & result_sc;
+        sc &= result_sc;
 
-        if (!holds_alternative<nil>(result) && !dynamic_pointer_cast<_LuaFunctioncall>(stmt)) {
+        if (!holds_alternative<nil>(result) && stmt->kind != _LuaAST::Kind::Functioncall) {
             return eval_success(result, sc);
         }
     }
@@ -279,36 +520,73 @@ eval_result_t ASTEvaluator::visit(const _LuaChunk& chunk, const shared_ptr<Envir
     return eval_success(nil(), sc);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaForStmt& for_stmt, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaForStmt& for_stmt,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit for" << endl;
 
-    auto newenv = make_shared<lua::rt::Environment>(env);
-
     source_change_t sc;
 
+    // start, limit and step are evaluated once before the loop
     EVAL(start, for_stmt.start, env);
-    EVALL(var, for_stmt.var, env, make_tuple(start, true));
-
-    sc = sc & start_sc & var_sc;
+    sc &= start_sc;
+    EVAL(end, for_stmt.end, env);
+    sc &= end_sc;
+    EVAL(step, for_stmt.step, env);
+    sc &= step_sc;
+
+    start = fst(start);
+    end = fst(end);
+    step = fst(step);
+
+    if (!start.isnumber())
+        return EvalError{"'for' initial value must be a number"};
+    if (!end.isnumber())
+        return EvalError{"'for' limit must be a number"};
+    if (!step.isnumber())
+        return EvalError{"'for' step must be a number"};
+
+    const double first = get<double>(start);
+    const double limit = get<double>(end);
+    const double inc = get<double>(step);
+
+    if (inc == 0)
+        return EvalError{"'for' step is zero"};
+
+    // the loop variable is a local of the body
+    const auto& var = *for_stmt.var;
+    shared_ptr<sourcefor> source;
+
+    // integer loops count their iterations, float loops add the step like reference Lua (so
+    // 0.1 + 0.1 + 0.1 is not 3 * 0.1)
+    const bool integral = first == trunc(first) && inc == trunc(inc);
+    double current = first;
+
+    for (double n = 0;; ++n) {
+        if (n > 0)
+            current = integral ? first + n * inc : current + inc;
 
-    for (;;) {
-        val current = newenv->getvar(var);
-
-        EVAL(end, for_stmt.end, newenv);
-        sc = sc & end_sc;
+        // loop end reached
+        if (inc > 0 ? current > limit : current < limit)
+            return eval_success(nil(), sc);
 
-        auto gt = op_gt(current, fst(end));
-        if (holds_alternative<string>(gt)) {
-            return gt;
+        // the value of the loop variable doesn't depend on the previous iterations, so the source
+        // of the last one is reused if the body didn't keep its value
+        val value{current};
+        if constexpr (Policy::tracking) {
+            if (source && source.use_count() == 1) {
+                source->n = n;
+            } else {
+                source = sourcefor::create(start, step, n);
+            }
+            value.source = source;
         }
 
-        // loop end reached
-        if (get<bool>(get_val(gt)))
-            return eval_success(nil(), sc);
+        auto newenv = frames.frame(env, for_stmt.body->num_slots);
+        newenv.get()->assign_local(0, var.ref.slot, var.token.match(), value);
 
         EVAL(result, for_stmt.body, newenv);
-        sc = sc & result_sc;
+        sc &= result_sc;
 
         // return statement in body
         if (holds_alternative<vallist_p>(result))
@@ -317,33 +595,22 @@ eval_result_t ASTEvaluator::visit(const _LuaForStmt& for_stmt, const shared_ptr<
         // break statement in body
         if (holds_alternative<bool>(result))
             return eval_success(nil(), sc);
-
-        // increment loop variable
-        EVAL(step, for_stmt.step, newenv);
-        sc = sc & step_sc;
-
-        auto sum = op_add(current, step);
-        if (holds_alternative<eval_success_t>(sum)) {
-            EVALL(var, for_stmt.var, env, make_tuple(get_val(sum), true));
-            sc = sc & var_sc;
-        } else {
-            return sum;
-        }
     }
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaLoopStmt& loop_stmt, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaLoopStmt& loop_stmt,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit loop" << endl;
 
     source_change_t sc;
 
     if (loop_stmt.head_controlled) {
         EVAL(condition, loop_stmt.end, env);
-        sc = sc & condition_sc;
+        sc &= condition_sc;
 
         auto neq = op_neq(val{true}, condition);
-        if (holds_alternative<string>(neq)) {
+        if (holds_alternative<EvalError>(neq)) {
             return neq;
         }
         if (get<bool>(get_val(neq))) {
@@ -352,10 +619,10 @@ eval_result_t ASTEvaluator::visit(const _LuaLoopStmt& loop_stmt, const shared_pt
     }
 
     for (;;) {
-        auto newenv = make_shared<lua::rt::Environment>(env);
+        auto newenv = frames.frame(env, loop_stmt.body->num_slots);
 
         EVAL(result, loop_stmt.body, newenv);
-        sc = sc & result_sc;
+        sc &= result_sc;
 
         // return statement in body
         if (holds_alternative<vallist_p>(result))
@@ -365,12 +632,12 @@ eval_result_t ASTEvaluator::visit(const _LuaLoopStmt& loop_stmt, const shared_pt
         if (holds_alternative<bool>(result))
             return eval_success(nil());
 
-        // check loop condition
-        EVAL(condition, loop_stmt.end, newenv);
-        sc = sc & condition_sc;
+        // check loop condition (repeat-until can see the locals of the body)
+        EVAL(condition, loop_stmt.end, loop_stmt.head_controlled ? env : newenv.get());
+        sc &= condition_sc;
 
         auto neq = op_neq(val{true}, condition);
-        if (holds_alternative<string>(neq)) {
+        if (holds_alternative<EvalError>(neq)) {
             return neq;
         }
         if (get<bool>(get_val(neq))) {
@@ -379,9 +646,9 @@ eval_result_t ASTEvaluator::visit(const _LuaLoopStmt& loop_stmt, const shared_pt
     }
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaTableconstructor& tableconst,
-                                  const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaTableconstructor& tableconst,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit tableconstructor" << endl;
     table_p result = make_shared<table>();
     source_change_t sc;
@@ -389,48 +656,50 @@ eval_result_t ASTEvaluator::visit(const _LuaTableconstructor& tableconst,
     double default_idx = 1.0;
     for (const LuaField& field : tableconst.fields) {
         EVAL(rhs, field->rhs, env);
-        sc = sc & rhs_sc;
+        sc &= rhs_sc;
 
         if (!field->lhs) {
-            (*result)[val(default_idx)] = rhs;
+            result->set(val(default_idx), rhs);
             default_idx++;
         } else {
             EVAL(lhs, field->lhs, env);
-            sc = sc & lhs_sc;
+            sc &= lhs_sc;
 
-            (*result)[lhs] = rhs;
+            result->set(lhs, rhs);
         }
     }
 
     val _result = result;
-    _result.source = sourceval::create(tableconst.tokens);
+    if constexpr (Policy::tracking)
+        _result.source = sourceval::create(tableconst.tokens.to_vector());
 
     return eval_success(_result, sc);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaFunction& exp, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaFunction& exp,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit function" << endl;
 
-    return eval_success(
-        make_shared<lfunction>(exp.body, exp.params, make_shared<Environment>(env)));
+    return eval_success(make_shared<lfunction>(exp.body, exp.params, env));
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaIfStmt& stmt, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaIfStmt& stmt,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit if" << endl;
 
     source_change_t sc;
 
     for (const auto& branch : stmt.branches) {
         EVAL(condition, branch.first, env);
-        sc = sc & condition_sc;
+        sc &= condition_sc;
 
         if (condition.to_bool()) {
-            auto newenv = make_shared<lua::rt::Environment>(env);
+            auto newenv = frames.frame(env, branch.second->num_slots);
 
             EVAL(result, branch.second, newenv);
-            sc = sc & result_sc;
+            sc &= result_sc;
 
             // break or return statement in body
             if (!holds_alternative<nil>(result))
@@ -442,13 +711,18 @@ eval_result_t ASTEvaluator::visit(const _LuaIfStmt& stmt, const shared_ptr<Envir
     return eval_success(nil(), sc);
 }
 
-eval_result_t ASTEvaluator::visit(const _LuaComment& comment, const shared_ptr<Environment>& env,
-                                  const assign_t& assign) const {
+template <typename Policy>
+eval_result_t BasicASTEvaluator<Policy>::visit(const _LuaComment& comment,
+                                               const shared_ptr<Environment>& env) const {
     //    cout << "visit function" << endl;
 
     source_change_t sc;
     return eval_success(nil(), sc);
 }
 
+template struct BasicASTEvaluator<FullTracking>;
+template struct BasicASTEvaluator<LazyTracking>;
+template struct BasicASTEvaluator<NoTracking>;
+
 } // namespace rt
 } // namespace lua
@@ -1,17 +1,28 @@
 #include "MiniLua/luaparser.hpp"
+#include "MiniLua/luaresolver.hpp"
 
-LuaParser::LuaParser() {}
+LuaParser::LuaParser() : token_list{make_shared<token_list_t>()} {}
 
 auto LuaParser::parse(const string program, PerformanceStatistics& ps) -> parse_result_t<LuaChunk> {
     auto tokenize_start = chrono::steady_clock::now();
-    tokens = tokenize(begin(program), end(program));
+    // a new list, the AST of the last program still refers to the old one
+    auto tokens = tokenize(program);
+    if (holds_alternative<string>(tokens)) {
+        token_list = make_shared<token_list_t>();
+        return get<string>(tokens);
+    }
+    token_list = make_shared<token_list_t>(move(get<token_list_t>(tokens)));
+    arena = make_shared<lua::rt::ASTArena>();
     auto tokenize_end = chrono::steady_clock::now();
-    //    for (const auto& token : tokens)
+    //    for (const auto& token : *token_list)
     //        cout << token << endl;
 
-    token_it_t begin_tok = tokens.cbegin();
-    token_it_t end_tok = tokens.cend() - 1; // end_token is not part of the program
+    depth = 0;
+    token_it_t begin_tok = token_list->cbegin();
+    token_it_t end_tok = token_list->cend() - 1; // end_token is not part of the program
     auto parse_result = parse_chunk(begin_tok, end_tok);
+    if (holds_alternative<LuaChunk>(parse_result))
+        lua::rt::resolve(get<LuaChunk>(parse_result));
 
     auto parse_end = chrono::steady_clock::now();
 
@@ -21,33 +32,211 @@ auto LuaParser::parse(const string program, PerformanceStatistics& ps) -> parse_
     return parse_result;
 }
 
-auto LuaParser::tokenize(string::const_iterator first, string::const_iterator last)
-    -> token_list_t {
-    string ws = "";
+namespace {
+
+// counts a level of nesting while it is parsed
+struct Nesting {
+    explicit Nesting(unsigned& depth) : depth{depth} { ++depth; }
+    ~Nesting() { --depth; }
+
+    unsigned& depth;
+};
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+bool is_word(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+const unordered_map<string_view, LuaToken::Type> keywords = {
+    {"and", LuaToken::Type::AND},       {"break", LuaToken::Type::BREAK},
+    {"do", LuaToken::Type::DO},         {"else", LuaToken::Type::ELSE},
+    {"elseif", LuaToken::Type::ELSEIF}, {"end", LuaToken::Type::END},
+    {"false", LuaToken::Type::FALSE},   {"for", LuaToken::Type::FOR},
+    {"function", LuaToken::Type::FUNCTION}, {"if", LuaToken::Type::IF},
+    {"in", LuaToken::Type::IN},         {"local", LuaToken::Type::LOCAL},
+    {"nil", LuaToken::Type::NIL},       {"not", LuaToken::Type::NOT},
+    {"or", LuaToken::Type::OR},         {"repeat", LuaToken::Type::REPEAT},
+    {"return", LuaToken::Type::RETURN}, {"then", LuaToken::Type::THEN},
+    {"true", LuaToken::Type::TRUE},     {"until", LuaToken::Type::UNTIL},
+    {"while", LuaToken::Type::WHILE},
+};
+
+// the length of the number at the start of s: ((\d+\.?\d*)|(\d*\.?\d+))(e-?\d+)?
+size_t scan_number(string_view s) {
+    size_t i = 0;
+    while (i < s.size() && is_digit(s[i]))
+        ++i;
+    size_t integral = i;
+    if (i < s.size() && s[i] == '.')
+        ++i;
+    size_t dot = i;
+    while (i < s.size() && is_digit(s[i]))
+        ++i;
+
+    if (integral == 0 && i == dot)
+        return 0;
+
+    if (i < s.size() && s[i] == 'e') {
+        size_t e = i + 1;
+        if (e < s.size() && s[e] == '-')
+            ++e;
+        if (e < s.size() && is_digit(s[e])) {
+            while (e < s.size() && is_digit(s[e]))
+                ++e;
+            i = e;
+        }
+    }
+
+    return i;
+}
+
+// the length of the comment at the start of s (starting with --)
+pair<size_t, LuaToken::Type> scan_comment(string_view s) {
+    // a line comment is taken if it is longer than the block comment (longest match)
+    size_t line = min(s.find('\n'), s.size());
+    // the whitespace at the end belongs to the next token
+    while (is_space(s[line - 1]))
+        --line;
+
+    if (s.substr(2, 2) == "[[") {
+        size_t close = s.find(']', 4);
+        if (close != string_view::npos && close + 1 < s.size() && s[close + 1] == ']' &&
+            close + 2 >= line)
+            return {close + 2, LuaToken::Type::BLOCKCOMMENT};
+    }
+
+    return {line, LuaToken::Type::COMMENT};
+}
+
+// the length and type of the token at the start of s, the length is 0 if there is no token
+pair<size_t, LuaToken::Type> scan(string_view s) {
+    using T = LuaToken::Type;
+
+    auto next_is = [&s](char c) { return s.size() > 1 && s[1] == c; };
+
+    switch (s[0]) {
+    case '+':
+        return {1, T::ADD};
+    case '-':
+        if (next_is('-'))
+            return scan_comment(s);
+        return {1, T::SUB};
+    case '*':
+        return {1, T::MUL};
+    case '/':
+        return {1, T::DIV};
+    case '%':
+        return {1, T::MOD};
+    case '^':
+        return {1, T::POW};
+    case '#':
+        return {1, T::LEN};
+    case '$':
+        return {1, T::STRIP};
+    case '\\':
+        return {1, T::EVAL};
+    case '=':
+        return next_is('=') ? pair{2, T::EQ} : pair{1, T::ASSIGN};
+    case '~':
+        return next_is('=') ? pair{2, T::NEQ} : pair{0, T::NONE};
+    case '<':
+        return next_is('=') ? pair{2, T::LEQ} : pair{1, T::LT};
+    case '>':
+        return next_is('=') ? pair{2, T::GEQ} : pair{1, T::GT};
+    case '{':
+        return {1, T::LCB};
+    case '}':
+        return {1, T::RCB};
+    case '(':
+        return {1, T::LRB};
+    case ')':
+        return {1, T::RRB};
+    case '[':
+        return {1, T::LSB};
+    case ']':
+        return {1, T::RSB};
+    case ';':
+        return {1, T::SEM};
+    case ':':
+        return {1, T::COLON};
+    case ',':
+        return {1, T::COMMA};
+    case '.':
+        if (s.substr(0, 3) == "...")
+            return {3, T::ELLIPSE};
+        if (next_is('.'))
+            return {2, T::CONCAT};
+        if (size_t length = scan_number(s))
+            return {length, T::NUMLIT};
+        return {1, T::DOT};
+    case '"':
+    case '\'': {
+        size_t close = s.find(s[0], 1);
+        if (close == string_view::npos)
+            return {0, T::NONE};
+        return {close + 1, T::STRINGLIT};
+    }
+    default:
+        break;
+    }
+
+    if (is_digit(s[0]))
+        return {scan_number(s), T::NUMLIT};
+
+    if (is_word(s[0])) {
+        size_t length = 1;
+        while (length < s.size() && is_word(s[length]))
+            ++length;
+
+        auto keyword = keywords.find(s.substr(0, length));
+        return {length, keyword != keywords.end() ? keyword->second : T::NAME};
+    }
+
+    return {0, T::NONE};
+}
+
+} // namespace
+
+// a hand-written scanner, the tokens are the same as in the lexer rules of the old lexertl
+// tokenizer (the longest match wins), but keywords are only matched as whole words
+auto LuaParser::tokenize(const string& program) -> parse_result_t<token_list_t> {
+    // the positions have to fit into the tokens
+    if (program.size() > LuaToken::max_pos)
+        return "tokenizing failed: the program is larger than 4 GiB";
 
     token_list_t result_tokens;
-    bool tokenize_result =
-        bs::lex::tokenize(first, last, lua_lexer, [&, start = first](const auto& token) {
-            if (token.id() == WS) {
-                ws = string(token.value().begin(), token.value().end());
-                return true;
-            }
+    result_tokens.reserve(program.size() / 4 + 1);
+
+    // all tokens refer to the same copy of the program
+    LuaSource source{program};
+    string_view text = source.str();
+    size_t pos = 0;
 
-            string match = string(token.value().begin(), token.value().end());
-            long pos = token.value().begin() - start;
-            long length = static_cast<long>(match.size());
-            result_tokens.push_back(
-                LuaToken{static_cast<LuaToken::Type>(token.id()), match, pos, length, ws});
-            ws = "";
-            return true;
-        });
-
-    if (!tokenize_result) {
-        cerr << "tokenizing failed" << endl;
+    while (pos < text.size()) {
+        if (is_space(text[pos])) {
+            ++pos;
+            continue;
+        }
+
+        auto [length, type] = scan(text.substr(pos));
+        if (length == 0) {
+            cerr << "tokenizing failed" << endl;
+            break;
+        }
+        if (length >= LuaToken::max_length)
+            return "tokenizing failed: the token at " + to_string(pos) + " is too long";
+
+        result_tokens.push_back(source.token(type, pos, length));
+        pos += length;
     }
 
-    LuaToken end_token{LuaToken::Type::NONE, "", -1, 0, ws};
-    result_tokens.push_back(end_token);
+    // the end token holds the whitespace at the end
+    result_tokens.push_back(source.token(LuaToken::Type::NONE, pos, 0));
 
     return result_tokens;
 }
@@ -56,7 +245,11 @@ auto LuaParser::parse_chunk(token_it_t& begin, token_it_t& end) const -> parse_r
     // cout << "chunk" << endl;
     // chunk ::= {stat [`;´]} [laststat [`;´]]
 
-    LuaChunk result = make_shared<_LuaChunk>();
+    if (depth == max_depth)
+        return "block nested too deeply";
+    Nesting nesting{depth};
+
+    LuaChunk result = make<_LuaChunk>();
 
     while (begin != end && begin->type != LuaToken::Type::RETURN &&
            begin->type != LuaToken::Type::BREAK && begin->type != LuaToken::Type::END &&
@@ -119,14 +312,15 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
         token_it_t old_begin = begin;
         if (auto prefix = parse_prefixexp(begin, end); holds_alternative<LuaExp>(prefix)) {
             auto callexp = get<LuaExp>(prefix);
-            if (auto call = dynamic_pointer_cast<_LuaFunctioncall>(callexp); call) {
-                copy(stat_begin, begin, back_inserter(call->tokens));
+            if (callexp->kind == _LuaAST::Kind::Functioncall) {
+                auto call = static_pointer_cast<_LuaFunctioncall>(callexp);
+                call->tokens = span(stat_begin, begin);
                 return static_pointer_cast<_LuaStmt>(call);
             }
         }
         begin = old_begin;
 
-        auto assign = make_shared<_LuaAssignment>();
+        auto assign = make<_LuaAssignment>();
         auto varlist = parse_varlist(begin, end);
         if (holds_alternative<string>(varlist)) {
             return "stat (assignment) -> " + get<string>(varlist);
@@ -143,14 +337,14 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
         }
         assign->explist = get<LuaExplist>(explist);
 
-        copy(stat_begin, begin, back_inserter(assign->tokens));
+        assign->tokens = span(stat_begin, begin);
         return move(assign);
     }
     case LuaToken::Type::DO:
         return "unimplemented1";
     case LuaToken::Type::WHILE: {
         begin++; // while
-        LuaLoopStmt while_stmt = make_shared<_LuaLoopStmt>();
+        LuaLoopStmt while_stmt = make<_LuaLoopStmt>();
         while_stmt->head_controlled = true;
 
         if (auto exp = parse_exp(begin, end); holds_alternative<string>(exp)) {
@@ -173,12 +367,12 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
             return "stat (while): 'end' expected";
         }
 
-        copy(stat_begin, begin, back_inserter(while_stmt->tokens));
+        while_stmt->tokens = span(stat_begin, begin);
         return move(while_stmt);
     }
     case LuaToken::Type::REPEAT: {
         begin++; // repeat
-        LuaLoopStmt repeat_stmt = make_shared<_LuaLoopStmt>();
+        LuaLoopStmt repeat_stmt = make<_LuaLoopStmt>();
         repeat_stmt->head_controlled = false;
 
         if (auto block = parse_block(begin, end); holds_alternative<string>(block)) {
@@ -194,16 +388,16 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
         if (auto exp = parse_exp(begin, end); holds_alternative<string>(exp)) {
             return "stat (repeat) -> " + get<string>(exp);
         } else {
-            repeat_stmt->end = _LuaUnop::Not(get<LuaExp>(exp));
+            repeat_stmt->end = _LuaUnop::Not(arena, get<LuaExp>(exp));
         }
 
-        copy(stat_begin, begin, back_inserter(repeat_stmt->tokens));
+        repeat_stmt->tokens = span(stat_begin, begin);
         return move(repeat_stmt);
     }
     case LuaToken::Type::IF: {
         begin++;
 
-        LuaIfStmt if_stmt = make_shared<_LuaIfStmt>();
+        LuaIfStmt if_stmt = make<_LuaIfStmt>();
         if_stmt->branches.emplace_back();
 
         if (auto exp = parse_exp(begin, end); holds_alternative<string>(exp)) {
@@ -250,7 +444,7 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
             if (auto then = parse_block(begin, end); holds_alternative<string>(then)) {
                 return "stat (else) -> " + get<string>(then);
             } else {
-                if_stmt->branches.emplace_back(_LuaValue::True(), get<LuaChunk>(then));
+                if_stmt->branches.emplace_back(_LuaValue::True(arena), get<LuaChunk>(then));
             }
         }
 
@@ -258,16 +452,16 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
             return "stat (if): 'end' expected";
         }
 
-        copy(stat_begin, begin, back_inserter(if_stmt->tokens));
+        if_stmt->tokens = span(stat_begin, begin);
         return move(if_stmt);
     }
     case LuaToken::Type::FOR: {
         begin++;
 
         if (begin->type == LuaToken::Type::NAME && (begin + 1)->type == LuaToken::Type::ASSIGN) {
-            LuaForStmt for_stmt = make_shared<_LuaForStmt>();
+            LuaForStmt for_stmt = make<_LuaForStmt>();
 
-            for_stmt->var = make_shared<_LuaName>(*begin++); // name
+            for_stmt->var = make<_LuaName>(*begin++); // name
             begin++;                                         // =
 
             auto ast = parse_exp(begin, end);
@@ -298,7 +492,7 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
                     for_stmt->step = get<LuaExp>(ast);
                 }
             } else {
-                for_stmt->step = _LuaValue::Int(1);
+                for_stmt->step = _LuaValue::Int(arena, 1);
             }
 
             if (begin++->type != LuaToken::Type::DO) {
@@ -315,7 +509,7 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
                 return "stat (for): 'end' expected";
             }
 
-            copy(stat_begin, begin, back_inserter(for_stmt->tokens));
+            for_stmt->tokens = span(stat_begin, begin);
             return move(for_stmt);
         } else {
             return "unimplemented2";
@@ -324,37 +518,37 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
     case LuaToken::Type::FUNCTION: {
         begin++;
 
-        LuaAssignment assign = make_shared<_LuaAssignment>();
+        LuaAssignment assign = make<_LuaAssignment>();
 
         if (auto name = parse_funcname(begin, end); holds_alternative<string>(name)) {
             return "stat (function): -> " + get<string>(name);
         } else {
-            assign->varlist = make_shared<_LuaExplist>();
+            assign->varlist = make<_LuaExplist>();
             assign->varlist->exps.push_back(get<LuaVar>(name));
         }
 
         if (auto body = parse_funcbody(begin, end); holds_alternative<string>(body)) {
             return "stat (function): -> " + get<string>(body);
         } else {
-            assign->explist = make_shared<_LuaExplist>();
+            assign->explist = make<_LuaExplist>();
             assign->explist->exps.push_back(get<LuaFunction>(body));
         }
 
-        copy(stat_begin, begin, back_inserter(assign->tokens));
+        assign->tokens = span(stat_begin, begin);
         return move(assign);
     }
     case LuaToken::Type::LOCAL: {
         begin++;
 
-        LuaAssignment assign = make_shared<_LuaAssignment>();
+        LuaAssignment assign = make<_LuaAssignment>();
         assign->local = true;
 
         if (begin->type == LuaToken::Type::FUNCTION) {
             begin++;
 
             if (begin->type == LuaToken::Type::NAME) {
-                auto name = make_shared<_LuaName>(*begin++);
-                assign->varlist = make_shared<_LuaExplist>();
+                auto name = make<_LuaName>(*begin++);
+                assign->varlist = make<_LuaExplist>();
                 assign->varlist->exps.push_back(name);
             } else {
                 return "stat (local function): name expected.";
@@ -363,7 +557,7 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
             if (auto body = parse_funcbody(begin, end); holds_alternative<string>(body)) {
                 return "stat (local function): -> " + get<string>(body);
             } else {
-                assign->explist = make_shared<_LuaExplist>();
+                assign->explist = make<_LuaExplist>();
                 assign->explist->exps.push_back(get<LuaFunction>(body));
             }
 
@@ -382,20 +576,20 @@ auto LuaParser::parse_stat(token_it_t& begin, token_it_t& end) const -> parse_re
                 }
                 assign->explist = get<LuaExplist>(explist);
             } else {
-                assign->explist = make_shared<_LuaExplist>();
+                assign->explist = make<_LuaExplist>();
             }
         }
-        copy(stat_begin, begin, back_inserter(assign->tokens));
+        assign->tokens = span(stat_begin, begin);
         return move(assign);
     }
     case LuaToken::Type::COMMENT:
     case LuaToken::Type::BLOCKCOMMENT: {
         begin++;
-        LuaComment comment = make_shared<_LuaComment>();
+        LuaComment comment = make<_LuaComment>();
         return move(comment);}
     default:
         cout << lua_token_to_string(begin->type)<<endl;
-        return "stat: wrong alternative " + begin->match;
+        return "stat: wrong alternative " + string{begin->match()};
     }
 }
 
@@ -413,18 +607,18 @@ auto LuaParser::parse_laststat(token_it_t& begin, token_it_t& end) const
 
         token_it_t old_begin = begin;
         if (auto ast = parse_explist(begin, end); holds_alternative<LuaExplist>(ast)) {
-            return make_shared<_LuaReturnStmt>(get<LuaExplist>(ast));
+            return make<_LuaReturnStmt>(get<LuaExplist>(ast));
         } else {
             begin = old_begin;
         }
 
-        return make_shared<_LuaReturnStmt>();
+        return make<_LuaReturnStmt>();
     }
     case LuaToken::Type::BREAK:
         begin++;
-        return make_shared<_LuaBreakStmt>();
+        return make<_LuaBreakStmt>();
     default:
-        return "laststat: wrong alternative " + begin->match;
+        return "laststat: wrong alternative " + string{begin->match()};
     }
 }
 
@@ -433,14 +627,14 @@ auto LuaParser::parse_varlist(token_it_t& begin, token_it_t& end) const
     // cout << "varlist" << endl;
     // varlist ::= var {`,´ var}
 
-    LuaExplist varlist = make_shared<_LuaExplist>();
+    LuaExplist varlist = make<_LuaExplist>();
 
     do {
         auto ast = parse_prefixexp(begin, end);
         if (holds_alternative<string>(ast)) {
             return "varlist -> " + get<string>(ast);
         } else {
-            if (dynamic_pointer_cast<_LuaVar>(get<LuaExp>(ast))) {
+            if (_LuaVar::is_var(*get<LuaExp>(ast))) {
                 varlist->exps.push_back(get<LuaExp>(ast));
             } else {
                 return "varlist: var expected, got functioncall";
@@ -463,7 +657,7 @@ auto LuaParser::parse_var(token_it_t& begin, token_it_t& end) const -> parse_res
     // var ::=  Name | prefixexp `[´ exp `]´ | prefixexp `.´ Name
 
     if (begin->type == LuaToken::Type::NAME) {
-        return make_shared<_LuaNameVar>(make_shared<_LuaName>(*begin++));
+        return make<_LuaNameVar>(make<_LuaName>(*begin++));
     }
 
     LuaExp prefixexp;
@@ -474,7 +668,7 @@ auto LuaParser::parse_var(token_it_t& begin, token_it_t& end) const -> parse_res
     }
 
     //    if (begin->type == LuaToken::Type::LSB) {
-    //        LuaIndexVar var = make_shared<_LuaIndexVar>();
+    //        LuaIndexVar var = make<_LuaIndexVar>();
     //        var->table = prefixexp;
 
     //        begin++; // [
@@ -491,20 +685,20 @@ auto LuaParser::parse_var(token_it_t& begin, token_it_t& end) const -> parse_res
 
     //        return var;
     //    } else if (begin->type == LuaToken::Type::DOT) {
-    //        LuaMemberVar var = make_shared<_LuaMemberVar>();
+    //        LuaMemberVar var = make<_LuaMemberVar>();
     //        var->table = prefixexp;
     //        begin++; // .
 
     //        if (begin++->type != LuaToken::Type::NAME) {
     //            return "var: Name expected";
     //        } else {
-    //            var->member = make_shared<_LuaName>(*(begin-1));
+    //            var->member = make<_LuaName>(*(begin-1));
     //        }
 
     //        return var;
     //    }
 
-    return "var: wrong alternative " + begin->match;
+    return "var: wrong alternative " + string{begin->match()};
 }
 
 auto LuaParser::parse_namelist(token_it_t& begin, token_it_t& end) const
@@ -512,11 +706,11 @@ auto LuaParser::parse_namelist(token_it_t& begin, token_it_t& end) const
     // cout << "namelist" << endl;
     // namelist ::= Name {`,´ Name}
 
-    LuaExplist namelist = make_shared<_LuaExplist>();
+    LuaExplist namelist = make<_LuaExplist>();
 
     do {
         if (begin->type == LuaToken::Type::NAME) {
-            namelist->exps.push_back(make_shared<_LuaNameVar>(make_shared<_LuaName>(*begin++)));
+            namelist->exps.push_back(make<_LuaNameVar>(make<_LuaName>(*begin++)));
         } else {
             return "namelist: name expected";
         }
@@ -532,7 +726,7 @@ auto LuaParser::parse_explist(token_it_t& begin, token_it_t& end) const
     // cout << "explist" << endl;
     // explist ::= {exp `,´} exp
 
-    LuaExplist explist = make_shared<_LuaExplist>();
+    LuaExplist explist = make<_LuaExplist>();
 
     do {
         auto ast = parse_exp(begin, end);
@@ -548,7 +742,8 @@ auto LuaParser::parse_explist(token_it_t& begin, token_it_t& end) const
     return explist;
 }
 
-LuaExp resolve_precedence(vector<LuaExp>& exps, vector<LuaToken>& ops) {
+LuaExp resolve_precedence(vector<LuaExp>& exps, vector<LuaToken>& ops,
+                          const shared_ptr<lua::rt::ASTArena>& arena) {
     //                         Operator     precedence   left associative
     const static unordered_map<LuaToken::Type, pair<int, bool>> precedences = {
         {LuaToken::Type::ADD, {5, true}},     {LuaToken::Type::SUB, {5, true}},
@@ -564,7 +759,7 @@ LuaExp resolve_precedence(vector<LuaExp>& exps, vector<LuaToken>& ops) {
         while (i < static_cast<int>(ops.size()) - 1 &&
                precedences.at(ops[i].type).first - precedences.at(ops[i + 1].type).first >=
                    (precedences.at(ops[i].type).second ? 0 : 1)) {
-            LuaOp op = make_shared<_LuaOp>();
+            LuaOp op = lua::rt::make_node<_LuaOp>(arena);
             op->lhs = exps[i];
             op->rhs = exps[i + 1];
             op->op = ops[i];
@@ -577,7 +772,7 @@ LuaExp resolve_precedence(vector<LuaExp>& exps, vector<LuaToken>& ops) {
     }
 
     for (int i = ops.size() - 1; i >= 0; --i) {
-        LuaOp op = make_shared<_LuaOp>();
+        LuaOp op = lua::rt::make_node<_LuaOp>(arena);
         op->lhs = exps[i];
         op->rhs = exps[i + 1];
         op->op = ops[i];
@@ -598,6 +793,10 @@ auto LuaParser::parse_exp(token_it_t& begin, token_it_t& end) const -> parse_res
     if (begin == end)
         return "exp: unexpected end";
 
+    if (depth == max_depth)
+        return "expression nested too deeply";
+    Nesting nesting{depth};
+
     vector<LuaExp> exps;
     vector<LuaToken> ops;
 
@@ -610,7 +809,7 @@ auto LuaParser::parse_exp(token_it_t& begin, token_it_t& end) const -> parse_res
         case LuaToken::Type::TRUE:
         case LuaToken::Type::NUMLIT:
         case LuaToken::Type::STRINGLIT:
-            exps.push_back(_LuaValue::Value(*begin++));
+            exps.push_back(make<_LuaValue>(*begin++));
             break;
         case LuaToken::Type::ELLIPSE:
             begin++;
@@ -654,13 +853,13 @@ auto LuaParser::parse_exp(token_it_t& begin, token_it_t& end) const -> parse_res
                 unop_token = ops.back();
                 ops.pop_back();
             } else {
-                return "wrong alternative " + begin->match;
+                return "wrong alternative " + string{begin->match()};
             }
         }
 
         if (is_unop) {
             is_unop = false;
-            LuaUnop unop = make_shared<_LuaUnop>();
+            LuaUnop unop = make<_LuaUnop>();
             unop->exp = exps.back();
             unop->op = unop_token;
             exps.back() = unop;
@@ -681,7 +880,7 @@ auto LuaParser::parse_exp(token_it_t& begin, token_it_t& end) const -> parse_res
         }
     }
 
-    return resolve_precedence(exps, ops);
+    return resolve_precedence(exps, ops, arena);
 }
 
 auto LuaParser::parse_prefixexp(token_it_t& begin, token_it_t& end) const
@@ -722,7 +921,7 @@ auto LuaParser::parse_prefixexp(token_it_t& begin, token_it_t& end) const
 
         if (begin->type == LuaToken::Type::LSB) {
             // cout << "idx" << endl;
-            LuaIndexVar var = make_shared<_LuaIndexVar>();
+            LuaIndexVar var = make<_LuaIndexVar>();
             var->table = result;
 
             begin++; // [
@@ -739,14 +938,14 @@ auto LuaParser::parse_prefixexp(token_it_t& begin, token_it_t& end) const
 
             result = var;
         } else if (begin->type == LuaToken::Type::DOT) {
-            LuaMemberVar var = make_shared<_LuaMemberVar>();
+            LuaMemberVar var = make<_LuaMemberVar>();
             var->table = result;
             begin++; // .
 
             if (begin++->type != LuaToken::Type::NAME) {
                 return "var: Name expected";
             } else {
-                var->member = make_shared<_LuaName>(*(begin - 1));
+                var->member = make<_LuaName>(*(begin - 1));
             }
 
             result = var;
@@ -768,7 +967,7 @@ auto LuaParser::parse_functioncall(token_it_t& begin, token_it_t& end,
     -> parse_result_t<LuaFunctioncall> {
     // cout << "functioncall" << endl;
     // functioncall ::=  prefixexp args | prefixexp `:´ Name args
-    LuaFunctioncall call = make_shared<_LuaFunctioncall>();
+    LuaFunctioncall call = make<_LuaFunctioncall>();
 
     call->function = prefixexp;
 
@@ -777,7 +976,7 @@ auto LuaParser::parse_functioncall(token_it_t& begin, token_it_t& end,
         begin++; // :
 
         if (begin++->type == LuaToken::Type::NAME) {
-            name = make_shared<_LuaName>(*(begin - 1));
+            name = make<_LuaName>(*(begin - 1));
         } else {
             return "functioncall: Name expected";
         }
@@ -790,7 +989,7 @@ auto LuaParser::parse_functioncall(token_it_t& begin, token_it_t& end,
     }
 
     if (name) {
-        call->args->exps.insert(call->args->exps.begin(), make_shared<_LuaNameVar>(name));
+        call->args->exps.insert(call->args->exps.begin(), make<_LuaNameVar>(name));
     }
 
     return call;
@@ -803,7 +1002,7 @@ auto LuaParser::parse_args(token_it_t& begin, token_it_t& end) const -> parse_re
     if (begin == end)
         return "args: unexpected end";
 
-    LuaExplist args = make_shared<_LuaExplist>();
+    LuaExplist args = make<_LuaExplist>();
 
     switch (begin->type) {
     case LuaToken::Type::LRB:
@@ -833,11 +1032,11 @@ auto LuaParser::parse_args(token_it_t& begin, token_it_t& end) const -> parse_re
         return args;
     }
     case LuaToken::Type::STRINGLIT:
-        args->exps.push_back(make_shared<_LuaValue>(*begin++));
+        args->exps.push_back(make<_LuaValue>(*begin++));
 
         return args;
     default:
-        return "args: wrong alternative " + begin->match;
+        return "args: wrong alternative " + string{begin->match()};
     }
 }
 
@@ -864,7 +1063,7 @@ auto LuaParser::parse_funcbody(token_it_t& begin, token_it_t& end) const
     if (begin == end)
         return "funcbody: unexpected end";
 
-    LuaFunction func = make_shared<_LuaFunction>();
+    LuaFunction func = make<_LuaFunction>();
 
     if (begin++->type != LuaToken::Type::LRB) {
         return "funcbody: ( expected";
@@ -877,7 +1076,7 @@ auto LuaParser::parse_funcbody(token_it_t& begin, token_it_t& end) const
             func->params = get<LuaExplist>(parlist);
         }
     } else {
-        func->params = make_shared<_LuaExplist>();
+        func->params = make<_LuaExplist>();
     }
 
     if (begin++->type != LuaToken::Type::RRB) {
@@ -906,8 +1105,8 @@ auto LuaParser::parse_parlist(token_it_t& begin, token_it_t& end) const
         return "parlist: unexpected end";
 
     if (begin->type == LuaToken::Type::ELLIPSE) {
-        LuaExplist result = make_shared<_LuaExplist>();
-        result->exps.push_back(make_shared<_LuaValue>(*begin++));
+        LuaExplist result = make<_LuaExplist>();
+        result->exps.push_back(make<_LuaValue>(*begin++));
         return result;
     }
 
@@ -921,7 +1120,7 @@ auto LuaParser::parse_parlist(token_it_t& begin, token_it_t& end) const
     if (begin->type == LuaToken::Type::COMMA) {
         begin++; // comma
         if (begin++->type == LuaToken::Type::ELLIPSE) {
-            parlist->exps.push_back(make_shared<_LuaValue>(*begin++));
+            parlist->exps.push_back(make<_LuaValue>(*begin++));
         } else {
             return "parlist: ... expected";
         }
@@ -943,7 +1142,7 @@ auto LuaParser::parse_tableconstructor(token_it_t& begin, token_it_t& end) const
         return "tableconstructor: '{' expected";
     }
 
-    LuaTableconstructor result = make_shared<_LuaTableconstructor>();
+    LuaTableconstructor result = make<_LuaTableconstructor>();
     auto tableconst_begin = begin - 1;
 
     if (begin->type != LuaToken::Type::RCB) {
@@ -972,13 +1171,16 @@ auto LuaParser::parse_tableconstructor(token_it_t& begin, token_it_t& end) const
         return "tableconstructor: '}' expected";
     }
 
-    // add all tokens
-    for (auto it = tableconst_begin; it != begin; ++it)
-        result->tokens.push_back(*it);
+    result->tokens = span(tableconst_begin, begin);
 
     return move(result);
 }
 
+TokenSpan LuaParser::span(token_it_t first, token_it_t last) const {
+    return TokenSpan{token_list, static_cast<size_t>(first - token_list->cbegin()),
+                     static_cast<size_t>(last - token_list->cbegin())};
+}
+
 auto LuaParser::parse_field(token_it_t& begin, token_it_t& end) const -> parse_result_t<LuaField> {
     // cout << "field" << endl;
     // field ::= `[´ exp `]´ `=´ exp | Name `=´ exp | exp
@@ -986,7 +1188,7 @@ auto LuaParser::parse_field(token_it_t& begin, token_it_t& end) const -> parse_r
     if (begin == end)
         return "field: unexpected end";
 
-    LuaField field = make_shared<_LuaField>();
+    LuaField field = make<_LuaField>();
 
     if (begin->type == LuaToken::Type::LSB) {
         begin++; // [
@@ -1007,7 +1209,7 @@ auto LuaParser::parse_field(token_it_t& begin, token_it_t& end) const -> parse_r
 
     } else if (begin->type == LuaToken::Type::NAME) {
         if (begin + 1 != end && (begin + 1)->type == LuaToken::Type::ASSIGN) {
-            field->lhs = make_shared<_LuaName>(*begin);
+            field->lhs = make<_LuaName>(*begin);
             begin++; // name
             begin++; // =
         }
@@ -1027,7 +1229,7 @@ auto LuaParser::parse_funcname(token_it_t& begin, token_it_t& end) const -> pars
     // var ::=  funcname ::= Name {`.´ Name} [`:´ Name]
 
     if (begin->type == LuaToken::Type::NAME) {
-        return make_shared<_LuaNameVar>(make_shared<_LuaName>(*begin++));
+        return make<_LuaNameVar>(make<_LuaName>(*begin++));
     }
 
     return "funcname: name expected";
@@ -1037,7 +1239,7 @@ string get_string(const LuaParser::token_list_t& tokens) {
     stringstream ss;
 
     for (const auto& t : tokens) {
-        ss << t.ws << t.match;
+        ss << t.ws() << t.match();
     }
 
     return ss.str();
@@ -0,0 +1,352 @@
+#include "MiniLua/luaresolver.hpp"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace lua {
+namespace rt {
+
+namespace {
+
+// combines a fingerprint with a value (the finalizer of splitmix64)
+uint64_t mix(uint64_t print, uint64_t value) {
+    uint64_t h = print ^ (value + 0x9e3779b97f4a7c15 + (print << 6) + (print >> 2));
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+}
+
+bool operator==(const VarRef& a, const VarRef& b) {
+    return a.kind == b.kind && a.depth == b.depth && a.slot == b.slot;
+}
+
+class Resolver {
+public:
+    explicit Resolver(SharedStatements* shared = nullptr) : shared{shared} {}
+
+    void chunk(_LuaChunk& chunk);
+
+private:
+    struct Scope {
+        // redeclaring a local replaces the old one for the rest of the scope
+        unordered_map<string, unsigned> names;
+        unsigned num_slots = 0;
+        // the fingerprint of the locals visible in the scope (only with shared statements)
+        uint64_t print = 0;
+    };
+
+    // a statement whose StmtScope is recorded
+    struct Recording {
+        StmtScope* scope;
+        size_t level;                // the index of its scope
+        unordered_set<string> names; // the names in uses and the ones it declares
+    };
+
+    vector<Scope> scopes;
+    SharedStatements* shared;
+    vector<Recording> recording;
+
+    void open_scope() {
+        uint64_t print = scopes.empty() ? 0 : mix(scopes.back().print, scopes.size());
+        scopes.emplace_back();
+        scopes.back().print = print;
+    }
+    void close_scope(_LuaChunk& chunk) {
+        chunk.num_slots = scopes.back().num_slots;
+        // the annotations can change if the chunk is resolved again
+        chunk.bytecode.reset();
+        scopes.pop_back();
+    }
+
+    unsigned declare(const string& name);
+    void declare(_LuaName& name);
+    VarRef find(const string& name) const;
+    void lookup(_LuaName& name);
+    void record(const string& name, const VarRef& ref);
+    bool keeps(const StmtScope& scope);
+
+    void block(_LuaChunk& chunk);
+    void stat(LuaStmt& stmt);
+    void resolve_stat(const LuaStmt& stmt);
+    void exp(const LuaExp& exp);
+    void explist(const LuaExplist& explist);
+};
+
+unsigned Resolver::declare(const string& name) {
+    auto& scope = scopes.back();
+    unsigned slot = scope.names[name] = scope.num_slots++;
+
+    if (shared) {
+        scope.print = mix(mix(scope.print, hash<string>{}(name)), slot);
+        for (auto& r : recording) {
+            if (r.level == scopes.size() - 1) {
+                r.scope->declares.emplace_back(name, slot);
+                r.names.insert(name);
+            }
+        }
+    }
+    return slot;
+}
+
+void Resolver::declare(_LuaName& name) {
+    name.ref.kind = VarRef::Kind::Local;
+    name.ref.depth = 0;
+    name.ref.slot = declare(string{name.token.match()});
+}
+
+VarRef Resolver::find(const string& name) const {
+    VarRef ref;
+    for (unsigned depth = 0; depth < scopes.size(); ++depth) {
+        const auto& scope = scopes[scopes.size() - 1 - depth];
+        if (auto it = scope.names.find(name); it != scope.names.end()) {
+            ref.kind = VarRef::Kind::Local;
+            ref.depth = depth;
+            ref.slot = it->second;
+            return ref;
+        }
+    }
+
+    ref.kind = VarRef::Kind::Global;
+    return ref;
+}
+
+void Resolver::lookup(_LuaName& name) {
+    string key{name.token.match()};
+    name.ref = find(key);
+    if (name.ref.kind == VarRef::Kind::Global)
+        name.global.key = val{key};
+    if (!recording.empty())
+        record(key, name.ref);
+}
+
+// adds a use of a name (ref relative to the current scope) to the recorded statements that
+// don't declare it themselves
+void Resolver::record(const string& name, const VarRef& ref) {
+    size_t current = scopes.size() - 1;
+    for (auto& r : recording) {
+        VarRef outer = ref;
+        if (ref.kind == VarRef::Kind::Local) {
+            size_t level = current - ref.depth;
+            if (level > r.level)
+                continue;
+            outer.depth = static_cast<unsigned>(r.level - level);
+        }
+        // the first use decides, later ones can only see the locals the statement declared
+        if (r.names.insert(name).second)
+            r.scope->uses.emplace_back(name, outer);
+    }
+}
+
+// true if a shared statement is resolved like before here, then its locals are declared
+bool Resolver::keeps(const StmtScope& scope) {
+    if (scope.before != scopes.back().print) {
+        for (const auto& [name, ref] : scope.uses) {
+            if (!(find(name) == ref))
+                return false;
+        }
+        for (size_t i = 0; i < scope.declares.size(); ++i) {
+            if (scope.declares[i].second != scopes.back().num_slots + i)
+                return false;
+        }
+    }
+
+    // the statements around it that are recorded use and declare the same names
+    if (!recording.empty()) {
+        for (const auto& [name, ref] : scope.uses)
+            record(name, ref);
+    }
+    for (const auto& declared : scope.declares)
+        declare(declared.first);
+    return true;
+}
+
+void Resolver::chunk(_LuaChunk& chunk) {
+    open_scope();
+    block(chunk);
+    close_scope(chunk);
+}
+
+void Resolver::block(_LuaChunk& chunk) {
+    for (auto& stmt : chunk.statements)
+        stat(stmt);
+}
+
+void Resolver::stat(LuaStmt& stmt) {
+    if (!shared)
+        return resolve_stat(stmt);
+
+    auto it = shared->scopes.find(stmt.get());
+    if (it != shared->scopes.end() && it->second->resolved) {
+        if (keeps(*it->second))
+            return;
+        stmt = shared->copy(stmt);
+        it = shared->scopes.find(stmt.get());
+    }
+    if (it == shared->scopes.end())
+        return resolve_stat(stmt);
+
+    auto& scope = *it->second;
+    scope = StmtScope{};
+    scope.before = scopes.back().print;
+    recording.push_back(Recording{&scope, scopes.size() - 1, {}});
+    resolve_stat(stmt);
+    recording.pop_back();
+    scope.resolved = true;
+}
+
+void Resolver::resolve_stat(const LuaStmt& stmt) {
+    using Kind = _LuaAST::Kind;
+    switch (stmt->kind) {
+    case Kind::Functioncall:
+        exp(static_pointer_cast<_LuaFunctioncall>(stmt));
+        break;
+    case Kind::Assignment: {
+        const auto& assign = static_cast<const _LuaAssignment&>(*stmt);
+        if (assign.local) {
+            // local function f: f is already visible in its body
+            if (assign.varlist->exps.size() == 1 &&
+                assign.varlist->exps[0]->kind == Kind::Name) {
+                declare(static_cast<_LuaName&>(*assign.varlist->exps[0]));
+                explist(assign.explist);
+                return;
+            }
+
+            // local a, b = ...: the names are only visible after the statement
+            explist(assign.explist);
+            for (const auto& var : assign.varlist->exps) {
+                if (var->kind == Kind::NameVar)
+                    declare(*static_cast<const _LuaNameVar&>(*var).name);
+            }
+        } else {
+            explist(assign.explist);
+            explist(assign.varlist);
+        }
+        break;
+    }
+    case Kind::LoopStmt: {
+        const auto& loop = static_cast<const _LuaLoopStmt&>(*stmt);
+        if (loop.head_controlled)
+            exp(loop.end);
+
+        open_scope();
+        block(*loop.body);
+        // the condition of repeat-until can see the locals of the body
+        if (!loop.head_controlled)
+            exp(loop.end);
+        close_scope(*loop.body);
+        break;
+    }
+    case Kind::ForStmt: {
+        const auto& for_stmt = static_cast<const _LuaForStmt&>(*stmt);
+        exp(for_stmt.start);
+        exp(for_stmt.end);
+        exp(for_stmt.step);
+
+        open_scope();
+        declare(*for_stmt.var);
+        block(*for_stmt.body);
+        close_scope(*for_stmt.body);
+        break;
+    }
+    case Kind::IfStmt:
+        for (const auto& branch : static_cast<const _LuaIfStmt&>(*stmt).branches) {
+            exp(branch.first);
+            chunk(*branch.second);
+        }
+        break;
+    case Kind::ReturnStmt:
+        explist(static_cast<const _LuaReturnStmt&>(*stmt).explist);
+        break;
+    default:
+        break;
+    }
+}
+
+void Resolver::explist(const LuaExplist& explist) {
+    if (!explist)
+        return;
+
+    for (const auto& e : explist->exps)
+        exp(e);
+}
+
+void Resolver::exp(const LuaExp& exp) {
+    if (!exp)
+        return;
+
+    using Kind = _LuaAST::Kind;
+    switch (exp->kind) {
+    case Kind::NameVar:
+        lookup(*static_cast<const _LuaNameVar&>(*exp).name);
+        break;
+    case Kind::Op: {
+        // the left spine of operator chains (1 + 2 + 3) is walked in a loop, innermost first
+        vector<const _LuaOp*> chain{static_cast<const _LuaOp*>(exp.get())};
+        while (chain.back()->lhs && chain.back()->lhs->kind == Kind::Op)
+            chain.push_back(static_cast<const _LuaOp*>(chain.back()->lhs.get()));
+
+        this->exp(chain.back()->lhs);
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+            this->exp((*it)->rhs);
+        break;
+    }
+    case Kind::Unop:
+        this->exp(static_cast<const _LuaUnop&>(*exp).exp);
+        break;
+    case Kind::Functioncall: {
+        const auto& call = static_cast<const _LuaFunctioncall&>(*exp);
+        this->exp(call.function);
+        explist(call.args);
+        break;
+    }
+    case Kind::IndexVar: {
+        auto& index_var = static_cast<_LuaIndexVar&>(*exp);
+        this->exp(index_var.table);
+        this->exp(index_var.index);
+        if (index_var.index && index_var.index->kind == Kind::Value) {
+            const auto& value = static_cast<const _LuaValue&>(*index_var.index);
+            if (value.constant && value.constant->isstring())
+                index_var.field.key = val{get<string>(*value.constant)};
+        }
+        break;
+    }
+    case Kind::MemberVar: {
+        auto& member_var = static_cast<_LuaMemberVar&>(*exp);
+        this->exp(member_var.table);
+        member_var.field.key = val{string{member_var.member->token.match()}};
+        break;
+    }
+    case Kind::Tableconstructor:
+        for (const auto& field : static_cast<const _LuaTableconstructor&>(*exp).fields) {
+            this->exp(field->lhs);
+            this->exp(field->rhs);
+        }
+        break;
+    case Kind::Function: {
+        const auto& function = static_cast<const _LuaFunction&>(*exp);
+        // the parameters are the first locals of the function scope
+        open_scope();
+        if (function.params) {
+            for (const auto& param : function.params->exps) {
+                if (param->kind == Kind::NameVar)
+                    declare(*static_cast<const _LuaNameVar&>(*param).name);
+            }
+        }
+        block(*function.body);
+        close_scope(*function.body);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+} // namespace
+
+void resolve(const LuaChunk& chunk) { Resolver().chunk(*chunk); }
+
+void resolve(const LuaChunk& chunk, SharedStatements& shared) { Resolver{&shared}.chunk(*chunk); }
+
+} // namespace rt
+} // namespace lua
@@ -1,8 +1,92 @@
 #include "MiniLua/luatoken.hpp"
 
+#include <algorithm>
+#include <cctype>
+
+LuaToken::LuaToken(Type type, string_view match, long pos, string_view ws)
+    : text{new Text{1, (pos < 0 ? -1 : pos) - static_cast<long>(ws.size()),
+                    string{ws} + string{match}}},
+      start{static_cast<uint32_t>(ws.size())},
+      // the match is the rest of the text, max_length stands for a longer one
+      length_{static_cast<uint32_t>(min(match.size(), max_length))}, type{type} {}
+
+const LuaToken::Text& LuaToken::root(size_t& offset) const {
+    offset = start;
+    const Text* root = text;
+    for (; root->parent; root = root->parent)
+        offset += root->base;
+    return *root;
+}
+
+long LuaToken::pos() const {
+    if (!text)
+        return -1;
+    size_t offset;
+    const auto& root = this->root(offset);
+    return root.base + static_cast<long>(offset);
+}
+
+long LuaToken::length() const {
+    if (length_ == max_length) {
+        size_t offset;
+        return static_cast<long>(root(offset).text.size() - offset);
+    }
+    return length_;
+}
+
+string_view LuaToken::match() const {
+    if (!text)
+        return {};
+    size_t offset;
+    const auto& root = this->root(offset);
+    return string_view{root.text}.substr(offset, length());
+}
+
+string_view LuaToken::ws() const {
+    if (!text)
+        return {};
+
+    size_t offset;
+    const auto& text = root(offset).text;
+    size_t begin = offset;
+    while (begin > 0 && isspace(static_cast<unsigned char>(text[begin - 1])))
+        --begin;
+    return string_view{text}.substr(begin, offset - begin);
+}
+
 string LuaToken::to_string() const {
-    return "[" + std::to_string(static_cast<int>(type)) + "]" + match +
-           " start:" + std::to_string(pos) + " length:" + std::to_string(length);
+    return "[" + std::to_string(static_cast<int>(type)) + "]" + string{match()} +
+           " start:" + std::to_string(pos()) + " length:" + std::to_string(length());
 }
 
 ostream& operator<<(ostream& os, const LuaToken& token) { return os << token.to_string(); }
+
+LuaSource::LuaSource(const LuaSource& parent, size_t pos)
+    : text{new LuaToken::Text{1, static_cast<long>(pos) - parent.pos(), "", parent.text}} {
+    parent.text->refs++;
+}
+
+const string& LuaSource::str() const {
+    const LuaToken::Text* root = text;
+    while (root->parent)
+        root = root->parent;
+    return root->text;
+}
+
+long LuaSource::pos() const {
+    long pos = 0;
+    for (const LuaToken::Text* t = text; t; t = t->parent)
+        pos += t->base;
+    return pos;
+}
+
+void LuaSource::move_to(size_t pos) { text->base = static_cast<long>(pos); }
+
+void LuaSource::move_to(const LuaSource& parent, size_t pos) {
+    // retained first, the parent can stay the same
+    parent.text->refs++;
+    if (--text->parent->refs == 0)
+        delete text->parent;
+    text->parent = parent.text;
+    text->base = static_cast<long>(pos) - parent.pos();
+}
@@ -0,0 +1,427 @@
+#include "MiniLua/luavm.hpp"
+
+#include <cmath>
+
+namespace lua {
+namespace rt {
+
+template <typename Policy>
+eval_result_t BasicBytecodeVM<Policy>::run_in(const LuaChunk& chunk,
+                                              const shared_ptr<Environment>& frame) const {
+    StepBudget::Run steps{budget};
+    ProvenanceStore::Run store{provenance};
+
+    auto proto = compile(*chunk);
+    if (holds_alternative<string>(proto))
+        return get<string>(proto);
+
+    source_change_t sc;
+    auto result = execute(get<shared_ptr<const Proto>>(proto), frame, sc);
+    if (holds_alternative<EvalError>(result))
+        return result;
+
+    return eval_success(get_val(result), sc);
+}
+
+template <typename Policy>
+eval_result_t BasicBytecodeVM<Policy>::execute(const shared_ptr<const Proto>& entry,
+                                               const shared_ptr<Environment>& env,
+                                               source_change_t& sc) const {
+    // the registers of all frames; a frame uses R[base..base+max_registers)
+    vector<val> registers(entry->max_registers);
+    // the scopes opened by calls and PUSHENV; the innermost one is the current environment
+    vector<shared_ptr<Environment>> envs{env};
+    // the active calls, the last one is executed
+    vector<CallFrame> calls;
+    calls.push_back({entry, nullptr, 0, 0, 1, 0, false}); // env belongs to the caller of run
+
+    // the state of the current frame
+    const Proto* proto;
+    const Instruction* code;
+    const val* K;
+    val* R;
+    size_t pc;
+
+    auto load = [&]() {
+        const CallFrame& frame = calls.back();
+        proto = frame.proto.get();
+        code = proto->code.data();
+        K = proto->constants.data();
+        R = registers.data() + frame.base;
+        pc = frame.pc;
+    };
+
+    // copies count registers starting at first
+    auto range = [](const val* first, unsigned count) {
+        vallist values;
+        values.assign(first, first + count);
+        return values;
+    };
+
+    auto stack_size = [&]() {
+        return registers.size() * sizeof(val) + calls.size() * sizeof(CallFrame) +
+               envs.size() * sizeof(Environment);
+    };
+
+    // leaves the scopes of the current frame
+    auto pop_envs = [&](size_t env_base) {
+        while (envs.size() > env_base) {
+            frames.release(move(envs.back()));
+            envs.pop_back();
+        }
+    };
+
+    // returns from the current frame, true if it was the entry frame (its result is in returned)
+    val returned;
+    auto leave = [&](val result) {
+        CallFrame frame = move(calls.back());
+        calls.pop_back();
+        if (calls.empty()) {
+            returned = move(result);
+            return true;
+        }
+
+        pop_envs(frame.env_base);
+        registers.resize(frame.base);
+
+        if (frame.single) {
+            if (holds_alternative<vallist_p>(result)) {
+                const auto& results = *get<vallist_p>(result);
+                result = results.empty() ? val{} : results[0];
+            } else {
+                result = val{};
+            }
+        } else if (!holds_alternative<vallist_p>(result)) {
+            // no return statement
+            result = make_shared<vallist>();
+        }
+        registers[frame.result] = move(result);
+
+        load();
+        return false;
+    };
+
+    load();
+
+#define BINOP(fn)                                                                                  \
+    {                                                                                              \
+        auto result = fn(R[i.b], R[i.c], *proto->tokens[i.aux]);                                   \
+        if (holds_alternative<EvalError>(result))                                                  \
+            return result;                                                                         \
+        R[i.a] = get_val(result);                                                                  \
+        sc &= get_sc(result);                                                                      \
+        break;                                                                                     \
+    }
+
+#define CMPOP(fn)                                                                                  \
+    {                                                                                              \
+        auto result = fn(R[i.b], R[i.c]);                                                          \
+        if (holds_alternative<EvalError>(result))                                                  \
+            return result;                                                                         \
+        R[i.a] = get_val(result);                                                                  \
+        sc &= get_sc(result);                                                                      \
+        break;                                                                                     \
+    }
+
+#define UNOP(expr)                                                                                 \
+    {                                                                                              \
+        auto result = (expr);                                                                      \
+        if (holds_alternative<EvalError>(result))                                                  \
+            return result;                                                                         \
+        R[i.a] = get_val(result);                                                                  \
+        sc &= get_sc(result);                                                                      \
+        break;                                                                                     \
+    }
+
+    for (;;) {
+        // every instruction is one step of the budget
+        if (!budget.step() && !budget.refill())
+            return budget.error();
+
+        const Instruction& i = code[pc++];
+
+        switch (i.op) {
+        case OpCode::LOADK:
+            R[i.a] = K[i.b];
+            if constexpr (!Policy::tracking)
+                R[i.a].source.reset();
+            break;
+        case OpCode::MOVE:
+            R[i.a] = R[i.b];
+            break;
+        case OpCode::GETLOCAL:
+            R[i.a] = envs.back()->local(i.c, i.b);
+            break;
+        case OpCode::SETLOCAL:
+            envs.back()->assign_local(i.c, i.b, get<string>(K[i.aux]), R[i.a]);
+            break;
+        case OpCode::GETGLOBAL:
+            R[i.a] = envs.back()->getglobal(K[i.b], proto->fields[i.aux]->cache);
+            break;
+        case OpCode::SETGLOBAL:
+            envs.back()->assign_global(K[i.b], R[i.a], proto->fields[i.aux]->cache);
+            break;
+        case OpCode::GETVAR:
+            R[i.a] = envs.back()->getvar(K[i.b]);
+            break;
+        case OpCode::SETVAR:
+            envs.back()->assign(K[i.b], R[i.a], i.c != 0);
+            break;
+        case OpCode::GETINDEX: {
+            if (!R[i.b].istable())
+                return EvalError{"cannot access index on {}", R[i.b]};
+
+            R[i.a] = get<table_p>(R[i.b])->get(R[i.c]);
+            break;
+        }
+        case OpCode::SETINDEX:
+            if (!R[i.a].istable())
+                return EvalError{"cannot access index on {}", R[i.a]};
+
+            get<table_p>(R[i.a])->set(R[i.b], R[i.c]);
+            break;
+        case OpCode::GETFIELD:
+            if (!R[i.b].istable())
+                return i.c ? EvalError{"cannot access member on {}", R[i.b]}
+                           : EvalError{"cannot access index on {}", R[i.b]};
+
+            R[i.a] = proto->fields[i.aux]->cache.get(*get<table_p>(R[i.b]),
+                                                     *proto->fields[i.aux]->key);
+            break;
+        case OpCode::SETFIELD:
+            if (!R[i.a].istable())
+                return i.c ? EvalError{"cannot access member on {}", R[i.a]}
+                           : EvalError{"cannot access index on {}", R[i.a]};
+
+            proto->fields[i.aux]->cache.set(*get<table_p>(R[i.a]), *proto->fields[i.aux]->key,
+                                            R[i.b]);
+            break;
+        case OpCode::NEWTABLE:
+            R[i.a] = val{make_shared<table>(), Policy::tracking ? K[i.b].source : nullptr};
+            break;
+
+        case OpCode::ADD:
+            BINOP(op_add<Policy>)
+        case OpCode::SUB:
+            BINOP(op_sub<Policy>)
+        case OpCode::MUL:
+            BINOP(op_mul<Policy>)
+        case OpCode::DIV:
+            BINOP(op_div<Policy>)
+        case OpCode::POW:
+            BINOP(op_pow<Policy>)
+        case OpCode::MOD:
+            BINOP(op_mod<Policy>)
+        case OpCode::EVAL:
+            BINOP(op_eval<Policy>)
+        case OpCode::CONCAT:
+            CMPOP(op_concat)
+        case OpCode::LT:
+            CMPOP(op_lt)
+        case OpCode::LEQ:
+            CMPOP(op_leq)
+        case OpCode::GT:
+            CMPOP(op_gt)
+        case OpCode::GEQ:
+            CMPOP(op_geq)
+        case OpCode::EQ:
+            CMPOP(op_eq)
+        case OpCode::NEQ:
+            CMPOP(op_neq)
+
+        case OpCode::NEG:
+            UNOP(op_neg<Policy>(R[i.b], *proto->tokens[i.aux]))
+        case OpCode::LEN:
+            UNOP(op_len(R[i.b]))
+        case OpCode::NOT:
+            UNOP(op_not(R[i.b]))
+        case OpCode::STRIP:
+            UNOP(op_strip(R[i.b]))
+        case OpCode::POSTFIX_EVAL:
+            UNOP(op_postfix_eval<Policy>(R[i.b], *proto->tokens[i.aux]))
+
+        case OpCode::JMP:
+            pc = i.b;
+            break;
+        case OpCode::TEST:
+            if (R[i.a].to_bool() == (i.c != 0))
+                pc = i.b;
+            break;
+
+        case OpCode::CALL:
+        case OpCode::TAILCALL: {
+            vallist call_args;
+            call_args.reserve(i.b);
+            for (unsigned arg = 1; arg <= i.b; ++arg)
+                call_args.push_back(R[i.a + arg]);
+            call_args = flatten(call_args);
+
+            vallist results;
+            const val& func = R[i.a];
+
+            if (holds_alternative<cfunction_p>(func)) {
+                auto result = get<cfunction_p>(func)->f(call_args, *proto->calls[i.aux]);
+
+                if (holds_alternative<std::shared_ptr<SourceChange>>(result)) {
+                    sc &= get<std::shared_ptr<SourceChange>>(result);
+                } else if (holds_alternative<vallist>(result)) {
+                    results = move(get<vallist>(result));
+                } else {
+                    return get<string>(result);
+                }
+            } else if (holds_alternative<lfunction_p>(func)) {
+                auto lf = get<lfunction_p>(func);
+
+                auto callee = compile(*lf->f, lf->params.get());
+                if (holds_alternative<string>(callee))
+                    return get<string>(callee);
+
+                CallFrame frame;
+                frame.proto = move(get<shared_ptr<const Proto>>(callee));
+                frame.function = move(lf);
+
+                if (i.op == OpCode::TAILCALL) {
+                    // the callee replaces the current frame and returns to its caller
+                    CallFrame& current = calls.back();
+                    frame.base = current.base;
+                    frame.env_base = current.env_base;
+                    frame.result = current.result;
+                    frame.single = current.single;
+                    pop_envs(current.env_base);
+                    calls.back() = move(frame);
+                } else {
+                    calls.back().pc = pc;
+                    frame.base = calls.back().base + proto->max_registers;
+                    frame.env_base = envs.size();
+                    frame.result = calls.back().base + i.a;
+                    frame.single = i.c != 0;
+                    calls.push_back(move(frame));
+                }
+
+                const CallFrame& callee_frame = calls.back();
+                const auto& callee_proto = *callee_frame.proto;
+                registers.resize(callee_frame.base + callee_proto.max_registers);
+                for (unsigned k = 0; k < callee_proto.num_params; ++k)
+                    registers[callee_frame.base + k] = k < call_args.size() ? call_args[k] : val{};
+                envs.push_back(frames.acquire(callee_frame.function->env,
+                                              callee_frame.function->f->num_slots));
+
+                if (stack_size() > stack_limit)
+                    return EvalError{"stack overflow"};
+
+                load();
+                break;
+            } else if (holds_alternative<nil>(func)) {
+                return EvalError{"attempted to call a nil value"};
+            } else {
+                return EvalError{"functioncall unimplemented"};
+            }
+
+            if (i.op == OpCode::TAILCALL) {
+                if (leave(make_shared<vallist>(move(results))))
+                    return eval_success(returned);
+            } else if (i.c) {
+                R[i.a] = results.empty() ? val{} : results[0];
+            } else {
+                R[i.a] = make_shared<vallist>(move(results));
+            }
+            break;
+        }
+        case OpCode::CLOSURE: {
+            const _LuaFunction& function = *proto->functions[i.aux];
+            R[i.a] = make_shared<lfunction>(function.body, function.params, envs.back());
+            break;
+        }
+
+        case OpCode::PUSHENV:
+            envs.push_back(frames.acquire(envs.back(), i.a));
+            break;
+        case OpCode::POPENV:
+            for (unsigned k = 0; k < i.a; ++k) {
+                frames.release(move(envs.back()));
+                envs.pop_back();
+            }
+            break;
+
+        case OpCode::FORPREP: {
+            if (!R[i.a].isnumber())
+                return EvalError{"'for' initial value must be a number"};
+            if (!R[i.a + 1].isnumber())
+                return EvalError{"'for' limit must be a number"};
+            if (!R[i.a + 2].isnumber())
+                return EvalError{"'for' step must be a number"};
+
+            double start = get<double>(R[i.a]);
+            double limit = get<double>(R[i.a + 1]);
+            double step = get<double>(R[i.a + 2]);
+
+            if (step == 0)
+                return EvalError{"'for' step is zero"};
+            if (step > 0 ? start > limit : start < limit) {
+                pc = i.b;
+                break;
+            }
+
+            R[i.a + 3] = 0.0;
+            R[i.a + 4] = val{start};
+            if constexpr (Policy::tracking)
+                R[i.a + 4].source = sourcefor::create(R[i.a], R[i.a + 2], 0);
+            break;
+        }
+        case OpCode::FORLOOP: {
+            double n = get<double>(R[i.a + 3]) + 1;
+            double start = get<double>(R[i.a]);
+            double step = get<double>(R[i.a + 2]);
+            // integer loops count their iterations, float loops add the step like reference Lua
+            double current = start == trunc(start) && step == trunc(step)
+                                 ? start + n * step
+                                 : get<double>(R[i.a + 4]) + step;
+            double limit = get<double>(R[i.a + 1]);
+            if (step > 0 ? current > limit : current < limit)
+                break;
+
+            // the value of the loop variable doesn't depend on the previous iterations, so the
+            // source of the last one is reused if the body didn't keep its value
+            R[i.a + 3] = n;
+            auto source = move(R[i.a + 4].source);
+            R[i.a + 4] = val{current};
+            if constexpr (Policy::tracking) {
+                if (source && source.use_count() == 1) {
+                    static_cast<sourcefor&>(*source).n = n;
+                    R[i.a + 4].source = move(source);
+                } else {
+                    R[i.a + 4].source = sourcefor::create(R[i.a], R[i.a + 2], n);
+                }
+            }
+            pc = i.b;
+            break;
+        }
+
+        case OpCode::UNPACK: {
+            vallist values = flatten(range(R + i.a, i.b));
+            for (unsigned k = 0; k < i.c; ++k)
+                R[i.a + k] = k < values.size() ? values[k] : val{};
+            break;
+        }
+        case OpCode::RETURN: {
+            val result = nil();
+            if (!i.c)
+                result = make_shared<vallist>(flatten(range(R + i.a, i.b)));
+            if (leave(move(result)))
+                return eval_success(returned);
+            break;
+        }
+        }
+    }
+
+#undef BINOP
+#undef CMPOP
+#undef UNOP
+}
+
+template struct BasicBytecodeVM<FullTracking>;
+template struct BasicBytecodeVM<LazyTracking>;
+template struct BasicBytecodeVM<NoTracking>;
+
+} // namespace rt
+} // namespace lua
@@ -1,6 +1,8 @@
 #include "MiniLua/operators.hpp"
 #include "MiniLua/sourcechange.hpp"
 #include "MiniLua/sourceexp.hpp"
+#include "MiniLua/table.hpp"
+#include "MiniLua/trace.hpp"
 
 #include <cmath>
 #include <sstream>
@@ -8,52 +10,81 @@
 namespace lua {
 namespace rt {
 
+// the source of the result of a binary operation (none without tracking, a record of the
+// execution trace with lazy tracking)
+template <typename Policy>
+static shared_ptr<sourceexp> binop_source(const val& a, const val& b, const LuaToken& tok) {
+    if constexpr (Policy::lazy) {
+        return ExecutionTrace::binop(a, b, tok);
+    } else if constexpr (Policy::tracking) {
+        return sourcebinop::create(a, b, tok);
+    } else {
+        return nullptr;
+    }
+}
+
+template <typename Policy>
+static shared_ptr<sourceexp> unop_source(const val& v, const LuaToken& tok) {
+    if constexpr (Policy::lazy) {
+        return ExecutionTrace::unop(v, tok);
+    } else if constexpr (Policy::tracking) {
+        return sourceunop::create(v, tok);
+    } else {
+        return nullptr;
+    }
+}
+
+template <typename Policy>
 eval_result_t op_add(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     if (holds_alternative<double>(a) && holds_alternative<double>(b))
-        return eval_success({get<double>(a) + get<double>(b), sourcebinop::create(a, b, tok)});
+        return eval_success({get<double>(a) + get<double>(b), binop_source<Policy>(a, b, tok)});
 
-    return string{"could not add values of type other than number (" + a.type() + ", " + b.type() +
-                  ")"};
+    return EvalError{"could not add values of type other than number ({}, {})", a, b};
 }
 
+template <typename Policy>
 eval_result_t op_sub(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     if (holds_alternative<double>(a) && holds_alternative<double>(b))
         return eval_success(
-            lua::rt::val{get<double>(a) - get<double>(b), sourcebinop::create(a, b, tok)});
+            lua::rt::val{get<double>(a) - get<double>(b), binop_source<Policy>(a, b, tok)});
 
-    return string{"could not subtract variables of type other than number"};
+    return EvalError{"could not subtract variables of type other than number"};
 }
 
+template <typename Policy>
 eval_result_t op_mul(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     if (holds_alternative<double>(a) && holds_alternative<double>(b))
         return eval_success(
-            lua::rt::val{get<double>(a) * get<double>(b), sourcebinop::create(a, b, tok)});
+            lua::rt::val{get<double>(a) * get<double>(b), binop_source<Policy>(a, b, tok)});
 
-    return string{"could not multiply variables of type other than number"};
+    return EvalError{"could not multiply variables of type other than number"};
 }
 
+template <typename Policy>
 eval_result_t op_div(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     if (holds_alternative<double>(a) && holds_alternative<double>(b))
         return eval_success(
-            lua::rt::val{get<double>(a) / get<double>(b), sourcebinop::create(a, b, tok)});
+            lua::rt::val{get<double>(a) / get<double>(b), binop_source<Policy>(a, b, tok)});
 
-    return string{"could not divide variables of type other than number"};
+    return EvalError{"could not divide variables of type other than number"};
 }
 
+template <typename Policy>
 eval_result_t op_pow(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     if (holds_alternative<double>(a) && holds_alternative<double>(b))
         return eval_success(
-            lua::rt::val{pow(get<double>(a), get<double>(b)), sourcebinop::create(a, b, tok)});
+            lua::rt::val{pow(get<double>(a), get<double>(b)), binop_source<Policy>(a, b, tok)});
 
-    return string{"could not exponentiate variables of type other than number"};
+    return EvalError{"could not exponentiate variables of type other than number"};
 }
 
+template <typename Policy>
 eval_result_t op_mod(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     if (holds_alternative<double>(a) && holds_alternative<double>(b))
         return eval_success(
-            lua::rt::val{fmod(get<double>(a), get<double>(b)), sourcebinop::create(a, b, tok)});
+            lua::rt::val{fmod(get<double>(a), get<double>(b)), binop_source<Policy>(a, b, tok)});
 
-    return string{"could not mod variables of type other than number"};
+    return EvalError{"could not mod variables of type other than number"};
 }
 
 eval_result_t op_concat(lua::rt::val a, lua::rt::val b) {
@@ -65,12 +96,16 @@ eval_result_t op_concat(lua::rt::val a, lua::rt::val b) {
         return eval_success(lua::rt::val{ss.str()});
     }
 
-    return string{"could not concatenate other types than strings or numbers"};
+    return EvalError{"could not concatenate other types than strings or numbers"};
 }
 
+template <typename Policy>
 eval_result_t op_eval(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     // cout << a.literal() << "\\" << b.literal() << endl;
 
+    if constexpr (!Policy::tracking)
+        return eval_success(a);
+
     val result = a;
     result.source = sourcebinop::create(a, b, tok);
 
@@ -91,9 +126,12 @@ eval_result_t op_eval(lua::rt::val a, lua::rt::val b, const LuaToken& tok) {
     return eval_success(result);
 }
 
-eval_result_t op_postfix_eval(val a, const LuaToken& tok) {
+template <typename Policy> eval_result_t op_postfix_eval(val a, const LuaToken& tok) {
     // cout << a.literal() << "\\" << endl;
 
+    if constexpr (!Policy::tracking)
+        return eval_success(a);
+
     val result = a;
     result.source = sourceunop::create(a, tok);
 
@@ -107,7 +145,7 @@ eval_result_t op_lt(lua::rt::val a, lua::rt::val b) {
     if (holds_alternative<string>(a) && holds_alternative<string>(b))
         return eval_success(lua::rt::val{get<string>(a) < get<string>(b)});
 
-    return string{"only strings and numbers can be compared"};
+    return EvalError{"only strings and numbers can be compared"};
 }
 
 eval_result_t op_leq(lua::rt::val a, lua::rt::val b) {
@@ -117,7 +155,7 @@ eval_result_t op_leq(lua::rt::val a, lua::rt::val b) {
     if (holds_alternative<string>(a) && holds_alternative<string>(b))
         return eval_success(lua::rt::val{get<string>(a) <= get<string>(b)});
 
-    return string{"only strings and numbers can be compared"};
+    return EvalError{"only strings and numbers can be compared"};
 }
 
 eval_result_t op_gt(lua::rt::val a, lua::rt::val b) {
@@ -126,7 +164,7 @@ eval_result_t op_gt(lua::rt::val a, lua::rt::val b) {
     if (holds_alternative<eval_success_t>(leq))
         return op_not(get_val(leq));
 
-    return string{"only strings and numbers can be compared"};
+    return EvalError{"only strings and numbers can be compared"};
 }
 
 eval_result_t op_geq(lua::rt::val a, lua::rt::val b) {
@@ -135,7 +173,7 @@ eval_result_t op_geq(lua::rt::val a, lua::rt::val b) {
     if (holds_alternative<eval_success_t>(leq))
         return op_not(get_val(leq));
 
-    return string{"only strings and numbers can be compared"};
+    return EvalError{"only strings and numbers can be compared"};
 }
 
 eval_result_t op_eq(lua::rt::val a, lua::rt::val b) {
@@ -158,17 +196,10 @@ eval_result_t op_or(val a, val b) { return eval_success(a.to_bool() ? a : b); }
 
 eval_result_t op_len(val v) {
     if (!v.istable()) {
-        return string{"unary # can only be applied to a table (is " + v.type() + ")"};
+        return EvalError{"unary # can only be applied to a table (is {})", v};
     }
 
-    table& t = *get<table_p>(v);
-
-    int i = 1;
-    for (;; i++) {
-        if (auto idx = t.find(i); idx == t.end() || idx->second.isnil())
-            break;
-    }
-    return eval_success(i - 1);
+    return eval_success(static_cast<double>(get<table_p>(v)->border()));
 }
 
 eval_result_t op_strip(val v) {
@@ -178,12 +209,12 @@ eval_result_t op_strip(val v) {
 
 eval_result_t op_not(val v) { return eval_success(!v.to_bool()); }
 
-eval_result_t op_neg(val v, const LuaToken& tok) {
+template <typename Policy> eval_result_t op_neg(val v, const LuaToken& tok) {
     if (holds_alternative<double>(v)) {
-        return eval_success(val{-get<double>(v), sourceunop::create(v, tok)});
+        return eval_success(val{-get<double>(v), unop_source<Policy>(v, tok)});
     }
 
-    return string{"unary - can only be applied to a number"};
+    return EvalError{"unary - can only be applied to a number"};
 }
 
 eval_result_t op_sqrt(val v) {
@@ -202,7 +233,7 @@ eval_result_t op_sqrt(val v) {
                 if (holds_alternative<double>(v)) {
                     return eval_success(sqrt(get<double>(v.reevaluate())));
                 }
-                return string{"sqrt can only be applied to a number"};
+                return EvalError{"sqrt can only be applied to a number"};
             }
 
             bool isDirty() const override { return v.source && v.source->isDirty(); }
@@ -219,8 +250,25 @@ eval_result_t op_sqrt(val v) {
         return eval_success(val{sqrt(get<double>(v)), std::make_shared<sqrt_exp>(v)});
     }
 
-    return string{"sqrt can only be applied to a number"};
+    return EvalError{"sqrt can only be applied to a number"};
 }
 
+#define INSTANTIATE(Policy)                                                                        \
+    template eval_result_t op_add<Policy>(val, val, const LuaToken&);                              \
+    template eval_result_t op_sub<Policy>(val, val, const LuaToken&);                              \
+    template eval_result_t op_mul<Policy>(val, val, const LuaToken&);                              \
+    template eval_result_t op_div<Policy>(val, val, const LuaToken&);                              \
+    template eval_result_t op_pow<Policy>(val, val, const LuaToken&);                              \
+    template eval_result_t op_mod<Policy>(val, val, const LuaToken&);                              \
+    template eval_result_t op_eval<Policy>(val, val, const LuaToken&);                             \
+    template eval_result_t op_postfix_eval<Policy>(val, const LuaToken&);                          \
+    template eval_result_t op_neg<Policy>(val, const LuaToken&);
+
+INSTANTIATE(FullTracking)
+INSTANTIATE(LazyTracking)
+INSTANTIATE(NoTracking)
+
+#undef INSTANTIATE
+
 } // namespace rt
 } // namespace lua
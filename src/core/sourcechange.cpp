@@ -1,5 +1,6 @@
 #include "MiniLua/sourcechange.hpp"
 
+#include <algorithm>
 #include <sstream>
 
 namespace lua {
@@ -7,6 +8,8 @@ namespace rt {
 
 SourceChangeVisitor::~SourceChangeVisitor() {}
 
+void SourceChangeVisitor::visit(const SourceChangeSet& sc) { sc.tree()->accept(*this); }
+
 SourceChange::~SourceChange() {}
 
 string SourceChangeOr::to_string() const {
@@ -46,20 +49,183 @@ void ApplySCVisitor::visit(const SourceChangeAnd& sc_and) {
 
 void ApplySCVisitor::visit(const SourceAssignment& sc_ass) { changes.push_back(sc_ass); }
 
-vector<LuaToken> ApplySCVisitor::apply_changes(const vector<LuaToken>& tokens) {
-    auto new_tokens = tokens;
+void ApplySCVisitor::visit(const SourceChangeSet& sc_set) { sc_set.applied(changes); }
+
+// appends the nodes of a change tree to a set
+struct SourceChangeSet::Appender : SourceChangeVisitor {
+    explicit Appender(SourceChangeSet& set) : set{set} {}
+
+    void visit(const SourceChangeOr& sc_or) override {
+        size_t index = open(Node::Kind::Or);
+        for (const auto& alternative : sc_or.alternatives) {
+            // every alternative has to be a single subtree
+            ++depth;
+            alternative->accept(*this);
+            --depth;
+        }
+        close(index);
+    }
+
+    void visit(const SourceChangeAnd& sc_and) override {
+        // the set itself is an And, so the top level is flattened
+        if (depth == 0) {
+            for (const auto& c : sc_and.changes)
+                c->accept(*this);
+            return;
+        }
 
-    // sort the collected changes according to their position
-    std::sort(changes.begin(), changes.end(),
-              [](const auto& a, const auto& b) { return a.token.pos > b.token.pos; });
+        size_t index = open(Node::Kind::And);
+        for (const auto& c : sc_and.changes)
+            c->accept(*this);
+        close(index);
+    }
+
+    void visit(const SourceAssignment& sc_ass) override {
+        set.nodes.push_back(
+            {Node::Kind::Assignment, 1, static_cast<uint32_t>(set.assignments.size())});
+        set.assignments.push_back(sc_ass);
+    }
+
+    void visit(const SourceChangeSet& sc_set) override {
+        size_t index = depth == 0 ? 0 : open(Node::Kind::And);
+
+        auto offset = static_cast<uint32_t>(set.assignments.size());
+        for (Node node : sc_set.nodes) {
+            if (node.kind == Node::Kind::Assignment)
+                node.assignment += offset;
+            set.nodes.push_back(node);
+        }
+        set.assignments.insert(set.assignments.end(), sc_set.assignments.begin(),
+                               sc_set.assignments.end());
+
+        if (depth != 0)
+            close(index);
+    }
+
+    size_t open(Node::Kind kind) {
+        set.nodes.push_back({kind, 1, 0});
+        ++depth;
+        return set.nodes.size() - 1;
+    }
+
+    void close(size_t index) {
+        --depth;
+        set.nodes[index].size = static_cast<uint32_t>(set.nodes.size() - index);
+    }
+
+    SourceChangeSet& set;
+    unsigned depth = 0;
+};
+
+void SourceChangeSet::add(const SourceChange& change) {
+    if (&change == this) {
+        // appending to itself would read the arrays while they grow
+        SourceChangeSet copy = *this;
+        add(copy);
+        return;
+    }
+
+    Appender appender{*this};
+    change.accept(appender);
+}
+
+void SourceChangeSet::applied(vector<SourceAssignment>& out) const {
+    // the choices that are currently scanned: where their first alternative ends and where the
+    // next node after the choice starts
+    vector<pair<size_t, size_t>> choices;
+
+    for (size_t i = 0; i < nodes.size();) {
+        while (!choices.empty() && i == choices.back().first) {
+            i = choices.back().second;
+            choices.pop_back();
+        }
+        if (i >= nodes.size())
+            break;
+
+        const Node& node = nodes[i];
+        if (node.kind == Node::Kind::Assignment) {
+            out.push_back(assignments[node.assignment]);
+        } else if (node.kind == Node::Kind::Or && node.size > 1) {
+            choices.emplace_back(i + 1 + nodes[i + 1].size, i + node.size);
+        } else if (node.kind == Node::Kind::Or) {
+            // no alternatives
+            i += node.size;
+            continue;
+        }
+        ++i;
+    }
+}
 
-    // apply the changes from back to front
+shared_ptr<SourceChange> SourceChangeSet::build(size_t& index) const {
+    const Node& node = nodes[index];
+    size_t end = index + node.size;
+    ++index;
+
+    switch (node.kind) {
+    case Node::Kind::Assignment:
+        return make_shared<SourceAssignment>(assignments[node.assignment]);
+    case Node::Kind::And: {
+        auto sc_and = make_shared<SourceChangeAnd>();
+        while (index < end)
+            sc_and->changes.push_back(build(index));
+        return sc_and;
+    }
+    case Node::Kind::Or: {
+        auto sc_or = make_shared<SourceChangeOr>();
+        while (index < end)
+            sc_or->alternatives.push_back(build(index));
+        return sc_or;
+    }
+    }
+    return nullptr;
+}
+
+shared_ptr<SourceChange> SourceChangeSet::tree() const {
+    auto sc_and = make_shared<SourceChangeAnd>();
+    for (size_t index = 0; index < nodes.size();)
+        sc_and->changes.push_back(build(index));
+
+    if (sc_and->changes.size() == 1)
+        return sc_and->changes[0];
+    return sc_and;
+}
+
+string SourceChangeSet::to_string() const { return tree()->to_string(); }
+
+// the index of the token at pos or tokens.size()
+static size_t find_token(const vector<LuaToken>& tokens, long pos) {
+    auto it = lower_bound(tokens.begin(), tokens.end(), pos,
+                          [](const LuaToken& t, long pos) { return t.pos() < pos; });
+
+    if (it == tokens.end() || it->pos() != pos)
+        return tokens.size();
+    return static_cast<size_t>(it - tokens.begin());
+}
+
+void ApplySCVisitor::normalize() {
+    std::stable_sort(changes.begin(), changes.end(),
+                     [](const auto& a, const auto& b) { return a.token.pos() < b.token.pos(); });
+
+    // keep the last change of every token
+    size_t kept = 0;
+    for (size_t i = 0; i < changes.size(); ++i) {
+        if (i + 1 < changes.size() && changes[i + 1].token.pos() == changes[i].token.pos())
+            continue;
+        if (kept != i)
+            changes[kept] = move(changes[i]);
+        ++kept;
+    }
+    changes.resize(kept);
+}
+
+vector<LuaToken> ApplySCVisitor::apply_changes(const vector<LuaToken>& tokens) {
+    normalize();
+
+    auto new_tokens = tokens;
     for (const auto& sc : changes) {
-        for (auto& t : new_tokens) {
-            if (t.pos == sc.token.pos) {
-                t.match = sc.replacement;
-                t.length = static_cast<long>(sc.replacement.length());
-            }
+        if (size_t index = find_token(tokens, sc.token.pos()); index != tokens.size()) {
+            const auto& token = tokens[index];
+            new_tokens[index] = LuaToken{token.type, sc.replacement, token.pos(), token.ws()};
         }
     }
 
@@ -69,5 +235,35 @@ vector<LuaToken> ApplySCVisitor::apply_changes(const vector<LuaToken>& tokens) {
     return new_tokens;
 }
 
+vector<TextEdit> ApplySCVisitor::text_edits(const vector<LuaToken>& tokens) {
+    normalize();
+
+    vector<TextEdit> edits;
+    edits.reserve(changes.size());
+    for (auto& sc : changes) {
+        if (size_t index = find_token(tokens, sc.token.pos()); index != tokens.size())
+            edits.push_back({tokens[index].pos(), tokens[index].length(), move(sc.replacement)});
+    }
+
+    changes.clear();
+
+    return edits;
+}
+
+string apply_edits(const string& source, const vector<TextEdit>& edits) {
+    string result;
+    result.reserve(source.size());
+
+    size_t pos = 0;
+    for (const auto& edit : edits) {
+        result.append(source, pos, static_cast<size_t>(edit.pos) - pos);
+        result += edit.replacement;
+        pos = static_cast<size_t>(edit.pos + edit.length);
+    }
+    result.append(source, pos, string::npos);
+
+    return result;
+}
+
 } // namespace rt
 } // namespace lua
@@ -3,6 +3,7 @@
 #include "MiniLua/sourcechange.hpp"
 
 #include <cmath>
+#include <functional>
 
 namespace lua {
 namespace rt {
@@ -25,7 +26,7 @@ source_change_t sourceval::forceValue(const val& v) const {
 
 eval_result_t sourceval::reevaluate() {
     // should not be necessary, as the value cannot change
-    return string{"reevaluate unimplemented"};
+    return EvalError{"reevaluate unimplemented"};
 }
 
 bool sourceval::isDirty() const { return false; }
@@ -212,7 +213,7 @@ eval_result_t sourcebinop::reevaluate() {
     case LuaToken::Type::OR:
         return op_or(_lhs, _rhs);
     default:
-        return string{op.match + " cannot be reevaluated"};
+        return string{op.match()} + " cannot be reevaluated";
     }
 }
 
@@ -232,7 +233,7 @@ source_change_t sourceunop::forceValue(const val& new_v) const {
         auto res_or = make_shared<SourceChangeOr>();
         if (auto result = v.source->forceValue(val{-get<double>(new_v)}); result) {
             if (auto p = dynamic_pointer_cast<sourceval>(v.source);
-                !p || p->location[0].pos != op.pos + op.length) {
+                !p || p->location[0].pos() != op.pos() + op.length()) {
                 res_or->alternatives.push_back(*result);
             }
         }
@@ -269,11 +270,326 @@ eval_result_t sourceunop::reevaluate() {
     case LuaToken::Type::EVAL:
         return op_postfix_eval(_v);
     default:
-        return string{op.match + " is not a unary operator"};
+        return string{op.match()} + " is not a unary operator";
     }
 }
 
 bool sourceunop::isDirty() const { return v.source && v.source->isDirty(); }
 
+source_change_t sourcefor::forceValue(const val& v) const {
+    if (!holds_alternative<double>(v) || !holds_alternative<double>(start) ||
+        !holds_alternative<double>(step))
+        return nullopt;
+
+    double new_v = get<double>(v);
+    auto res_or = make_shared<SourceChangeOr>();
+
+    // change the start value of the loop
+    if (start.source) {
+        if (auto result = start.source->forceValue(val{new_v - n * get<double>(step)}); result)
+            res_or->alternatives.push_back(*result);
+    }
+    // or the step
+    if (step.source && n != 0) {
+        if (auto result = step.source->forceValue(val{(new_v - get<double>(start)) / n}); result)
+            res_or->alternatives.push_back(*result);
+    }
+
+    if (!res_or->alternatives.empty())
+        return res_or;
+    return nullopt;
+}
+
+eval_result_t sourcefor::reevaluate() {
+    auto _start = fst(start.reevaluate());
+    auto _step = fst(step.reevaluate());
+
+    if (!holds_alternative<double>(_start) || !holds_alternative<double>(_step))
+        return EvalError{"'for' values must be numbers"};
+
+    return eval_success(val{get<double>(_start) + n * get<double>(_step),
+                            sourcefor::create(_start, _step, n)});
+}
+
+bool sourcefor::isDirty() const {
+    return (start.source && start.source->isDirty()) || (step.source && step.source->isDirty());
+}
+
+source_change_t sourceaffine::forceValue(const val& v) const {
+    if (!holds_alternative<double>(v) || !holds_alternative<double>(base))
+        return nullopt;
+
+    // the value of the summary without the term at skip
+    auto rest = [this](const Term* skip) {
+        double result = offset + scale * get<double>(base);
+        for (const auto& term : terms) {
+            if (&term != skip)
+                result += term.coeff * get<double>(term.v);
+        }
+        return result;
+    };
+
+    auto res_or = make_shared<SourceChangeOr>();
+
+    // change the start of the chain
+    if (base.source && scale != 0) {
+        double new_base = (get<double>(v) - (rest(nullptr) - scale * get<double>(base))) / scale;
+        if (isfinite(new_base)) {
+            if (auto result = base.source->forceValue(val{new_base}); result)
+                res_or->alternatives.push_back(*result);
+        }
+    }
+    // or one of the terms
+    for (const auto& term : terms) {
+        if (term.coeff == 0)
+            continue;
+        double new_term = (get<double>(v) - rest(&term)) / term.coeff;
+        if (!isfinite(new_term))
+            continue;
+        if (auto result = term.v.source->forceValue(val{new_term}); result)
+            res_or->alternatives.push_back(*result);
+    }
+
+    if (!res_or->alternatives.empty())
+        return res_or;
+    return nullopt;
+}
+
+eval_result_t sourceaffine::reevaluate() {
+    auto _base = fst(base.reevaluate());
+
+    if (!holds_alternative<double>(_base))
+        return EvalError{"a chain of arithmetic can only be reevaluated on a number (is {})",
+                         _base};
+
+    double result = scale * get<double>(_base) + offset;
+    vector<Term> _terms;
+    for (auto& term : terms) {
+        auto _v = fst(term.v.reevaluate());
+        if (!holds_alternative<double>(_v))
+            return EvalError{"a chain of arithmetic can only be reevaluated on a number (is {})",
+                             _v};
+        result += term.coeff * get<double>(_v);
+        if (_v.source)
+            _terms.push_back(Term{_v, term.coeff});
+    }
+
+    return eval_success(val{result, sourceaffine::create(_base, scale, offset, move(_terms))});
+}
+
+bool sourceaffine::isDirty() const {
+    if (base.source && base.source->isDirty())
+        return true;
+    for (const auto& term : terms) {
+        if (term.v.source->isDirty())
+            return true;
+    }
+    return false;
+}
+
+shared_ptr<sourceexp> sourcebinop::create(const val& lhs, const val& rhs, const LuaToken& op) {
+    if (!lhs.source && !rhs.source)
+        return nullptr;
+
+    return ProvenanceStore::active().binop(lhs, rhs, op);
+}
+
+shared_ptr<sourceexp> sourceunop::create(const val& v, const LuaToken& op) {
+    if (!v.source)
+        return nullptr;
+
+    return ProvenanceStore::active().unop(v, op);
+}
+
+// the store of the innermost active run of the thread, nullptr outside of a run
+static ProvenanceStore*& current() {
+    thread_local ProvenanceStore* store = nullptr;
+    return store;
+}
+
+ProvenanceStore& ProvenanceStore::active() {
+    if (auto store = current())
+        return *store;
+
+    thread_local ProvenanceStore store;
+    return store;
+}
+
+ProvenanceStore::Run::Run(ProvenanceStore& store) : store{store}, outer{current()} {
+    if (store.runs++ == 0)
+        store.nodes.clear();
+    current() = &store;
+}
+
+ProvenanceStore::Run::~Run() {
+    store.runs--;
+    current() = outer;
+}
+
+size_t ProvenanceStore::KeyHash::operator()(const Key& key) const {
+    size_t h = hash<long>{}(key.pos) * 31 + key.type;
+    for (int i = 0; i < 2; ++i) {
+        h = h * 31 + hash<const sourceexp*>{}(key.sources[i]);
+        h = h * 31 + hash<double>{}(key.operands[i]);
+    }
+    return h;
+}
+
+template <typename F> shared_ptr<sourceexp> ProvenanceStore::intern(const Key& key, F make) {
+    auto& entry = nodes[key];
+    // the name of the node belongs to the variable it was assigned to first
+    if (auto node = entry.lock(); node && node->identifier.empty())
+        return node;
+
+    shared_ptr<sourceexp> node = make();
+    entry = node;
+
+    if (nodes.size() > max_size) {
+        for (auto it = nodes.begin(); it != nodes.end();) {
+            it = it->second.expired() ? nodes.erase(it) : next(it);
+        }
+        if (nodes.size() > max_size)
+            nodes.clear();
+    }
+
+    return node;
+}
+
+static uint32_t depth_of(const val& v) { return v.source ? v.source->depth : 0; }
+
+// the chain value with its source as a summary, chain itself is the base if it isn't one yet
+static sourceaffine split_affine(const val& chain) {
+    if (auto affine = dynamic_pointer_cast<sourceaffine>(chain.source))
+        return *affine;
+
+    sourceaffine summary;
+    summary.base = chain;
+    return summary;
+}
+
+// adds coeff * v to the summary, as a term if v has a source and there is room for it
+static void add_term(sourceaffine& summary, const val& v, double coeff) {
+    if (v.source) {
+        for (auto& term : summary.terms) {
+            if (term.v.source == v.source) {
+                term.coeff += coeff;
+                return;
+            }
+        }
+        if (summary.terms.size() < sourceaffine::max_terms) {
+            summary.terms.push_back(sourceaffine::Term{v, coeff});
+            return;
+        }
+    }
+    summary.offset += coeff * get<double>(v);
+}
+
+// multiplies the summary by c
+static void scale_affine(sourceaffine& summary, double c) {
+    summary.scale *= c;
+    summary.offset *= c;
+    for (auto& term : summary.terms)
+        term.coeff *= c;
+}
+
+// divides the summary by c
+static void divide_affine(sourceaffine& summary, double c) {
+    summary.scale /= c;
+    summary.offset /= c;
+    for (auto& term : summary.terms)
+        term.coeff /= c;
+}
+
+static shared_ptr<sourceexp> create_affine(sourceaffine& summary) {
+    return sourceaffine::create(summary.base, summary.scale, summary.offset,
+                                move(summary.terms));
+}
+
+shared_ptr<sourceexp> ProvenanceStore::binop(const val& lhs, const val& rhs, const LuaToken& op) {
+    auto make = [&lhs, &rhs, &op]() {
+        auto node = make_shared<sourcebinop>();
+        node->lhs = lhs;
+        node->rhs = rhs;
+        node->op = op;
+        node->depth = 1 + max(depth_of(lhs), depth_of(rhs));
+        return node;
+    };
+
+    if (max(depth_of(lhs), depth_of(rhs)) >= max_depth) {
+        // the deeper operand continues the chain, the other one is a term or a constant of the
+        // summary
+        bool left = depth_of(lhs) >= depth_of(rhs);
+        const val& chain = left ? lhs : rhs;
+        const val& other = left ? rhs : lhs;
+
+        if (chain.isnumber() && other.isnumber()) {
+            auto summary = split_affine(chain);
+
+            double c = get<double>(other);
+            switch (op.type) {
+            case LuaToken::Type::ADD:
+                add_term(summary, other, 1);
+                return create_affine(summary);
+            case LuaToken::Type::SUB:
+                if (!left)
+                    scale_affine(summary, -1);
+                add_term(summary, other, left ? -1 : 1);
+                return create_affine(summary);
+            case LuaToken::Type::MUL:
+                scale_affine(summary, c);
+                return create_affine(summary);
+            case LuaToken::Type::DIV:
+                if (left && c != 0) {
+                    divide_affine(summary, c);
+                    return create_affine(summary);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        // not affine: the result only remembers the source of the other operand
+        if (!other.source)
+            return nullptr;
+        val constant = chain;
+        constant.source.reset();
+        return left ? binop(constant, rhs, op) : binop(lhs, constant, op);
+    }
+
+    if (!lhs.isnumber() || !rhs.isnumber())
+        return make();
+
+    return intern(Key{op.type,
+                      op.pos(),
+                      {lhs.source.get(), rhs.source.get()},
+                      {get<double>(lhs), get<double>(rhs)}},
+                  make);
+}
+
+shared_ptr<sourceexp> ProvenanceStore::unop(const val& v, const LuaToken& op) {
+    auto make = [&v, &op]() {
+        auto node = make_shared<sourceunop>();
+        node->v = v;
+        node->op = op;
+        node->depth = 1 + depth_of(v);
+        return node;
+    };
+
+    if (depth_of(v) >= max_depth) {
+        if (v.isnumber() && op.type == LuaToken::Type::SUB) {
+            auto summary = split_affine(v);
+            scale_affine(summary, -1);
+            return create_affine(summary);
+        }
+        return nullptr;
+    }
+
+    if (!v.isnumber())
+        return make();
+
+    return intern(Key{op.type, op.pos(), {v.source.get(), nullptr}, {get<double>(v), 0}}, make);
+}
+
 } // namespace rt
 } // namespace lua
@@ -0,0 +1,271 @@
+#include "MiniLua/table.hpp"
+
+#include <atomic>
+
+namespace lua {
+namespace rt {
+
+table::shape_t table::Shape::new_id() {
+    // tables are not shared between threads, but interpreters in different threads take their
+    // ids from the same counter
+    static atomic<shape_t> next{0};
+    return next.fetch_add(1, memory_order_relaxed) + 1;
+}
+
+const shared_ptr<table::Shape>& table::Shape::root() {
+    thread_local shared_ptr<Shape> root = make_shared<Shape>();
+    return root;
+}
+
+table::Shape::~Shape() {
+    if (!parent || keys.empty())
+        return;
+
+    // forget the transition to this shape
+    auto it = parent->transitions.find(keys.back());
+    if (it != parent->transitions.end() && it->second.expired())
+        parent->transitions.erase(it);
+}
+
+shared_ptr<table::Shape> table::Shape::transition(const val& key) {
+    // the shape is shared, so neither it nor its transitions keep the source of the key of one of
+    // the tables
+    val shared_key = key;
+    shared_key.source = nullptr;
+
+    auto& child = transitions[shared_key];
+    if (auto shape = child.lock(); shape)
+        return shape;
+
+    auto shape = make_shared<Shape>();
+    shape->slots = slots;
+    shape->keys = keys;
+    shape->slots.emplace(shared_key, keys.size());
+    shape->keys.push_back(shared_key);
+    shape->parent = shared_from_this();
+    child = shape;
+    return shape;
+}
+
+shared_ptr<table::Shape> table::Shape::dictionary() const {
+    auto shape = make_shared<Shape>();
+    shape->slots = slots;
+    shape->keys = keys;
+    shape->shared = false;
+    return shape;
+}
+
+table::table() : shape_{Shape::root()} {}
+
+table::table(const table& other)
+    : array{other.array}, array_count{other.array_count}, array_border{other.array_border},
+      shape_{other.shape_->shared ? other.shape_ : other.shape_->dictionary()},
+      values{other.values}, hash_count{other.hash_count} {}
+
+table::table(table&& other)
+    : array{move(other.array)}, array_count{other.array_count},
+      array_border{other.array_border}, shape_{move(other.shape_)}, values{move(other.values)},
+      hash_count{other.hash_count} {
+    other.clear();
+}
+
+table& table::operator=(const table& other) {
+    array = other.array;
+    array_count = other.array_count;
+    array_border = other.array_border;
+    shape_ = other.shape_->shared ? other.shape_ : other.shape_->dictionary();
+    values = other.values;
+    hash_count = other.hash_count;
+    return *this;
+}
+
+table& table::operator=(table&& other) {
+    if (this != &other) {
+        array = move(other.array);
+        array_count = other.array_count;
+        array_border = other.array_border;
+        shape_ = move(other.shape_);
+        values = move(other.values);
+        hash_count = other.hash_count;
+        other.clear();
+    }
+    return *this;
+}
+
+bool table::array_index(const val& key, size_t& index) const {
+    if (!key.isnumber())
+        return false;
+
+    double d = std::get<double>(key);
+    if (!(d >= 1.0 && d <= static_cast<double>(array.size() + 1)))
+        return false;
+
+    index = static_cast<size_t>(d);
+    if (static_cast<double>(index) != d)
+        return false;
+
+    index--;
+    return true;
+}
+
+val table::get(const val& key) const {
+    if (size_t index; array_index(key, index) && index < array.size())
+        return array.get(index);
+
+    return get_slot(slot(key));
+}
+
+void table::set(const val& key, const val& value) {
+    if (size_t index; array_index(key, index)) {
+        if (index < array.size()) {
+            set_array(index, value);
+            return;
+        }
+
+        // append to the array part (the hash part never contains this key)
+        if (!value.isnil()) {
+            push_array(value);
+
+            // move the following keys from the hash part
+            while (hash_count > 0) {
+                size_t next = slot(val{static_cast<double>(array.size() + 1)});
+                if (next == npos || values[next].isnil())
+                    break;
+
+                push_array(values[next]);
+                values[next] = nil();
+                hash_count--;
+            }
+        }
+        return;
+    }
+
+    if (size_t index = slot(key); index != npos) {
+        // a removed key keeps its (empty) slot
+        if (values[index].isnil() && !value.isnil())
+            hash_count++;
+        else if (!values[index].isnil() && value.isnil())
+            hash_count--;
+        values[index] = value;
+    } else if (!value.isnil()) {
+        insert(key, value);
+    }
+}
+
+void table::insert(const val& key, const val& value) {
+    if (shape_->shared && shape_->keys.size() < max_shared_keys) {
+        shape_ = shape_->transition(key);
+    } else {
+        if (shape_->shared) {
+            shape_ = shape_->dictionary();
+        } else if (values.size() - hash_count > max(hash_count, max_shared_keys)) {
+            // drop the empty slots when they outnumber the values
+            vector<val> keys;
+            vector<val> used;
+            shape_->slots.clear();
+            for (size_t i = 0; i < values.size(); ++i) {
+                if (values[i].isnil())
+                    continue;
+                shape_->slots.emplace(shape_->keys[i], keys.size());
+                keys.push_back(move(shape_->keys[i]));
+                used.push_back(move(values[i]));
+            }
+            shape_->keys = move(keys);
+            values = move(used);
+        }
+        shape_->slots.emplace(key, shape_->keys.size());
+        shape_->keys.push_back(key);
+        shape_->id = Shape::new_id();
+    }
+
+    values.push_back(value);
+    hash_count++;
+}
+
+void table::set_array(size_t index, const val& value) {
+    bool was_nil = array.raw(index).isnil();
+    array.set(index, value);
+
+    if (value.isnil()) {
+        if (!was_nil)
+            array_count--;
+        if (index < array_border)
+            array_border = index;
+
+        // drop trailing nils, so that the array part always ends with a value
+        size_t size = array.size();
+        while (size > 0 && array.raw(size - 1).isnil())
+            size--;
+        array.resize(size);
+    } else {
+        if (was_nil)
+            array_count++;
+        while (array_border < array.size() && !array.raw(array_border).isnil())
+            array_border++;
+    }
+}
+
+void table::push_array(const val& value) {
+    array.push_back(value);
+    array_count++;
+
+    if (array_border == array.size() - 1)
+        array_border++;
+}
+
+size_t table::count(const val& key) const {
+    if (size_t index; array_index(key, index) && index < array.size())
+        return array.raw(index).isnil() ? 0 : 1;
+
+    return get_slot(slot(key)).isnil() ? 0 : 1;
+}
+
+void table::clear() {
+    array.clear();
+    array_count = 0;
+    array_border = 0;
+    shape_ = Shape::root();
+    values.clear();
+    hash_count = 0;
+}
+
+table::const_iterator table::begin() const { return const_iterator{this, 0}; }
+
+table::const_iterator table::end() const {
+    return const_iterator{this, array.size() + values.size()};
+}
+
+table::const_iterator table::find(const val& key) const {
+    if (size_t index; array_index(key, index) && index < array.size()) {
+        if (array.raw(index).isnil())
+            return end();
+        return const_iterator{this, index};
+    }
+
+    size_t index = slot(key);
+    if (index == npos || values[index].isnil())
+        return end();
+    return const_iterator{this, array.size() + index};
+}
+
+void table::const_iterator::load() {
+    while (index < t->array.size() && t->array.raw(index).isnil())
+        ++index;
+
+    if (index < t->array.size()) {
+        current = make_pair(val{static_cast<double>(index + 1)}, t->array.get(index));
+        return;
+    }
+
+    size_t end = t->array.size() + t->values.size();
+    while (index < end && t->values[index - t->array.size()].isnil())
+        ++index;
+
+    if (index < end) {
+        size_t slot = index - t->array.size();
+        current = make_pair(t->shape_->keys[slot], t->values[slot]);
+    }
+}
+
+} // namespace rt
+} // namespace lua
@@ -0,0 +1,173 @@
+#include "MiniLua/trace.hpp"
+
+#include <functional>
+
+namespace lua {
+namespace rt {
+
+static shared_ptr<ExecutionTrace>& current() {
+    thread_local shared_ptr<ExecutionTrace> trace = make_shared<ExecutionTrace>();
+    return trace;
+}
+
+const shared_ptr<ExecutionTrace>& ExecutionTrace::active() { return current(); }
+
+const shared_ptr<ExecutionTrace>& ExecutionTrace::writable() {
+    auto& trace = current();
+    if (trace->records.size() == capacity) {
+        // the sources of the trace share its control block, so it is only referenced by current
+        // when all of its values are gone
+        if (trace.use_count() == 1) {
+            trace->records.clear();
+            trace->retained.clear();
+            trace->built.clear();
+        } else {
+            trace = make_shared<ExecutionTrace>();
+        }
+    }
+    return trace;
+}
+
+uint32_t ExecutionTrace::operand(const val& v) {
+    if (!v.source)
+        return tracedop::none;
+
+    const void* begin = records.data();
+    const void* end = records.data() + records.size();
+    const void* p = v.source.get();
+    if (!less<const void*>{}(p, begin) && less<const void*>{}(p, end))
+        return static_cast<uint32_t>(static_cast<const tracedop*>(v.source.get()) - records.data());
+
+    retained.push_back(v.source);
+    return tracedop::retained | static_cast<uint32_t>(retained.size() - 1);
+}
+
+static uint32_t depth_of(const val& v) { return v.source ? v.source->depth : 0; }
+
+shared_ptr<sourceexp> ExecutionTrace::binop(const val& lhs, const val& rhs, const LuaToken& op) {
+    if (!lhs.source && !rhs.source)
+        return nullptr;
+
+    auto& store = ProvenanceStore::active();
+    if (max(depth_of(lhs), depth_of(rhs)) >= store.max_depth)
+        return store.binop(lhs, rhs, op);
+
+    const auto& trace = writable();
+    tracedop& record = trace->records.emplace_back();
+    record.op = op;
+    record.operands[0] = lhs.def_number();
+    record.operands[1] = rhs.def_number();
+    record.sources[0] = trace->operand(lhs);
+    record.sources[1] = trace->operand(rhs);
+    record.trace = trace.get();
+    record.depth = 1 + max(depth_of(lhs), depth_of(rhs));
+    return shared_ptr<sourceexp>{trace, &record};
+}
+
+shared_ptr<sourceexp> ExecutionTrace::unop(const val& v, const LuaToken& op) {
+    if (!v.source)
+        return nullptr;
+
+    auto& store = ProvenanceStore::active();
+    if (depth_of(v) >= store.max_depth)
+        return store.unop(v, op);
+
+    const auto& trace = writable();
+    tracedop& record = trace->records.emplace_back();
+    record.op = op;
+    record.operands[0] = v.def_number();
+    record.sources[0] = trace->operand(v);
+    record.trace = trace.get();
+    record.depth = 1 + depth_of(v);
+    record.unary = true;
+    return shared_ptr<sourceexp>{trace, &record};
+}
+
+const shared_ptr<sourceexp>& ExecutionTrace::source(uint32_t id) const {
+    static const shared_ptr<sourceexp> missing;
+    if (id == tracedop::none)
+        return missing;
+    if (id & tracedop::retained)
+        return retained[id & ~tracedop::retained];
+    return built[id];
+}
+
+const shared_ptr<sourceexp>& ExecutionTrace::node(uint32_t index) const {
+    built.resize(records.size());
+
+    // the operands are built first, with a stack of the records still to build instead of
+    // recursion (a chain of records can be max_depth long)
+    vector<uint32_t> pending{index};
+    while (!pending.empty()) {
+        const uint32_t i = pending.back();
+        const tracedop& record = records[i];
+        if (built[i]) {
+            pending.pop_back();
+            continue;
+        }
+
+        bool ready = true;
+        for (uint32_t id : record.sources) {
+            if (!(id & tracedop::retained) && !built[id]) {
+                pending.push_back(id);
+                ready = false;
+            }
+        }
+        if (!ready)
+            continue;
+        pending.pop_back();
+
+        // names can be given to the records after their nodes were built
+        auto operand = [this, &record](int k) {
+            const uint32_t id = record.sources[k];
+            const auto& source = this->source(id);
+            if (source && !(id & tracedop::retained))
+                source->identifier = records[id].identifier;
+            return val{record.operands[k], source};
+        };
+
+        shared_ptr<sourceexp> node;
+        if (record.unary) {
+            auto unop = make_shared<sourceunop>();
+            unop->v = operand(0);
+            unop->op = record.op;
+            node = move(unop);
+        } else {
+            auto binop = make_shared<sourcebinop>();
+            binop->lhs = operand(0);
+            binop->rhs = operand(1);
+            binop->op = record.op;
+            node = move(binop);
+        }
+        node->depth = record.depth;
+        built[i] = move(node);
+    }
+
+    built[index]->identifier = records[index].identifier;
+    return built[index];
+}
+
+shared_ptr<sourceexp> tracedop::node() const {
+    return trace->node(static_cast<uint32_t>(this - trace->records.data()));
+}
+
+source_change_t tracedop::forceValue(const val& v) const { return node()->forceValue(v); }
+
+eval_result_t tracedop::reevaluate() { return node()->reevaluate(); }
+
+bool tracedop::isDirty() const {
+    for (uint32_t id : sources) {
+        if (id == none)
+            continue;
+        const sourceexp* source = id & retained ? trace->retained[id & ~retained].get()
+                                                : &trace->records[id];
+        if (source->isDirty())
+            return true;
+    }
+    return false;
+}
+
+vector<LuaToken> tracedop::get_all_tokens() const { return node()->get_all_tokens(); }
+
+} // namespace rt
+} // namespace lua
@@ -1,5 +1,6 @@
 #include "MiniLua/val.hpp"
 #include "MiniLua/sourceexp.hpp"
+#include "MiniLua/table.hpp"
 
 #include <sstream>
 
@@ -68,6 +69,23 @@ string val::to_string() const {
 
 ostream& operator<<(ostream& os, const val& value) { return os << value.to_string(); }
 
+string EvalError::message() const {
+    if (built)
+        return *built;
+
+    string result;
+    uint8_t next = 0;
+    for (const char* c = text; *c; ++c) {
+        if (c[0] == '{' && c[1] == '}' && next < num_types) {
+            result += val::type_name(types[next++]);
+            ++c;
+        } else {
+            result += *c;
+        }
+    }
+    return result;
+}
+
 optional<shared_ptr<SourceChange>> val::forceValue(const val& v) const {
     if (source)
         return source->forceValue(v);
@@ -4,9 +4,19 @@
 #include <variant>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <optional>
+#include <unordered_map>
 
+#include "MiniLua/incremental.hpp"
 #include "MiniLua/luainterpreter.hpp"
 #include "MiniLua/luaparser.hpp"
+#include "MiniLua/luaresolver.hpp"
+#include "MiniLua/luavm.hpp"
+
+#if defined(__GLIBC__)
+#include <pthread.h>
+#endif
 
 void add_force_function_to_env(const std::shared_ptr<lua::rt::Environment>& env) {
     env->assign(string{"force"},
@@ -28,7 +38,8 @@ void add_force_function_to_env(const std::shared_ptr<lua::rt::Environment>& env)
                 false);
 }
 
-std::string parse_eval_update(std::string program) {
+std::string parse_eval_update(std::string program,
+                              const lua::rt::Evaluator& eval = lua::rt::ASTEvaluator{}) {
     // parse
     LuaParser parser;
     PerformanceStatistics ps;
@@ -46,17 +57,19 @@ std::string parse_eval_update(std::string program) {
     env->populate_stdlib();
     add_force_function_to_env(env);
 
-    lua::rt::ASTEvaluator eval;
-    auto eval_result = ast->accept(eval, env);
+    auto eval_result = eval.run(ast, env);
 
-    if (std::holds_alternative<std::string>(eval_result)) {
-        INFO(std::get<std::string>(eval_result));
+    if (std::holds_alternative<lua::rt::EvalError>(eval_result)) {
+        INFO(std::get<lua::rt::EvalError>(eval_result).message());
         CHECK(false);
     }
 
     // update ast
     if (auto sc = get_sc(eval_result)) {
-        return get_string((*sc)->apply(parser.tokens));
+        auto new_program = get_string((*sc)->apply(parser.tokens()));
+        // the text edits result in the same program
+        CHECK(lua::rt::apply_edits(program, (*sc)->edits(parser.tokens())) == new_program);
+        return new_program;
     }
 
     // TODO (why) is this needed?
@@ -86,6 +99,14 @@ TEST_CASE("parse, eval, update", "[parse][leaks]") {
         REQUIRE(result == "force(3, 3)");
     }
 
+    SECTION("force loop variable") {
+        REQUIRE(parse_eval_update("for i=1, 3 do if i == 3 then force(i, 5) end end") ==
+                "for i=3, 3 do if i == 3 then force(i, 5) end end");
+        // values of earlier iterations keep their source
+        REQUIRE(parse_eval_update("t = {} for i=1, 3, 2 do t[i] = i end force(t[3], 9)") ==
+                "t = {} for i=7, 3, 2 do t[i] = i end force(t[3], 9)");
+    }
+
     SECTION("COMMENTS"){
         const std::string program = "print('test')\n --print('normal comment')\nprint('hello')";
         const auto result = parse_eval_update(program);
@@ -117,6 +138,956 @@ TEST_CASE("whole lua-programs") {
         REQUIRE(result == program);
     }
 }
+// runs the program and returns everything it printed
+std::string eval_output(std::string program, const lua::rt::Evaluator& eval) {
+    LuaParser parser;
+    PerformanceStatistics ps;
+    const auto result = parser.parse(program, ps);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+
+    std::string output;
+    auto env = std::make_shared<lua::rt::Environment>(nullptr);
+    env->populate_stdlib();
+    env->assign(string{"print"},
+                make_shared<lua::rt::cfunction>(
+                    [&output](const lua::rt::vallist& args) -> lua::rt::cfunction::result {
+                        for (const auto& arg : args)
+                            output += arg.to_string() + "\t";
+                        output += "\n";
+                        return lua::rt::vallist{};
+                    }),
+                false);
+
+    auto eval_result = eval.run(std::get<LuaChunk>(result), env);
+    if (std::holds_alternative<lua::rt::EvalError>(eval_result))
+        output += "error: " + std::get<lua::rt::EvalError>(eval_result).message();
+
+    env->clear();
+
+    return output;
+}
+
+TEST_CASE("bytecode vm", "[interpreter][leaks]") {
+    lua::rt::BytecodeVM vm;
+    vm.budget.set_limit(lua::rt::StepBudget::unlimited);
+
+    SECTION("parse, eval, update") {
+        std::string program = "for i=1, 10, 1 do \n    print('hello world ', i)\nend";
+        REQUIRE(parse_eval_update(program, vm) == program);
+
+        REQUIRE(parse_eval_update("force(2, 3)", vm) == "force(3, 3)");
+        program = "t = {} for i=1, 3, 2 do t[i] = i end force(t[3], 9)";
+        REQUIRE(parse_eval_update(program, vm) == parse_eval_update(program));
+        program = "i=(function () return 2 end)()+0.5; force(i, 3)";
+        REQUIRE(parse_eval_update(program, vm) == parse_eval_update(program));
+        program = "i=1+1.5; force(-i, 3)";
+        REQUIRE(parse_eval_update(program, vm) == parse_eval_update(program));
+
+        program = "print('test')\n --print('normal comment')\nprint('hello')";
+        REQUIRE(parse_eval_update(program, vm) == program);
+    }
+
+    SECTION("same output as the ASTEvaluator") {
+        const std::vector<std::string> programs = {
+            "a = 3\nb=4\nprint(a+b, a-b, a*b, a/b, a^b, b%a, a .. b)",
+            "a,b = 3,4\nb,a=a,b\nprint(a-b)",
+            "function mult(a, b) return a*b end print(mult(2, 3))",
+            "function test() for i=1, 10 do if i == 5 then return i end end end print(test())",
+            "function f() return 1, 2, 3 end a, b, c, d = f() print(a, b, c, d, f())",
+            "if a then print('fail') elseif 1 < 2 then print('pass') else print('fail') end",
+            "for i=1, 5 do print(i) if i==2 then break end end",
+            "n = 3 s = 1 for i=1, n, s do n = 1 s = 5 print(i) end for i=3, 1, -1 do print(i) end",
+            "for i=0, 1, 0.25 do print(i) end for i=1, 'a' do end",
+            "b = -1 while not (b > 5) do a=0 repeat a=a+1 if a ~= b then print(a, b) else break "
+            "end until a == 10 b = b+1 end",
+            "a = {4, 5, 6; foo = 'bar', [10] = true} print(a[2], a.foo, a[10], #a)",
+            "a = {} a['foo'] = 5 a[1] = 2 print(a['foo'], a[1])",
+            "function getx(p) return p.x end a = {x = 1} b = {y = 2, x = 3} "
+            "print(getx(a), getx(b), getx({})) a.x = nil b['x'] = 4 print(getx(a), getx(b), b.y)",
+            "a = {} a.b = 1 print(a.b, b)",
+            "a=2 if true then local a=3 print(a) end print(a)",
+            "local function test() local i = 0 return function () while true do if i == 5 then "
+            "break end i=i+1 end return i, 2 end end b=test() i=\"a\" print(i, b())",
+            "a = 3 print(_G._G._G._G._G.a)",
+            "print(math.sin(2), math.floor(2.5), tostring(3) .. 'a', type({}))",
+            "print(undefined())",
+        };
+
+        lua::rt::ASTEvaluator ast_eval;
+        ast_eval.budget.set_limit(lua::rt::StepBudget::unlimited);
+        for (const auto& program : programs) {
+            INFO(program);
+            REQUIRE(eval_output(program, vm) == eval_output(program, ast_eval));
+        }
+    }
+
+    SECTION("lua semantics") {
+        // recursion (every call gets its own activation)
+        REQUIRE(eval_output("function fib(n) if n < 2 then return n end return fib(n-1) + "
+                            "fib(n-2) end print(fib(10))",
+                            vm) == "55\t\n");
+
+        // the loop variable is local and the bounds are only evaluated once
+        REQUIRE(eval_output("n = 3 for i=1, n do n = 1 print(i) end print(i)", vm) ==
+                "1\t\n2\t\n3\t\nnil\t\n");
+        REQUIRE(eval_output("for i=1, 2, 0 do end", vm) == "error: 'for' step is zero");
+        REQUIRE(eval_output("for i=3, 1, -1 do print(i) end", vm) == "3\t\n2\t\n1\t\n");
+
+        // float steps are added up like in reference Lua: 0.1 added ten times is just below 1
+        // and twenty times just below 2 (so there is no iteration for 2)
+        lua::rt::ASTEvaluator ast_eval;
+        for (const lua::rt::Evaluator* eval :
+             std::vector<const lua::rt::Evaluator*>{&ast_eval, &vm}) {
+            INFO((eval == &vm ? "vm" : "ast"));
+            REQUIRE(eval_output("for i=0, 1, 0.1 do last = i end print(last == 0.9999999999999999)",
+                                *eval) == "true\t\n");
+            REQUIRE(eval_output("n = 0 for i=0, 2, 0.1 do n = n + 1 end print(n)", *eval) ==
+                    "20\t\n");
+            REQUIRE(eval_output("n = 0 for i=0, 0.6, 0.1 do n = n + 1 end print(n)", *eval) ==
+                    "7\t\n");
+        }
+
+        // and/or short circuit
+        REQUIRE(eval_output("print(nil and undefined(), 1 or undefined(), false or 2)", vm) ==
+                "nil\t1\t2\t\n");
+
+        REQUIRE(eval_output("if true then break end", vm) ==
+                "error: compile -> break outside of a loop");
+        REQUIRE(eval_output("a = 5 a.b = 3", vm) == "error: cannot access member on number");
+    }
+
+    SECTION("call stack") {
+        // calls don't use the native stack (without tracking, because the sources of the values
+        // would be nested as deeply as the calls)
+        lua::rt::UntrackedBytecodeVM untracked;
+        untracked.budget.set_limit(lua::rt::StepBudget::unlimited);
+        REQUIRE(eval_output("function depth(n) if n == 0 then return 0 end return 1 + "
+                            "depth(n - 1) end print(depth(100000))",
+                            untracked) == "100000\t\n");
+
+        // tail calls replace the frame of the caller
+        REQUIRE(eval_output("function loop(n) if n == 0 then return 'done' end return loop(n - 1) "
+                            "end print(loop(1000000))",
+                            untracked) == "done\t\n");
+        REQUIRE(eval_output("function f(a) return print(a, 2) end f(1)", vm) == "1\t2\t\n");
+        REQUIRE(eval_output("function f() return g(1) end function g(a) return a, a + 1 end "
+                            "print(f())",
+                            vm) == "1\t2\t\n");
+
+        vm.stack_limit = 64 * 1024;
+        REQUIRE(eval_output("function f() return 1 + f() end f()", vm) == "error: stack overflow");
+        REQUIRE(eval_output("function sum(n) if n == 0 then return 0 end return n + sum(n - 1) "
+                            "end print(sum(10))",
+                            vm) == "55\t\n");
+
+        // the AST evaluator recurses on the native stack, its depth is limited by stack_limit
+        // (300 calls fit into the default even in debug builds with sanitizers)
+        lua::rt::ASTEvaluator ast_eval;
+        ast_eval.budget.set_limit(lua::rt::StepBudget::unlimited);
+        REQUIRE(eval_output("function cnt(n) if n == 0 then return 0 end return 1 + cnt(n - 1) "
+                            "end print(cnt(300))",
+                            ast_eval) == "300\t\n");
+        REQUIRE(eval_output("function cnt(n) if n == 0 then return 0 end return cnt(n - 1) end "
+                            "print(cnt(100000))",
+                            ast_eval) == "error: stack overflow");
+
+#if defined(__GLIBC__)
+        // a thread with a smaller stack than stack_limit lowers the limit of its runs
+        LuaParser parser;
+        PerformanceStatistics ps;
+        const auto result = parser.parse(
+            "function cnt(n) if n == 0 then return 0 end return cnt(n - 1) end cnt(100000)", ps);
+        REQUIRE(std::holds_alternative<LuaChunk>(result));
+
+        struct Worker {
+            const lua::rt::ASTEvaluator& eval;
+            LuaChunk chunk;
+            std::shared_ptr<lua::rt::Environment> env;
+            lua::rt::eval_result_t result;
+        } worker{ast_eval, std::get<LuaChunk>(result),
+                 std::make_shared<lua::rt::Environment>(nullptr), lua::rt::EvalError{"not run"}};
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 512 * 1024);
+        pthread_t thread;
+        REQUIRE(pthread_create(
+                    &thread, &attr,
+                    [](void* arg) -> void* {
+                        auto& worker = *static_cast<Worker*>(arg);
+                        worker.result = worker.eval.run(worker.chunk, worker.env);
+                        return nullptr;
+                    },
+                    &worker) == 0);
+        pthread_join(thread, nullptr);
+        pthread_attr_destroy(&attr);
+        worker.env->clear();
+
+        REQUIRE(std::holds_alternative<lua::rt::EvalError>(worker.result));
+        REQUIRE(std::get<lua::rt::EvalError>(worker.result).message() == "stack overflow");
+#endif
+    }
+
+    SECTION("long expressions") {
+        // operator chains lean to the left and are compiled without recursion
+        std::string chain = "print(1";
+        for (int i = 0; i < 20000; ++i)
+            chain += " + 1";
+        chain += ")";
+        REQUIRE(eval_output(chain, vm) == "20001\t\n");
+
+        // right associative chains nest, their nesting is limited to 1000 levels (the assignment
+        // is the first level, every .. adds one)
+        auto concat = [](int levels) {
+            std::string program = "x = 'a'";
+            for (int i = 1; i < levels; ++i)
+                program += " .. 'a'";
+            return program + " print(x == '" + std::string(levels, 'a') + "')";
+        };
+        REQUIRE(eval_output(concat(1000), vm) == "true\t\n");
+        REQUIRE(eval_output(concat(1001), vm) == "error: compile -> expression nested too deeply");
+
+        lua::rt::UntrackedASTEvaluator ast_eval;
+        ast_eval.budget.set_limit(lua::rt::StepBudget::unlimited);
+        REQUIRE(eval_output(concat(1000), ast_eval) == "true\t\n");
+        ast_eval.stack_limit = 64 * 1024;
+        REQUIRE(eval_output(chain, ast_eval) == "error: stack overflow");
+
+        // the parser recurses for parentheses, it allows 1000 levels of nesting (the chunk and
+        // the assigned expression are the first two)
+        auto parens = [](int levels) {
+            return "x = " + std::string(levels - 2, '(') + "1" + std::string(levels - 2, ')') +
+                   " print(x)";
+        };
+        REQUIRE(eval_output(parens(1000), vm) == "1\t\n");
+
+        LuaParser parser;
+        PerformanceStatistics ps;
+        for (int levels : {1001, 30000}) {
+            const auto result = parser.parse(parens(levels), ps);
+            REQUIRE(std::holds_alternative<std::string>(result));
+            REQUIRE(std::get<std::string>(result).find("expression nested too deeply") !=
+                    std::string::npos);
+        }
+
+        // blocks count against the same limit, the chunk is the first level and every loop body
+        // adds one
+        auto blocks = [](int levels) {
+            std::string program;
+            for (int i = 1; i < levels; ++i)
+                program += "repeat ";
+            for (int i = 1; i < levels; ++i)
+                program += "until true ";
+            return program + "print(1)";
+        };
+        REQUIRE(eval_output(blocks(1000), vm) == "1\t\n");
+        const auto result = parser.parse(blocks(1001), ps);
+        REQUIRE(std::holds_alternative<std::string>(result));
+        REQUIRE(std::get<std::string>(result).find("block nested too deeply") != std::string::npos);
+    }
+}
+
+TEST_CASE("step budget", "[interpreter]") {
+    lua::rt::ASTEvaluator ast_eval;
+    lua::rt::BytecodeVM vm;
+
+    SECTION("chunks") {
+        // step() only counts down a chunk, refill() takes the next one from the budget
+        lua::rt::StepBudget budget{100};
+        auto take = [&budget] {
+            int steps = 0;
+            while (budget.step() || budget.refill())
+                ++steps;
+            return steps;
+        };
+
+        REQUIRE(take() == 100);
+        REQUIRE(budget.exhausted());
+        REQUIRE(budget.consumed() == 100);
+
+        budget.extend(10);
+        REQUIRE(!budget.exhausted());
+        REQUIRE(take() == 10);
+        REQUIRE(budget.consumed() == 110);
+
+        budget.reset();
+        REQUIRE(budget.step());
+        budget.abort();
+        REQUIRE(take() == 0);
+        REQUIRE(budget.consumed() == 1);
+
+        // the host can resume a run that used up its steps
+        budget.reset();
+        int resumed = 0;
+        budget.on_exhausted = [&resumed](lua::rt::StepBudget& budget) {
+            if (++resumed <= 2)
+                budget.extend(10);
+        };
+        REQUIRE(take() == 120);
+        REQUIRE(resumed == 3);
+        REQUIRE(budget.consumed() == 120);
+
+        // but not one that was aborted
+        budget.reset();
+        budget.abort();
+        REQUIRE(take() == 0);
+        REQUIRE(resumed == 3);
+    }
+
+    for (const lua::rt::Evaluator* eval : std::vector<const lua::rt::Evaluator*>{&ast_eval, &vm}) {
+        DYNAMIC_SECTION("limit reached " << (eval == &vm ? "(vm)" : "(ast)")) {
+            eval->budget.set_limit(1000);
+            REQUIRE(eval_output("while true do end", *eval) ==
+                    "error: visit limit reached, stopping");
+            REQUIRE(eval->budget.exhausted());
+            REQUIRE(eval->budget.consumed() == 1000);
+
+            // the next run gets the full limit again
+            REQUIRE(eval_output("print(1)", *eval) == "1\t\n");
+            REQUIRE(eval->budget.consumed() < 1000);
+        }
+
+        DYNAMIC_SECTION("runs back to back " << (eval == &vm ? "(vm)" : "(ast)")) {
+            const std::string program = "s = 0 for i=1, 10 do s = s + i end print(s)";
+            eval->budget.set_limit(lua::rt::StepBudget::unlimited);
+            REQUIRE(eval_output(program, *eval) == "55\t\n");
+            const auto steps = eval->budget.consumed();
+
+            // the limit is enough for one run, but not for two
+            eval->budget.set_limit(steps + steps / 2);
+            REQUIRE(eval_output(program, *eval) == "55\t\n");
+            REQUIRE(eval_output(program, *eval) == "55\t\n");
+            REQUIRE(eval->budget.consumed() == steps);
+        }
+
+        DYNAMIC_SECTION("resume " << (eval == &vm ? "(vm)" : "(ast)")) {
+            eval->budget.set_limit(100);
+            int resumed = 0;
+            eval->budget.on_exhausted = [&resumed](lua::rt::StepBudget& budget) {
+                ++resumed;
+                budget.extend(100);
+            };
+            REQUIRE(eval_output("s = 0 for i=1, 1000 do s = s + i end print(s)", *eval) ==
+                    "500500\t\n");
+            REQUIRE(resumed > 0);
+            REQUIRE(eval->budget.consumed() > 100);
+            eval->budget.on_exhausted = nullptr;
+        }
+
+        DYNAMIC_SECTION("abort " << (eval == &vm ? "(vm)" : "(ast)")) {
+            eval->budget.set_limit(lua::rt::StepBudget::unlimited);
+
+            LuaParser parser;
+            PerformanceStatistics ps;
+            const auto result = parser.parse("while true do stop() end", ps);
+            REQUIRE(std::holds_alternative<LuaChunk>(result));
+
+            auto env = std::make_shared<lua::rt::Environment>(nullptr);
+            env->assign(string{"stop"},
+                        make_shared<lua::rt::cfunction>(
+                            [eval](const lua::rt::vallist&) -> lua::rt::cfunction::result {
+                                eval->budget.abort();
+                                return lua::rt::vallist{};
+                            }),
+                        false);
+
+            auto eval_result = eval->run(std::get<LuaChunk>(result), env);
+            REQUIRE(std::holds_alternative<lua::rt::EvalError>(eval_result));
+            REQUIRE(std::get<lua::rt::EvalError>(eval_result).message() == "execution aborted");
+            env->clear();
+        }
+    }
+}
+
+TEST_CASE("provenance policy", "[interpreter]") {
+    lua::rt::ASTEvaluator ast_eval;
+    lua::rt::UntrackedASTEvaluator untracked_ast;
+    lua::rt::UntrackedBytecodeVM untracked_vm;
+
+    SECTION("same output") {
+        const std::vector<std::string> programs = {
+            "a = 3\nb=4\nprint(a+b, a-b, a*b, a/b, a^b, b%a, -a, a .. b)",
+            "function fib(n) if n < 2 then return n end return fib(n-1) + fib(n-2) end "
+            "print(fib(10))",
+            "a = {4, 5, 6; foo = 'bar'} for i=1, #a do print(a[i]) end print(a.foo)",
+            "print(math.sin(2), math.floor(2.5))",
+        };
+
+        for (const auto& program : programs) {
+            INFO(program);
+            REQUIRE(eval_output(program, untracked_ast) == eval_output(program, ast_eval));
+            REQUIRE(eval_output(program, untracked_vm) == eval_output(program, ast_eval));
+        }
+    }
+
+    SECTION("no sources without tracking") {
+        for (const lua::rt::Evaluator* eval :
+             std::vector<const lua::rt::Evaluator*>{&untracked_ast, &untracked_vm}) {
+            LuaParser parser;
+            PerformanceStatistics ps;
+            const auto result = parser.parse("a = 1 + 2 * -3 b = 'b' t = {} c = 2\\", ps);
+            REQUIRE(std::holds_alternative<LuaChunk>(result));
+
+            auto env = std::make_shared<lua::rt::Environment>(nullptr);
+            auto eval_result = eval->run(std::get<LuaChunk>(result), env);
+            REQUIRE(std::holds_alternative<lua::rt::eval_success_t>(eval_result));
+            REQUIRE(!lua::rt::get_sc(eval_result));
+
+            for (const char* name : {"a", "b", "t", "c"})
+                REQUIRE(env->getglobal(std::string{name}).source == nullptr);
+            env->clear();
+        }
+
+        REQUIRE(parse_eval_update("force(2, 3)", untracked_ast) == "force(2, 3)");
+        REQUIRE(parse_eval_update("force(2, 3)", untracked_vm) == "force(2, 3)");
+    }
+
+    SECTION("long chains") {
+        // the chain of x is collapsed instead of growing with every iteration
+        ast_eval.budget.set_limit(lua::rt::StepBudget::unlimited);
+        REQUIRE(parse_eval_update("x = 0 for i=1, 200000 do x = x + 1 end force(x, 200001)",
+                                  ast_eval) ==
+                "x = 1 for i=1, 200000 do x = x + 1 end force(x, 200001)");
+    }
+
+    SECTION("lazy tracking") {
+        lua::rt::LazyASTEvaluator lazy_ast;
+        lua::rt::LazyBytecodeVM lazy_vm;
+
+        const std::vector<std::string> programs = {
+            "a = (5*2)+3 force(a, 7)",
+            "a = 2 b = a * 3 - 1 force(-b, 1)",
+            "x = 0 for i=1, 3 do x = x + i end force(x, 12)",
+            "i=1+1.5; force(-i, 3)",
+        };
+
+        for (const auto& program : programs) {
+            INFO(program);
+            REQUIRE(parse_eval_update(program, lazy_ast) == parse_eval_update(program, ast_eval));
+            REQUIRE(parse_eval_update(program, lazy_vm) == parse_eval_update(program, ast_eval));
+        }
+
+        // the chain of x spans several traces
+        lazy_ast.budget.set_limit(lua::rt::StepBudget::unlimited);
+        REQUIRE(parse_eval_update("x = 0 for i=1, 1100 do x = x + 2 end force(x, 2201)",
+                                  lazy_ast) ==
+                "x = 1 for i=1, 1100 do x = x + 2 end force(x, 2201)");
+
+        // past max_depth the chain is collapsed like the one of FullTracking
+        lazy_vm.budget.set_limit(lua::rt::StepBudget::unlimited);
+        const std::string program = "x = 0 for i=1, 300000 do x = x + 1 end force(x, 300001)";
+        const std::string updated = "x = 1 for i=1, 300000 do x = x + 1 end force(x, 300001)";
+        REQUIRE(parse_eval_update(program, lazy_ast) == updated);
+        REQUIRE(parse_eval_update(program, lazy_vm) == updated);
+    }
+}
+
+TEST_CASE("call frames", "[interpreter]") {
+    lua::rt::ASTEvaluator ast_eval;
+    lua::rt::BytecodeVM vm;
+
+    for (const lua::rt::Evaluator* eval : std::vector<const lua::rt::Evaluator*>{&ast_eval, &vm}) {
+        DYNAMIC_SECTION("recursion and closures " << (eval == &vm ? "(vm)" : "(ast)")) {
+            eval->budget.set_limit(lua::rt::StepBudget::unlimited);
+
+            REQUIRE(eval_output("memo = {} function fib(n) if n < 2 then return n end "
+                                "if memo[n] then return memo[n] end "
+                                "local r = fib(n - 1) + fib(n - 2) memo[n] = r return r end "
+                                "print(fib(25))",
+                                *eval) == "75025\t\n");
+
+            // frames that are captured by closures are not reused
+            REQUIRE(eval_output("function mk(x) return function () return x end end "
+                                "a = mk(1) b = mk(2) function g(y) return y end g(5) g(6) "
+                                "for i=1, 3 do local c = i end print(a(), b())",
+                                *eval) == "1\t2\t\n");
+
+            REQUIRE(eval->frames.size() > 0);
+        }
+    }
+}
+
+TEST_CASE("incremental execution", "[interpreter]") {
+    lua::rt::ASTEvaluator ast_eval;
+    lua::rt::BytecodeVM vm;
+
+    for (const lua::rt::Evaluator* eval : std::vector<const lua::rt::Evaluator*>{&ast_eval, &vm}) {
+        DYNAMIC_SECTION("rerun " << (eval == &vm ? "(vm)" : "(ast)")) {
+            lua::rt::IncrementalRunner runner{*eval};
+
+            std::string output;
+            runner.define_effect(
+                "print", make_shared<lua::rt::cfunction>(
+                             [&output](const lua::rt::vallist& args) -> lua::rt::cfunction::result {
+                                 for (const auto& arg : args)
+                                     output += arg.to_string() + "\t";
+                                 output += "\n";
+                                 return lua::rt::vallist{};
+                             }));
+
+            auto stdlib = std::make_shared<lua::rt::Environment>(nullptr);
+            add_force_function_to_env(stdlib);
+            runner.define("force", stdlib->getglobal(std::string{"force"}));
+
+            // runs the program and returns what it printed and the changed program
+            auto run = [&](const std::string& program) {
+                LuaParser parser;
+                PerformanceStatistics ps;
+                const auto result = parser.parse(program, ps);
+                REQUIRE(std::holds_alternative<LuaChunk>(result));
+
+                output.clear();
+                auto eval_result = runner.run(std::get<LuaChunk>(result));
+                REQUIRE(std::holds_alternative<lua::rt::eval_success_t>(eval_result));
+
+                std::string new_program = program;
+                if (auto sc = get_sc(eval_result))
+                    new_program = get_string((*sc)->apply(parser.tokens()));
+                return std::make_pair(output, new_program);
+            };
+
+            const std::string program = "a = 1 local b = 2 function f(x) return x + b end "
+                                        "print(f(a)) c = f(3) print(c)";
+            REQUIRE(run(program).first == "3\t\n5\t\n");
+            REQUIRE(runner.stats().executed == 6);
+
+            // the effects of the reused statements are repeated
+            REQUIRE(run(program).first == "3\t\n5\t\n");
+            REQUIRE(runner.stats().reused == 6);
+
+            // only the statements that read a have to be executed again
+            REQUIRE(run("a = 2 local b = 2 function f(x) return x + b end "
+                        "print(f(a)) c = f(3) print(c)")
+                        .first == "4\t\n5\t\n");
+            REQUIRE(runner.stats().executed == 2);
+            REQUIRE(runner.stats().reused == 4);
+
+            // a local with another name changes the variables of the following statements
+            REQUIRE(run("local b = 2 print(b)").first == "2\t\n");
+            REQUIRE(run("local x = 2 print(b)").first == "nil\t\n");
+            REQUIRE(runner.stats().executed == 2);
+
+            // tables can be changed through other references, so they are not reused
+            REQUIRE(run("t = {1} print(t[1])").first == "1\t\n");
+            REQUIRE(run("t = {1} print(t[1])").first == "1\t\n");
+            REQUIRE(runner.stats().executed == 2);
+
+            // the source changes of reused statements are kept
+            REQUIRE(run("x = 1 force(x, 2)").second == "x = 2 force(x, 2)");
+            REQUIRE(run("x = 1 force(x, 2)").second == "x = 2 force(x, 2)");
+            REQUIRE(runner.stats().reused == 2);
+
+            // the following statements are reused if a statement changes its length
+            REQUIRE(run("a = 1 function f() return 2 end print(f())").first == "2\t\n");
+            REQUIRE(run("a = 10 function f() return 2 end print(f())").first == "2\t\n");
+            REQUIRE(runner.stats().executed == 1);
+            REQUIRE(runner.stats().reused == 2);
+
+            // or a statement is inserted, their source changes move with them
+            REQUIRE(run("function f() return 2 end force(f(), 5)").second ==
+                    "function f() return 5 end force(f(), 5)");
+            REQUIRE(run("x = 1 function f() return 2 end force(f(), 5)").second ==
+                    "x = 1 function f() return 5 end force(f(), 5)");
+            REQUIRE(runner.stats().executed == 1);
+            REQUIRE(runner.stats().reused == 2);
+            REQUIRE(run("x = 1 function f() return 2 end force(f(), 5) print(f())").first ==
+                    "2\t\n");
+            REQUIRE(runner.stats().reused == 3);
+
+            // every run has its own locals, a closure that the host kept from an earlier run
+            // still sees the ones of its run
+            auto kept = make_shared<lua::rt::table>();
+            runner.define("kept", lua::rt::val{kept});
+            REQUIRE(run("local x = 1 kept.getx = function () return x end").first.empty());
+            REQUIRE(run("local y = 2 print(kept.getx(), y)").first == "1\t2\t\n");
+
+            // reused closures over the locals get the ones of the new run
+            REQUIRE(run("local b = 1 function f() return b end print(f())").first == "1\t\n");
+            REQUIRE(run("local b = 1 function f() return b end print(f()) b = 4 print(f())")
+                        .first == "1\t\n4\t\n");
+            REQUIRE(runner.stats().reused == 3);
+        }
+
+        DYNAMIC_SECTION("step budget " << (eval == &vm ? "(vm)" : "(ast)")) {
+            lua::rt::IncrementalRunner runner{*eval};
+            auto run = [&](const std::string& program) {
+                LuaParser parser;
+                PerformanceStatistics ps;
+                const auto result = parser.parse(program, ps);
+                REQUIRE(std::holds_alternative<LuaChunk>(result));
+                return runner.run(std::get<LuaChunk>(result));
+            };
+            auto loop = [](int n) {
+                return "x = " + std::to_string(n) + " for i=1, 20 do x = x + i end ";
+            };
+
+            eval->budget.set_limit(lua::rt::StepBudget::unlimited);
+            run(loop(0));
+            const auto steps = eval->budget.consumed();
+            eval->budget.set_limit(steps + steps / 2);
+
+            // every run gets the full budget
+            for (int n = 1; n <= 50; ++n) {
+                INFO(n);
+                REQUIRE(std::holds_alternative<lua::rt::eval_success_t>(run(loop(n))));
+                REQUIRE(runner.stats().executed == 2);
+            }
+
+            // the statements of a run share it
+            auto result = run(loop(0) + "y = 0 for i=1, 20 do y = y + i end");
+            REQUIRE(std::holds_alternative<lua::rt::EvalError>(result));
+            REQUIRE(eval->budget.exhausted());
+        }
+    }
+}
+
+TEST_CASE("resolver", "[parse][interpreter]") {
+    SECTION("lexical addresses") {
+        LuaParser parser;
+        PerformanceStatistics ps;
+        const auto result =
+            parser.parse("local a = 1 b = a if a then local c = a + b end local a = 2", ps);
+        REQUIRE(std::holds_alternative<LuaChunk>(result));
+        const auto& chunk = std::get<LuaChunk>(result);
+        REQUIRE(chunk->num_slots == 2);
+
+        auto ref = [](const LuaExp& exp) {
+            return std::dynamic_pointer_cast<_LuaNameVar>(exp)->name->ref;
+        };
+
+        auto assign_b = std::dynamic_pointer_cast<_LuaAssignment>(chunk->statements[1]);
+        REQUIRE(ref(assign_b->varlist->exps[0]).kind == VarRef::Kind::Global);
+        REQUIRE(ref(assign_b->explist->exps[0]).kind == VarRef::Kind::Local);
+        REQUIRE(ref(assign_b->explist->exps[0]).slot == 0);
+
+        auto if_stmt = std::dynamic_pointer_cast<_LuaIfStmt>(chunk->statements[2]);
+        auto body = if_stmt->branches[0].second;
+        REQUIRE(body->num_slots == 1);
+        auto assign_c = std::dynamic_pointer_cast<_LuaAssignment>(body->statements[0]);
+        auto sum = std::dynamic_pointer_cast<_LuaOp>(assign_c->explist->exps[0]);
+        REQUIRE(ref(sum->lhs).kind == VarRef::Kind::Local);
+        REQUIRE(ref(sum->lhs).depth == 1);
+        REQUIRE(ref(assign_c->varlist->exps[0]).depth == 0);
+
+        auto assign_a = std::dynamic_pointer_cast<_LuaAssignment>(chunk->statements[3]);
+        REQUIRE(ref(assign_a->varlist->exps[0]).slot == 1);
+
+        // globals get their key for the global table
+        auto name_b = std::dynamic_pointer_cast<_LuaNameVar>(assign_b->varlist->exps[0])->name;
+        REQUIRE(name_b->global.key == lua::rt::val{"b"});
+    }
+
+    SECTION("scoping") {
+        lua::rt::ASTEvaluator ast_eval;
+        lua::rt::BytecodeVM vm;
+
+        const std::vector<std::pair<std::string, std::string>> programs = {
+            {"x = 1 local x = 2 print(x) function f() return x end x = 3 print(f())",
+             "2\t\n3\t\n"},
+            {"for i=1, 2 do print(x) local x = i end", "nil\t\nnil\t\n"},
+            {"function f() print(y) local y = 1 end f() f()", "nil\t\nnil\t\n"},
+            {"fs = {} for i=1, 3 do fs[i] = function () return i end end print(fs[1](), fs[3]())",
+             "1\t3\t\n"},
+            {"local function count(n) if n > 0 then return count(n - 1) + 1 end return 0 end "
+             "print(count(3))",
+             "3\t\n"},
+            {"a = 0 repeat local b = a a = a + 1 until b == 2 print(a)", "3\t\n"},
+            // the cached globals see new and removed globals
+            {"function f() return g end for i=1, 3 do if i == 2 then g = i end if i == 3 then "
+             "g = nil end print(f()) end",
+             "nil\t\n2\t\nnil\t\n"},
+        };
+
+        for (const auto& [program, output] : programs) {
+            INFO(program);
+            REQUIRE(eval_output(program, ast_eval) == output);
+            REQUIRE(eval_output(program, vm) == output);
+        }
+    }
+
+    SECTION("runs in one environment") {
+        lua::rt::ASTEvaluator ast_eval;
+        lua::rt::BytecodeVM vm;
+
+        for (const lua::rt::Evaluator* eval :
+             std::vector<const lua::rt::Evaluator*>{&ast_eval, &vm}) {
+            INFO((eval == &vm ? "vm" : "ast"));
+
+            std::string output;
+            auto env = std::make_shared<lua::rt::Environment>(nullptr);
+            env->populate_stdlib();
+            env->assign(string{"print"},
+                        make_shared<lua::rt::cfunction>(
+                            [&output](const lua::rt::vallist& args) -> lua::rt::cfunction::result {
+                                for (const auto& arg : args)
+                                    output += arg.to_string() + "\t";
+                                output += "\n";
+                                return lua::rt::vallist{};
+                            }),
+                        false);
+
+            auto run = [&](const std::string& program) {
+                LuaParser parser;
+                PerformanceStatistics ps;
+                const auto result = parser.parse(program, ps);
+                REQUIRE(std::holds_alternative<LuaChunk>(result));
+                REQUIRE(std::holds_alternative<lua::rt::eval_success_t>(
+                    eval->run(std::get<LuaChunk>(result), env)));
+            };
+
+            // the second run has its own locals, the closure of the first one keeps its x
+            run("local x = 1 function getx() return x end");
+            run("local y = 2 print(getx(), y) local x = 3 print(getx(), x)");
+            REQUIRE(output == "1\t2\t\n1\t3\t\n");
+
+            env->clear();
+        }
+    }
+}
+
+TEST_CASE("shared statements", "[parse][interpreter]") {
+    LuaParser parser;
+    PerformanceStatistics ps;
+    auto parse = [&](const std::string& program) {
+        auto result = parser.parse(program, ps);
+        REQUIRE(std::holds_alternative<LuaChunk>(result));
+        return std::get<LuaChunk>(result);
+    };
+
+    // the statements of the first chunk are recorded, the later chunks share them
+    std::unordered_map<const _LuaStmt*, lua::rt::StmtScope> scopes;
+    lua::rt::SharedStatements shared;
+    auto track = [&](const LuaChunk& chunk) {
+        for (const auto& stmt : chunk->statements)
+            shared.scopes[stmt.get()] = &scopes[stmt.get()];
+    };
+
+    auto first = parse("local a = 1 function f() return a end");
+    const auto local_a = first->statements[0];
+    const auto f = first->statements[1];
+    track(first);
+    lua::rt::resolve(first, shared);
+
+    // a copy is parsed again
+    const std::unordered_map<const _LuaStmt*, std::string> texts = {
+        {local_a.get(), "local a = 1"}, {f.get(), "function f() return a end"}};
+    int copies = 0;
+    shared.copy = [&](const LuaStmt& stmt) {
+        ++copies;
+        auto copy = parse(texts.at(stmt.get()))->statements[0];
+        shared.scopes[copy.get()] = &scopes[copy.get()];
+        return copy;
+    };
+
+    // the variable returned by f
+    auto ref = [](const LuaStmt& stmt) {
+        auto assign = std::dynamic_pointer_cast<_LuaAssignment>(stmt);
+        auto function = std::dynamic_pointer_cast<_LuaFunction>(assign->explist->exps[0]);
+        auto ret = std::dynamic_pointer_cast<_LuaReturnStmt>(function->body->statements[0]);
+        return std::dynamic_pointer_cast<_LuaNameVar>(ret->explist->exps[0])->name->ref;
+    };
+    auto uses = [&](const LuaStmt& stmt, const std::string& name) {
+        for (const auto& use : scopes[stmt.get()].uses) {
+            if (use.first == name)
+                return std::optional<VarRef>{use.second};
+        }
+        return std::optional<VarRef>{};
+    };
+
+    REQUIRE(scopes[f.get()].resolved);
+    REQUIRE(uses(f, "a"));
+    REQUIRE(uses(f, "a")->kind == VarRef::Kind::Local);
+    REQUIRE(uses(f, "a")->slot == 0);
+    REQUIRE(uses(f, "f")->kind == VarRef::Kind::Global);
+    REQUIRE(scopes[local_a.get()].declares.size() == 1);
+    REQUIRE(scopes[local_a.get()].uses.empty());
+
+    SECTION("kept where the names are the same") {
+        auto second = parse("y = 1");
+        track(second);
+        second->statements.push_back(local_a);
+        second->statements.push_back(f);
+        lua::rt::resolve(second, shared);
+
+        CHECK(copies == 0);
+        CHECK(second->statements[1] == local_a);
+        CHECK(second->statements[2] == f);
+        CHECK(second->num_slots == 1);
+        CHECK(uses(second->statements[0], "y")->kind == VarRef::Kind::Global);
+    }
+
+    SECTION("copied where a local has another slot") {
+        auto second = parse("local b = 2");
+        track(second);
+        second->statements.push_back(local_a);
+        second->statements.push_back(f);
+        lua::rt::resolve(second, shared);
+
+        CHECK(copies == 2);
+        CHECK(second->statements[1] != local_a);
+        CHECK(second->statements[2] != f);
+        CHECK(ref(second->statements[2]).slot == 1);
+        CHECK(second->num_slots == 2);
+        // the shared statements don't change
+        CHECK(ref(f).slot == 0);
+    }
+
+    SECTION("copied where a local is missing") {
+        auto second = parse("x = 1");
+        track(second);
+        second->statements.push_back(f);
+        lua::rt::resolve(second, shared);
+
+        CHECK(copies == 1);
+        CHECK(ref(second->statements[1]).kind == VarRef::Kind::Global);
+        CHECK(ref(f).kind == VarRef::Kind::Local);
+    }
+}
+
+TEST_CASE("literals", "[parse][interpreter]") {
+    LuaParser parser;
+    PerformanceStatistics ps;
+    const auto result = parser.parse("x = 1.5 y = 'abc'", ps);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+    const auto& chunk = std::get<LuaChunk>(result);
+
+    auto literal = [&](int stmt) {
+        auto assignment = std::dynamic_pointer_cast<_LuaAssignment>(chunk->statements[stmt]);
+        return std::dynamic_pointer_cast<_LuaValue>(assignment->explist->exps[0]);
+    };
+
+    REQUIRE(literal(0)->constant);
+    REQUIRE(*literal(0)->constant == lua::rt::val{1.5});
+    REQUIRE(*literal(1)->constant == lua::rt::val{"abc"});
+
+    // every evaluation returns the decoded constant with the same source
+    auto env = std::make_shared<lua::rt::Environment>(nullptr);
+    lua::rt::ASTEvaluator eval;
+    auto first = eval.eval(*literal(0), env);
+    auto second = eval.eval(*literal(0), env);
+    REQUIRE(lua::rt::get_val(first).source);
+    REQUIRE(lua::rt::get_val(first).source == lua::rt::get_val(second).source);
+
+    SECTION("variables fed from the same literal get their own names") {
+        const auto program = parser.parse("function f() return 5 end a = f() b = f()", ps);
+        REQUIRE(std::holds_alternative<LuaChunk>(program));
+        const auto& chunk = std::get<LuaChunk>(program);
+
+        lua::rt::BytecodeVM vm;
+        const std::vector<const lua::rt::Evaluator*> evaluators = {&eval, &vm};
+        for (const auto* evaluator : evaluators) {
+            // the names don't stick to the literal, a second run names its values again
+            for (int run = 0; run < 2; ++run) {
+                auto globals = std::make_shared<lua::rt::Environment>(nullptr);
+                REQUIRE(std::holds_alternative<lua::rt::eval_success_t>(
+                    evaluator->run(chunk, globals)));
+                REQUIRE(globals->getvar(lua::rt::val{"a"}).source->identifier == "a");
+                REQUIRE(globals->getvar(lua::rt::val{"b"}).source->identifier == "b");
+                globals->clear();
+            }
+        }
+        REQUIRE(lua::rt::get_val(first).source->identifier.empty());
+    }
+}
+
+TEST_CASE("tokenizer", "[parse]") {
+    LuaParser parser;
+    PerformanceStatistics ps;
+
+    // keywords are whole words, even if a parenthesis follows directly
+    const std::string program = "f=function(x)return x..'a'end --[[b]]\nprint(f(.5e-1))--c";
+    REQUIRE(std::holds_alternative<LuaChunk>(parser.parse(program, ps)));
+    REQUIRE(get_string(parser.tokens()) == program);
+
+    using T = LuaToken::Type;
+    const std::vector<std::pair<T, std::string>> expected = {
+        {T::NAME, "f"},        {T::ASSIGN, "="},      {T::FUNCTION, "function"},
+        {T::LRB, "("},         {T::NAME, "x"},        {T::RRB, ")"},
+        {T::RETURN, "return"}, {T::NAME, "x"},        {T::CONCAT, ".."},
+        {T::STRINGLIT, "'a'"}, {T::END, "end"},       {T::BLOCKCOMMENT, "--[[b]]"},
+        {T::NAME, "print"},    {T::LRB, "("},         {T::NAME, "f"},
+        {T::LRB, "("},         {T::NUMLIT, ".5e-1"},  {T::RRB, ")"},
+        {T::RRB, ")"},         {T::COMMENT, "--c"},   {T::NONE, ""},
+    };
+    REQUIRE(parser.tokens().size() == expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        INFO(i);
+        REQUIRE(parser.tokens()[i].type == expected[i].first);
+        REQUIRE(parser.tokens()[i].match() == expected[i].second);
+    }
+    REQUIRE(parser.tokens()[11].ws() == " ");
+    REQUIRE(parser.tokens()[12].pos() == 38);
+
+    // a token of the program has to fit into a LuaToken, a longer one is an error
+    const std::string text(LuaToken::max_length, 'a');
+    const auto result = parser.parse("x = '" + text + "'", ps);
+    REQUIRE(std::holds_alternative<std::string>(result));
+    REQUIRE(std::get<std::string>(result) == "tokenizing failed: the token at 4 is too long");
+
+    // a token with a text of its own is not limited
+    const LuaToken token{T::STRINGLIT, "'" + text + "'", 4};
+    REQUIRE(token.length() == static_cast<long>(text.size()) + 2);
+    REQUIRE(token.match().back() == '\'');
+}
+
+TEST_CASE("statements share the token list", "[parse]") {
+    LuaParser parser;
+    PerformanceStatistics ps;
+
+    auto result = parser.parse("while x do\n  y = 1\nend", ps);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+
+    auto loop = std::dynamic_pointer_cast<_LuaLoopStmt>(std::get<LuaChunk>(result)->statements[0]);
+    REQUIRE(loop);
+    const auto& nested = loop->body->statements[0]->tokens;
+
+    CHECK(loop->tokens.list == nested.list);
+    CHECK(&loop->tokens.list->front() == &parser.tokens().front());
+    CHECK(loop->tokens.size() == 7);
+    CHECK(nested.first == 3);
+    CHECK(nested.size() == 3);
+    CHECK(nested.front().match() == "y");
+    CHECK(nested.back().match() == "1");
+}
+
+TEST_CASE("tokens of an anchor", "[parse]") {
+    using T = LuaToken::Type;
+
+    // "if y then z = 2 end" is a part of a program at 10, "z = 2" is an anchor in it
+    LuaSource part{"if y then z = 2 end", 10};
+    const LuaToken if_token = part.token(T::IF, 0, 2);
+    auto anchor = std::make_unique<LuaSource>(part, 20);
+    const LuaToken z = anchor->token(T::NAME, 0, 1);
+    const LuaToken two = anchor->token(T::NUMLIT, 4, 1);
+
+    CHECK(anchor->pos() == 20);
+    CHECK(if_token.pos() == 10);
+    CHECK(z.pos() == 20);
+    CHECK(z.match() == "z");
+    CHECK(two.pos() == 24);
+    CHECK(two.match() == "2");
+    CHECK(two.ws() == " ");
+    CHECK(anchor->str() == part.str());
+
+    // moving the part moves the tokens of the anchor
+    part.move_to(15);
+    CHECK(if_token.pos() == 15);
+    CHECK(z.pos() == 25);
+    CHECK(two.pos() == 29);
+
+    // an anchor can move into another source, the tokens keep their source alive
+    {
+        auto other = std::make_unique<LuaSource>("while y do z = 2 end", 100);
+        anchor->move_to(*other, 111);
+    }
+    anchor.reset();
+    CHECK(z.pos() == 111);
+    CHECK(z.match() == "z");
+    CHECK(two.pos() == 115);
+    CHECK(two.match() == "2");
+    CHECK(if_token.pos() == 15);
+}
+
 TEST_CASE("Environment", "[interpreter][leaks]") {
     static_assert(std::is_move_constructible<lua::rt::Environment>());
 
@@ -1,8 +1,12 @@
 #include <catch2/catch.hpp>
 #include <cstring>
 #include <iostream>
+#include <string>
 #include <type_traits>
 
+#include "MiniLua/luaastbuilder.hpp"
+#include "MiniLua/luainterpreter.hpp"
+#include "MiniLua/luaparser.hpp"
 #include "tree_sitter/tree_sitter.hpp"
 
 using namespace std::string_literals;
@@ -1065,3 +1069,224 @@ end
         }
     }
 }
+
+// runs the chunk and returns everything it printed
+static std::string run(const LuaChunk& chunk) {
+    std::string output;
+    auto env = std::make_shared<lua::rt::Environment>(nullptr);
+    env->populate_stdlib();
+    env->assign(std::string{"print"},
+                std::make_shared<lua::rt::cfunction>(
+                    [&output](const lua::rt::vallist& args) -> lua::rt::cfunction::result {
+                        for (const auto& arg : args)
+                            output += arg.to_string() + "\t";
+                        output += "\n";
+                        return lua::rt::vallist{};
+                    }),
+                false);
+
+    lua::rt::ASTEvaluator eval;
+    auto eval_result = eval.run(chunk, env);
+    if (std::holds_alternative<lua::rt::EvalError>(eval_result))
+        output += "error: " + std::get<lua::rt::EvalError>(eval_result).message();
+    env->clear();
+    return output;
+}
+
+TEST_CASE("ast builder produces the same programs as the parser", "[tree-sitter][parser]") {
+    const std::vector<std::string> programs = {
+        "a = 3\nb=4\nprint(a+b, a-b, a*b, a/b, a^b, b%a, a .. b)",
+        "a,b = 3,4\nb,a=a,b\nprint(a-b)",
+        "function mult(a, b) return a*b end print(mult(2, 3))",
+        "function f() return 1, 2, 3 end a, b, c, d = f() print(a, b, c, d, f())",
+        "if a then print('fail') elseif 1 < 2 then print('pass') else print('fail') end",
+        "for i=1, 5 do print(i) if i==2 then break end end -- comment",
+        "b = -1 while not (b > 5) do a=0 repeat a=a+1 if a ~= b then print(a, b) else break "
+        "end until a == 10 b = b+1 end",
+        "a = {4, 5, 6; foo = 'bar', [10] = true} print(a[2], a.foo, a[10], #a)",
+        "a = {} a['foo'] = 5 a[1] = 2 print(a['foo'], (a)[1])",
+        "t = {x = 1} t.inc = function (self) self.x = self.x + 1 end t.inc(t) print(t.x)",
+        "a=2 if true then local a=3 print(a) end print(a)",
+        "local function test() local i = 0 return function () while true do if i == 5 then "
+        "break end i=i+1 end return i, 2 end end b=test() i=\"a\" print(i, b())",
+    };
+
+    for (const auto& program : programs) {
+        INFO(program);
+
+        LuaParser lua_parser;
+        PerformanceStatistics ps;
+        auto expected = lua_parser.parse(program, ps);
+        REQUIRE(std::holds_alternative<LuaChunk>(expected));
+
+        ts::Parser parser;
+        ts::Tree tree = parser.parse_string(program);
+        lua::rt::ASTBuilder builder;
+        auto result = builder.build(tree);
+        if (std::holds_alternative<std::string>(result))
+            FAIL(std::get<std::string>(result));
+
+        CHECK(run(std::get<LuaChunk>(result)) == run(std::get<LuaChunk>(expected)));
+    }
+
+    SECTION("tokens have the positions in the source") {
+        std::string program = "a = 3\nb=4\n";
+
+        LuaParser lua_parser;
+        PerformanceStatistics ps;
+        auto expected = std::get<LuaChunk>(lua_parser.parse(program, ps));
+
+        ts::Parser parser;
+        ts::Tree tree = parser.parse_string(program);
+        lua::rt::ASTBuilder builder;
+        auto chunk = std::get<LuaChunk>(builder.build(tree));
+
+        REQUIRE(chunk->statements.size() == 2);
+        for (size_t i = 0; i < 2; ++i) {
+            const auto& tokens = chunk->statements[i]->tokens;
+            const auto& expected_tokens = expected->statements[i]->tokens;
+            REQUIRE(tokens.size() == expected_tokens.size());
+            for (size_t j = 0; j < tokens.size(); ++j) {
+                CHECK(tokens[j].type == expected_tokens[j].type);
+                CHECK(tokens[j].match() == expected_tokens[j].match());
+                CHECK(tokens[j].pos() == expected_tokens[j].pos());
+            }
+        }
+    }
+
+    SECTION("a token has to fit into a LuaToken") {
+        const std::string text(LuaToken::max_length, 'a');
+
+        ts::Parser parser;
+        ts::Tree tree = parser.parse_string("x = '" + text + "'");
+        lua::rt::ASTBuilder builder;
+        auto result = builder.build(tree);
+        REQUIRE(std::holds_alternative<std::string>(result));
+        CHECK(std::get<std::string>(result) == "the token at 1:5 is too long");
+    }
+}
+
+TEST_CASE("ast builder reuses unchanged statements", "[tree-sitter][parser]") {
+    std::string source = "a = 1\nlocal b = 2\nfunction f(x) return x + b end\nprint(f(a))\n";
+
+    ts::Parser parser;
+    ts::Tree tree = parser.parse_string(source);
+
+    lua::rt::ASTBuilder builder;
+    auto result = builder.build(tree);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+    LuaChunk before = std::get<LuaChunk>(result);
+    REQUIRE(before->statements.size() == 4);
+    CHECK(builder.stats().built == 5);
+    CHECK(builder.stats().reused == 0);
+
+    CHECK(run(before) == "3\t\n");
+    long print_pos = before->statements[3]->tokens.front().pos();
+
+    // change the 1 of the first statement to 10
+    ts::Range one{
+        .start = ts::Location{.point = ts::Point{.row = 0, .column = 4}, .byte = 4},
+        .end = ts::Location{.point = ts::Point{.row = 0, .column = 5}, .byte = 5},
+    };
+    ts::EditResult edit = tree.edit({ts::Edit{.range = one, .replacement = "10"s}});
+    REQUIRE(tree.source() == "a = 10\nlocal b = 2\nfunction f(x) return x + b end\nprint(f(a))\n"s);
+
+    result = builder.rebuild(tree, edit);
+    REQUIRE(std::holds_alternative<LuaChunk>(result));
+    LuaChunk chunk = std::get<LuaChunk>(result);
+    REQUIRE(chunk->statements.size() == 4);
+
+    CHECK(builder.stats().built == 1);
+    CHECK(builder.stats().reused == 3);
+    CHECK(builder.stats().copied == 0);
+
+    // the following statements moved by one byte
+    CHECK(chunk->statements[3]->tokens.front().pos() == print_pos + 1);
+    CHECK(chunk->statements[3]->tokens.front().match() == "print");
+    CHECK(run(chunk) == "12\t\n");
+
+    // the other statements are shared with the first build, which still runs like before (with
+    // the new positions)
+    CHECK(chunk->statements[0] != before->statements[0]);
+    for (size_t i = 1; i < 4; ++i)
+        CHECK(chunk->statements[i] == before->statements[i]);
+    CHECK(before->statements[3]->tokens.front().pos() == print_pos + 1);
+    CHECK(run(before) == "3\t\n");
+
+    SECTION("a local declared before a shared statement") {
+        // b is another slot of the main chunk now, its declaration and f are copied
+        ts::Range a{
+            .start = ts::Location{.point = ts::Point{.row = 0, .column = 0}, .byte = 0},
+            .end = ts::Location{.point = ts::Point{.row = 0, .column = 1}, .byte = 1},
+        };
+        edit = tree.edit({ts::Edit{.range = a, .replacement = "local c = 5 a"s}});
+
+        result = builder.rebuild(tree, edit);
+        REQUIRE(std::holds_alternative<LuaChunk>(result));
+        LuaChunk local = std::get<LuaChunk>(result);
+        REQUIRE(local->statements.size() == 5);
+        CHECK(builder.stats().reused == 3);
+        CHECK(builder.stats().copied == 2);
+        CHECK(local->statements[2] != chunk->statements[1]);
+        CHECK(local->statements[3] != chunk->statements[2]);
+        CHECK(local->statements[4] == chunk->statements[3]);
+        CHECK(local->statements[3]->tokens.front().match() == "function");
+
+        CHECK(run(local) == "12\t\n");
+        CHECK(run(chunk) == "12\t\n");
+        CHECK(run(before) == "3\t\n");
+    }
+}
+
+TEST_CASE("ast builder rebuilds in proportion to the edit", "[tree-sitter][parser]") {
+    // the same edit in a program with n statements, returns the statistics of the rebuild
+    auto rebuild = [](int n, bool nested) {
+        std::string source = nested ? "function f()\n" : "";
+        for (int i = 0; i < n; ++i)
+            source += "x" + std::to_string(i) + " = " + std::to_string(i) + " + 1\n";
+        source += nested ? "end\nf()\nprint(x0)\n" : "print(x0)\n";
+
+        ts::Parser parser;
+        ts::Tree tree = parser.parse_string(source);
+        lua::rt::ASTBuilder builder;
+        REQUIRE(std::holds_alternative<LuaChunk>(builder.build(tree)));
+        CHECK(builder.stats().tokens >= static_cast<size_t>(6 * n));
+
+        // change the 1 of the first assignment to 2
+        uint32_t row = nested ? 1 : 0;
+        uint32_t byte = source.find("+ 1") + 2;
+        ts::Range one{
+            .start = ts::Location{.point = ts::Point{.row = row, .column = 9}, .byte = byte},
+            .end = ts::Location{.point = ts::Point{.row = row, .column = 10}, .byte = byte + 1},
+        };
+        ts::EditResult edit = tree.edit({ts::Edit{.range = one, .replacement = "2"s}});
+
+        auto result = builder.rebuild(tree, edit);
+        REQUIRE(std::holds_alternative<LuaChunk>(result));
+        CHECK(run(std::get<LuaChunk>(result)) == "2\t\n");
+        return builder.stats();
+    };
+
+    SECTION("top-level statements") {
+        auto small = rebuild(100, false);
+        auto large = rebuild(1000, false);
+        CHECK(small.built == 1);
+        CHECK(large.built == 1);
+        CHECK(small.reused == 100);
+        CHECK(large.reused == 1000);
+        CHECK(large.tokens == small.tokens);
+        CHECK(large.copied == 0);
+    }
+
+    SECTION("statements nested in a function") {
+        // the function is built again, its other statements are shared
+        auto small = rebuild(100, true);
+        auto large = rebuild(1000, true);
+        CHECK(small.built == 2);
+        CHECK(large.built == 2);
+        CHECK(small.reused == 101);
+        CHECK(large.reused == 1001);
+        CHECK(large.tokens == small.tokens);
+        CHECK(large.copied == 0);
+    }
+}
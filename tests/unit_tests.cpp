@@ -1,3 +1,591 @@
 #include <catch2/catch.hpp>
+#include <cstring>
 
 TEST_CASE("1 == 1", "[simple]") { REQUIRE(1 == 1); }
+
+#include "MiniLua/astarena.hpp"
+#include "MiniLua/compactval.hpp"
+#include "MiniLua/environment.hpp"
+#include "MiniLua/fieldcache.hpp"
+#include "MiniLua/luaast.hpp"
+#include "MiniLua/operators.hpp"
+#include "MiniLua/sourcechange.hpp"
+#include "MiniLua/sourceexp.hpp"
+#include "MiniLua/table.hpp"
+#include "MiniLua/trace.hpp"
+
+TEST_CASE("compact values", "[values]") {
+    using lua::rt::CompactVal;
+    using lua::rt::val;
+
+    SECTION("roundtrip") {
+        auto t = std::make_shared<lua::rt::table>();
+        for (const val& v : {val{}, val{true}, val{false}, val{2.5}, val{-0.0}, val{"foo"},
+                             val{std::string(100, 'x')}, val{t}}) {
+            CompactVal c{v};
+            REQUIRE(c.to_val() == v);
+            REQUIRE(c.to_val().index() == v.index());
+        }
+
+        CompactVal nan{0.0 / 0.0};
+        REQUIRE(nan.isnumber());
+        REQUIRE(nan.number() != nan.number());
+        CompactVal neg_nan{-(0.0 / 0.0)};
+        REQUIRE(neg_nan.isnumber());
+    }
+
+    SECTION("equality") {
+        REQUIRE(CompactVal{val{"foo"}} == CompactVal{val{"foo"}});
+        REQUIRE(CompactVal{val{"foo"}} != CompactVal{val{"bar"}});
+        REQUIRE(CompactVal{1.0} == CompactVal{1.0});
+        REQUIRE(CompactVal{1.0} != CompactVal{true});
+        REQUIRE(CompactVal{val{std::make_shared<lua::rt::table>()}} !=
+                CompactVal{val{std::make_shared<lua::rt::table>()}});
+    }
+
+    SECTION("refcounting") {
+        auto t = std::make_shared<lua::rt::table>();
+        {
+            CompactVal a{val{t}};
+            CompactVal b = a;
+            CompactVal c{std::move(b)};
+            a = c;
+            REQUIRE(t.use_count() == 2);
+        }
+        REQUIRE(t.use_count() == 1);
+    }
+
+    SECTION("array with provenance") {
+        lua::rt::CompactArray array;
+        auto source = lua::rt::sourceval::create(LuaToken{LuaToken::Type::NUMLIT, "1", 0});
+
+        array.push_back(val{1.0, source});
+        array.push_back(val{2.0});
+        REQUIRE(array.get(0).source == source);
+        REQUIRE(array.get(1).source == nullptr);
+
+        array.set(0, val{"a"});
+        REQUIRE(array.get(0) == val{"a"});
+        REQUIRE(array.get(0).source == nullptr);
+
+        array.set(1, val{3.0, source});
+        array.resize(1);
+        array.resize(2);
+        REQUIRE(array.get(1).isnil());
+        REQUIRE(array.get(1).source == nullptr);
+    }
+}
+
+TEST_CASE("tables", "[values]") {
+    using lua::rt::val;
+
+    lua::rt::table t;
+
+    SECTION("append") {
+        for (double i = 1; i <= 100; ++i)
+            t[i] = i * 2;
+        REQUIRE(t.border() == 100);
+        REQUIRE(t.size() == 100);
+        REQUIRE(t.get(50.0) == val{100.0});
+        REQUIRE(t.get(101.0).isnil());
+    }
+
+    SECTION("border with holes") {
+        t = lua::rt::table{{{1.0, "a"}, {2.0, "b"}, {3.0, "c"}}};
+        REQUIRE(t.border() == 3);
+
+        t[2.0] = val{};
+        REQUIRE(t.border() == 1);
+        REQUIRE(t.count(2.0) == 0);
+        REQUIRE(t.size() == 2);
+
+        t[2.0] = "x";
+        REQUIRE(t.border() == 3);
+
+        t[3.0] = val{};
+        REQUIRE(t.border() == 2);
+    }
+
+    SECTION("keys move from the hash part") {
+        t[3.0] = "c";
+        t[2.0] = "b";
+        t["x"] = 1.0;
+        REQUIRE(t.border() == 0);
+
+        t[1.0] = "a";
+        REQUIRE(t.border() == 3);
+        REQUIRE(t.get(3.0) == val{"c"});
+        REQUIRE(t.size() == 4);
+    }
+
+    SECTION("non-integer keys") {
+        t[1.5] = "a";
+        t[0.0] = "b";
+        t[-1.0] = "c";
+        REQUIRE(t.border() == 0);
+        REQUIRE(t.get(1.5) == val{"a"});
+        REQUIRE(t.get(0.0) == val{"b"});
+    }
+
+    SECTION("iteration") {
+        t = lua::rt::table{{{1.0, "a"}, {2.0, "b"}, {"x", "c"}}};
+        t[1.0] = val{};
+
+        std::vector<std::pair<val, val>> entries(t.begin(), t.end());
+        REQUIRE(entries.size() == 2);
+        REQUIRE(entries[0].first == val{2.0});
+        REQUIRE(entries[0].second == val{"b"});
+        REQUIRE(entries[1].first == val{"x"});
+
+        REQUIRE(t.find(1.0) == t.end());
+        REQUIRE(t.find(2.0)->second == val{"b"});
+        REQUIRE(t.find("x")->second == val{"c"});
+    }
+
+    SECTION("nil removes keys") {
+        t["x"] = 1.0;
+        t["x"] = val{};
+        REQUIRE(t.count("x") == 0);
+        REQUIRE(t.empty());
+        REQUIRE(t.begin() == t.end());
+    }
+
+    SECTION("many keys") {
+        // keys come and go, only the last ten stay
+        for (int i = 0; i < 1000; ++i) {
+            t["k" + std::to_string(i)] = static_cast<double>(i);
+            if (i >= 10)
+                t["k" + std::to_string(i - 10)] = val{};
+        }
+        REQUIRE(t.size() == 10);
+        REQUIRE(std::distance(t.begin(), t.end()) == 10);
+        REQUIRE(t.get("k995") == val{995.0});
+        REQUIRE(t.count("k500") == 0);
+    }
+}
+
+TEST_CASE("field caches", "[values]") {
+    using lua::rt::val;
+
+    lua::rt::FieldCache cache;
+    const val key{"x"};
+
+    SECTION("shapes") {
+        lua::rt::table t;
+        auto shape = t.shape();
+        t["x"] = 1.0;
+        REQUIRE(t.shape() != shape);
+
+        // assigning existing keys and the array part keeps the shape
+        shape = t.shape();
+        t["x"] = 2.0;
+        t[1.0] = 2.0;
+        REQUIRE(t.shape() == shape);
+
+        // tables that got the same keys in the same order share their shape
+        lua::rt::table copy = t;
+        REQUIRE(copy.shape() == t.shape());
+        lua::rt::table other;
+        other["x"] = 3.0;
+        REQUIRE(other.shape() == t.shape());
+        other["y"] = 3.0;
+        REQUIRE(other.shape() != t.shape());
+
+        // removing a key keeps its slot
+        t["x"] = val{};
+        REQUIRE(t.shape() == shape);
+        REQUIRE(t.count("x") == 0);
+        REQUIRE(t.size() == 1);
+
+        // tables with many keys get a shape of their own that changes with every new key
+        lua::rt::table a, b;
+        for (unsigned i = 0; i < lua::rt::table::max_shared_keys + 1; ++i) {
+            a[std::to_string(i)] = 1.0;
+            b[std::to_string(i)] = 1.0;
+        }
+        REQUIRE(a.shape() != b.shape());
+        shape = a.shape();
+        a["new"] = 1.0;
+        REQUIRE(a.shape() != shape);
+        REQUIRE(a.size() == lua::rt::table::max_shared_keys + 2);
+
+        // a shared shape doesn't keep the source of the key that created it
+        lua::rt::table keep;
+        std::weak_ptr<lua::rt::sourceexp> key_source;
+        {
+            const val z{"z", lua::rt::sourceval::create(LuaToken{LuaToken::Type::STRINGLIT, "z"})};
+            key_source = z.source;
+            lua::rt::table sourced;
+            sourced[z] = 1.0;
+            keep["z"] = 1.0;
+            REQUIRE(keep.shape() == sourced.shape());
+        }
+        REQUIRE(key_source.expired());
+    }
+
+    SECTION("monomorphic") {
+        lua::rt::table t{{{"x", 1.0}}};
+        REQUIRE(cache.get(t, key) == val{1.0});
+        REQUIRE(cache.size() == 1);
+
+        cache.set(t, key, 2.0);
+        REQUIRE(t.get("x") == val{2.0});
+        REQUIRE(cache.get(t, key) == val{2.0});
+        REQUIRE(cache.size() == 1);
+
+        // removing the key changes the shape
+        cache.set(t, key, val{});
+        REQUIRE(t.count("x") == 0);
+        REQUIRE(cache.get(t, key).isnil());
+        cache.set(t, key, 3.0);
+        REQUIRE(cache.get(t, key) == val{3.0});
+    }
+
+    SECTION("shared shapes") {
+        // one site sees many tables with the same layout
+        std::vector<lua::rt::table> tables(lua::rt::FieldCache::ways * 4);
+        for (unsigned i = 0; i < tables.size(); ++i) {
+            tables[i]["x"] = static_cast<double>(i);
+            tables[i]["y"] = 0.0;
+        }
+
+        for (unsigned i = 0; i < tables.size(); ++i) {
+            REQUIRE(cache.get(tables[i], key) == val{static_cast<double>(i)});
+            cache.set(tables[i], key, static_cast<double>(i + 1));
+        }
+        REQUIRE(cache.size() == 1);
+        REQUIRE(!cache.megamorphic());
+        for (unsigned i = 0; i < tables.size(); ++i)
+            REQUIRE(tables[i].get("x") == val{static_cast<double>(i + 1)});
+    }
+
+    SECTION("one table") {
+        // like the global table: the shape changes with every new key
+        lua::rt::table globals;
+        for (unsigned i = 0; i < lua::rt::table::max_shared_keys * 2; ++i) {
+            globals[std::to_string(i)] = 0.0;
+            REQUIRE(cache.get_monomorphic(globals, key).isnil());
+        }
+        REQUIRE(cache.size() == 1);
+        REQUIRE(!cache.megamorphic());
+
+        cache.set_monomorphic(globals, key, 1.0);
+        REQUIRE(cache.get_monomorphic(globals, key) == val{1.0});
+        cache.set_monomorphic(globals, key, 2.0);
+        REQUIRE(globals.get("x") == val{2.0});
+        cache.set_monomorphic(globals, key, val{});
+        REQUIRE(cache.get_monomorphic(globals, key).isnil());
+        REQUIRE(cache.size() == 1);
+    }
+
+    SECTION("polymorphic and megamorphic") {
+        // the tables get different layouts
+        std::vector<lua::rt::table> tables(lua::rt::FieldCache::ways + 1);
+        for (unsigned i = 0; i < tables.size(); ++i) {
+            tables[i][std::to_string(i)] = 0.0;
+            tables[i]["x"] = static_cast<double>(i);
+        }
+
+        for (unsigned i = 0; i < lua::rt::FieldCache::ways; ++i)
+            REQUIRE(cache.get(tables[i], key) == val{static_cast<double>(i)});
+        REQUIRE(cache.size() == lua::rt::FieldCache::ways);
+        REQUIRE(!cache.megamorphic());
+
+        REQUIRE(cache.get(tables.back(), key) == val{static_cast<double>(tables.size() - 1)});
+        REQUIRE(cache.megamorphic());
+        REQUIRE(cache.get(tables[0], key) == val{0.0});
+    }
+}
+
+TEST_CASE("source change sets", "[sourcechange]") {
+    using namespace lua::rt;
+
+    auto assignment = [](long pos, const std::string& replacement) {
+        return SourceAssignment::create(LuaToken{LuaToken::Type::NUMLIT, "0", pos},
+                                        replacement);
+    };
+    auto replacements = [](const SourceChange& sc) {
+        ApplySCVisitor vis;
+        sc.accept(vis);
+        std::string result;
+        for (const auto& change : vis.changes)
+            result += change.replacement;
+        return result;
+    };
+
+    SECTION("accumulation is flat and in place") {
+        source_change_t sc;
+        sc &= source_change_t{assignment(0, "a")};
+        sc &= source_change_t{assignment(1, "b")};
+        const SourceChange* set = sc->get();
+        REQUIRE(dynamic_cast<const SourceChangeSet*>(set));
+
+        for (int i = 2; i < 100; ++i)
+            sc &= source_change_t{assignment(i, "c")};
+        REQUIRE(sc->get() == set);
+
+        auto tree = std::dynamic_pointer_cast<SourceChangeAnd>(
+            dynamic_cast<const SourceChangeSet*>(set)->tree());
+        REQUIRE(tree);
+        REQUIRE(tree->changes.size() == 100);
+    }
+
+    SECTION("shared sets are not modified") {
+        source_change_t sc = source_change_t{assignment(0, "a")} & assignment(1, "b");
+        source_change_t copy = sc;
+        copy &= source_change_t{assignment(2, "c")};
+        REQUIRE(replacements(**sc) == "ab");
+        REQUIRE(replacements(**copy) == "abc");
+    }
+
+    SECTION("alternatives") {
+        auto inner = make_shared<SourceChangeOr>();
+        inner->alternatives = {assignment(1, "x"), assignment(2, "y")};
+        auto both = make_shared<SourceChangeAnd>();
+        both->changes = {inner, assignment(3, "z")};
+        auto sc_or = make_shared<SourceChangeOr>();
+        sc_or->alternatives = {both, assignment(4, "w")};
+
+        SourceChangeSet set;
+        set.add(*assignment(0, "a"));
+        set.add(*sc_or);
+        set.add(*make_shared<SourceChangeOr>());
+        set.add(*assignment(5, "b"));
+
+        REQUIRE(replacements(set) == "axzb");
+        REQUIRE(replacements(*set.tree()) == "axzb");
+        REQUIRE(set.to_string() == set.tree()->to_string());
+
+        SourceChangeSet copy;
+        copy.add(set);
+        copy.add(copy);
+        REQUIRE(replacements(copy) == "axzbaxzb");
+    }
+}
+
+TEST_CASE("applying source changes", "[sourcechange]") {
+    using namespace lua::rt;
+
+    // "a = 10 + 200"
+    std::vector<LuaToken> tokens = {{LuaToken::Type::NAME, "a", 0, ""},
+                                    {LuaToken::Type::ASSIGN, "=", 2, " "},
+                                    {LuaToken::Type::NUMLIT, "10", 4, " "},
+                                    {LuaToken::Type::ADD, "+", 7, " "},
+                                    {LuaToken::Type::NUMLIT, "200", 9, " "}};
+
+    auto sc = make_shared<SourceChangeAnd>();
+    sc->changes = {SourceAssignment::create(tokens[4], "3"),
+                   SourceAssignment::create(tokens[2], "1"),
+                   SourceAssignment::create(tokens[4], "4"),
+                   SourceAssignment::create(LuaToken{LuaToken::Type::NAME, "b", 5}, "c")};
+
+    auto new_tokens = sc->apply(tokens);
+    REQUIRE(new_tokens[2].match() == "1");
+    REQUIRE(new_tokens[4].match() == "4");
+    REQUIRE(new_tokens[4].length() == 1);
+
+    auto edits = sc->edits(tokens);
+    REQUIRE(edits.size() == 2);
+    REQUIRE(edits[0].pos == 4);
+    REQUIRE(edits[0].length == 2);
+    REQUIRE(edits[1].replacement == "4");
+    REQUIRE(apply_edits("a = 10 + 200", edits) == "a = 1 + 4");
+}
+
+TEST_CASE("ast arena", "[parse]") {
+    using lua::rt::ASTArena;
+    using lua::rt::make_node;
+
+    auto arena = std::make_shared<ASTArena>();
+    std::weak_ptr<ASTArena> weak = arena;
+
+    auto op = make_node<_LuaOp>(arena);
+    op->lhs = make_node<_LuaValue>(arena, LuaToken{LuaToken::Type::NUMLIT, "1"});
+    op->rhs = make_node<_LuaName>(arena, LuaToken{LuaToken::Type::NAME, "a"});
+    REQUIRE(op->kind == _LuaAST::Kind::Op);
+    REQUIRE(op->lhs->kind == _LuaAST::Kind::Value);
+    REQUIRE(op->rhs->kind == _LuaAST::Kind::Name);
+
+    auto call = make_node<_LuaFunctioncall>(arena);
+    REQUIRE(static_cast<_LuaExp&>(*call).kind == _LuaAST::Kind::Functioncall);
+    REQUIRE(static_cast<_LuaStmt&>(*call).kind == _LuaAST::Kind::Functioncall);
+
+    // the nodes the parser adds (not for repeat-until, true for else) are in the arena, too
+    auto negated = _LuaUnop::Not(arena, _LuaValue::True(arena));
+    REQUIRE(negated->exp->kind == _LuaAST::Kind::Value);
+
+    // the nodes are in one block, that is released with the last node
+    REQUIRE(arena->capacity() == 16 * 1024);
+    arena.reset();
+    call.reset();
+    op.reset();
+    REQUIRE(!weak.expired());
+    negated.reset();
+    REQUIRE(weak.expired());
+}
+
+TEST_CASE("evaluation errors", "[values]") {
+    using lua::rt::EvalError;
+    using lua::rt::val;
+
+    // the message is only formatted when it is read
+    REQUIRE(EvalError{"static"}.message() == "static");
+    REQUIRE(EvalError{std::string{"built"}}.message() == "built");
+
+    // only string literals are referenced, other text is copied
+    std::string buffer = "copied";
+    EvalError copied{buffer.c_str()};
+    buffer = "changed";
+    REQUIRE(copied.message() == "copied");
+    char array[16] = "first";
+    EvalError from_array{array};
+    std::strcpy(array, "second");
+    REQUIRE(from_array.message() == "first");
+    static_assert(!std::is_constructible_v<EvalError, char(&)[16], const val&>);
+    static_assert(!std::is_constructible_v<EvalError, char(&)[16], const val&, const val&>);
+    REQUIRE(EvalError{"cannot index {}", val{}}.message() == "cannot index nil");
+
+    auto result = lua::rt::op_add(val{1.0}, val{"a"});
+    REQUIRE(std::holds_alternative<EvalError>(result));
+    REQUIRE(std::get<EvalError>(result).message() ==
+            "could not add values of type other than number (number, string)");
+    REQUIRE(std::get<EvalError>(lua::rt::op_len(val{true})).message() ==
+            "unary # can only be applied to a table (is bool)");
+}
+
+TEST_CASE("provenance store", "[values]") {
+    using lua::rt::val;
+
+    lua::rt::ProvenanceStore store;
+    lua::rt::ProvenanceStore::Run run{store};
+    const LuaToken literal{LuaToken::Type::NUMLIT, "1", 0};
+    const val one{1.0, lua::rt::sourceval::create(literal)};
+    const LuaToken add{LuaToken::Type::ADD, "+", 2};
+    const LuaToken mul{LuaToken::Type::MUL, "*", 4};
+
+    SECTION("identical operations share their node") {
+        auto a = lua::rt::unwrap(lua::rt::op_add(one, val{2.0}, add));
+        auto b = lua::rt::unwrap(lua::rt::op_add(one, val{2.0}, add));
+        auto c = lua::rt::unwrap(lua::rt::op_add(one, val{3.0}, add));
+        REQUIRE(a.source == b.source);
+        REQUIRE(a.source != c.source);
+    }
+
+    SECTION("named nodes are not shared") {
+        auto env = std::make_shared<lua::rt::Environment>(nullptr);
+        env->assign(val{"a"}, lua::rt::unwrap(lua::rt::op_add(one, val{2.0}, add)), false);
+        env->assign(val{"b"}, lua::rt::unwrap(lua::rt::op_add(one, val{2.0}, add)), false);
+        REQUIRE(env->getvar(val{"a"}).source->identifier == "a");
+        REQUIRE(env->getvar(val{"b"}).source->identifier == "b");
+    }
+
+    SECTION("every run starts with an empty store") {
+        lua::rt::ProvenanceStore other;
+        {
+            lua::rt::ProvenanceStore::Run first{other};
+            REQUIRE(&lua::rt::ProvenanceStore::active() == &other);
+            auto a = lua::rt::unwrap(lua::rt::op_add(one, val{2.0}, add));
+            REQUIRE(other.size() == 1);
+        }
+        REQUIRE(&lua::rt::ProvenanceStore::active() == &store);
+
+        lua::rt::ProvenanceStore::Run second{other};
+        REQUIRE(other.size() == 0);
+    }
+
+    SECTION("long chains are collapsed") {
+        store.max_depth = 10;
+
+        // x = 2 * x - 1 starting at 1
+        val x = one;
+        for (int i = 0; i < 20; ++i) {
+            x = lua::rt::unwrap(lua::rt::op_mul(val{2.0}, x, mul));
+            x = lua::rt::unwrap(lua::rt::op_add(x, val{-1.0}, add));
+        }
+        REQUIRE(std::get<double>(x) == 1);
+        REQUIRE(x.source->depth <= 11);
+
+        // the summary can still be forced to a new start value
+        auto sc = x.forceValue(val{(1 << 20) + 1.0});
+        REQUIRE(sc);
+        REQUIRE(lua::rt::apply_edits("1", (*sc)->edits({literal})) == "2");
+    }
+
+    SECTION("collapsed chains keep the sources of their terms") {
+        store.max_depth = 10;
+        const LuaToken step_literal{LuaToken::Type::NUMLIT, "2", 4};
+        const val dx{2.0, lua::rt::sourceval::create(step_literal)};
+
+        // x = x + 1 until the chain is collapsed, then x = x + dx
+        val x = one;
+        for (int i = 0; i < 10; ++i)
+            x = lua::rt::unwrap(lua::rt::op_add(x, val{1.0}, add));
+        for (int i = 0; i < 20; ++i)
+            x = lua::rt::unwrap(lua::rt::op_add(x, dx, add));
+        REQUIRE(std::get<double>(x) == 51);
+        REQUIRE(x.source->depth <= 12);
+
+        // forcing changes the start or dx
+        auto sc = x.forceValue(val{71.0});
+        REQUIRE(sc);
+        const auto& alternatives =
+            std::static_pointer_cast<lua::rt::SourceChangeOr>(*sc)->alternatives;
+        REQUIRE(alternatives.size() == 2);
+        const std::vector<LuaToken> tokens{literal, add, step_literal};
+        REQUIRE(lua::rt::apply_edits("1 + 2", alternatives[0]->edits(tokens)) == "21 + 2");
+        REQUIRE(lua::rt::apply_edits("1 + 2", alternatives[1]->edits(tokens)) == "1 + 3");
+        REQUIRE(std::get<double>(lua::rt::unwrap(x.source->reevaluate())) == 51);
+
+        // the result of a non-affine operation only keeps the source of the shallow operand
+        const LuaToken pow{LuaToken::Type::POW, "^", 2};
+        auto y = lua::rt::unwrap(lua::rt::op_pow(x, dx, pow));
+        REQUIRE(y.source->depth == 2);
+        REQUIRE(y.source->get_all_tokens().size() == 2);
+    }
+}
+
+TEST_CASE("execution trace", "[values]") {
+    using lua::rt::val;
+
+    const LuaToken literal{LuaToken::Type::NUMLIT, "1", 0};
+    const val one{1.0, lua::rt::sourceval::create(literal)};
+    const LuaToken add{LuaToken::Type::ADD, "+", 2};
+
+    // x = 1 + 1, y = x + x
+    const val x{2.0, lua::rt::ExecutionTrace::binop(one, val{1.0}, add)};
+    const val y{4.0, lua::rt::ExecutionTrace::binop(x, x, add)};
+    const auto& op = static_cast<const lua::rt::tracedop&>(*y.source);
+
+    // the node is built once, its operands are the nodes of their records
+    auto node = std::dynamic_pointer_cast<lua::rt::sourcebinop>(op.node());
+    REQUIRE(node);
+    REQUIRE(op.node() == node);
+    REQUIRE(node->lhs.source == static_cast<const lua::rt::tracedop&>(*x.source).node());
+
+    // sources from outside of the trace are retained by the trace
+    const auto& first = static_cast<const lua::rt::tracedop&>(*x.source);
+    REQUIRE(first.sources[0] & lua::rt::tracedop::retained);
+    REQUIRE(first.sources[1] == lua::rt::tracedop::none);
+    REQUIRE(std::static_pointer_cast<lua::rt::sourcebinop>(first.node())->lhs.source == one.source);
+
+    auto sc = y.forceValue(val{6.0});
+    REQUIRE(sc);
+    REQUIRE(lua::rt::apply_edits("1", (*sc)->edits({literal})) == "3");
+
+    // operations on a source of max_depth are not recorded, the chain is collapsed instead
+    lua::rt::ProvenanceStore store;
+    store.max_depth = 10;
+    lua::rt::ProvenanceStore::Run run{store};
+    val z = one;
+    for (int i = 0; i < 100; ++i)
+        z = val{std::get<double>(z) + 1, lua::rt::ExecutionTrace::binop(z, val{1.0}, add)};
+    REQUIRE(std::get<double>(z) == 101);
+    REQUIRE(z.source->depth == 11);
+    REQUIRE(std::dynamic_pointer_cast<lua::rt::sourceaffine>(z.source));
+
+    sc = z.forceValue(val{111.0});
+    REQUIRE(sc);
+    const auto& alternatives =
+        std::static_pointer_cast<lua::rt::SourceChangeOr>(*sc)->alternatives;
+    REQUIRE(lua::rt::apply_edits("1", alternatives[0]->edits({literal})) == "11");
+}